@@ -0,0 +1,165 @@
+/**
+  ******************************************************************************
+  * @file           : sd_bbox.h
+  * @brief          : Black-box logging to a raw partition, no file system
+  ******************************************************************************
+  * @note           : A ring of self-describing 512-byte blocks in the card's
+  *                   SDFMT_RAW_TYPE partition (SDFMT_FormatAs raw_sectors),
+  *                   written with SD_disk_write next to the FAT log. Nothing
+  *                   on the card changes but the blocks themselves: no FAT,
+  *                   no directory entry, no f_sync, so a power cut loses at
+  *                   most what was still in RAM and the last block written.
+  *
+  *                   Block (all values little endian):
+  *
+  *                     magic   u32  BBOX_MAGIC, BBOX_HDR_MAGIC in block 0
+  *                     seq     u32  block sequence number, from 1
+  *                     blocks  u32  ring size N, the partition less block 0
+  *                     tick    u32  HAL_GetTick when the block was filled
+  *                     len     u16  payload bytes used
+  *                     flags   u16  BBOX_FLAG_START on a session's first block
+  *                     payload      BBOX_PAYLOAD bytes
+  *                     crc     u16  CRC16-CCITT of all of the above
+  *
+  *                   Block seq lives at partition block 1 + (seq - 1) % N.
+  *                   The payloads in seq order are one byte stream, records
+  *                   run across blocks. Block 0 keeps the first bytes of the
+  *                   current session (BINLOG_Init's sync frame and schemas),
+  *                   so a ring that has wrapped past them still decodes.
+  ******************************************************************************
+  */
+
+#ifndef SD_BBOX_H
+#define SD_BBOX_H
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BBOX_MAGIC              0x31584242u  // "BBX1"
+#define BBOX_HDR_MAGIC          0x48584242u  // "BBXH"
+
+#define BBOX_BLOCK              512u
+#define BBOX_HEAD_SIZE          20u
+#define BBOX_PAYLOAD            (BBOX_BLOCK - BBOX_HEAD_SIZE - 2u)
+
+#define BBOX_FLAG_START         0x0001u
+
+/* Blocks buffered in RAM (power of two), filled by BBOX_Append and
+   written by BBOX_Service in as few multi-block writes as the ring allows;
+   twice as many with 512-byte sectors (_MAX_SS, SD_LOG.ioc) */
+#ifndef BBOX_RING_BLOCKS
+#if _MAX_SS == _MIN_SS
+#define BBOX_RING_BLOCKS        16u
+#else
+#define BBOX_RING_BLOCKS        8u
+#endif
+#endif
+
+#if BBOX_RING_BLOCKS & (BBOX_RING_BLOCKS - 1u)
+#error "BBOX_RING_BLOCKS must be a power of two"
+#endif
+
+/* Black box statistics */
+typedef struct {
+    uint32_t records;        // records accepted
+    uint32_t bytes;          // bytes accepted
+    uint32_t dropped;        // records refused, RAM ring full
+    uint32_t blocks;         // blocks written
+    uint32_t writes;         // SD_disk_write calls
+    uint32_t max_pending;    // high-water mark, full blocks waiting
+    uint32_t probes;         // blocks read by BBOX_Open to find the head
+} BBOX_Stats_t;
+
+/* Black box */
+typedef struct {
+    BYTE          pdrv;
+    DWORD         base;               // LBA of the partition, block 0
+    uint32_t      blocks;             // ring blocks N
+    uint32_t      last_seq;           // newest block on the card, 0 if none
+    uint32_t      first_seq;          // this session's first block
+    uint32_t      next_seq;           // seq of the next block written
+    UINT          fill;               // payload bytes in the filling block
+    volatile UINT head;               // blocks handed over (filling one is head % COUNT)
+    volatile UINT tail;               // blocks written
+    bool          capture;            // copying into the header block
+    UINT          pre_len;
+    BBOX_Stats_t  stats;
+    DWORD         pre[BBOX_BLOCK / sizeof(DWORD)];
+    DWORD         buf[BBOX_RING_BLOCKS][BBOX_BLOCK / sizeof(DWORD)];
+} BBOX_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Find the black-box partition and the newest block in it
+  * @note   Reads the MBR, then binary searches the ring: block i is before
+  *         the head while it is valid and in the same pass over the ring as
+  *         block 0, about log2(N) + 2 reads. The session continues after
+  *         the newest block, with the bytes appended up to
+  *         BBOX_SavePreamble also kept for block 0. The drive must be
+  *         initialised (mounted) and have 512-byte sectors.
+  * @param  b: Black box
+  * @param  pdrv: Physical drive
+  * @retval FRESULT, FR_NO_FILE if the card has no black-box partition
+  */
+FRESULT BBOX_Open(BBOX_t *b, BYTE pdrv);
+
+/**
+  * @brief  Append one record
+  * @note   Producer side, no card access. The record is taken whole or not
+  *         at all: when the free blocks cannot hold it, it is dropped and
+  *         counted. May run in an interrupt while the main loop is inside
+  *         BBOX_Service, but not concurrently with itself or BBOX_Flush.
+  * @param  b: Black box
+  * @param  data: Record
+  * @param  len: Record length
+  * @retval true if the record was taken
+  */
+bool BBOX_Append(BBOX_t *b, const void *data, UINT len);
+
+/**
+  * @brief  BBOX_Append with an untyped black box, the BINLOG_Sink_t signature
+  * @param  b: Black box (BBOX_t *)
+  * @param  data: Encoded bytes
+  * @param  len: Number of bytes
+  * @retval true if taken
+  */
+bool BBOX_Sink(void *b, const void *data, UINT len);
+
+/**
+  * @brief  Write the session's first bytes to block 0
+  * @note   Call once after BINLOG_Init and BINLOG_Sync, so block 0 holds
+  *         a sync frame and the schemas. Bytes past BBOX_PAYLOAD are not
+  *         kept there.
+  * @param  b: Black box
+  * @retval FRESULT
+  */
+FRESULT BBOX_SavePreamble(BBOX_t *b);
+
+/**
+  * @brief  Write the full blocks
+  * @note   Writer side, call from the main loop. Blocks that follow each
+  *         other in RAM and on the card go in one SD_disk_write.
+  * @param  b: Black box
+  * @retval FRESULT
+  */
+FRESULT BBOX_Service(BBOX_t *b);
+
+/**
+  * @brief  Write everything buffered, including a partial block
+  * @note   The partial block takes a sequence number of its own; the next
+  *         record starts a new block.
+  * @param  b: Black box
+  * @retval FRESULT
+  */
+FRESULT BBOX_Flush(BBOX_t *b);
+
+/**
+  * @brief  Copy the statistics
+  * @param  b: Black box
+  * @param  stats: Output
+  */
+void BBOX_GetStats(BBOX_t *b, BBOX_Stats_t *stats);
+
+#endif /* SD_BBOX_H */
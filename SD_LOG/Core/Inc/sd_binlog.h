@@ -0,0 +1,219 @@
+/**
+  ******************************************************************************
+  * @file           : sd_binlog.h
+  * @brief          : Compact binary log records for the SD logger
+  ******************************************************************************
+  * @note           : Stream layout (all multi-byte values little endian):
+  *
+  *                   sync    FE A5 5A C3, version, CRC16 of the segment since
+  *                           the previous sync, timestamp (u32), offset of the
+  *                           newest index record (u32, BINLOG_NO_INDEX if
+  *                           none), CRC16 of the version..index bytes (17
+  *                           bytes; version 1 frames have no index, 13 bytes)
+  *                   schema  FD, id, field count, field types, name and
+  *                           field names as NUL terminated strings
+  *                   record  schema id (1..BINLOG_MAX_SCHEMA), timestamp
+  *                           delta (unsigned varint), fields
+  *                   index   FC, entry count n, level count l, n sync frames
+  *                           then l earlier index records as (timestamp u32,
+  *                           offset u32) pairs
+  *                   pad     00, skipped (checkpoint padding at the end)
+  *
+  *                   Varints are LEB128, signed ones zigzag encoded first.
+  *                   CRC16 is CCITT (0x1021, initial 0xFFFF). A decoder that
+  *                   loses its place looks for the next sync marker whose
+  *                   header CRC checks, and drops a segment whose CRC does
+  *                   not match. Schemas are written once, after the first
+  *                   sync of a file.
+  *
+  *                   Offsets count from the log's first sync frame, which is
+  *                   the start of the file unless the stream is compressed.
+  *                   An index record follows every BINLOG_INDEX_SYNCS-th sync
+  *                   frame and lists the sync frames since the previous one.
+  *                   Level j points back to the newest earlier index record
+  *                   whose number (from 1) is a multiple of 2^j, with the
+  *                   timestamp of its first entry, so a reader starting from
+  *                   the index named in the last sync frame reaches any time
+  *                   in O(log n) record reads (sd_logread.c).
+  ******************************************************************************
+  */
+
+#ifndef SD_BINLOG_H
+#define SD_BINLOG_H
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define BINLOG_VERSION          2u
+
+/* Record bytes between sync frames, bounds what a bad CRC throws away */
+#ifndef BINLOG_SYNC_BYTES
+#define BINLOG_SYNC_BYTES       1024u
+#endif
+
+/* Largest encoded record, schema records included */
+#ifndef BINLOG_MAX_RECORD
+#define BINLOG_MAX_RECORD       128u
+#endif
+
+/* Schema ids run from 1 to this */
+#ifndef BINLOG_MAX_SCHEMA
+#define BINLOG_MAX_SCHEMA       16u
+#endif
+
+#define BINLOG_MAX_FIELDS       16u
+
+/* Sync frames per index record, 0 for no index */
+#ifndef BINLOG_INDEX_SYNCS
+#define BINLOG_INDEX_SYNCS      16u
+#endif
+
+/* Back pointers per index record; past 2^levels records the top level is
+   followed one record at a time */
+#ifndef BINLOG_INDEX_LEVELS
+#define BINLOG_INDEX_LEVELS     12u
+#endif
+
+/* Tags */
+#define BINLOG_TAG_PAD          0x00u
+#define BINLOG_TAG_SCHEMA       0xFDu
+#define BINLOG_TAG_SYNC         0xFEu
+#define BINLOG_TAG_INDEX        0xFCu
+#define BINLOG_SYNC_SIZE        17u
+#define BINLOG_SYNC_SIZE_V1     13u
+#define BINLOG_NO_INDEX         0xFFFFFFFFu
+
+/* Largest index record */
+#define BINLOG_INDEX_SIZE       (3u + 8u * (BINLOG_INDEX_SYNCS + BINLOG_INDEX_LEVELS))
+
+/* Field types */
+typedef enum {
+    BINLOG_U8 = 1,
+    BINLOG_I8,
+    BINLOG_U16,
+    BINLOG_I16,
+    BINLOG_U32,
+    BINLOG_I32,
+    BINLOG_F32,
+    BINLOG_UVAR,             // unsigned varint, small counters and deltas
+    BINLOG_SVAR,             // signed varint (zigzag)
+    BINLOG_BYTES             // varint length + bytes, BINLOG_WriteBytes only
+} BINLOG_Type_t;
+
+/* Record layout */
+typedef struct {
+    uint8_t            id;         // 1..BINLOG_MAX_SCHEMA
+    const char         *name;
+    uint8_t            nfields;
+    const uint8_t      *types;     // BINLOG_Type_t per field
+    const char *const  *fields;    // field names
+} BINLOG_Schema_t;
+
+/* Where encoded bytes go, false when they were not taken (SDLOG_Sink) */
+typedef bool (*BINLOG_Sink_t)(void *ctx, const void *data, UINT len);
+
+/* Encoder statistics */
+typedef struct {
+    uint32_t records;        // records written
+    uint32_t bytes;          // bytes written, sync and schema frames included
+    uint32_t syncs;          // sync frames written
+    uint32_t indexes;        // index records written
+    uint32_t dropped;        // records the sink refused or that did not encode
+} BINLOG_Stats_t;
+
+/* Encoder */
+typedef struct {
+    BINLOG_Sink_t          sink;
+    void                   *ctx;
+    const BINLOG_Schema_t  *schema[BINLOG_MAX_SCHEMA + 1u];
+    uint32_t               last_ts;
+    uint16_t               crc;        // running CRC of the current segment
+    uint32_t               seg_bytes;
+    uint32_t               pos;        // stream offset of the next byte
+    bool                   need_sync;
+#if BINLOG_INDEX_SYNCS
+    uint32_t               idx_last;   // offset of the newest index record
+    uint32_t               idx_count;  // index records written
+    UINT                   idx_n;
+    uint32_t               idx_ent[BINLOG_INDEX_SYNCS][2];   // sync frames since then, (ts, offset)
+    uint32_t               idx_lvl[BINLOG_INDEX_LEVELS][2];  // back pointers, (first ts, offset)
+#endif
+    BINLOG_Stats_t         stats;
+} BINLOG_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Start a binary log: first sync frame and the schema records
+  * @param  b: Encoder
+  * @param  sink: Output, e.g. SDLOG_Sink with the SDLOG_t as ctx
+  * @param  ctx: Passed to sink
+  * @param  schemas: Record layouts used in this log
+  * @param  n: Number of schemas
+  * @retval true if everything was written
+  */
+bool BINLOG_Init(BINLOG_t *b, BINLOG_Sink_t sink, void *ctx, const BINLOG_Schema_t *const *schemas, UINT n);
+
+/**
+  * @brief  Encode and write one record
+  * @note   values holds one word per field: integers as their value (signed
+  *         ones sign extended), F32 as the float's bits (BINLOG_Float).
+  * @param  b: Encoder
+  * @param  id: Schema id
+  * @param  ts: Timestamp, any unit; only the delta to the previous record
+  *         is stored, modulo 2^32
+  * @param  values: Field values
+  * @retval true if written, false if dropped (counted)
+  */
+bool BINLOG_Write(BINLOG_t *b, uint8_t id, uint32_t ts, const uint32_t *values);
+
+/**
+  * @brief  Write one record of a schema with a single BINLOG_BYTES field
+  * @param  b: Encoder
+  * @param  id: Schema id
+  * @param  ts: Timestamp
+  * @param  data: Payload
+  * @param  len: Payload bytes
+  * @retval true if written, false if dropped (counted)
+  */
+bool BINLOG_WriteBytes(BINLOG_t *b, uint8_t id, uint32_t ts, const void *data, UINT len);
+
+/**
+  * @brief  Close the current segment with a sync frame
+  * @note   Call before SDLOG_Flush/SDLOG_Close so the last records can be
+  *         checked by the decoder. Every BINLOG_INDEX_SYNCS-th frame is
+  *         followed by an index record.
+  * @param  b: Encoder
+  * @retval true if written
+  */
+bool BINLOG_Sync(BINLOG_t *b);
+
+/**
+  * @brief  CRC16-CCITT update, shared with the host decoder
+  * @param  crc: Running value, 0xFFFF to start
+  * @param  data: Bytes
+  * @param  len: Number of bytes
+  * @retval Updated CRC
+  */
+uint16_t BINLOG_Crc16(uint16_t crc, const void *data, UINT len);
+
+/**
+  * @brief  Copy the statistics
+  * @param  b: Encoder
+  * @param  stats: Output
+  */
+void BINLOG_GetStats(BINLOG_t *b, BINLOG_Stats_t *stats);
+
+/**
+  * @brief  Bits of a float for an F32 field
+  */
+static inline uint32_t BINLOG_Float(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+#endif /* SD_BINLOG_H */
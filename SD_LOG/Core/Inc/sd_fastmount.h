@@ -0,0 +1,82 @@
+/**
+  ******************************************************************************
+  * @file           : sd_fastmount.h
+  * @brief          : Mount with the free cluster count cached across power cycles
+  ******************************************************************************
+  * @note           : The cache is a small struct the caller keeps somewhere
+  *                   that survives a power cycle (backup SRAM on VBAT in
+  *                   main.c). It holds a FAT16 volume's free cluster count
+  *                   and allocation point, keyed by the volume serial
+  *                   number, a hash of the geometry and a hash of the card's
+  *                   CID (every volume this firmware formats has serial
+  *                   number 0, get_fattime being 0), so that f_getfree does
+  *                   not scan the FAT at every boot. FAT32 keeps its own
+  *                   count in FSINFO and exFAT counts its small bitmap; on
+  *                   those FMOUNT_Mount is f_mount.
+  ******************************************************************************
+  */
+
+#ifndef SD_FASTMOUNT_H
+#define SD_FASTMOUNT_H
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FMOUNT_MAGIC            0x544E4D46u  // "FMNT"
+
+/* How FMOUNT_Mount got the free count */
+#define FMOUNT_FAST             0u  // from the cache, checked against the FAT
+#define FMOUNT_NO_CACHE         1u  // nothing valid cached, or not FAT16
+#define FMOUNT_MISMATCH         2u  // cache is for another volume
+#define FMOUNT_STALE            3u  // clusters allocated since it was saved
+
+/* Cached free count, 36 bytes */
+typedef struct {
+    uint32_t magic;
+    uint32_t serial;         // volume serial number in the boot sector
+    uint32_t geo_hash;       // hash of the geometry f_mount derives from the BPB
+    uint32_t card_hash;      // hash of the CID register, 0 if the driver has none
+    DWORD    volbase;
+    DWORD    free_clst;      // as of the last FMOUNT_Save
+    DWORD    last_clst;
+    BYTE     drv;
+    BYTE     fs_type;
+    BYTE     reserved[2];
+    uint32_t check;          // hash of all of the above
+} FMOUNT_Cache_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Mount a volume, with the cached free count when it holds
+  * @note   f_mount(fs, path, 1) mounts the volume. On FAT16 the card's
+  *         CID, the boot sector (still in the window) and the geometry are
+  *         then checked against the cache, and the FAT sector at the cached
+  *         allocation point is read: when no cluster was allocated there
+  *         since the save, the cached count and allocation point are used
+  *         and f_getfree needs no scan. Otherwise the count stays unknown
+  *         and the cache is keyed to this volume for the next boot.
+  * @param  fs: File system object
+  * @param  path: Logical drive ("", "0:", "1:")
+  * @param  cache: Cache, in memory that survives a power cycle
+  * @param  how: FMOUNT_FAST, FMOUNT_NO_CACHE, FMOUNT_MISMATCH or
+  *         FMOUNT_STALE, may be NULL
+  * @retval FRESULT of f_mount
+  */
+FRESULT FMOUNT_Mount(FATFS *fs, const TCHAR *path, FMOUNT_Cache_t *cache, BYTE *how);
+
+/**
+  * @brief  Store the current free cluster count and allocation point
+  * @note   The count is a hint, like the one in FSINFO, and a mount only
+  *         uses it after checking the FAT at the allocation point. With
+  *         nothing allocated since the mount, the point is found in the
+  *         first FAT sector (one read).
+  *         Call after f_sync or at shutdown, as often as FatFs would update
+  *         FSINFO. Does nothing for a volume the cache is not keyed to.
+  * @param  fs: Mounted file system object
+  * @param  cache: Cache filled by FMOUNT_Mount for this volume
+  */
+void FMOUNT_Save(FATFS *fs, FMOUNT_Cache_t *cache);
+
+#endif /* SD_FASTMOUNT_H */
@@ -0,0 +1,36 @@
+/**
+  ******************************************************************************
+  * @file           : sd_ffpriv.h
+  * @brief          : FatFs revision the SD modules' use of its object fields
+  *                   was checked against
+  ******************************************************************************
+  * @note           : ff.h declares FATFS and FIL in full, but only the f_
+  *                   functions are FatFs's interface; the fields are laid out
+  *                   and kept consistent by ff.c. These modules read or set
+  *                   them as R0.12c does, and include this header so that a
+  *                   FatFs update stops the build until each is checked:
+  *
+  *                   sd_logger.c     fsi_flag around f_sync (SDLOG_Sync)
+  *                   sd_fastmount.c  free_clst, last_clst, win, winsect, wflag
+  *                   sd_rawlog.c     obj.sclust, and f_open's unset n_frag
+  *                   sd_rotlog.c     free_clst
+  *                   sd_format.c     fp->clust at cluster boundaries
+  *
+  *                   Geometry read back from a mounted FATFS (drv, fs_type,
+  *                   csize, ssize, volbase, fatbase, database, n_fatent) is
+  *                   not listed; every FatFs revision has kept it.
+  ******************************************************************************
+  */
+
+#ifndef SD_FFPRIV_H
+#define SD_FFPRIV_H
+
+#include "ff.h"
+
+#define SD_FATFS_CHECKED        68300   // R0.12c
+
+#if _FATFS != SD_FATFS_CHECKED
+#error "FatFs revision changed: check the modules listed in sd_ffpriv.h against it"
+#endif
+
+#endif /* SD_FFPRIV_H */
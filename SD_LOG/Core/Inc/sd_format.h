@@ -0,0 +1,114 @@
+/**
+  ******************************************************************************
+  * @file           : sd_format.h
+  * @brief          : AU-aligned FAT format for the logging card
+  ******************************************************************************
+  */
+
+#ifndef SD_FORMAT_H
+#define SD_FORMAT_H
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Largest cluster tried first. FatFs caps FAT/FAT32 clusters at 64 KB, big
+   clusters mean fewer FAT updates per MB of log. */
+#ifndef SDFMT_MAX_CLUSTER
+#define SDFMT_MAX_CLUSTER       65536u
+#endif
+
+/* exFAT cluster, as the SD file system specification gives it for 64 GB to
+   512 GB cards; exFAT has no cluster count limit that forces it down */
+#ifndef SDFMT_EXFAT_CLUSTER
+#define SDFMT_EXFAT_CLUSTER     131072u
+#endif
+
+/* Cards up to 2 GB (SDSC) get FAT12/16 with at most 32 KB clusters, up to
+   32 GB (SDHC) FAT32, larger cards (SDXC) exFAT, as the SD file system
+   specification lays them out. */
+#define SDFMT_SDSC_SECTORS      4194304u
+#define SDFMT_SDHC_SECTORS      67108864u
+
+/* Partition 1 (the FAT volume) starts where f_mkfs would put it, f_mkfs
+   aligns its data area from there. A raw partition follows on an AU
+   boundary, typed "non-FS data" so hosts leave it alone. */
+#define SDFMT_VOL_START         63u
+#define SDFMT_RAW_TYPE          0xDAu
+
+/* MBR layout, for SDFMT_FormatAs and the readers of its partitions (ff.c
+   keeps its own private) */
+#define SDFMT_MBR_TABLE         446u  // first partition entry
+#define SDFMT_PTE_SIZE          16u
+#define SDFMT_PTE_TYPE          4u    // offsets in an entry
+#define SDFMT_PTE_START         8u    // first LBA, little-endian
+#define SDFMT_PTE_SECTORS       12u   // size in sectors, little-endian
+#define SDFMT_MBR_SIG           510u  // 0x55 0xAA
+
+/* Volume layout */
+typedef struct {
+    uint32_t au_sectors;     // alignment used (GET_BLOCK_SIZE)
+    uint32_t cluster_bytes;  // cluster size
+    uint32_t clusters;       // data clusters
+    uint32_t vol_base;       // LBA of the volume boot record
+    uint32_t fat_base;       // LBA of the first FAT
+    uint32_t fat_sectors;    // size of one FAT
+    uint32_t data_base;      // LBA of cluster 2
+    uint8_t  fs_type;        // FS_FAT12, FS_FAT16, FS_FAT32 or FS_EXFAT
+    bool     aligned;        // data area and clusters on AU boundaries
+} SDFMT_Layout_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Format a volume with its data area on an AU boundary
+  * @note   Writes a new MBR: the whole card is partition 1.
+  * @param  path: Logical drive ("0:", "1:")
+  * @param  work: f_mkfs work buffer, at least _MAX_SS bytes
+  * @param  len: Size of the work buffer, larger formats faster
+  * @param  layout: Chosen layout, may be NULL
+  * @retval FRESULT
+  */
+FRESULT SDFMT_Format(const TCHAR *path, void *work, UINT len, SDFMT_Layout_t *layout);
+
+/**
+  * @brief  Format a volume as a given FAT type, data area on an AU boundary
+  * @note   For a card that must stay readable where exFAT is not, or to
+  *         put exFAT on an SDHC card for files of 4 GB and more. With
+  *         raw_sectors the card's last AUs become partition 2 (type
+  *         SDFMT_RAW_TYPE, the black box of sd_bbox.h), erased, and the FAT
+  *         volume takes the rest.
+  * @param  path: Logical drive ("0:", "1:")
+  * @param  fs_type: FS_FAT16 (FAT12/16 by size), FS_FAT32, FS_EXFAT (needs
+  *         _FS_EXFAT), or 0 to choose by card size as SDFMT_Format does
+  * @param  raw_sectors: Raw partition size, rounded up to whole AUs; 0 for none
+  * @param  work: f_mkfs work buffer, at least _MAX_SS bytes
+  * @param  len: Size of the work buffer, larger formats faster
+  * @param  layout: Chosen layout, may be NULL
+  * @retval FRESULT, FR_MKFS_ABORTED when the card is too small for the type,
+  *         FR_INVALID_PARAMETER when raw_sectors leaves no room for it
+  */
+FRESULT SDFMT_FormatAs(const TCHAR *path, BYTE fs_type, DWORD raw_sectors, void *work, UINT len,
+                       SDFMT_Layout_t *layout);
+
+/**
+  * @brief  Describe the layout of a mounted volume
+  * @param  fs: Mounted file system object
+  * @param  layout: Output
+  * @retval FRESULT
+  */
+FRESULT SDFMT_GetLayout(FATFS *fs, SDFMT_Layout_t *layout);
+
+/**
+  * @brief  Reserve space for a capture file and erase it in advance
+  * @note   Grows the file to size (file opened with FA_WRITE), trims every
+  *         run of contiguous clusters and rewinds to offset 0. Overwriting
+  *         the reserved clusters then needs no FAT updates and lands on
+  *         erased AUs.
+  * @param  fp: Open file
+  * @param  size: Bytes to reserve, 0 keeps the current size
+  * @retval FRESULT
+  */
+FRESULT SDFMT_PreErase(FIL *fp, FSIZE_t size);
+
+#endif /* SD_FORMAT_H */
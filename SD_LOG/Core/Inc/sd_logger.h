@@ -0,0 +1,240 @@
+/**
+  ******************************************************************************
+  * @file           : sd_logger.h
+  * @brief          : Double-buffered log writer with sector-multiple f_writes
+  ******************************************************************************
+  */
+
+#ifndef SD_LOGGER_H
+#define SD_LOGGER_H
+
+#include "ff.h"
+#include "sd_queue.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Sectors per buffer. f_write of whole sectors at a sector-aligned file
+   offset bypasses the FIL buffer and goes straight to disk_write. */
+#ifndef SDLOG_BUF_SECTORS
+#define SDLOG_BUF_SECTORS       8u
+#endif
+
+/* Buffers in the ring (power of two), one filling while the others wait for
+   SDLOG_Service. 512-byte sectors (_MAX_SS, SD_LOG.ioc) free enough RAM
+   for four, so producers appending from interrupts ride out a longer card
+   stall. */
+#ifndef SDLOG_BUF_COUNT
+#if _MAX_SS == _MIN_SS
+#define SDLOG_BUF_COUNT         4u
+#else
+#define SDLOG_BUF_COUNT         2u
+#endif
+#endif
+
+#define SDLOG_BUF_BYTES         (SDLOG_BUF_SECTORS * _MIN_SS)
+
+/* Durability policy, see SDLOG_SetPolicy. All zero (the default) syncs only
+   in SDLOG_Flush and SDLOG_Close. */
+typedef struct {
+    uint32_t sync_ms;        // sync once the oldest unsynced record is this old, 0 = off
+    uint32_t sync_bytes;     // sync once this many written bytes are unsynced, 0 = off
+    uint32_t fsinfo_every;   // policy syncs per FSINFO free count update, 0 = close only
+} SDLOG_Policy_t;
+
+/* Logger statistics */
+typedef struct {
+    uint32_t records;        // records accepted
+    uint32_t bytes;          // bytes accepted
+    uint32_t dropped;        // records refused, no free buffer (overflow)
+    uint32_t dropped_bytes;  // bytes in those records
+    uint32_t writes;         // f_write calls
+    uint32_t short_writes;   // writes that were not whole sectors (flushes)
+    uint32_t max_pending;    // high-water mark, full buffers waiting
+    uint32_t max_level;      // high-water mark, bytes buffered
+    uint32_t syncs;          // f_syncs, policy and SDLOG_Flush
+    uint32_t max_unsynced;   // high-water mark, bytes accepted but not synced
+    uint32_t max_unsynced_ms;// longest a record waited for its sync
+    uint32_t fragmented;     // files SDLOG_SetContiguous found no free run for
+} SDLOG_Stats_t;
+
+/* Logger */
+typedef struct {
+    FIL           *fil;
+    FIL           *next;              // file to continue in, see SDLOG_Switch
+    UINT          switch_at;          // buffers that still go to fil
+    UINT          ss;                 // sector size
+    FSIZE_t       pos;                // file offset of the filling buffer
+    UINT          fill;               // bytes in the filling buffer
+    UINT          cap;                // its capacity, ends on a sector boundary
+    volatile UINT head;               // buffers handed over (filling one is head % COUNT)
+    volatile UINT tail;               // buffers written
+    UINT          len[SDLOG_BUF_COUNT];
+    SDLOG_Policy_t policy;
+    uint32_t      in;                 // bytes accepted
+    uint32_t      out;                // bytes written
+    volatile uint32_t synced;         // out at the last f_sync
+    volatile uint32_t dirty_tick;     // HAL_GetTick when the oldest unsynced record came in
+    volatile UINT req;                // syncs asked for (SDLOG_Commit, sync_ms)
+    UINT          served;             // syncs done for them
+    uint32_t      req_tick;           // HAL_GetTick of the last request
+    uint32_t      fsinfo_left;        // policy syncs until the next FSINFO update
+    FSIZE_t       contig;             // free run to start each file in, 0 = off
+    SDLOG_Stats_t stats;
+    DWORD         buf[SDLOG_BUF_COUNT][SDLOG_BUF_BYTES / sizeof(DWORD)];
+} SDLOG_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Attach a logger to an open file
+  * @note   Data goes at the current file position. When that is not on a
+  *         sector boundary the first buffer is cut short so every later
+  *         write starts on one.
+  * @param  log: Logger
+  * @param  fp: File opened with FA_WRITE
+  * @retval FRESULT, FR_INVALID_PARAMETER when a buffer is not a whole number
+  *         of the volume's sectors
+  */
+FRESULT SDLOG_Init(SDLOG_t *log, FIL *fp);
+
+/**
+  * @brief  Append one record
+  * @note   Producer side, no FatFs call. The record is taken whole or not at
+  *         all: when the free buffers cannot hold it, it is dropped and
+  *         counted in stats.dropped. May run in an interrupt while the main
+  *         loop is inside SDLOG_Service, but not concurrently with itself,
+  *         SDLOG_Flush or SDLOG_Close.
+  * @param  log: Logger
+  * @param  data: Record
+  * @param  len: Record length
+  * @retval true if the record was taken
+  */
+bool SDLOG_Append(SDLOG_t *log, const void *data, UINT len);
+
+/**
+  * @brief  SDLOG_Append with an untyped logger, the BINLOG_Sink_t signature
+  * @param  log: Logger (SDLOG_t *)
+  * @param  data: Encoded bytes
+  * @param  len: Number of bytes
+  * @retval true if taken
+  */
+bool SDLOG_Sink(void *log, const void *data, UINT len);
+
+/**
+  * @brief  Move committed records from a queue into the buffers
+  * @note   Consumer side of q, call from the main loop before SDLOG_Service.
+  *         Stops at a record the free buffers cannot hold yet, so the queue
+  *         absorbs a slow card before anything is dropped here.
+  * @param  log: Logger
+  * @param  q: Queue filled by interrupt producers
+  * @retval Records moved
+  */
+uint32_t SDLOG_Drain(SDLOG_t *log, LOGQ_t *q);
+
+/**
+  * @brief  Write the full buffers, then sync if the policy says so
+  * @note   Writer side, call from the main loop. Each f_write is a whole
+  *         number of sectors at a sector-aligned offset. The old file of an
+  *         SDLOG_Switch is synced before the log moves on.
+  * @param  log: Logger
+  * @retval FRESULT
+  */
+FRESULT SDLOG_Service(SDLOG_t *log);
+
+/**
+  * @brief  Set when the log is synced
+  * @note   An f_sync is what makes written data survive a power loss: it
+  *         stores the file size in the directory entry and writes out the
+  *         FAT. Syncing per record costs several single-sector writes each
+  *         time; a policy batches them. sync_bytes is checked by
+  *         SDLOG_Service, sync_ms by SDLOG_Append/SDLOG_Drain (call either,
+  *         or SDLOG_SyncDue, regularly so an idle log is synced too), and
+  *         SDLOG_Commit syncs at an event. The FSINFO sector (FAT32) only
+  *         holds the free cluster count, so policy syncs leave it for every
+  *         fsinfo_every'th sync or SDLOG_Flush/SDLOG_Close; after a power
+  *         loss the count on the card can be high by what was written since.
+  * @param  log: Logger
+  * @param  policy: Policy, copied; set after SDLOG_Init, which clears it
+  */
+void SDLOG_SetPolicy(SDLOG_t *log, const SDLOG_Policy_t *policy);
+
+/**
+  * @brief  Start each file of the log at a free run of clusters
+  * @note   On exFAT a file whose clusters follow each other is kept as a
+  *         no-FAT-chain object: appends only set bits in the allocation
+  *         bitmap and the FAT is never written. The file at hand (if still
+  *         empty) and each file of a later SDLOG_Switch get f_expand(fp,
+  *         size, 0), which finds a free run of size bytes and makes it the
+  *         next allocation point without allocating it, so the file keeps
+  *         its size and the durability of the policy. No free run is
+  *         counted in stats.fragmented and the file is written anyway.
+  *         Does nothing on FAT12/16/32, where the search is a FAT scan and
+  *         a contiguous chain still has to be written to the FAT.
+  * @param  log: Logger
+  * @param  size: Bytes a file grows to, a little more for a rotating set;
+  *         0 turns it off
+  */
+void SDLOG_SetContiguous(SDLOG_t *log, FSIZE_t size);
+
+/**
+  * @brief  Sync everything appended so far, e.g. after a critical event
+  * @note   Producer side, no FatFs call: the filling buffer is handed over
+  *         (a short write) and the next SDLOG_Service writes it and syncs.
+  * @param  log: Logger
+  */
+void SDLOG_Commit(SDLOG_t *log);
+
+/**
+  * @brief  Check if sync_ms is due
+  * @note   For pipelines that hold data before the logger (LZ_Flush first,
+  *         then SDLOG_Commit). SDLOG_Append and SDLOG_Drain commit on their
+  *         own when it is due.
+  * @param  log: Logger
+  * @retval true if unsynced data is older than policy.sync_ms
+  */
+bool SDLOG_SyncDue(SDLOG_t *log);
+
+/**
+  * @brief  Bytes accepted but not yet synced, what a power loss now would cost
+  * @param  log: Logger
+  * @retval Bytes
+  */
+uint32_t SDLOG_Unsynced(SDLOG_t *log);
+
+/**
+  * @brief  Continue the log in another file
+  * @note   Producer side, no FatFs call: the filling buffer is handed over
+  *         as the last (short) write to the current file, and SDLOG_Service
+  *         moves on to next once everything before it is written. The old
+  *         file is left open for the caller to close (sd_rotlog.c).
+  * @param  log: Logger
+  * @param  next: File opened with FA_WRITE, at a sector-aligned position
+  * @retval false if the previous switch has not happened yet
+  */
+bool SDLOG_Switch(SDLOG_t *log, FIL *next);
+
+/**
+  * @brief  Write everything buffered, including a partial buffer, and f_sync
+  * @note   The partial buffer is a short write; the next buffer is cut short
+  *         to get back onto a sector boundary.
+  * @param  log: Logger
+  * @retval FRESULT
+  */
+FRESULT SDLOG_Flush(SDLOG_t *log);
+
+/**
+  * @brief  Flush and close the file
+  * @param  log: Logger
+  * @retval FRESULT
+  */
+FRESULT SDLOG_Close(SDLOG_t *log);
+
+/**
+  * @brief  Copy the statistics
+  * @param  log: Logger
+  * @param  stats: Output
+  * @param  clear: Reset the counters after copying
+  */
+void SDLOG_GetStats(SDLOG_t *log, SDLOG_Stats_t *stats, bool clear);
+
+#endif /* SD_LOGGER_H */
@@ -0,0 +1,133 @@
+/**
+  ******************************************************************************
+  * @file           : sd_logread.h
+  * @brief          : Random access to long log files through a cluster map
+  ******************************************************************************
+  * @note           : Without a cluster link map f_lseek follows the FAT chain
+  *                   from the start of the file, one FAT sector read per 128
+  *                   clusters (FAT32), so a seek near the end of a large log
+  *                   costs the whole chain. LOGRD_Open walks the chain once
+  *                   into a caller-supplied table (FatFs fast seek) and every
+  *                   later seek is arithmetic, as it is anyway on an exFAT
+  *                   file with no FAT chain. On binary logs (sd_binlog.h)
+  *                   LOGRD_SeekTime then finds a timestamp through the index
+  *                   records, for replay on the device or to serve part of a
+  *                   file over USB.
+  ******************************************************************************
+  */
+
+#ifndef SD_LOGREAD_H
+#define SD_LOGREAD_H
+
+#include "ff.h"
+#include "sd_binlog.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bytes read per step when looking for sync frames, holds an index record */
+#ifndef LOGRD_WIN_BYTES
+#define LOGRD_WIN_BYTES         512u
+#endif
+
+/* How far back from the end of the file the last sync frame is looked for */
+#ifndef LOGRD_TAIL_BYTES
+#define LOGRD_TAIL_BYTES        (4u * BINLOG_SYNC_BYTES)
+#endif
+
+/* DWORDs of cluster map for a file in n fragments (one for a file written
+   on an empty or AU-aligned volume) */
+#define LOGRD_MAP_DWORDS(n)     (2u * (n) + 2u)
+
+#define LOGRD_NONE              0xFFFFFFFFu
+
+#if LOGRD_WIN_BYTES < BINLOG_INDEX_SIZE
+#error "LOGRD_WIN_BYTES must hold an index record"
+#endif
+
+/* Reader statistics */
+typedef struct {
+    uint32_t seeks;          // LOGRD_Seek and LOGRD_SeekTime calls
+    uint32_t hops;           // index records read by LOGRD_SeekTime
+    uint32_t scanned;        // bytes searched for sync frames
+} LOGRD_Stats_t;
+
+/* Reader */
+typedef struct {
+    FIL            fil;
+    bool           mapped;         // seeks go through the cluster map
+    DWORD          map_need;       // DWORDs the map needed when it did not fit
+    uint32_t       last_sync;      // offset of the newest sync frame, LOGRD_NONE if none
+    uint32_t       last_ts;        // its timestamp
+    uint32_t       last_index;     // newest index record it names, LOGRD_NONE if none
+    LOGRD_Stats_t  stats;
+    BYTE           win[LOGRD_WIN_BYTES];
+} LOGRD_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Open a file for reading and map its clusters
+  * @note   Builds the map (one pass over the FAT chain) and, for a binary
+  *         log, finds the newest sync frame by reading back from the end.
+  *         A map that does not fit is reported in map_need and the file is
+  *         read without it; a file with no sync frame can still be read by
+  *         offset. With _FS_LOCK the file being written cannot be opened;
+  *         read the closed files of a set.
+  * @param  r: Reader
+  * @param  path: File name
+  * @param  map: Cluster map, kept in use until LOGRD_Close; NULL for none
+  * @param  map_len: DWORDs in map, see LOGRD_MAP_DWORDS
+  * @retval FRESULT
+  */
+FRESULT LOGRD_Open(LOGRD_t *r, const TCHAR *path, DWORD *map, UINT map_len);
+
+/**
+  * @brief  Move the read position
+  * @param  r: Reader
+  * @param  ofs: Byte offset, clipped at the file size
+  * @retval FRESULT
+  */
+FRESULT LOGRD_Seek(LOGRD_t *r, FSIZE_t ofs);
+
+/**
+  * @brief  Read from the current position
+  * @param  r: Reader
+  * @param  buf: Output
+  * @param  btr: Bytes to read
+  * @param  br: Bytes read, less than btr at the end of the file
+  * @retval FRESULT
+  */
+FRESULT LOGRD_Read(LOGRD_t *r, void *buf, UINT btr, UINT *br);
+
+/**
+  * @brief  Position a binary log where records from a timestamp start
+  * @note   Leaves the file at a sync frame: every record before it is older
+  *         than ts, and the first record at or after ts follows it, as a
+  *         rule within the next segment. Decode from there with the frame's
+  *         timestamp as the base and skip records older than ts. The search
+  *         reads O(log n) index records, plus the sync frames written after
+  *         the newest one. Timestamps are taken not to wrap within a file,
+  *         and offsets in the log are 32-bit: on exFAT keep a binary log
+  *         under 4 GB per file (sd_rotlog.h) to search it by time.
+  * @param  r: Reader
+  * @param  ts: Timestamp to start from
+  * @param  base_ts: Timestamp in the sync frame, may be NULL
+  * @retval FRESULT, FR_NO_FILE if the file has no sync frame
+  */
+FRESULT LOGRD_SeekTime(LOGRD_t *r, uint32_t ts, uint32_t *base_ts);
+
+/**
+  * @brief  Close the file
+  * @param  r: Reader
+  * @retval FRESULT
+  */
+FRESULT LOGRD_Close(LOGRD_t *r);
+
+/**
+  * @brief  Copy the statistics
+  * @param  r: Reader
+  * @param  stats: Output
+  */
+void LOGRD_GetStats(LOGRD_t *r, LOGRD_Stats_t *stats);
+
+#endif /* SD_LOGREAD_H */
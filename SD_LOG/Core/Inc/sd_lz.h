@@ -0,0 +1,130 @@
+/**
+  ******************************************************************************
+  * @file           : sd_lz.h
+  * @brief          : Streaming LZ compressor for log output (SD and USB)
+  ******************************************************************************
+  * @note           : Stream layout: a sequence of blocks, each a 16-bit
+  *                   little endian header followed by its payload.
+  *
+  *                   header  bit 15 stored (payload is the raw bytes),
+  *                           bit 14 reset (forget all earlier output),
+  *                           bits 0..13 payload bytes
+  *                   payload LZ4-style sequences: token (literal count << 4
+  *                           | match length - 4), extra literal count
+  *                           bytes when the nibble is 15 (255 continues),
+  *                           the literals, then a 16-bit little endian
+  *                           offset and extra match length bytes the same
+  *                           way. The last sequence of a block has literals
+  *                           only.
+  *
+  *                   Matches may reach back up to 2 * LZ_WINDOW bytes,
+  *                   across block boundaries but never past a reset block.
+  *                   The host decompressor is Tools/sdsim/sdlz.c.
+  ******************************************************************************
+  */
+
+#ifndef SD_LZ_H
+#define SD_LZ_H
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Input bytes per block, also the history kept behind it */
+#ifndef LZ_WINDOW
+#define LZ_WINDOW               1024u
+#endif
+
+/* Match finder table, 2^LZ_HASH_BITS 16-bit entries */
+#ifndef LZ_HASH_BITS
+#define LZ_HASH_BITS            10u
+#endif
+
+#if LZ_WINDOW < 64u || LZ_WINDOW > 8192u
+#error "LZ_WINDOW must be 64..8192"
+#endif
+
+#define LZ_MIN_MATCH            4u
+#define LZ_BLOCK_STORED         0x8000u
+#define LZ_BLOCK_RESET          0x4000u
+#define LZ_BLOCK_LEN_MASK       0x3FFFu
+
+/* Where compressed blocks go, false when they were not taken (SDLOG_Sink) */
+typedef bool (*LZ_Sink_t)(void *ctx, const void *data, UINT len);
+
+/* Compressor statistics */
+typedef struct {
+    uint32_t bytes_in;       // bytes accepted
+    uint32_t bytes_out;      // bytes handed to the sink, block headers included
+    uint32_t blocks;         // blocks written
+    uint32_t stored;         // blocks that did not compress and went out raw
+    uint32_t dropped;        // blocks the sink refused
+} LZ_Stats_t;
+
+/* Compressor, about 5 KB with the defaults; nothing in it needs DMA access,
+   so it can live in CCMRAM */
+typedef struct {
+    LZ_Sink_t   sink;
+    void        *ctx;
+    uint16_t    fill;                          // input bytes waiting in win[LZ_WINDOW..]
+    uint16_t    hist;                          // history bytes behind them
+    bool        reset;                         // next block starts a new stream
+    LZ_Stats_t  stats;
+    uint16_t    hash[1u << LZ_HASH_BITS];      // last win[] index per hash
+    uint8_t     win[2u * LZ_WINDOW];           // history, then the block being filled
+    uint8_t     out[LZ_WINDOW + 2u];           // the block being written
+} LZ_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Set up a compressor in front of a sink
+  * @param  z: Compressor
+  * @param  sink: Output, e.g. SDLOG_Sink or a USB CDC wrapper
+  * @param  ctx: Passed to sink
+  */
+void LZ_Init(LZ_t *z, LZ_Sink_t sink, void *ctx);
+
+/**
+  * @brief  Compress bytes into the stream
+  * @note   Bytes are copied into the window; every LZ_WINDOW of them one
+  *         block is compressed and handed to the sink, so a call costs at
+  *         most one block of work per LZ_WINDOW bytes given. If the sink
+  *         refuses a block it is counted in dropped and the next block
+  *         starts a new stream, so the decoder only loses that block. The
+  *         block may hold bytes of earlier calls and not all of this one,
+  *         so the drop is not reported to the caller.
+  * @param  z: Compressor
+  * @param  data: Bytes
+  * @param  len: Number of bytes
+  */
+void LZ_Write(LZ_t *z, const void *data, UINT len);
+
+/**
+  * @brief  LZ_Write with the LZ_t as a void pointer, to chain behind the
+  *         record encoder (BINLOG_Init(&b, LZ_Sink, &z, ...))
+  * @retval true, the bytes are always taken; a lost block shows up in
+  *         LZ_Stats_t.dropped and the record decoder resyncs after it
+  */
+bool LZ_Sink(void *z, const void *data, UINT len);
+
+/**
+  * @brief  Compress and hand over what is buffered
+  * @note   Call before SDLOG_Flush/SDLOG_Close. A short block compresses
+  *         worse, so flush at checkpoints rather than after every record.
+  * @param  z: Compressor
+  * @param  reset: Also start a new stream, e.g. so a reader can join a USB
+  *         stream at the next block
+  * @retval true if the block was taken
+  */
+bool LZ_Flush(LZ_t *z, bool reset);
+
+/**
+  * @brief  Copy the statistics
+  * @param  z: Compressor
+  * @param  stats: Output
+  * @param  clear: Reset the counters after copying
+  */
+void LZ_GetStats(LZ_t *z, LZ_Stats_t *stats, bool clear);
+
+#endif /* SD_LZ_H */
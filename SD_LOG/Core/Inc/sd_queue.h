@@ -0,0 +1,120 @@
+/**
+  ******************************************************************************
+  * @file           : sd_queue.h
+  * @brief          : Lock-free record queue between interrupt producers and
+  *                    the SD logging loop
+  ******************************************************************************
+  */
+
+#ifndef SD_QUEUE_H
+#define SD_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Longest record payload, the length field is 16 bits */
+#define LOGQ_MAX_RECORD         0xFFF0u
+
+/* Largest ring, record spans are kept in 32-bit words in 16 bits */
+#define LOGQ_MAX_SIZE           (1u << 18)
+
+/* Queue statistics */
+typedef struct {
+    uint32_t records;        // records released by the consumer
+    uint32_t bytes;          // payload bytes in those records
+    uint32_t dropped;        // reservations refused, ring full
+    uint32_t dropped_bytes;  // bytes in those reservations
+    uint32_t max_used;       // high-water mark, ring bytes in use
+} LOGQ_Stats_t;
+
+/* Queue */
+typedef struct {
+    uint32_t          *buf;
+    uint32_t          size;           // bytes, power of two
+    volatile uint32_t head;           // bytes reserved (producers)
+    volatile uint32_t tail;           // bytes released (consumer)
+    volatile uint32_t dropped;        // producer side counters
+    volatile uint32_t dropped_bytes;
+    uint32_t          records;        // consumer side counters
+    uint32_t          bytes;
+    uint32_t          max_used;
+} LOGQ_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Set up a queue on a caller-provided ring
+  * @param  q: Queue
+  * @param  buf: Ring storage, word aligned
+  * @param  size: Ring size in bytes, a power of two from 16 to LOGQ_MAX_SIZE
+  * @retval true if the size is usable
+  */
+bool LOGQ_Init(LOGQ_t *q, void *buf, uint32_t size);
+
+/**
+  * @brief  Reserve room for a record, single producer
+  * @note   Only valid while exactly one context produces into q. The payload
+  *         is written in place, then handed over with LOGQ_Commit. A record
+  *         never wraps around the end of the ring.
+  * @param  q: Queue
+  * @param  len: Payload bytes to reserve
+  * @retval Word-aligned payload area, NULL when the ring is full (counted
+  *         in dropped)
+  */
+void *LOGQ_Reserve(LOGQ_t *q, uint32_t len);
+
+/**
+  * @brief  Reserve room for a record, any number of producers
+  * @note   Claims the space with LDREX/STREX, so interrupts of different
+  *         priorities can produce into the same queue without masking. A
+  *         producer that is preempted between reserve and commit holds up
+  *         the consumer at its record, never the other producers.
+  * @param  q: Queue
+  * @param  len: Payload bytes to reserve
+  * @retval Word-aligned payload area, NULL when the ring is full
+  */
+void *LOGQ_ReserveMP(LOGQ_t *q, uint32_t len);
+
+/**
+  * @brief  Hand a reserved record to the consumer
+  * @param  q: Queue
+  * @param  rec: Pointer returned by LOGQ_Reserve/LOGQ_ReserveMP
+  * @param  len: Payload bytes written, at most the reserved length
+  */
+void LOGQ_Commit(LOGQ_t *q, void *rec, uint32_t len);
+
+/**
+  * @brief  Copy a record into the queue (LOGQ_ReserveMP + LOGQ_Commit)
+  * @param  q: Queue
+  * @param  data: Payload
+  * @param  len: Payload bytes
+  * @retval true if queued
+  */
+bool LOGQ_Push(LOGQ_t *q, const void *data, uint32_t len);
+
+/**
+  * @brief  Oldest committed record
+  * @note   Consumer side, a single context. The record stays in the ring
+  *         until LOGQ_Release.
+  * @param  q: Queue
+  * @param  len: Payload bytes of the record
+  * @retval Payload, NULL when the queue is empty or the oldest record is
+  *         not committed yet
+  */
+const void *LOGQ_Peek(LOGQ_t *q, uint32_t *len);
+
+/**
+  * @brief  Drop the record returned by LOGQ_Peek and free its space
+  * @param  q: Queue
+  */
+void LOGQ_Release(LOGQ_t *q);
+
+/**
+  * @brief  Copy the statistics
+  * @param  q: Queue
+  * @param  stats: Output
+  * @param  clear: Reset the counters after copying
+  */
+void LOGQ_GetStats(LOGQ_t *q, LOGQ_Stats_t *stats, bool clear);
+
+#endif /* SD_QUEUE_H */
@@ -0,0 +1,106 @@
+/**
+  ******************************************************************************
+  * @file           : sd_rawlog.h
+  * @brief          : Preallocated log file written as raw consecutive sectors
+  ******************************************************************************
+  */
+
+#ifndef SD_RAWLOG_H
+#define SD_RAWLOG_H
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Recovery stops after this many erased sectors in a row. One erased looking
+   sector can be genuine data (a block of zeros), a whole run is taken as
+   the end of what was written before the power cut. */
+#ifndef RAWLOG_GUARD_SECTORS
+#define RAWLOG_GUARD_SECTORS    8u
+#endif
+
+/* Byte used to fill the unwritten part of the last sector at a checkpoint */
+#define RAWLOG_PAD              0x00u
+
+/* Size record, the last sector of the extent:
+     magic u32, its own LBA u32, size u64, little endian, the rest 0 */
+#define RAWLOG_MAGIC            0x474C5752u  // "RWLG"
+
+/* Open log */
+typedef struct {
+    FIL      fil;            // FatFs handle, keeps the directory entry
+    FATFS    *fs;
+    DWORD    lba_base;       // first sector of the extent
+    DWORD    lba_count;      // sectors reserved
+    DWORD    lba_next;       // next full sector to write, relative to lba_base
+    FSIZE_t  size;           // bytes logged
+    FSIZE_t  committed;      // size in the size record
+    UINT     ss;             // sector size
+    UINT     tail_len;       // bytes waiting in tail
+    bool     erased;         // extent was trimmed at open, recovery can find its end
+    DWORD    lba_rec;        // the size record, after the lba_count sectors
+    BYTE     tail[_MAX_SS];  // partial sector
+    BYTE     rec[_MAX_SS];   // size record
+} RAWLOG_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Create a log file with a contiguous extent of reserve bytes
+  * @note   The extent is allocated with f_expand and trimmed. The directory
+  *         entry covers the whole extent until RAWLOG_Close, so a disk
+  *         checker finds the clusters in use; the size logged is kept in a
+  *         record in the last sector of the extent, one sector more than
+  *         reserve. Writes touch no FAT or directory sector.
+  * @param  log: Log object
+  * @param  path: File name, the file is replaced if it exists
+  * @param  reserve: Bytes to reserve, the log cannot grow past this
+  * @retval FRESULT, FR_DENIED when no contiguous area of that size is free
+  */
+FRESULT RAWLOG_Open(RAWLOG_t *log, const TCHAR *path, FSIZE_t reserve);
+
+/**
+  * @brief  Append data
+  * @note   Whole sectors go from data straight to disk_write, a remainder
+  *         stays in log->tail until the next call fills it.
+  * @param  log: Log object
+  * @param  data: Bytes to log
+  * @param  len: Number of bytes
+  * @retval FRESULT, FR_DENIED when the extent is full (nothing written)
+  */
+FRESULT RAWLOG_Write(RAWLOG_t *log, const void *data, UINT len);
+
+/**
+  * @brief  Make everything logged so far survive a power cut
+  * @note   Writes the partial sector padded with RAWLOG_PAD, then the size
+  *         record, and syncs the card.
+  * @param  log: Log object
+  * @retval FRESULT
+  */
+FRESULT RAWLOG_Checkpoint(RAWLOG_t *log);
+
+/**
+  * @brief  Checkpoint, release the unused part of the extent and close
+  * @param  log: Log object
+  * @retval FRESULT
+  */
+FRESULT RAWLOG_Close(RAWLOG_t *log);
+
+/**
+  * @brief  Fix the size of a log that was not closed
+  * @note   Call after f_mount. Sectors past the recorded size are scanned
+  *         until RAWLOG_GUARD_SECTORS erased ones in a row or the end of
+  *         the extent; the size is extended to the last written sector,
+  *         so a partly written last sector keeps its padding, and the file
+  *         is cut to that size as RAWLOG_Close would. The scan starts at
+  *         the size in the size record; a file without one (closed), or not
+  *         one contiguous extent, is left alone.
+  * @param  path: Log file
+  * @param  work: Scan buffer, a multiple of the sector size
+  * @param  len: Size of the work buffer
+  * @param  size: Size after recovery, may be NULL
+  * @retval FRESULT
+  */
+FRESULT RAWLOG_Recover(const TCHAR *path, void *work, UINT len, FSIZE_t *size);
+
+#endif /* SD_RAWLOG_H */
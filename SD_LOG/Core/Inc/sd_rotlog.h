@@ -0,0 +1,145 @@
+/**
+  ******************************************************************************
+  * @file           : sd_rotlog.h
+  * @brief          : Size-capped rotating set of log files
+  ******************************************************************************
+  * @note           : The set lives in one directory as NNNNNNNN.LOG files,
+  *                   numbered in the order they were started. At most nfiles
+  *                   of them exist, each about max_size bytes; the oldest is
+  *                   removed to make room for a new one, or earlier when the
+  *                   volume runs short of free space.
+  ******************************************************************************
+  */
+
+#ifndef SD_ROTLOG_H
+#define SD_ROTLOG_H
+
+#include "ff.h"
+#include "sd_logger.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bytes the oldest file is cut back by per ROTLOG_Service call; bounds the
+   FAT updates (one entry per cluster) done in one step */
+#ifndef ROTLOG_TRIM_BYTES
+#define ROTLOG_TRIM_BYTES       (256u * 1024u)
+#endif
+
+/* Free space to keep beyond one max_size file, in bytes */
+#ifndef ROTLOG_RESERVE_BYTES
+#define ROTLOG_RESERVE_BYTES    0u
+#endif
+
+#define ROTLOG_MAX_DIR          12u
+#define ROTLOG_FREE_UNKNOWN     0xFFFFFFFFu
+
+/* Set statistics */
+typedef struct {
+    uint32_t rotations;      // files started by ROTLOG_Rotate
+    uint32_t deleted;        // old files removed
+    uint32_t trim_steps;     // ROTLOG_TRIM_BYTES steps spent removing them
+    uint32_t max_overrun;    // most bytes written past max_size before a rotation
+} ROTLOG_Stats_t;
+
+/* Rotating set */
+typedef struct {
+    FSIZE_t        max_size;
+    UINT           nfiles;
+    uint32_t       oldest;            // sequence number of the oldest file
+    uint32_t       newest;            // sequence number of the one being written
+    UINT           count;             // files in the set, the spare not included
+    BYTE           cur;               // fil[cur] is the file being written
+    BYTE           state;             // what the spare fil[cur ^ 1] is doing
+    FATFS          *fs;
+    ROTLOG_Stats_t stats;
+    char           dir[ROTLOG_MAX_DIR + 1u];
+    char           path[ROTLOG_MAX_DIR + 14u];
+    FIL            fil[2];
+} ROTLOG_t;
+
+/* Function Prototypes */
+
+/**
+  * @brief  Open a rotating set and start a new file in it
+  * @note   Lists the directory once (creating it if needed) to find the
+  *         oldest and newest files; empty files left by a power loss are
+  *         removed. Logging always starts a new file, so a torn tail stays
+  *         at the end of the previous one. On FAT12/16 the free clusters are
+  *         counted here once (a FAT of at most 256 sectors).
+  * @param  r: Set
+  * @param  dir: Directory on the default drive, at most ROTLOG_MAX_DIR chars
+  * @param  nfiles: Files kept, the one being written included (2 or more)
+  * @param  max_size: Bytes per file before ROTLOG_Due asks for a rotation
+  * @retval FRESULT
+  */
+FRESULT ROTLOG_Open(ROTLOG_t *r, const char *dir, UINT nfiles, FSIZE_t max_size);
+
+/**
+  * @brief  File being written, for SDLOG_Init
+  */
+FIL *ROTLOG_File(ROTLOG_t *r);
+
+/**
+  * @brief  Check if the current file is full and the next one is ready
+  * @note   Producer side, no FatFs call. Call between records; when it
+  *         returns true, close off the record stream (BINLOG_Sync,
+  *         LZ_Flush with reset) and call ROTLOG_Rotate. While the next file
+  *         is not ready the current one keeps growing (stats.max_overrun).
+  * @param  r: Set
+  * @param  log: Logger writing to the set
+  * @retval true to rotate now
+  */
+bool ROTLOG_Due(ROTLOG_t *r, SDLOG_t *log);
+
+/**
+  * @brief  Continue the log in the next file
+  * @note   Producer side, no FatFs call (SDLOG_Switch). The previous file
+  *         is closed by a later ROTLOG_Service once its last buffer is
+  *         written.
+  * @param  r: Set
+  * @param  log: Logger writing to the set
+  * @retval true if switched, false if the next file is not ready
+  */
+bool ROTLOG_Rotate(ROTLOG_t *r, SDLOG_t *log);
+
+/**
+  * @brief  One step of background work
+  * @note   Call from the main loop after SDLOG_Service. Each call does at
+  *         most one of: close the previous file, cut ROTLOG_TRIM_BYTES off
+  *         the oldest file (or remove it once empty), create the next
+  *         file. None of it touches the logger's buffers.
+  * @param  r: Set
+  * @param  log: Logger writing to the set
+  * @retval FRESULT
+  */
+FRESULT ROTLOG_Service(ROTLOG_t *r, SDLOG_t *log);
+
+/**
+  * @brief  Close the logger and the set
+  * @note   A next file created ahead is removed again.
+  * @param  r: Set
+  * @param  log: Logger writing to the set
+  * @retval FRESULT
+  */
+FRESULT ROTLOG_Close(ROTLOG_t *r, SDLOG_t *log);
+
+/**
+  * @brief  Free clusters on a mounted volume, without scanning the FAT
+  * @note   FatFs starts from the FSINFO count at mount and adjusts it on
+  *         every allocation and release, ours included. f_getfree only
+  *         scans when that count is unknown, which for a FAT32 card over SPI
+  *         takes seconds; here that case is reported instead (ROTLOG_Open
+  *         seeds the count on FAT12/16, where the FAT is small).
+  * @param  fs: Volume
+  * @retval Free clusters, ROTLOG_FREE_UNKNOWN if not known
+  */
+DWORD ROTLOG_FreeClusters(FATFS *fs);
+
+/**
+  * @brief  Copy the statistics
+  * @param  r: Set
+  * @param  stats: Output
+  */
+void ROTLOG_GetStats(ROTLOG_t *r, ROTLOG_Stats_t *stats);
+
+#endif /* SD_ROTLOG_H */
@@ -26,6 +26,18 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include "../../Middlewares/FATFS_SD/FATFS_SD.h"
+#include "sd_format.h"
+#include "sd_rawlog.h"
+#include "sd_logger.h"
+#include "sd_queue.h"
+#include "sd_binlog.h"
+#include "sd_lz.h"
+#include "sd_rotlog.h"
+#include "sd_fastmount.h"
+#include "sd_logread.h"
+#include "sd_bbox.h"
+#include "usbd_cdc_if.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -35,6 +47,22 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define SD_STATS_PERIOD_MS  10000  // SD driver statistics dump interval over CDC, 0 = off
+#define SD_FORMAT_ON_BOOT   0      // 1 = AU-aligned reformat of drive 0 at startup, exFAT on SDXC (erases the card!)
+#define SD_BLACKBOX_MB      16     // ... leaving this much at the end of the card as a black-box partition, 0 = none
+#define SD_RAWLOG_FILE      "LOG.BIN"  // preallocated raw log, its size is recovered at mount
+#define LOG_QUEUE_BYTES     (_MAX_SS == _MIN_SS ? 16384 : 4096)  // ring between interrupt producers (USB CDC RX) and the SD logger, sized by the FatFs sector buffers (_MAX_SS)
+#define LOG_COMPRESS        1          // 1 = binary log goes through the LZ stage (Tools/sdsim/sdlz -d to unpack)
+#define LOG_TO_USB          0          // 1 = compressed log streams over USB CDC instead of to the card
+#define LOG_SET_DIR         "LOGS"     // rotating log set: LOGS/NNNNNNNN.LOG, a new file every boot
+#define LOG_SET_FILES       8          // files kept, the oldest is removed in the background
+#define LOG_SET_FILE_BYTES  (1024u * 1024u)  // size at which the next file is started
+#define LOG_SYNC_MS         1000       // f_sync the log at least this often, 0 = only on close
+#define LOG_SYNC_KB         256        // ... and after this much data, 0 = off
+#define SD_FAST_MOUNT       1          // 1 = FAT16 free count cached in backup SRAM (sd_fastmount.h)
+#define LOG_MAP_FRAGMENTS   16         // cluster map for random access to a log file (sd_logread.h)
+#define LOG_BLACKBOX        1          // 1 = the records also go to the card's black-box partition (sd_bbox.h)
+#define HOST_LOG_FILE       "HOST_RX.BIN"  // after the test, what the host sends over USB CDC, appended as received
 
 /* USER CODE END PD */
 
@@ -47,7 +75,28 @@
 
 /* USER CODE BEGIN PV */
 SPI_HandleTypeDef hspi1;
+SPI_HandleTypeDef hspi2;
 char TxBuffer[250];
+LOGQ_t LogQueue;  // filled from interrupts, drained into the SD logger by the main loop
+static uint32_t LogQueueBuf[LOG_QUEUE_BYTES / 4];
+static SDLOG_t Logger;  // the test's log set, then HOST_LOG_FILE for the main loop
+static FATFS HostFs;
+static FIL HostFil;
+static bool HostLogOpen;
+
+// Binary log record layouts, described in the file so the decoder needs no copy of them
+#define LOG_SCHEMA_COUNTER  1
+#define LOG_SCHEMA_USB_RX   2
+static const uint8_t CounterTypes[] = { BINLOG_UVAR, BINLOG_U32 };
+static const char *const CounterFields[] = { "index", "tick_ms" };
+static const BINLOG_Schema_t CounterSchema = { LOG_SCHEMA_COUNTER, "counter", 2, CounterTypes, CounterFields };
+static const uint8_t UsbRxTypes[] = { BINLOG_BYTES };
+static const char *const UsbRxFields[] = { "data" };
+static const BINLOG_Schema_t UsbRxSchema = { LOG_SCHEMA_USB_RX, "usb_rx", 1, UsbRxTypes, UsbRxFields };
+static const BINLOG_Schema_t *const LogSchemas[] = { &CounterSchema, &UsbRxSchema };
+#if LOG_COMPRESS
+static LZ_t LogLz __attribute__((section(".ccmbss")));  // set up by LZ_Init, NOLOAD: no image in FLASH
+#endif
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -57,6 +106,16 @@ static void MX_SPI1_Init(void);
 /* USER CODE BEGIN PFP */
 void MX_USB_DEVICE_Init(void);  // ✅ ADDED: USB Device initialization
 static void SD_Card_Test(void);
+static void Host_Log_Open(void);
+static void SD_Stats_Dump(BYTE pdrv);
+#if SD_FORMAT_ON_BOOT
+static void SD_Format_Card(void);
+#endif
+static void MX_SPI2_Init(void);
+void SPI2_MspInit(SPI_HandleTypeDef* hspi);
+#if SD_USE_SDIO
+void SDIO_MspInit(void);
+#endif
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -66,6 +125,106 @@ static void USB_CDC_Print(char* str)
     CDC_Transmit_FS((uint8_t*)str, strlen(str));  // Send via USB CDC
     HAL_Delay(10);  // Small delay to ensure transmission completes
 }
+
+#if LOG_TO_USB
+//------------------[ Log Sink For USB CDC ]--------------------
+static bool USB_CDC_Sink(void *ctx, const void *data, UINT len)
+{
+    (void)ctx;
+    return CDC_Transmit_Wait_FS((uint8_t*)data, (uint16_t)len, 100) == USBD_OK;
+}
+#endif
+
+//------------------[ SD Driver Statistics Over CDC ]--------------------
+static void SD_Stats_Dump(BYTE pdrv)
+{
+    static const char *Names[SD_OP_CLASSES] = { "rd1", "rdN", "wr1", "wrN", "busy", "init", "ers" };
+    SD_Stats_t St;
+    int len;
+
+    // Read the interval counters and start a new interval
+    if (disk_ioctl(pdrv, SD_GET_STATS_CLEAR, &St) != RES_OK) return;
+
+    sprintf(TxBuffer, "SD%u: rd %lu B, wr %lu B, err cmd %lu data %lu dma %lu, retries %lu\r\n", pdrv,
+            (unsigned long)St.bytes_read, (unsigned long)St.bytes_written, (unsigned long)St.cmd_errors,
+            (unsigned long)St.data_errors, (unsigned long)St.dma_errors, (unsigned long)St.retries);
+    USB_CDC_Print(TxBuffer);
+
+    // Software CRC16 (DMA builds): what the table loop really costs per byte
+    if (St.crc_bytes)
+    {
+        sprintf(TxBuffer, "SD%u: CRC16 %lu B, %lu cycles/KB\r\n", pdrv, (unsigned long)St.crc_bytes,
+                (unsigned long)(St.crc_cycles * 1024u / St.crc_bytes));
+        USB_CDC_Print(TxBuffer);
+    }
+
+    for (int op = 0; op < SD_OP_CLASSES; op++)
+    {
+        SD_OpStats_t *Op = &St.op[op];
+        if (Op->count == 0) continue;
+        // count, average, max, then the log2(us) histogram "bucket:count"
+        len = sprintf(TxBuffer, " %-4s n=%lu avg=%luus max=%luus |", Names[op], (unsigned long)Op->count,
+                      (unsigned long)(Op->total_us / Op->count), (unsigned long)Op->max_us);
+        for (int b = 0; b < SD_STAT_BUCKETS && len < (int)sizeof(TxBuffer) - 16; b++)
+        {
+            if (Op->hist[b]) len += sprintf(TxBuffer + len, " %d:%lu", b, (unsigned long)Op->hist[b]);
+        }
+        sprintf(TxBuffer + len, "\r\n");
+        USB_CDC_Print(TxBuffer);
+    }
+}
+
+#if SD_FAST_MOUNT
+//------------------[ Backup SRAM For The Mount Cache ]--------------------
+// The 4 KB backup SRAM keeps its contents on VBAT once the backup regulator is on. After
+// VBAT was lost it holds garbage, which FMOUNT_Mount rejects (magic and check).
+#define MountCache ((FMOUNT_Cache_t *)BKPSRAM_BASE)
+
+static void Backup_SRAM_Init(void)
+{
+  __HAL_RCC_PWR_CLK_ENABLE();
+  HAL_PWR_EnableBkUpAccess();
+  __HAL_RCC_BKPSRAM_CLK_ENABLE();
+  HAL_PWREx_EnableBkUpReg();
+}
+#endif
+
+#if SD_FORMAT_ON_BOOT
+//------------------[ AU-Aligned Format ]--------------------
+static void SD_Format_Card(void)
+{
+    static BYTE Work[_MAX_SS];
+    SDFMT_Layout_t Layout;
+    FRESULT FR_Status;
+
+    USB_CDC_Print("Formatting SD card...\r\n");
+    FR_Status = SDFMT_FormatAs(USERPath, 0, SD_BLACKBOX_MB * 2048u, Work, sizeof(Work), &Layout);
+    sprintf(TxBuffer, "Format Result: (%i), AU: %lu Sectors, Cluster: %lu Bytes\r\n\n", FR_Status,
+            (unsigned long)Layout.au_sectors, (unsigned long)Layout.cluster_bytes);
+    USB_CDC_Print(TxBuffer);
+}
+#endif
+
+//------------------[ Host Data Log ]--------------------
+// Once the test is done the main loop drains LogQueue (CDC_Receive_FS) into HOST_LOG_FILE, so
+// what the host sends keeps reaching the card; SDLOG_Service writes it, synced as the log set is.
+static void Host_Log_Open(void)
+{
+  static const SDLOG_Policy_t HostPolicy = { LOG_SYNC_MS, LOG_SYNC_KB * 1024u, 0 };
+  FRESULT FR_Status;
+
+  FR_Status = f_mount(&HostFs, "", 1);
+  if (FR_Status == FR_OK) FR_Status = f_open(&HostFil, HOST_LOG_FILE, FA_WRITE | FA_OPEN_APPEND);
+  if (FR_Status == FR_OK) FR_Status = SDLOG_Init(&Logger, &HostFil);
+  if (FR_Status == FR_OK)
+  {
+    SDLOG_SetPolicy(&Logger, &HostPolicy);
+    HostLogOpen = true;
+  }
+  sprintf(TxBuffer, "Host Log: %s From Offset %lu, Result (%i)\r\n\n", HOST_LOG_FILE,
+          (unsigned long)(FR_Status == FR_OK ? f_tell(&HostFil) : 0u), FR_Status);
+  USB_CDC_Print(TxBuffer);
+}
 /* USER CODE END 0 */
 
 /**
@@ -92,7 +251,7 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+  LOGQ_Init(&LogQueue, LogQueueBuf, sizeof(LogQueueBuf));  // before USB can receive
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
@@ -101,10 +260,21 @@ int main(void)
   MX_SPI1_Init();
 
   /* USER CODE BEGIN 2 */
+  MX_SPI2_Init();
+#if SD_USE_SDIO
+  SDIO_MspInit();  // drive 0 on the SDIO slot instead of SPI1
+#endif
   MX_FATFS_Init();
+#if SD_FAST_MOUNT
+  Backup_SRAM_Init();
+#endif
   HAL_Delay(2000);  // ✅ ADDED: Wait for USB enumeration to complete
   USB_CDC_Print("\r\n=== STM32F429 SD Card Test via USB CDC ===\r\n\n");  // ✅ CHANGED
+#if SD_FORMAT_ON_BOOT
+  SD_Format_Card();
+#endif
   SD_Card_Test();
+  Host_Log_Open();
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -114,6 +284,22 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    if (HostLogOpen)
+    {
+      SDLOG_Drain(&Logger, &LogQueue);  // USB CDC RX queued by the interrupt
+      SDLOG_Service(&Logger);
+    }
+    SD_disk_poll(0);  // close idle SD write sessions
+    SD_disk_poll(1);
+
+#if SD_STATS_PERIOD_MS > 0
+    static uint32_t StatsTick;
+    if (HAL_GetTick() - StatsTick >= SD_STATS_PERIOD_MS)
+    {
+      StatsTick = HAL_GetTick();
+      SD_Stats_Dump(0);
+    }
+#endif
   }
   /* USER CODE END 3 */
 }
@@ -132,25 +318,74 @@ static void SD_Card_Test(void)
   do
   {
     //------------------[ Mount The SD Card ]--------------------
+    // Card identification and mount, timed as part of boot-to-first-sample
+    uint32_t MountTick = HAL_GetTick();
+#if SD_FAST_MOUNT
+    static const char *const MountHow[] = { "cached free count", "nothing cached", "other volume",
+                                            "cached free count out of date" };
+    BYTE How;
+    FR_Status = FMOUNT_Mount(&FatFs, "", MountCache, &How);
+#else
     FR_Status = f_mount(&FatFs, "", 1);
+#endif
+    MountTick = HAL_GetTick() - MountTick;
     if (FR_Status != FR_OK)
     {
       sprintf(TxBuffer, "Error! While Mounting SD Card, Error Code: (%i)\r\n", FR_Status);
       USB_CDC_Print(TxBuffer);  // ✅ CHANGED: UART_Print → USB_CDC_Print
       break;
     }
-    sprintf(TxBuffer, "SD Card Mounted Successfully! \r\n\n");
+#if SD_FAST_MOUNT
+    sprintf(TxBuffer, "SD Card Mounted Successfully! (%lu ms, %s) \r\n\n", (unsigned long)MountTick, MountHow[How]);
+#else
+    sprintf(TxBuffer, "SD Card Mounted Successfully! (%lu ms) \r\n\n", (unsigned long)MountTick);
+#endif
     USB_CDC_Print(TxBuffer);  // ✅ CHANGED
 
     //------------------[ Get & Print The SD Card Size & Free Space ]--------------------
-    f_getfree("", &FreeClusters, &FS_Ptr);
+    // The free count comes from FSINFO, f_getfree would scan the whole FAT without it.
+    // A FAT16 FAT is small enough to count, and so is the exFAT allocation bitmap.
+    FS_Ptr = &FatFs;
+    FreeClusters = ROTLOG_FreeClusters(FS_Ptr);
+    if (FreeClusters == ROTLOG_FREE_UNKNOWN && FS_Ptr->fs_type != FS_FAT32) f_getfree("", &FreeClusters, &FS_Ptr);
+#if SD_FAST_MOUNT
+    FMOUNT_Save(&FatFs, MountCache);  // the next boot skips that scan
+#endif
     TotalSize = (uint32_t)((FS_Ptr->n_fatent - 2) * FS_Ptr->csize * 0.5);
     FreeSpace = (uint32_t)(FreeClusters * FS_Ptr->csize * 0.5);
     sprintf(TxBuffer, "Total SD Card Size: %lu Bytes\r\n", TotalSize);
     USB_CDC_Print(TxBuffer);  // ✅ CHANGED
-    sprintf(TxBuffer, "Free SD Card Space: %lu Bytes\r\n\n", FreeSpace);
+    if (FreeClusters == ROTLOG_FREE_UNKNOWN) sprintf(TxBuffer, "Free SD Card Space: Unknown (no FSINFO count)\r\n\n");
+    else sprintf(TxBuffer, "Free SD Card Space: %lu Bytes\r\n\n", FreeSpace);
     USB_CDC_Print(TxBuffer);  // ✅ CHANGED
 
+    //------------------[ Check The Volume Against The Card's Allocation Unit ]--------------------
+    static const char *const FsNames[] = { "?", "FAT12", "FAT16", "FAT32", "exFAT" };  // by FS_FATxx
+    SDFMT_Layout_t Layout;
+    if (SDFMT_GetLayout(FS_Ptr, &Layout) == FR_OK)
+    {
+      sprintf(TxBuffer, "%s, AU: %lu Sectors, Cluster: %lu Bytes, Data Area: LBA %lu (%s)\r\n\n",
+              FsNames[Layout.fs_type <= FS_EXFAT ? Layout.fs_type : 0],
+              (unsigned long)Layout.au_sectors, (unsigned long)Layout.cluster_bytes,
+              (unsigned long)Layout.data_base, Layout.aligned ? "aligned" : "NOT aligned, reformat");
+      USB_CDC_Print(TxBuffer);
+    }
+
+    //------------------[ Recover The Size Of A Raw Log Cut Off By A Power Loss ]--------------------
+    static BYTE RecoverWork[4 * _MAX_SS];
+    FSIZE_t LogSize;
+    FR_Status = RAWLOG_Recover(SD_RAWLOG_FILE, RecoverWork, sizeof(RecoverWork), &LogSize);
+    if (FR_Status == FR_OK)
+    {
+      sprintf(TxBuffer, "Raw Log (%s): %lu Bytes\r\n\n", SD_RAWLOG_FILE, (unsigned long)LogSize);
+      USB_CDC_Print(TxBuffer);
+    }
+    else if (FR_Status != FR_NO_FILE)
+    {
+      sprintf(TxBuffer, "Error! While Recovering (%s), Error Code: (%i)\r\n\n", SD_RAWLOG_FILE, FR_Status);
+      USB_CDC_Print(TxBuffer);
+    }
+
     //------------------[ Open A Text File For Write & Write Data ]--------------------
     //Open the file
     FR_Status = f_open(&Fil, "TextFileWrite.txt", FA_WRITE | FA_READ | FA_CREATE_ALWAYS);
@@ -218,6 +453,190 @@ static void SD_Card_Test(void)
     USB_CDC_Print(TxBuffer);  // ✅ CHANGED
     f_close(&Fil);
 
+    //------------------[ Log Binary Records Through The Double-Buffered Writer ]--------------------
+    // Samples are encoded as compact binary records (sd_binlog.h), whatever the interrupts queued
+    // (USB CDC RX) goes in as byte records, and the logger packs both into sector-multiple buffers.
+    // With LOG_COMPRESS the records pass through the LZ stage first (sd_lz.h). The files are a
+    // rotating set (sd_rotlog.h); each starts with the schemas, so each decodes on its own.
+    // Tools/sdsim/binlog2csv turns a file back into CSV, after sdlz -d if it was compressed.
+    static ROTLOG_t LogSet;
+    ROTLOG_Stats_t SetStats;
+    static const SDLOG_Policy_t LogPolicy = { LOG_SYNC_MS, LOG_SYNC_KB * 1024u, 0 };
+    SDLOG_Stats_t LogStats;
+    bool LogEvent;
+    uint32_t LogSyncs = 0;
+    static BINLOG_t BinLog;
+    BINLOG_Stats_t BinStats;
+    BINLOG_Sink_t LogSink = SDLOG_Sink;
+    void *LogCtx = &Logger;
+#if LOG_COMPRESS
+    LZ_Stats_t LzStats;
+#if LOG_TO_USB
+    LZ_Init(&LogLz, USB_CDC_Sink, NULL);
+#else
+    LZ_Init(&LogLz, SDLOG_Sink, &Logger);
+#endif
+    LogSink = LZ_Sink;
+    LogCtx = &LogLz;
+#endif
+    uint32_t BinCycles = 0, CsvCycles = 0, CsvBytes = 0;
+#if !LOG_COMPRESS
+    uint32_t LogStartTick = HAL_GetTick();  // for the replay below
+#endif
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;  // cycle counter for the encode cost
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#if LOG_BLACKBOX
+    // The same records, uncompressed, into a ring of raw blocks that needs no file system
+    // (sd_bbox.h). It carries on after the newest block of the last session; block 0 keeps
+    // this session's schemas. Tools/sdsim/bbox2bin pulls the ring out of a card image.
+    static BBOX_t BlackBox;
+    static BINLOG_t BoxLog;
+    BBOX_Stats_t BoxStats;
+    FRESULT BoxStatus = BBOX_Open(&BlackBox, 0);
+    uint32_t BoxProbes = BlackBox.stats.probes;
+    if (BoxStatus == FR_OK && (!BINLOG_Init(&BoxLog, BBOX_Sink, &BlackBox, LogSchemas, 2) || !BINLOG_Sync(&BoxLog)))
+      BoxStatus = FR_DENIED;
+    if (BoxStatus == FR_OK) BoxStatus = BBOX_SavePreamble(&BlackBox);
+#endif
+    FR_Status = ROTLOG_Open(&LogSet, LOG_SET_DIR, LOG_SET_FILES, LOG_SET_FILE_BYTES);
+    if (FR_Status == FR_OK)
+    {
+      FR_Status = SDLOG_Init(&Logger, ROTLOG_File(&LogSet));
+      SDLOG_SetPolicy(&Logger, &LogPolicy);
+      // exFAT: each file starts at a free run and grows without a FAT chain
+      if (FR_Status == FR_OK) SDLOG_SetContiguous(&Logger, LOG_SET_FILE_BYTES + SDLOG_BUF_COUNT * SDLOG_BUF_BYTES);
+      if (FR_Status == FR_OK && !BINLOG_Init(&BinLog, LogSink, LogCtx, LogSchemas, 2)) FR_Status = FR_DENIED;
+      for (uint32_t i = 0; FR_Status == FR_OK && i < 1000; i++)
+      {
+        const void *Rec;
+        uint32_t Len, Tick = HAL_GetTick();
+        uint32_t Values[2] = { i, Tick };
+        uint32_t T0 = DWT->CYCCNT;
+        BINLOG_Write(&BinLog, LOG_SCHEMA_COUNTER, Tick, Values);
+        BinCycles += DWT->CYCCNT - T0;
+#if LOG_BLACKBOX
+        if (BoxStatus == FR_OK) BINLOG_Write(&BoxLog, LOG_SCHEMA_COUNTER, Tick, Values);
+#endif
+        // Host data as records of the binary log while the test runs (the main loop takes over after)
+        LogEvent = false;
+        while ((Rec = LOGQ_Peek(&LogQueue, &Len)) != NULL)
+        {
+          BINLOG_WriteBytes(&BinLog, LOG_SCHEMA_USB_RX, HAL_GetTick(), Rec, Len);
+#if LOG_BLACKBOX
+          if (BoxStatus == FR_OK) BINLOG_WriteBytes(&BoxLog, LOG_SCHEMA_USB_RX, HAL_GetTick(), Rec, Len);
+#endif
+          LOGQ_Release(&LogQueue);
+          LogEvent = true;
+        }
+#if LOG_BLACKBOX
+        if (BoxStatus == FR_OK) BoxStatus = BBOX_Service(&BlackBox);
+#endif
+
+        // A host command is an event worth keeping through a power cut: sync right after it,
+        // and on the LOG_SYNC_MS clock otherwise. The LZ stage holds its block until flushed.
+        if (LogEvent || SDLOG_SyncDue(&Logger))
+        {
+#if LOG_COMPRESS && !LOG_TO_USB
+          LZ_Flush(&LogLz, false);
+#endif
+          SDLOG_Commit(&Logger);
+        }
+        FR_Status = SDLOG_Service(&Logger);
+#if SD_FAST_MOUNT
+        if (Logger.stats.syncs != LogSyncs)
+        {
+          LogSyncs = Logger.stats.syncs;
+          FMOUNT_Save(&FatFs, MountCache);  // keep the cached free count as fresh as FSINFO
+        }
+#endif
+
+        // Next file between records: end the stream here, start it again with the schemas
+        if (ROTLOG_Due(&LogSet, &Logger))
+        {
+          BINLOG_Sync(&BinLog);
+#if LOG_COMPRESS
+          LZ_Flush(&LogLz, true);
+#endif
+          ROTLOG_Rotate(&LogSet, &Logger);
+          BINLOG_Init(&BinLog, LogSink, LogCtx, LogSchemas, 2);
+        }
+        if (FR_Status == FR_OK) FR_Status = ROTLOG_Service(&LogSet, &Logger);  // one short step at a time
+      }
+      BINLOG_Sync(&BinLog);  // closes the last segment so its CRC can be checked
+#if LOG_COMPRESS
+      LZ_Flush(&LogLz, false);
+#endif
+      FRESULT CloseStatus = ROTLOG_Close(&LogSet, &Logger);
+      if (FR_Status == FR_OK) FR_Status = CloseStatus;
+#if LOG_BLACKBOX
+      if (BoxStatus == FR_OK && !BINLOG_Sync(&BoxLog)) BoxStatus = FR_DENIED;
+      if (BoxStatus == FR_OK) BoxStatus = BBOX_Flush(&BlackBox);
+#endif
+#if SD_FAST_MOUNT
+      FMOUNT_Save(&FatFs, MountCache);  // free count as of the last sync
+#endif
+
+      // The same records as the sprintf CSV lines this test used to log
+      for (uint32_t i = 0; i < 1000; i++)
+      {
+        uint32_t T0 = DWT->CYCCNT;
+        CsvBytes += sprintf(RW_Buffer, "%lu,%lu\r\n", (unsigned long)i, (unsigned long)HAL_GetTick());
+        CsvCycles += DWT->CYCCNT - T0;
+      }
+
+      BINLOG_GetStats(&BinLog, &BinStats);
+      sprintf(TxBuffer, "Binary Log: %lu Records, %lu Bytes, %lu Cycles/Record (CSV: %lu Bytes, %lu Cycles/Record), Result (%i)\r\n\n",
+              (unsigned long)BinStats.records, (unsigned long)BinStats.bytes, (unsigned long)(BinCycles / 1000u),
+              (unsigned long)CsvBytes, (unsigned long)(CsvCycles / 1000u), FR_Status);
+      USB_CDC_Print(TxBuffer);
+      ROTLOG_GetStats(&LogSet, &SetStats);
+      sprintf(TxBuffer, "Log Set: %s/%08lu.LOG, Files %lu..%lu, %lu Rotations, %lu Deleted, Free %lu Clusters\r\n\n",
+              LOG_SET_DIR, (unsigned long)LogSet.newest, (unsigned long)LogSet.oldest, (unsigned long)LogSet.newest,
+              (unsigned long)SetStats.rotations, (unsigned long)SetStats.deleted,
+              (unsigned long)ROTLOG_FreeClusters(&FatFs));
+      USB_CDC_Print(TxBuffer);
+      SDLOG_GetStats(&Logger, &LogStats, false);
+      sprintf(TxBuffer, "Log Sync: %lu Syncs, At Risk Max %lu Bytes / %lu ms, %lu Files Fragmented\r\n\n",
+              (unsigned long)LogStats.syncs, (unsigned long)LogStats.max_unsynced,
+              (unsigned long)LogStats.max_unsynced_ms, (unsigned long)LogStats.fragmented);
+      USB_CDC_Print(TxBuffer);
+#if LOG_BLACKBOX
+      BBOX_GetStats(&BlackBox, &BoxStats);
+      sprintf(TxBuffer, "Black Box: Head Seq %lu Found In %lu Reads, %lu Blocks In %lu Writes, %lu Dropped, Result (%i)\r\n\n",
+              (unsigned long)(BlackBox.first_seq - 1u), (unsigned long)BoxProbes, (unsigned long)BoxStats.blocks,
+              (unsigned long)BoxStats.writes, (unsigned long)BoxStats.dropped, BoxStatus);
+      USB_CDC_Print(TxBuffer);
+#endif
+#if LOG_COMPRESS
+      LZ_GetStats(&LogLz, &LzStats, false);
+      sprintf(TxBuffer, "LZ Stage: %lu -> %lu Bytes, %lu Blocks (%lu Stored, %lu Dropped)\r\n\n",
+              (unsigned long)LzStats.bytes_in, (unsigned long)LzStats.bytes_out, (unsigned long)LzStats.blocks,
+              (unsigned long)LzStats.stored, (unsigned long)LzStats.dropped);
+      USB_CDC_Print(TxBuffer);
+#endif
+
+#if !LOG_COMPRESS
+      // Replay from the middle of the file just closed: the cluster map makes every seek
+      // arithmetic, the index records in the log find the timestamp in a few reads
+      static LOGRD_t LogReader;
+      static DWORD LogMap[LOGRD_MAP_DWORDS(LOG_MAP_FRAGMENTS)];
+      LOGRD_Stats_t ReadStats;
+      uint32_t SeekTick = LogStartTick + (HAL_GetTick() - LogStartTick) / 2u, BaseTick = 0;
+      sprintf(RW_Buffer, "%s/%08lu.LOG", LOG_SET_DIR, (unsigned long)LogSet.newest);
+      FR_Status = LOGRD_Open(&LogReader, RW_Buffer, LogMap, sizeof(LogMap) / sizeof(LogMap[0]));
+      if (FR_Status == FR_OK)
+      {
+        FR_Status = LOGRD_SeekTime(&LogReader, SeekTick, &BaseTick);
+        LOGRD_GetStats(&LogReader, &ReadStats);
+        sprintf(TxBuffer, "Log Seek: Tick %lu At Offset %lu (Sync Tick %lu), %lu Index Reads, Map %s, Result (%i)\r\n\n",
+                (unsigned long)SeekTick, (unsigned long)f_tell(&LogReader.fil), (unsigned long)BaseTick,
+                (unsigned long)ReadStats.hops, LogReader.mapped ? "Used" : "Too Small", FR_Status);
+        USB_CDC_Print(TxBuffer);
+        LOGRD_Close(&LogReader);
+      }
+#endif
+    }
+
     //------------------[ Delete The Text File ]--------------------
     // Delete The File
     /*
@@ -355,6 +774,32 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
+/**
+  * @brief SPI2 Initialization Function (second SD card, drive 1)
+  * @param None
+  * @retval None
+  */
+static void MX_SPI2_Init(void)
+{
+  /* SPI2 parameter configuration*/
+  hspi2.Instance = SPI2;
+  hspi2.Init.Mode = SPI_MODE_MASTER;
+  hspi2.Init.Direction = SPI_DIRECTION_2LINES;
+  hspi2.Init.DataSize = SPI_DATASIZE_8BIT;
+  hspi2.Init.CLKPolarity = SPI_POLARITY_LOW;
+  hspi2.Init.CLKPhase = SPI_PHASE_1EDGE;
+  hspi2.Init.NSS = SPI_NSS_SOFT;
+  hspi2.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256;
+  hspi2.Init.FirstBit = SPI_FIRSTBIT_MSB;
+  hspi2.Init.TIMode = SPI_TIMODE_DISABLE;
+  hspi2.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
+  hspi2.Init.CRCPolynomial = 10;
+  SPI2_MspInit(&hspi2);
+  if (HAL_SPI_Init(&hspi2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
 
 /* USER CODE END 4 */
 
@@ -0,0 +1,296 @@
+/**
+  ******************************************************************************
+  * @file           : sd_bbox.c
+  * @brief          : Black-box logging to a raw partition, no file system
+  ******************************************************************************
+  * @note           : The producer packs records into BBOX_RING_BLOCKS block
+  *                   buffers and hands each one over as it fills, as the
+  *                   double-buffered logger does; BBOX_Service numbers the
+  *                   full blocks, seals them with their CRC and writes each
+  *                   run that is contiguous both in RAM and on the card in
+  *                   one SD_disk_write (CMD25 on the SPI driver).
+  *
+  *                   Blocks are written in seq order, so after a power cut
+  *                   the ring holds seq s+1..s+k in slots 0..k-1 and the pass
+  *                   before it in the rest. Whether slot i was written in the
+  *                   same pass as slot 0 is a monotonic predicate, and the
+  *                   head is found by bisecting it.
+  ******************************************************************************
+  */
+
+#include "sd_bbox.h"
+#include "sd_binlog.h"
+#include "sd_format.h"
+#include "main.h"
+#include "../../Middlewares/FATFS_SD/FATFS_SD.h"
+#include <stddef.h>
+#include <string.h>
+
+/* Private function prototypes */
+static uint32_t BBOX_Get32(const BYTE *p);
+static void BBOX_Put32(BYTE *p, uint32_t v);
+static uint32_t BBOX_Check(BBOX_t *b, const BYTE *p, uint32_t magic);
+static uint32_t BBOX_Probe(BBOX_t *b, uint32_t slot, FRESULT *fr);
+static void BBOX_Seal(BBOX_t *b, BYTE *p, uint32_t magic, uint32_t seq);
+static void BBOX_Hand(BBOX_t *b);
+static UINT BBOX_Room(BBOX_t *b);
+
+/**
+  * @brief  Little endian u32
+  */
+static uint32_t BBOX_Get32(const BYTE *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+  * @brief  Store a little endian u32
+  */
+static void BBOX_Put32(BYTE *p, uint32_t v)
+{
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+    p[2] = (BYTE)(v >> 16);
+    p[3] = (BYTE)(v >> 24);
+}
+
+/**
+  * @brief  Sequence number of a valid block of this ring, 0 if it is not one
+  */
+static uint32_t BBOX_Check(BBOX_t *b, const BYTE *p, uint32_t magic)
+{
+    uint16_t crc = (uint16_t)(p[BBOX_BLOCK - 2u] | p[BBOX_BLOCK - 1u] << 8);
+
+    if (BBOX_Get32(&p[0]) != magic || BBOX_Get32(&p[8]) != b->blocks) return 0;
+    if (BINLOG_Crc16(0xFFFFu, p, BBOX_BLOCK - 2u) != crc) return 0;
+    return BBOX_Get32(&p[4]);
+}
+
+/**
+  * @brief  Read ring slot and return its seq, 0 if not valid or misplaced
+  * @note   Uses the first RAM block, nothing is buffered yet.
+  */
+static uint32_t BBOX_Probe(BBOX_t *b, uint32_t slot, FRESULT *fr)
+{
+    BYTE *p = (BYTE *)b->buf[0];
+    uint32_t seq;
+
+    b->stats.probes++;
+    if (SD_disk_read(b->pdrv, p, b->base + 1u + slot, 1) != RES_OK) {
+        *fr = FR_DISK_ERR;
+        return 0;
+    }
+    seq = BBOX_Check(b, p, BBOX_MAGIC);
+    if (seq == 0u || (seq - 1u) % b->blocks != slot) return 0;
+    return seq;
+}
+
+/**
+  * @brief  Fill in the header fields the writer owns and the CRC
+  */
+static void BBOX_Seal(BBOX_t *b, BYTE *p, uint32_t magic, uint32_t seq)
+{
+    uint16_t crc;
+
+    BBOX_Put32(&p[0], magic);
+    BBOX_Put32(&p[4], seq);
+    BBOX_Put32(&p[8], b->blocks);
+    p[18] = (seq == b->first_seq) ? (BYTE)BBOX_FLAG_START : 0u;
+    p[19] = 0;
+    crc = BINLOG_Crc16(0xFFFFu, p, BBOX_BLOCK - 2u);
+    p[BBOX_BLOCK - 2u] = (BYTE)crc;
+    p[BBOX_BLOCK - 1u] = (BYTE)(crc >> 8);
+}
+
+/**
+  * @brief  Queue the filling block for the writer and start the next one
+  */
+static void BBOX_Hand(BBOX_t *b)
+{
+    BYTE *p = (BYTE *)b->buf[b->head % BBOX_RING_BLOCKS];
+    UINT pending;
+
+    memset(&p[BBOX_HEAD_SIZE + b->fill], 0, BBOX_PAYLOAD - b->fill);
+    BBOX_Put32(&p[12], HAL_GetTick());
+    p[16] = (BYTE)b->fill;
+    p[17] = (BYTE)(b->fill >> 8);
+    __DMB();  /* block contents before the new head */
+    b->head++;
+
+    b->fill = 0;
+    pending = b->head - b->tail;
+    if (pending > b->stats.max_pending) b->stats.max_pending = pending;
+}
+
+/**
+  * @brief  Bytes BBOX_Append can take right now
+  */
+static UINT BBOX_Room(BBOX_t *b)
+{
+    UINT pending = b->head - b->tail;
+
+    if (pending >= BBOX_RING_BLOCKS) return 0;
+    return (BBOX_PAYLOAD - b->fill) + (BBOX_RING_BLOCKS - 1u - pending) * BBOX_PAYLOAD;
+}
+
+/**
+  * @brief  Find the black-box partition and the newest block in it
+  */
+FRESULT BBOX_Open(BBOX_t *b, BYTE pdrv)
+{
+    BYTE *mbr = (BYTE *)b->pre;
+    BYTE *pte;
+    DWORD size = 0;
+    uint32_t seq0, seq, lo, hi, mid;
+    FRESULT fr = FR_OK;
+    UINT i;
+
+    memset(b, 0, offsetof(BBOX_t, pre));
+    b->pdrv = pdrv;
+    if (SD_disk_status(pdrv) & STA_NOINIT) return FR_NOT_READY;
+    if (SD_disk_read(pdrv, mbr, 0, 1) != RES_OK) return FR_DISK_ERR;
+    if (mbr[SDFMT_MBR_SIG] != 0x55u || mbr[SDFMT_MBR_SIG + 1u] != 0xAAu) return FR_NO_FILE;
+    for (i = 0; i < 4u; i++) {
+        pte = &mbr[SDFMT_MBR_TABLE + SDFMT_PTE_SIZE * i];
+        if (pte[SDFMT_PTE_TYPE] == SDFMT_RAW_TYPE) {
+            b->base = BBOX_Get32(&pte[SDFMT_PTE_START]);
+            size = BBOX_Get32(&pte[SDFMT_PTE_SECTORS]);
+            break;
+        }
+    }
+    if (size < 3u) return FR_NO_FILE;
+    b->blocks = size - 1u;
+
+    /* slots 0..lo are in block 0's pass, lo + 1 onwards are not */
+    seq0 = BBOX_Probe(b, 0, &fr);
+    if (fr != FR_OK) return fr;
+    if (seq0 == 0u) {
+        /* empty, or slot 0 was cut short as the ring wrapped */
+        b->last_seq = BBOX_Probe(b, b->blocks - 1u, &fr);
+    } else {
+        lo = 0;
+        hi = b->blocks;
+        while (fr == FR_OK && hi - lo > 1u) {
+            mid = lo + (hi - lo) / 2u;
+            seq = BBOX_Probe(b, mid, &fr);
+            if (seq && (seq - 1u) / b->blocks == (seq0 - 1u) / b->blocks) lo = mid;
+            else hi = mid;
+        }
+        b->last_seq = seq0 + lo;
+    }
+    if (fr != FR_OK) return fr;
+
+    b->next_seq = b->last_seq + 1u;
+    b->first_seq = b->next_seq;
+    memset(b->pre, 0, sizeof(b->pre));
+    b->capture = true;
+    return FR_OK;
+}
+
+/**
+  * @brief  Append one record
+  */
+bool BBOX_Append(BBOX_t *b, const void *data, UINT len)
+{
+    const BYTE *p = (const BYTE *)data;
+    UINT n;
+
+    if (!b->blocks || len > BBOX_Room(b)) {
+        b->stats.dropped++;
+        return false;
+    }
+    b->stats.records++;
+    b->stats.bytes += len;
+
+    if (b->capture && b->pre_len < BBOX_PAYLOAD) {
+        n = BBOX_PAYLOAD - b->pre_len;
+        if (n > len) n = len;
+        memcpy((BYTE *)b->pre + BBOX_HEAD_SIZE + b->pre_len, p, n);
+        b->pre_len += n;
+    }
+    while (len) {
+        n = BBOX_PAYLOAD - b->fill;
+        if (n > len) n = len;
+        memcpy((BYTE *)b->buf[b->head % BBOX_RING_BLOCKS] + BBOX_HEAD_SIZE + b->fill, p, n);
+        b->fill += n;
+        p += n;
+        len -= n;
+        if (b->fill == BBOX_PAYLOAD) BBOX_Hand(b);
+    }
+    return true;
+}
+
+/**
+  * @brief  BBOX_Append for BINLOG_Init and other encoders
+  */
+bool BBOX_Sink(void *b, const void *data, UINT len)
+{
+    return BBOX_Append((BBOX_t *)b, data, len);
+}
+
+/**
+  * @brief  Write the session's first bytes to block 0
+  */
+FRESULT BBOX_SavePreamble(BBOX_t *b)
+{
+    BYTE *p = (BYTE *)b->pre;
+
+    if (!b->blocks) return FR_NOT_READY;
+    b->capture = false;
+    __DMB();  /* no more bytes from the producer */
+    BBOX_Put32(&p[12], HAL_GetTick());
+    p[16] = (BYTE)b->pre_len;
+    p[17] = (BYTE)(b->pre_len >> 8);
+    BBOX_Seal(b, p, BBOX_HDR_MAGIC, b->first_seq);
+    if (SD_disk_write(b->pdrv, p, b->base, 1) != RES_OK) return FR_DISK_ERR;
+    return FR_OK;
+}
+
+/**
+  * @brief  Write the full blocks
+  */
+FRESULT BBOX_Service(BBOX_t *b)
+{
+    UINT i, k, n;
+    uint32_t slot;
+
+    while (b->tail != b->head) {
+        /* up to the end of the RAM ring and of the ring on the card */
+        i = b->tail % BBOX_RING_BLOCKS;
+        slot = (b->next_seq - 1u) % b->blocks;
+        n = b->head - b->tail;
+        if (n > BBOX_RING_BLOCKS - i) n = BBOX_RING_BLOCKS - i;
+        if (n > b->blocks - slot) n = b->blocks - slot;
+
+        for (k = 0; k < n; k++) BBOX_Seal(b, (BYTE *)b->buf[i + k], BBOX_MAGIC, b->next_seq + k);
+        b->stats.writes++;
+        if (SD_disk_write(b->pdrv, (const BYTE *)b->buf[i], b->base + 1u + slot, n) != RES_OK) return FR_DISK_ERR;
+        b->stats.blocks += n;
+        b->next_seq += n;
+        b->last_seq = b->next_seq - 1u;
+        __DMB();  /* blocks written out before the producer may reuse them */
+        b->tail += n;
+    }
+    return FR_OK;
+}
+
+/**
+  * @brief  Write everything buffered, including a partial block
+  */
+FRESULT BBOX_Flush(BBOX_t *b)
+{
+    FRESULT fr;
+
+    if (b->fill) BBOX_Hand(b);
+    fr = BBOX_Service(b);
+    if (fr == FR_OK && SD_disk_ioctl(b->pdrv, CTRL_SYNC, NULL) != RES_OK) fr = FR_DISK_ERR;
+    return fr;
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void BBOX_GetStats(BBOX_t *b, BBOX_Stats_t *stats)
+{
+    *stats = b->stats;
+}
@@ -0,0 +1,364 @@
+/**
+  ******************************************************************************
+  * @file           : sd_binlog.c
+  * @brief          : Compact binary log records for the SD logger
+  ******************************************************************************
+  * @note           : A sprintf'd CSV line of a few readings is 30-60 bytes
+  *                   and a few thousand cycles of formatting. Here a record
+  *                   is a schema id, the timestamp delta as a varint (one
+  *                   byte for steps below 128 ticks) and the fields in their
+  *                   native width, put together with shifts and stores. The
+  *                   layout is described in sd_binlog.h; the host decoder is
+  *                   Tools/sdsim/binlog2csv.c.
+  *
+  *                   The sparse index costs BINLOG_INDEX_SIZE bytes or less
+  *                   per BINLOG_INDEX_SYNCS segments (about 1.5% with the
+  *                   defaults) and is built from offsets and timestamps the
+  *                   encoder already has, with no file access of its own.
+  ******************************************************************************
+  */
+
+#include "sd_binlog.h"
+
+/* Private function prototypes */
+static uint8_t *BINLOG_PutVar(uint8_t *p, uint32_t v);
+static uint8_t *BINLOG_PutField(uint8_t *p, uint8_t type, uint32_t v);
+static bool BINLOG_Emit(BINLOG_t *b, const uint8_t *rec, UINT len, uint32_t ts);
+static bool BINLOG_PutSchema(BINLOG_t *b, const BINLOG_Schema_t *s);
+static uint8_t *BINLOG_Put32(uint8_t *p, uint32_t v);
+#if BINLOG_INDEX_SYNCS
+static void BINLOG_PutIndex(BINLOG_t *b);
+#endif
+
+/* CRC16-CCITT, poly 0x1021 */
+static const uint16_t BINLOG_Crc16Table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+/**
+  * @brief  Append an unsigned LEB128 varint
+  */
+static uint8_t *BINLOG_PutVar(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80u) {
+        *p++ = (uint8_t)(v | 0x80u);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/**
+  * @brief  Append one fixed-size or varint field
+  */
+static uint8_t *BINLOG_PutField(uint8_t *p, uint8_t type, uint32_t v)
+{
+    switch (type) {
+    case BINLOG_U8:
+    case BINLOG_I8:
+        *p++ = (uint8_t)v;
+        break;
+    case BINLOG_U16:
+    case BINLOG_I16:
+        *p++ = (uint8_t)v;
+        *p++ = (uint8_t)(v >> 8);
+        break;
+    case BINLOG_U32:
+    case BINLOG_I32:
+    case BINLOG_F32:
+        *p++ = (uint8_t)v;
+        *p++ = (uint8_t)(v >> 8);
+        *p++ = (uint8_t)(v >> 16);
+        *p++ = (uint8_t)(v >> 24);
+        break;
+    case BINLOG_UVAR:
+        p = BINLOG_PutVar(p, v);
+        break;
+    case BINLOG_SVAR:
+        p = BINLOG_PutVar(p, (v << 1) ^ (uint32_t)((int32_t)v >> 31));
+        break;
+    default:
+        return NULL;
+    }
+    return p;
+}
+
+/**
+  * @brief  Hand an encoded record to the sink, sync frame first when due
+  * @note   A refused record leaves the CRC and the timestamp base alone, so
+  *         the stream stays consistent without it.
+  */
+static bool BINLOG_Emit(BINLOG_t *b, const uint8_t *rec, UINT len, uint32_t ts)
+{
+    if ((b->need_sync || b->seg_bytes >= BINLOG_SYNC_BYTES) && !BINLOG_Sync(b)) {
+        b->stats.dropped++;
+        return false;
+    }
+    if (!b->sink(b->ctx, rec, len)) {
+        b->stats.dropped++;
+        return false;
+    }
+    b->crc = BINLOG_Crc16(b->crc, rec, len);
+    b->seg_bytes += len;
+    b->pos += len;
+    b->last_ts = ts;
+    b->stats.records++;
+    b->stats.bytes += len;
+    return true;
+}
+
+/**
+  * @brief  Write the description of one schema
+  */
+static bool BINLOG_PutSchema(BINLOG_t *b, const BINLOG_Schema_t *s)
+{
+    uint8_t rec[BINLOG_MAX_RECORD];
+    UINT len = 0, n, i;
+
+    rec[len++] = BINLOG_TAG_SCHEMA;
+    rec[len++] = s->id;
+    rec[len++] = s->nfields;
+    for (i = 0; i < s->nfields; i++) rec[len++] = s->types[i];
+    for (i = 0; i <= s->nfields; i++) {
+        const char *str = i ? s->fields[i - 1u] : s->name;
+        n = (UINT)strlen(str) + 1u;
+        if (len + n > sizeof(rec)) return false;
+        memcpy(&rec[len], str, n);
+        len += n;
+    }
+    if (!b->sink(b->ctx, rec, len)) return false;
+    b->crc = BINLOG_Crc16(b->crc, rec, len);
+    b->seg_bytes += len;
+    b->pos += len;
+    b->stats.bytes += len;
+    return true;
+}
+
+/**
+  * @brief  Append a little endian u32
+  */
+static uint8_t *BINLOG_Put32(uint8_t *p, uint32_t v)
+{
+    *p++ = (uint8_t)v;
+    *p++ = (uint8_t)(v >> 8);
+    *p++ = (uint8_t)(v >> 16);
+    *p++ = (uint8_t)(v >> 24);
+    return p;
+}
+
+#if BINLOG_INDEX_SYNCS
+/**
+  * @brief  Write the index record for the sync frames since the last one
+  * @note   Starts the segment after the frame that filled it. If the sink
+  *         refuses it the entries are dropped: the previous index record
+  *         still brackets them and a reader scans a little further.
+  */
+static void BINLOG_PutIndex(BINLOG_t *b)
+{
+    uint8_t rec[BINLOG_INDEX_SIZE];
+    uint8_t *p = rec;
+    uint32_t first_ts = b->idx_ent[0][0], at = b->pos, num;
+    UINT i, levels = 0, len;
+
+    while (levels < BINLOG_INDEX_LEVELS && (1uL << levels) <= b->idx_count) levels++;
+    *p++ = BINLOG_TAG_INDEX;
+    *p++ = (uint8_t)b->idx_n;
+    *p++ = (uint8_t)levels;
+    for (i = 0; i < b->idx_n; i++) {
+        p = BINLOG_Put32(p, b->idx_ent[i][0]);
+        p = BINLOG_Put32(p, b->idx_ent[i][1]);
+    }
+    for (i = 0; i < levels; i++) {
+        p = BINLOG_Put32(p, b->idx_lvl[i][0]);
+        p = BINLOG_Put32(p, b->idx_lvl[i][1]);
+    }
+    len = (UINT)(p - rec);
+    b->idx_n = 0;
+    if (!b->sink(b->ctx, rec, len)) return;
+
+    b->crc = BINLOG_Crc16(b->crc, rec, len);
+    b->seg_bytes += len;
+    b->pos += len;
+    b->stats.bytes += len;
+    b->stats.indexes++;
+    b->idx_last = at;
+    num = ++b->idx_count;
+    for (i = 0; i < BINLOG_INDEX_LEVELS && !(num & ((1uL << i) - 1u)); i++) {
+        b->idx_lvl[i][0] = first_ts;
+        b->idx_lvl[i][1] = at;
+    }
+}
+#endif
+
+/**
+  * @brief  Start a binary log: first sync frame and the schema records
+  */
+bool BINLOG_Init(BINLOG_t *b, BINLOG_Sink_t sink, void *ctx, const BINLOG_Schema_t *const *schemas, UINT n)
+{
+    UINT i;
+
+    memset(b, 0, sizeof(*b));
+    b->sink = sink;
+    b->ctx = ctx;
+    b->crc = 0xFFFFu;
+#if BINLOG_INDEX_SYNCS
+    b->idx_last = BINLOG_NO_INDEX;
+#endif
+    for (i = 0; i < n; i++) {
+        const BINLOG_Schema_t *s = schemas[i];
+        if (s->id == 0u || s->id > BINLOG_MAX_SCHEMA || s->nfields > BINLOG_MAX_FIELDS) return false;
+        /* fixed fields must fit a record, a bytes field takes what is left */
+        if (1u + 5u + s->nfields * 5u > BINLOG_MAX_RECORD) return false;
+        b->schema[s->id] = s;
+    }
+
+    if (!BINLOG_Sync(b)) return false;
+    for (i = 0; i < n; i++) {
+        if (!BINLOG_PutSchema(b, schemas[i])) return false;
+    }
+    return true;
+}
+
+/**
+  * @brief  Encode and write one record
+  */
+bool BINLOG_Write(BINLOG_t *b, uint8_t id, uint32_t ts, const uint32_t *values)
+{
+    const BINLOG_Schema_t *s = (id <= BINLOG_MAX_SCHEMA) ? b->schema[id] : NULL;
+    uint8_t rec[BINLOG_MAX_RECORD];
+    uint8_t *p = rec;
+    UINT i;
+
+    if (!s) {
+        b->stats.dropped++;
+        return false;
+    }
+    *p++ = id;
+    p = BINLOG_PutVar(p, ts - b->last_ts);
+    for (i = 0; i < s->nfields && p; i++) {
+        p = BINLOG_PutField(p, s->types[i], values[i]);
+    }
+    if (!p) {
+        b->stats.dropped++;
+        return false;
+    }
+    return BINLOG_Emit(b, rec, (UINT)(p - rec), ts);
+}
+
+/**
+  * @brief  Write one record of a schema with a single BINLOG_BYTES field
+  */
+bool BINLOG_WriteBytes(BINLOG_t *b, uint8_t id, uint32_t ts, const void *data, UINT len)
+{
+    const BINLOG_Schema_t *s = (id <= BINLOG_MAX_SCHEMA) ? b->schema[id] : NULL;
+    uint8_t rec[BINLOG_MAX_RECORD];
+    uint8_t *p = rec;
+
+    if (!s || s->nfields != 1u || s->types[0] != BINLOG_BYTES || len > BINLOG_MAX_RECORD - 11u) {
+        b->stats.dropped++;
+        return false;
+    }
+    *p++ = id;
+    p = BINLOG_PutVar(p, ts - b->last_ts);
+    p = BINLOG_PutVar(p, len);
+    memcpy(p, data, len);
+    return BINLOG_Emit(b, rec, (UINT)(p - rec) + len, ts);
+}
+
+/**
+  * @brief  Close the current segment with a sync frame
+  */
+bool BINLOG_Sync(BINLOG_t *b)
+{
+    uint8_t f[BINLOG_SYNC_SIZE];
+    uint32_t at = b->pos;
+    uint16_t crc;
+
+    f[0] = BINLOG_TAG_SYNC;
+    f[1] = 0xA5u;
+    f[2] = 0x5Au;
+    f[3] = 0xC3u;
+    f[4] = BINLOG_VERSION;
+    f[5] = (uint8_t)b->crc;
+    f[6] = (uint8_t)(b->crc >> 8);
+    BINLOG_Put32(&f[7], b->last_ts);
+#if BINLOG_INDEX_SYNCS
+    BINLOG_Put32(&f[11], b->idx_last);
+#else
+    BINLOG_Put32(&f[11], BINLOG_NO_INDEX);
+#endif
+    crc = BINLOG_Crc16(0xFFFFu, &f[4], 11u);
+    f[15] = (uint8_t)crc;
+    f[16] = (uint8_t)(crc >> 8);
+
+    if (!b->sink(b->ctx, f, sizeof(f))) {
+        b->need_sync = true;
+        return false;
+    }
+    b->crc = 0xFFFFu;
+    b->seg_bytes = 0;
+    b->pos += sizeof(f);
+    b->need_sync = false;
+    b->stats.syncs++;
+    b->stats.bytes += sizeof(f);
+#if BINLOG_INDEX_SYNCS
+    b->idx_ent[b->idx_n][0] = b->last_ts;
+    b->idx_ent[b->idx_n][1] = at;
+    if (++b->idx_n == BINLOG_INDEX_SYNCS) BINLOG_PutIndex(b);
+#else
+    (void)at;
+#endif
+    return true;
+}
+
+/**
+  * @brief  CRC16-CCITT update
+  */
+uint16_t BINLOG_Crc16(uint16_t crc, const void *data, UINT len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    while (len--) {
+        crc = (uint16_t)(crc << 8) ^ BINLOG_Crc16Table[(uint8_t)(crc >> 8) ^ *p++];
+    }
+    return crc;
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void BINLOG_GetStats(BINLOG_t *b, BINLOG_Stats_t *stats)
+{
+    *stats = b->stats;
+}
@@ -0,0 +1,225 @@
+/**
+  ******************************************************************************
+  * @file           : sd_fastmount.c
+  * @brief          : Mount with the free cluster count cached across power cycles
+  ******************************************************************************
+  * @note           : f_mount reads sector 0, the partition's boot sector when
+  *                   sector 0 is an MBR, and FSINFO on FAT32; a FAT12/16
+  *                   volume has no free count until f_getfree scans the
+  *                   whole FAT. The volume is mounted by f_mount as usual;
+  *                   on FAT16 the count and allocation point saved at the
+  *                   last sync are then put back into the FATFS object, once
+  *                   the card, the boot sector and the FAT at the allocation
+  *                   point show they still hold. Nothing else of the FATFS
+  *                   object is touched.
+  ******************************************************************************
+  */
+
+#include "sd_fastmount.h"
+#include "sd_ffpriv.h"
+#include "diskio.h"
+#include <stddef.h>
+#include <string.h>
+
+/* Boot sector offsets (ff.c keeps its own private) */
+#define FMOUNT_VOLID16          39u   // BS_VolID
+
+#if _MAX_SS == _MIN_SS
+#define FMOUNT_SS(fs)   ((UINT)_MAX_SS)
+#else
+#define FMOUNT_SS(fs)   ((UINT)(fs)->ssize)
+#endif
+
+/* Private function prototypes */
+static uint32_t FMOUNT_Hash(uint32_t h, const void *data, UINT len);
+static uint32_t FMOUNT_Ld16(const BYTE *p);
+static uint32_t FMOUNT_Ld32(const BYTE *p);
+static uint32_t FMOUNT_Check(const FMOUNT_Cache_t *cache);
+static uint32_t FMOUNT_CardHash(BYTE drv);
+static uint32_t FMOUNT_GeoHash(const FATFS *fs);
+static FRESULT FMOUNT_Serial(FATFS *fs, uint32_t *serial);
+static BYTE FMOUNT_Restore(FATFS *fs, const FMOUNT_Cache_t *cache);
+static void FMOUNT_Fill(FATFS *fs, FMOUNT_Cache_t *cache);
+
+/**
+  * @brief  FNV-1a over a byte range, continuing from h
+  */
+static uint32_t FMOUNT_Hash(uint32_t h, const void *data, UINT len)
+{
+    const BYTE *p = (const BYTE *)data;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+  * @brief  Little endian u16
+  */
+static uint32_t FMOUNT_Ld16(const BYTE *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+}
+
+/**
+  * @brief  Little endian u32
+  */
+static uint32_t FMOUNT_Ld32(const BYTE *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+  * @brief  Hash of the cache contents before check
+  */
+static uint32_t FMOUNT_Check(const FMOUNT_Cache_t *cache)
+{
+    return FMOUNT_Hash(2166136261u, cache, offsetof(FMOUNT_Cache_t, check));
+}
+
+/**
+  * @brief  Hash of the card's CID (MMC_GET_CID), 0 when not available
+  */
+static uint32_t FMOUNT_CardHash(BYTE drv)
+{
+    BYTE cid[16];
+
+    if (disk_ioctl(drv, MMC_GET_CID, cid) != RES_OK) return 0;
+    return FMOUNT_Hash(2166136261u, cid, sizeof(cid));
+}
+
+/**
+  * @brief  Hash of the geometry f_mount worked out from the boot sector
+  */
+static uint32_t FMOUNT_GeoHash(const FATFS *fs)
+{
+    DWORD geo[6];
+
+    geo[0] = fs->fatbase;
+    geo[1] = fs->dirbase;
+    geo[2] = fs->database;
+    geo[3] = fs->fsize;
+    geo[4] = fs->n_fatent;
+    geo[5] = (DWORD)fs->csize << 16 | (DWORD)fs->n_rootdir;
+    return FMOUNT_Hash(2166136261u, geo, sizeof(geo));
+}
+
+/**
+  * @brief  Volume serial number of a mounted FAT12/16 volume
+  * @note   Right after f_mount the boot sector is still in win[], so this
+  *         costs no read then; otherwise it is read into the clean window.
+  */
+static FRESULT FMOUNT_Serial(FATFS *fs, uint32_t *serial)
+{
+    if (fs->winsect != fs->volbase) {
+        if (fs->wflag) return FR_DENIED;
+        if (disk_read(fs->drv, fs->win, fs->volbase, 1) != RES_OK) return FR_DISK_ERR;
+        fs->winsect = fs->volbase;
+    }
+    *serial = FMOUNT_Ld32(fs->win + FMOUNT_VOLID16);
+    return FR_OK;
+}
+
+/**
+  * @brief  Put the cached free count back into a volume f_mount has mounted
+  * @note   FatFs allocates from the cluster after last_clst first, so a
+  *         cluster taken since the last FMOUNT_Save (elsewhere, or a power
+  *         cut before the next save) shows up there and the count is left
+  *         unknown. FAT12 entries straddle sectors; its FAT is small enough
+  *         for f_getfree to count.
+  */
+static BYTE FMOUNT_Restore(FATFS *fs, const FMOUNT_Cache_t *cache)
+{
+    uint32_t serial;
+    DWORD clst, sect;
+
+    if (cache->drv != fs->drv || cache->volbase != fs->volbase || cache->fs_type != fs->fs_type ||
+        cache->geo_hash != FMOUNT_GeoHash(fs) || cache->card_hash != FMOUNT_CardHash(fs->drv) ||
+        FMOUNT_Serial(fs, &serial) != FR_OK || serial != cache->serial) {
+        return FMOUNT_MISMATCH;
+    }
+    if (cache->free_clst > fs->n_fatent - 2u) return FMOUNT_STALE;
+    if (cache->last_clst == 0u || cache->last_clst + 1u >= fs->n_fatent) return FMOUNT_STALE;
+
+    clst = cache->last_clst + 1u;
+    sect = fs->fatbase + clst / (FMOUNT_SS(fs) / 2u);
+    if (disk_read(fs->drv, fs->win, sect, 1) != RES_OK) return FMOUNT_STALE;
+    fs->winsect = sect;
+    if (FMOUNT_Ld16(fs->win + clst * 2u % FMOUNT_SS(fs)) != 0u) return FMOUNT_STALE;
+
+    fs->free_clst = cache->free_clst;
+    fs->last_clst = cache->last_clst;
+    return FMOUNT_FAST;
+}
+
+/**
+  * @brief  Key the cache to a volume f_mount has just mounted
+  */
+static void FMOUNT_Fill(FATFS *fs, FMOUNT_Cache_t *cache)
+{
+    uint32_t serial;
+
+    memset(cache, 0, sizeof(*cache));
+    if (FMOUNT_Serial(fs, &serial) != FR_OK) return;
+    cache->serial = serial;
+    cache->card_hash = FMOUNT_CardHash(fs->drv);
+    cache->geo_hash = FMOUNT_GeoHash(fs);
+    cache->volbase = fs->volbase;
+    cache->free_clst = cache->last_clst = 0xFFFFFFFF;
+    cache->drv = fs->drv;
+    cache->fs_type = fs->fs_type;
+    cache->magic = FMOUNT_MAGIC;
+    cache->check = FMOUNT_Check(cache);
+}
+
+/**
+  * @brief  Mount a volume, with the cached free count when it holds
+  */
+FRESULT FMOUNT_Mount(FATFS *fs, const TCHAR *path, FMOUNT_Cache_t *cache, BYTE *how)
+{
+    BYTE result = FMOUNT_NO_CACHE;
+    FRESULT fr;
+
+    fr = f_mount(fs, path, 1);
+    if (fr != FR_OK) {
+        cache->magic = 0;
+        return fr;
+    }
+    if (fs->fs_type == FS_FAT16) {
+        if (cache->magic == FMOUNT_MAGIC && cache->check == FMOUNT_Check(cache)) {
+            result = FMOUNT_Restore(fs, cache);
+        }
+        if (result == FMOUNT_NO_CACHE || result == FMOUNT_MISMATCH) FMOUNT_Fill(fs, cache);
+    }
+    if (how) *how = result;
+    return FR_OK;
+}
+
+/**
+  * @brief  Store the current free cluster count and allocation point
+  */
+void FMOUNT_Save(FATFS *fs, FMOUNT_Cache_t *cache)
+{
+    DWORD clst, n;
+
+    if (cache->magic != FMOUNT_MAGIC || cache->volbase != fs->volbase || cache->fs_type != fs->fs_type) return;
+    /* nothing allocated since a full mount: FatFs takes the first free
+       cluster next, the mount check needs to know which (first FAT sector) */
+    if (fs->last_clst >= fs->n_fatent && fs->free_clst <= fs->n_fatent - 2u &&
+        !fs->wflag && disk_read(fs->drv, fs->win, fs->fatbase, 1) == RES_OK) {
+        fs->winsect = fs->fatbase;
+        n = FMOUNT_SS(fs) / 2u;
+        if (n > fs->n_fatent) n = fs->n_fatent;
+        for (clst = 2u; clst < n; clst++) {
+            if (FMOUNT_Ld16(fs->win + clst * 2u) == 0u) {
+                fs->last_clst = clst - 1u;
+                break;
+            }
+        }
+    }
+    cache->free_clst = fs->free_clst;
+    cache->last_clst = fs->last_clst;
+    cache->check = FMOUNT_Check(cache);
+}
@@ -0,0 +1,251 @@
+/**
+  ******************************************************************************
+  * @file           : sd_format.c
+  * @brief          : AU-aligned FAT format for the logging card
+  ******************************************************************************
+  * @note           : f_mkfs aligns the start of the data area to the erase
+  *                   block reported by GET_BLOCK_SIZE, which FATFS_SD answers
+  *                   with the card's allocation unit (ACMD13). With a power
+  *                   of two cluster every cluster then sits inside one AU and
+  *                   the FAT region ends on an AU boundary, so sequential log
+  *                   data never shares an AU with the FAT and the card does
+  *                   not have to read-modify-write AUs behind our back.
+  *
+  *                   exFAT (SDXC) has the same alignment, and a file whose
+  *                   clusters are contiguous needs no FAT chain at all: only
+  *                   the allocation bitmap changes as it grows.
+  *
+  *                   The MBR is written here rather than by f_mkfs, so that
+  *                   the card's last AUs can be left out of the FAT volume
+  *                   as a raw partition; f_mkfs then formats partition 1.
+  ******************************************************************************
+  */
+
+#include "sd_format.h"
+#include "sd_ffpriv.h"
+#include "diskio.h"
+#include <string.h>
+
+#if _MAX_SS == _MIN_SS
+#define SDFMT_SS(fs)    ((UINT)_MAX_SS)
+#else
+#define SDFMT_SS(fs)    ((UINT)(fs)->ssize)
+#endif
+
+/* Placeholder type for partition 1 until f_mkfs sets the real one */
+#define SDFMT_TYPE_PENDING      0x07u
+
+/* Private function prototypes */
+static BYTE SDFMT_Drive(const TCHAR *path);
+static void SDFMT_Entry(BYTE *pte, BYTE type, DWORD start, DWORD size);
+static DRESULT SDFMT_Trim(FATFS *fs, DWORD clst, DWORD n);
+
+/**
+  * @brief  Physical drive of a "N:" path, drive 0 when no number is given
+  */
+static BYTE SDFMT_Drive(const TCHAR *path)
+{
+    if (path && path[0] >= '0' && path[0] <= '9' && path[1] == ':') {
+        return (BYTE)(path[0] - '0');
+    }
+    return 0;
+}
+
+/**
+  * @brief  Fill in a partition table entry, LBA only
+  */
+static void SDFMT_Entry(BYTE *pte, BYTE type, DWORD start, DWORD size)
+{
+    static const BYTE no_chs[3] = { 0xFEu, 0xFFu, 0xFFu };
+    UINT i;
+
+    memcpy(&pte[1], no_chs, 3);
+    pte[SDFMT_PTE_TYPE] = type;
+    memcpy(&pte[SDFMT_PTE_TYPE + 1u], no_chs, 3);
+    for (i = 0; i < 4u; i++) {
+        pte[SDFMT_PTE_START + i] = (BYTE)(start >> (8u * i));
+        pte[SDFMT_PTE_SECTORS + i] = (BYTE)(size >> (8u * i));
+    }
+}
+
+/**
+  * @brief  Trim n clusters starting at clst
+  */
+static DRESULT SDFMT_Trim(FATFS *fs, DWORD clst, DWORD n)
+{
+    DWORD range[2];
+
+    range[0] = fs->database + (clst - 2u) * fs->csize;
+    range[1] = range[0] + n * fs->csize - 1u;
+    return disk_ioctl(fs->drv, CTRL_TRIM, range);
+}
+
+/**
+  * @brief  Format a volume with its data area on an AU boundary
+  */
+FRESULT SDFMT_Format(const TCHAR *path, void *work, UINT len, SDFMT_Layout_t *layout)
+{
+    return SDFMT_FormatAs(path, 0, 0, work, len, layout);
+}
+
+/**
+  * @brief  Format a volume as a given FAT type, data area on an AU boundary
+  */
+FRESULT SDFMT_FormatAs(const TCHAR *path, BYTE fs_type, DWORD raw_sectors, void *work, UINT len,
+                       SDFMT_Layout_t *layout)
+{
+    BYTE pdrv = SDFMT_Drive(path);
+    BYTE *mbr = (BYTE *)work;
+    DWORD sectors, au, total;
+    DWORD csize;
+    WORD ss;
+    BYTE opt;
+#if _MULTI_PARTITION
+    BYTE pt;
+#endif
+    FRESULT fr;
+
+    if (pdrv >= _VOLUMES) return FR_INVALID_DRIVE;
+    if (disk_initialize(pdrv) & STA_NOINIT) return FR_NOT_READY;
+    if (disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectors) != RES_OK) return FR_DISK_ERR;
+    if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &au) != RES_OK || au == 0) au = 1;
+#if _MAX_SS == _MIN_SS
+    ss = _MAX_SS;
+#else
+    if (disk_ioctl(pdrv, GET_SECTOR_SIZE, &ss) != RES_OK || ss < _MIN_SS || ss > _MAX_SS) return FR_DISK_ERR;
+#endif
+    if (len < _MAX_SS) return FR_NOT_ENOUGH_CORE;
+
+    /* raw partition in whole AUs at the end, the FAT volume before it */
+    total = sectors;
+    if (raw_sectors) {
+        raw_sectors = (raw_sectors + au - 1u) / au * au;
+        if (raw_sectors >= total) return FR_INVALID_PARAMETER;
+        sectors = (total - raw_sectors) / au * au;
+        if (sectors <= SDFMT_VOL_START + au) return FR_INVALID_PARAMETER;
+    }
+
+    if (fs_type == 0) {
+        if (sectors <= SDFMT_SDSC_SECTORS) fs_type = FS_FAT16;
+        else if (sectors <= SDFMT_SDHC_SECTORS || !_FS_EXFAT) fs_type = FS_FAT32;
+        else fs_type = FS_EXFAT;
+    }
+
+    /* SDSC: FAT12/16, at most 32 KB clusters; SDHC: FAT32; SDXC: exFAT */
+    csize = SDFMT_MAX_CLUSTER / ss;
+    switch (fs_type) {
+    case FS_FAT12:
+    case FS_FAT16:
+        opt = FM_FAT | FM_FAT32;  // FAT32 if FAT16 cannot hold the cluster count
+        if (csize > 32768u / ss) csize = 32768u / ss;
+        break;
+    case FS_FAT32:
+        opt = FM_FAT32;
+        break;
+#if _FS_EXFAT
+    case FS_EXFAT:
+        opt = FM_EXFAT;
+        csize = SDFMT_EXFAT_CLUSTER / ss;
+        break;
+#endif
+    default:
+        return FR_INVALID_PARAMETER;
+    }
+
+    memset(mbr, 0, _MAX_SS);
+    SDFMT_Entry(&mbr[SDFMT_MBR_TABLE], SDFMT_TYPE_PENDING, SDFMT_VOL_START, sectors - SDFMT_VOL_START);
+    if (sectors < total) {
+        SDFMT_Entry(&mbr[SDFMT_MBR_TABLE + SDFMT_PTE_SIZE], SDFMT_RAW_TYPE, sectors, total - sectors);
+    }
+    mbr[SDFMT_MBR_SIG] = 0x55u;
+    mbr[SDFMT_MBR_SIG + 1u] = 0xAAu;
+    if (disk_write(pdrv, mbr, 0, 1) != RES_OK) return FR_DISK_ERR;
+    if (sectors < total) {
+        /* an erased ring has no valid block left from an earlier one */
+        DWORD range[2] = { sectors, total - 1u };
+        disk_ioctl(pdrv, CTRL_TRIM, range);
+    }
+
+    /* largest cluster that still leaves a valid cluster count for the FAT
+       type; f_mkfs formats partition 1 of the MBR above, mounts find it */
+#if _MULTI_PARTITION
+    pt = VolToPart[pdrv].pt;
+    VolToPart[pdrv].pt = 1;
+#endif
+    for (;;) {
+        fr = f_mkfs(path, opt, csize * ss, work, len);
+        if (fr != FR_MKFS_ABORTED || csize == 1u) break;
+        csize >>= 1;
+    }
+#if _MULTI_PARTITION
+    VolToPart[pdrv].pt = pt;
+#endif
+
+    if (layout) {
+        memset(layout, 0, sizeof(*layout));
+        layout->au_sectors = au;
+        if (fr == FR_OK) layout->cluster_bytes = csize * ss;
+    }
+    return fr;
+}
+
+/**
+  * @brief  Describe the layout of a mounted volume
+  */
+FRESULT SDFMT_GetLayout(FATFS *fs, SDFMT_Layout_t *layout)
+{
+    DWORD au;
+
+    if (!fs || !fs->fs_type) return FR_NOT_ENABLED;
+    if (disk_ioctl(fs->drv, GET_BLOCK_SIZE, &au) != RES_OK || au == 0) au = 1;
+
+    layout->au_sectors = au;
+    layout->cluster_bytes = (uint32_t)fs->csize * SDFMT_SS(fs);
+    layout->clusters = fs->n_fatent - 2u;
+    layout->vol_base = fs->volbase;
+    layout->fat_base = fs->fatbase;
+    layout->fat_sectors = fs->fsize;
+    layout->data_base = fs->database;
+    layout->fs_type = fs->fs_type;
+    layout->aligned = (fs->database % au) == 0u &&
+                      (fs->csize >= au ? fs->csize % au : au % fs->csize) == 0u;
+    return FR_OK;
+}
+
+/**
+  * @brief  Reserve space for a capture file and erase it in advance
+  */
+FRESULT SDFMT_PreErase(FIL *fp, FSIZE_t size)
+{
+    FATFS *fs = fp->obj.fs;
+    FSIZE_t ofs, bcs;
+    DWORD run = 0, len = 0;
+    FRESULT fr;
+
+    /* seeking past the end of a writable file allocates the clusters */
+    if (size > f_size(fp)) {
+        fr = f_lseek(fp, size);
+        if (fr != FR_OK) return fr;
+        if (f_tell(fp) != size) return FR_DENIED;    /* volume full */
+    }
+
+    /* at a cluster boundary fp->clust is the cluster just finished, so walk
+       the chain by seeking to the end of each cluster, no sector is read */
+    bcs = (FSIZE_t)fs->csize * SDFMT_SS(fs);
+    for (ofs = 0; ofs < f_size(fp); ofs += bcs) {
+        fr = f_lseek(fp, (f_size(fp) - ofs < bcs) ? f_size(fp) : ofs + bcs);
+        if (fr != FR_OK) return fr;
+        if (len && fp->clust == run + len) {
+            len++;
+            continue;
+        }
+        if (len && SDFMT_Trim(fs, run, len) != RES_OK) return FR_DISK_ERR;
+        run = fp->clust;
+        len = 1;
+    }
+    if (len && SDFMT_Trim(fs, run, len) != RES_OK) return FR_DISK_ERR;
+
+    fr = f_lseek(fp, 0);
+    if (fr == FR_OK) fr = f_sync(fp);
+    return fr;
+}
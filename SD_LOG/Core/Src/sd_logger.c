@@ -0,0 +1,367 @@
+/**
+  ******************************************************************************
+  * @file           : sd_logger.c
+  * @brief          : Double-buffered log writer with sector-multiple f_writes
+  ******************************************************************************
+  * @note           : Small f_puts/f_write calls land in the FIL sector buffer
+  *                   and reach the card as partial-sector updates, read back
+  *                   and rewritten as the file grows. Here records are packed
+  *                   into SDLOG_BUF_COUNT buffers of SDLOG_BUF_SECTORS sectors;
+  *                   a full buffer is handed to SDLOG_Service, which writes
+  *                   it in one f_write at a sector-aligned offset (FatFs then
+  *                   transfers it directly, CMD25 on the SPI driver) while the
+  *                   producer keeps filling the next one.
+  *
+  *                   Durability is a separate decision (SDLOG_Policy_t): the
+  *                   writes only become safe from a power loss at f_sync, so
+  *                   syncs are batched by age, by size or at an event, and
+  *                   in/synced keep count of what is still at risk.
+  ******************************************************************************
+  */
+
+#include "sd_logger.h"
+#include "sd_ffpriv.h"
+#include "main.h"
+#include <stddef.h>
+#include <string.h>
+
+#if _MAX_SS == _MIN_SS
+#define SDLOG_SS(fs)    ((UINT)_MAX_SS)
+#else
+#define SDLOG_SS(fs)    ((UINT)(fs)->ssize)
+#endif
+
+/* Private function prototypes */
+static void SDLOG_Hand(SDLOG_t *log);
+static uint32_t SDLOG_Level(SDLOG_t *log);
+static UINT SDLOG_Room(SDLOG_t *log);
+static void SDLOG_Request(SDLOG_t *log);
+static FRESULT SDLOG_Sync(SDLOG_t *log, bool fsinfo);
+static void SDLOG_Place(SDLOG_t *log, FIL *fp);
+
+/**
+  * @brief  Queue the filling buffer for the writer and start the next one
+  */
+static void SDLOG_Hand(SDLOG_t *log)
+{
+    UINT pending;
+
+    log->len[log->head % SDLOG_BUF_COUNT] = log->fill;
+    log->pos += log->fill;
+    __DMB();  /* buffer contents before the new head */
+    log->head++;
+
+    log->fill = 0;
+    log->cap = SDLOG_BUF_BYTES - (UINT)(log->pos % log->ss);
+    pending = log->head - log->tail;
+    if (pending > log->stats.max_pending) log->stats.max_pending = pending;
+}
+
+/**
+  * @brief  Bytes waiting in full buffers plus the filling one
+  */
+static uint32_t SDLOG_Level(SDLOG_t *log)
+{
+    uint32_t level = log->fill;
+    UINT i;
+
+    for (i = log->tail; i != log->head; i++) {
+        level += log->len[i % SDLOG_BUF_COUNT];
+    }
+    return level;
+}
+
+/**
+  * @brief  Bytes SDLOG_Append can take right now
+  * @note   After a failed SDLOG_Flush all buffers can still be waiting.
+  */
+static UINT SDLOG_Room(SDLOG_t *log)
+{
+    UINT pending = log->head - log->tail;
+
+    if (pending >= SDLOG_BUF_COUNT) return 0;
+    return (log->cap - log->fill) + (SDLOG_BUF_COUNT - 1u - pending) * SDLOG_BUF_BYTES;
+}
+
+/**
+  * @brief  Hand over the filling buffer and ask the writer for a sync
+  */
+static void SDLOG_Request(SDLOG_t *log)
+{
+    if (log->fill) SDLOG_Hand(log);
+    log->req_tick = HAL_GetTick();
+    __DMB();  /* buffer before the request */
+    log->req++;
+}
+
+/**
+  * @brief  f_sync the file and account for what it made durable
+  * @note   sync_fs writes FSINFO only while fsi_flag is exactly 1, so
+  *         clearing it around f_sync defers the update; an allocation sets
+  *         it again anyway. SDLOG_Append may run in an interrupt, so
+  *         synced and dirty_tick are updated with interrupts masked.
+  */
+static FRESULT SDLOG_Sync(SDLOG_t *log, bool fsinfo)
+{
+    FATFS *fs = log->fil->obj.fs;
+    uint32_t out = log->out, age, primask;
+    bool defer = !fsinfo && fs->fsi_flag == 1u;
+    FRESULT fr;
+
+    if (defer) fs->fsi_flag = 0;
+    fr = f_sync(log->fil);
+    if (defer) fs->fsi_flag |= 1u;
+    if (fr != FR_OK) return fr;
+
+    log->stats.syncs++;
+    if (out != log->synced) {
+        primask = __get_PRIMASK();
+        __disable_irq();
+        age = HAL_GetTick() - log->dirty_tick;
+        if (age > log->stats.max_unsynced_ms) log->stats.max_unsynced_ms = age;
+        /* what is left came in after the request, or is older (sync_bytes) */
+        if (log->in != out && log->req != log->served) log->dirty_tick = log->req_tick;
+        log->synced = out;
+        __set_PRIMASK(primask);
+    }
+    return FR_OK;
+}
+
+/**
+  * @brief  Point the next allocation of an empty file at a free run
+  * @note   The first cluster comes from fs->last_clst and each later one
+  *         from the cluster after the last, so a free run keeps the file in
+  *         one piece (obj.stat 2).
+  */
+static void SDLOG_Place(SDLOG_t *log, FIL *fp)
+{
+#if _FS_EXFAT && _USE_EXPAND
+    if (!log->contig || f_size(fp) != 0u || fp->obj.fs->fs_type != FS_EXFAT) return;
+    if (f_expand(fp, log->contig, 0) != FR_OK) log->stats.fragmented++;
+#else
+    (void)log;
+    (void)fp;
+#endif
+}
+
+/**
+  * @brief  Attach a logger to an open file
+  */
+FRESULT SDLOG_Init(SDLOG_t *log, FIL *fp)
+{
+    if (!fp || !fp->obj.fs) return FR_INVALID_OBJECT;
+
+    memset(log, 0, offsetof(SDLOG_t, buf));
+    log->fil = fp;
+    log->ss = SDLOG_SS(fp->obj.fs);
+    if (SDLOG_BUF_BYTES % log->ss) return FR_INVALID_PARAMETER;
+    log->pos = f_tell(fp);
+    log->cap = SDLOG_BUF_BYTES - (UINT)(log->pos % log->ss);
+    return FR_OK;
+}
+
+/**
+  * @brief  Append one record
+  */
+bool SDLOG_Append(SDLOG_t *log, const void *data, UINT len)
+{
+    const BYTE *p = (const BYTE *)data;
+    UINT n;
+    uint32_t level;
+
+    if (len > SDLOG_Room(log)) {
+        log->stats.dropped++;
+        log->stats.dropped_bytes += len;
+        return false;
+    }
+
+    /* the oldest unsynced record sets the clock for sync_ms */
+    if (log->in == log->synced) log->dirty_tick = HAL_GetTick();
+    log->in += len;
+    log->stats.records++;
+    log->stats.bytes += len;
+    while (len) {
+        n = log->cap - log->fill;
+        if (n > len) n = len;
+        memcpy((BYTE *)log->buf[log->head % SDLOG_BUF_COUNT] + log->fill, p, n);
+        log->fill += n;
+        p += n;
+        len -= n;
+        if (log->fill == log->cap) SDLOG_Hand(log);
+    }
+
+    level = SDLOG_Level(log);
+    if (level > log->stats.max_level) log->stats.max_level = level;
+    level = log->in - log->synced;
+    if (level > log->stats.max_unsynced) log->stats.max_unsynced = level;
+    if (SDLOG_SyncDue(log)) SDLOG_Request(log);
+    return true;
+}
+
+/**
+  * @brief  SDLOG_Append for BINLOG_Init and other encoders
+  */
+bool SDLOG_Sink(void *log, const void *data, UINT len)
+{
+    return SDLOG_Append((SDLOG_t *)log, data, len);
+}
+
+/**
+  * @brief  Move committed records from a queue into the buffers
+  */
+uint32_t SDLOG_Drain(SDLOG_t *log, LOGQ_t *q)
+{
+    const void *rec;
+    uint32_t len, n = 0;
+
+    while ((rec = LOGQ_Peek(q, &len)) != NULL) {
+        /* leave it queued until SDLOG_Service frees a buffer, unless it
+           could never fit */
+        if (len > SDLOG_Room(log) && log->head != log->tail) break;
+        SDLOG_Append(log, rec, len);
+        LOGQ_Release(q);
+        n++;
+    }
+    if (SDLOG_SyncDue(log)) SDLOG_Request(log);
+    return n;
+}
+
+/**
+  * @brief  Set when the log is synced
+  */
+void SDLOG_SetPolicy(SDLOG_t *log, const SDLOG_Policy_t *policy)
+{
+    log->policy = *policy;
+    log->fsinfo_left = policy->fsinfo_every;
+}
+
+/**
+  * @brief  Start each file of the log at a free run of clusters
+  */
+void SDLOG_SetContiguous(SDLOG_t *log, FSIZE_t size)
+{
+    log->contig = size;
+    SDLOG_Place(log, log->fil);
+}
+
+/**
+  * @brief  Sync everything appended so far
+  */
+void SDLOG_Commit(SDLOG_t *log)
+{
+    if (log->in != log->synced) SDLOG_Request(log);
+}
+
+/**
+  * @brief  Check if sync_ms is due
+  */
+bool SDLOG_SyncDue(SDLOG_t *log)
+{
+    if (!log->policy.sync_ms || log->req != log->served || log->in == log->synced) return false;
+    return HAL_GetTick() - log->dirty_tick >= log->policy.sync_ms;
+}
+
+/**
+  * @brief  Bytes accepted but not yet synced
+  */
+uint32_t SDLOG_Unsynced(SDLOG_t *log)
+{
+    return log->in - log->synced;
+}
+
+/**
+  * @brief  Continue the log in another file
+  */
+bool SDLOG_Switch(SDLOG_t *log, FIL *next)
+{
+    if (log->next) return false;
+
+    if (log->fill) SDLOG_Hand(log);
+    log->switch_at = log->head;
+    log->pos = f_tell(next);
+    log->cap = SDLOG_BUF_BYTES - (UINT)(log->pos % log->ss);
+    __DMB();  /* switch point before the writer can see next */
+    log->next = next;
+    return true;
+}
+
+/**
+  * @brief  Write the full buffers, then sync if the policy says so
+  */
+FRESULT SDLOG_Service(SDLOG_t *log)
+{
+    FRESULT fr;
+    UINT i, n, bw;
+    UINT req = log->req;  /* read first: its buffers are handed over by now */
+    bool fsinfo;
+
+    for (;;) {
+        if (log->next && log->tail == log->switch_at) {
+            if (log->out != log->synced) {
+                fr = SDLOG_Sync(log, false);
+                if (fr != FR_OK) return fr;
+            }
+            log->fil = log->next;
+            log->next = NULL;
+            SDLOG_Place(log, log->fil);
+        }
+        if (log->tail == log->head) break;
+        i = log->tail % SDLOG_BUF_COUNT;
+        n = log->len[i];
+        fr = f_write(log->fil, log->buf[i], n, &bw);
+        log->stats.writes++;
+        if (n % log->ss) log->stats.short_writes++;
+        if (fr == FR_OK && bw != n) fr = FR_DENIED;
+        if (fr != FR_OK) return fr;
+        log->out += n;
+        __DMB();  /* buffer read out before the producer may reuse it */
+        log->tail++;
+    }
+
+    if (req == log->served && (!log->policy.sync_bytes || log->out - log->synced < log->policy.sync_bytes)) {
+        return FR_OK;
+    }
+    fsinfo = false;
+    if (log->policy.fsinfo_every && --log->fsinfo_left == 0u) {
+        log->fsinfo_left = log->policy.fsinfo_every;
+        fsinfo = true;
+    }
+    fr = SDLOG_Sync(log, fsinfo);
+    if (fr == FR_OK) log->served = req;
+    return fr;
+}
+
+/**
+  * @brief  Write everything buffered, including a partial buffer, and f_sync
+  */
+FRESULT SDLOG_Flush(SDLOG_t *log)
+{
+    FRESULT fr;
+
+    if (log->fill) SDLOG_Hand(log);
+    fr = SDLOG_Service(log);
+    if (fr == FR_OK) fr = SDLOG_Sync(log, true);
+    if (fr == FR_OK) log->served = log->req;
+    return fr;
+}
+
+/**
+  * @brief  Flush and close the file
+  */
+FRESULT SDLOG_Close(SDLOG_t *log)
+{
+    FRESULT fr;
+
+    fr = SDLOG_Flush(log);
+    if (fr == FR_OK) fr = f_close(log->fil);
+    return fr;
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void SDLOG_GetStats(SDLOG_t *log, SDLOG_Stats_t *stats, bool clear)
+{
+    *stats = log->stats;
+    if (clear) memset(&log->stats, 0, sizeof(log->stats));
+}
@@ -0,0 +1,265 @@
+/**
+  ******************************************************************************
+  * @file           : sd_logread.c
+  * @brief          : Random access to long log files through a cluster map
+  ******************************************************************************
+  * @note           : The map is FatFs's cluster link map table: the file as
+  *                   (length, first cluster) fragment pairs, so f_lseek and
+  *                   f_read find any cluster without touching the FAT. A file
+  *                   the logger wrote on a fresh volume is one fragment.
+  *
+  *                   LOGRD_SeekTime starts at the index record named in the
+  *                   last sync frame. If its first entry is not older than
+  *                   the target it follows the highest back pointer whose
+  *                   record still starts at or after the target, otherwise
+  *                   the previous record, and repeats; once a record starts
+  *                   before the target, its entries give the sync frame.
+  *                   Each step is one short read at a mapped offset.
+  ******************************************************************************
+  */
+
+#include "sd_logread.h"
+#include <stddef.h>
+#include <string.h>
+
+/* Private function prototypes */
+static uint32_t LOGRD_Get32(const BYTE *p);
+static UINT LOGRD_Frame(const BYTE *p, UINT avail, uint32_t *ts, uint32_t *index);
+static FRESULT LOGRD_Load(LOGRD_t *r, FSIZE_t ofs, UINT len, UINT *got);
+static FRESULT LOGRD_Tail(LOGRD_t *r);
+static FRESULT LOGRD_Index(LOGRD_t *r, uint32_t ofs, UINT *n, UINT *levels);
+static FRESULT LOGRD_Scan(LOGRD_t *r, uint32_t from, uint32_t ts, bool tail, uint32_t *base_ts);
+
+/**
+  * @brief  Little endian u32
+  */
+static uint32_t LOGRD_Get32(const BYTE *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+  * @brief  Check for a sync frame at p, returns its length or 0
+  */
+static UINT LOGRD_Frame(const BYTE *p, UINT avail, uint32_t *ts, uint32_t *index)
+{
+    UINT n;
+
+    if (avail < BINLOG_SYNC_SIZE_V1 || p[0] != BINLOG_TAG_SYNC || p[1] != 0xA5u || p[2] != 0x5Au || p[3] != 0xC3u) {
+        return 0;
+    }
+    if (p[4] == 1u) n = BINLOG_SYNC_SIZE_V1;
+    else if (p[4] == BINLOG_VERSION) n = BINLOG_SYNC_SIZE;
+    else return 0;
+    if (avail < n || BINLOG_Crc16(0xFFFFu, &p[4], n - 6u) != (uint16_t)(p[n - 2u] | p[n - 1u] << 8)) return 0;
+
+    *ts = LOGRD_Get32(&p[7]);
+    *index = (n == BINLOG_SYNC_SIZE) ? LOGRD_Get32(&p[11]) : LOGRD_NONE;
+    return n;
+}
+
+/**
+  * @brief  Read len bytes at an offset into win
+  */
+static FRESULT LOGRD_Load(LOGRD_t *r, FSIZE_t ofs, UINT len, UINT *got)
+{
+    FRESULT fr;
+
+    fr = f_lseek(&r->fil, ofs);
+    if (fr == FR_OK) fr = f_read(&r->fil, r->win, len, got);
+    return fr;
+}
+
+/**
+  * @brief  Find the newest sync frame, reading back from the end
+  */
+static FRESULT LOGRD_Tail(LOGRD_t *r)
+{
+    FSIZE_t end = f_size(&r->fil), start;
+    FSIZE_t stop = (end > LOGRD_TAIL_BYTES) ? end - LOGRD_TAIL_BYTES : 0;
+    uint32_t ts, index;
+    UINT got, i;
+    FRESULT fr;
+
+    r->last_sync = LOGRD_NONE;
+    r->last_index = LOGRD_NONE;
+    while (end > stop) {
+        start = (end - stop > LOGRD_WIN_BYTES) ? end - LOGRD_WIN_BYTES : stop;
+        fr = LOGRD_Load(r, start, LOGRD_WIN_BYTES, &got);
+        if (fr != FR_OK) return fr;
+        r->stats.scanned += got;
+        for (i = got; i-- > 0u; ) {
+            if (r->win[i] == BINLOG_TAG_SYNC && LOGRD_Frame(&r->win[i], got - i, &ts, &index)) {
+                r->last_sync = (uint32_t)(start + i);
+                r->last_ts = ts;
+                r->last_index = index;
+                return FR_OK;
+            }
+        }
+        if (start == stop) break;
+        end = start + BINLOG_SYNC_SIZE - 1u;  // a frame across the boundary
+    }
+    return FR_OK;
+}
+
+/**
+  * @brief  Read the index record at ofs into win
+  * @note   Header first, then just the rest: mostly one sector.
+  */
+static FRESULT LOGRD_Index(LOGRD_t *r, uint32_t ofs, UINT *n, UINT *levels)
+{
+    UINT got, len;
+    FRESULT fr;
+
+    fr = LOGRD_Load(r, ofs, 3u, &got);
+    if (fr != FR_OK) return fr;
+    r->stats.hops++;
+    if (got < 3u || r->win[0] != BINLOG_TAG_INDEX || r->win[1] == 0u) return FR_INT_ERR;
+    *n = r->win[1];
+    *levels = r->win[2];
+    len = 8u * (*n + *levels);
+    if (3u + len > LOGRD_WIN_BYTES) return FR_INT_ERR;
+    fr = f_read(&r->fil, &r->win[3], len, &got);
+    if (fr == FR_OK && got != len) fr = FR_INT_ERR;
+    return fr;
+}
+
+/**
+  * @brief  Check the sync frame at from, optionally move on to the newest
+  *         one older than ts, and leave the file there
+  */
+static FRESULT LOGRD_Scan(LOGRD_t *r, uint32_t from, uint32_t ts, bool tail, uint32_t *base_ts)
+{
+    FSIZE_t pos = from;
+    uint32_t best_ts, t, index;
+    UINT got, end, i, n;
+    FRESULT fr;
+
+    fr = LOGRD_Load(r, pos, tail ? LOGRD_WIN_BYTES : BINLOG_SYNC_SIZE, &got);
+    if (fr != FR_OK) return fr;
+    r->stats.scanned += got;
+    i = LOGRD_Frame(r->win, got, &best_ts, &index);
+    if (!i) return FR_INT_ERR;
+
+    while (tail) {
+        /* a frame that does not fit is looked at again in the next window */
+        end = (got < LOGRD_WIN_BYTES) ? got : got - (BINLOG_SYNC_SIZE - 1u);
+        for (; i < end; i++) {
+            if (r->win[i] != BINLOG_TAG_SYNC || !(n = LOGRD_Frame(&r->win[i], got - i, &t, &index))) continue;
+            if (t >= ts) {
+                tail = false;
+                break;
+            }
+            from = (uint32_t)(pos + i);
+            best_ts = t;
+            i += n - 1u;
+        }
+        if (!tail || got < LOGRD_WIN_BYTES) break;
+        pos += i;
+        fr = LOGRD_Load(r, pos, LOGRD_WIN_BYTES, &got);
+        if (fr != FR_OK) return fr;
+        r->stats.scanned += got;
+        i = 0;
+    }
+
+    if (base_ts) *base_ts = best_ts;
+    return f_lseek(&r->fil, from);
+}
+
+/**
+  * @brief  Open a file for reading and map its clusters
+  */
+FRESULT LOGRD_Open(LOGRD_t *r, const TCHAR *path, DWORD *map, UINT map_len)
+{
+    FRESULT fr;
+
+    memset(r, 0, offsetof(LOGRD_t, win));
+    fr = f_open(&r->fil, path, FA_READ);
+    if (fr != FR_OK) return fr;
+#if _USE_FASTSEEK
+    if (map && map_len >= LOGRD_MAP_DWORDS(1)) {
+        map[0] = map_len;
+        r->fil.cltbl = map;
+        fr = f_lseek(&r->fil, CREATE_LINKMAP);
+        if (fr == FR_OK) r->mapped = true;
+        if (fr == FR_NOT_ENOUGH_CORE) {
+            r->map_need = map[0];
+            r->fil.cltbl = NULL;
+            fr = FR_OK;
+        }
+    }
+#endif
+    if (fr == FR_OK) fr = LOGRD_Tail(r);
+    if (fr != FR_OK) f_close(&r->fil);
+    return fr;
+}
+
+/**
+  * @brief  Move the read position
+  */
+FRESULT LOGRD_Seek(LOGRD_t *r, FSIZE_t ofs)
+{
+    r->stats.seeks++;
+    return f_lseek(&r->fil, ofs);
+}
+
+/**
+  * @brief  Read from the current position
+  */
+FRESULT LOGRD_Read(LOGRD_t *r, void *buf, UINT btr, UINT *br)
+{
+    return f_read(&r->fil, buf, btr, br);
+}
+
+/**
+  * @brief  Position a binary log where records from a timestamp start
+  */
+FRESULT LOGRD_SeekTime(LOGRD_t *r, uint32_t ts, uint32_t *base_ts)
+{
+    uint32_t cur = r->last_index, from = 0;
+    UINT n, levels, i;
+    bool tail = true;
+    FRESULT fr;
+
+    if (r->last_sync == LOGRD_NONE) return FR_NO_FILE;
+    r->stats.seeks++;
+    if (ts > r->last_ts) {
+        /* after every sync frame: the newest one */
+        from = r->last_sync;
+        cur = LOGRD_NONE;
+        tail = false;
+    }
+
+    while (cur != LOGRD_NONE) {
+        fr = LOGRD_Index(r, cur, &n, &levels);
+        if (fr != FR_OK) return fr;
+        if (LOGRD_Get32(&r->win[3]) < ts) {
+            for (i = 1; i < n && LOGRD_Get32(&r->win[3u + 8u * i]) < ts; i++) {}
+            from = LOGRD_Get32(&r->win[3u + 8u * (i - 1u) + 4u]);
+            /* only the newest record can have sync frames after it */
+            tail = (i == n && cur == r->last_index);
+            break;
+        }
+        tail = false;
+        if (levels == 0u) break;  // the first record: from the start
+        for (i = levels - 1u; i > 0u && LOGRD_Get32(&r->win[3u + 8u * (n + i)]) < ts; i--) {}
+        cur = LOGRD_Get32(&r->win[3u + 8u * (n + i) + 4u]);
+    }
+    return LOGRD_Scan(r, from, ts, tail, base_ts);
+}
+
+/**
+  * @brief  Close the file
+  */
+FRESULT LOGRD_Close(LOGRD_t *r)
+{
+    return f_close(&r->fil);
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void LOGRD_GetStats(LOGRD_t *r, LOGRD_Stats_t *stats)
+{
+    *stats = r->stats;
+}
@@ -0,0 +1,237 @@
+/**
+  ******************************************************************************
+  * @file           : sd_lz.c
+  * @brief          : Streaming LZ compressor for log output (SD and USB)
+  ******************************************************************************
+  * @note           : Greedy LZ77 with a single-entry hash table, the same
+  *                   trade as LZ4: one table lookup per input position and
+  *                   one compare per matched byte, no chains to walk, so the
+  *                   cost per byte is bounded whatever the data. Input is
+  *                   compressed one LZ_WINDOW block at a time against the
+  *                   previous LZ_WINDOW bytes; a block that does not get
+  *                   smaller goes out stored. The stream layout is in
+  *                   sd_lz.h.
+  ******************************************************************************
+  */
+
+#include "sd_lz.h"
+#include <string.h>
+
+#define LZ_HASH_SIZE            (1u << LZ_HASH_BITS)
+
+/* Private function prototypes */
+static uint32_t LZ_Read32(const uint8_t *p);
+static uint32_t LZ_Hash(const uint8_t *p);
+static uint8_t *LZ_PutLen(uint8_t *op, uint32_t n);
+static UINT LZ_Compress(LZ_t *z, UINT n);
+static bool LZ_Block(LZ_t *z);
+
+/**
+  * @brief  Unaligned 32-bit load
+  */
+static uint32_t LZ_Read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+  * @brief  Hash of the 4 bytes at p
+  */
+static uint32_t LZ_Hash(const uint8_t *p)
+{
+    return (LZ_Read32(p) * 2654435761u) >> (32u - LZ_HASH_BITS);
+}
+
+/**
+  * @brief  Extra length bytes for a count that did not fit its nibble
+  */
+static uint8_t *LZ_PutLen(uint8_t *op, uint32_t n)
+{
+    while (n >= 255u) {
+        *op++ = 255u;
+        n -= 255u;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+/**
+  * @brief  Compress the n bytes at win[LZ_WINDOW] into out[2..]
+  * @retval Payload bytes, 0 if it would not be smaller than n
+  */
+static UINT LZ_Compress(LZ_t *z, UINT n)
+{
+    const uint8_t *win = z->win;
+    uint32_t lo = LZ_WINDOW - z->hist;       // oldest usable history
+    uint32_t end = LZ_WINDOW + n;
+    uint32_t ip = LZ_WINDOW, anchor = LZ_WINDOW;
+    uint8_t *op = &z->out[2];
+    uint8_t *limit = &z->out[2] + n - 1u;    // compressed must beat stored
+    uint32_t lit, mlen, cand, h;
+    uint8_t *token;
+
+    while (ip + LZ_MIN_MATCH <= end) {
+        h = LZ_Hash(&win[ip]);
+        cand = z->hash[h];
+        z->hash[h] = (uint16_t)ip;
+        if (cand < lo || cand >= ip || LZ_Read32(&win[cand]) != LZ_Read32(&win[ip])) {
+            ip++;
+            continue;
+        }
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end && win[cand + mlen] == win[ip + mlen]) mlen++;
+
+        /* token, literal count, literals, offset, match length */
+        lit = ip - anchor;
+        if (op + 1u + lit / 255u + 1u + lit + 2u + (mlen - LZ_MIN_MATCH) / 255u + 1u > limit) return 0;
+        token = op++;
+        *token = (uint8_t)(((lit < 15u) ? lit : 15u) << 4);
+        if (lit >= 15u) op = LZ_PutLen(op, lit - 15u);
+        memcpy(op, &win[anchor], lit);
+        op += lit;
+        *op++ = (uint8_t)(ip - cand);
+        *op++ = (uint8_t)((ip - cand) >> 8);
+        if (mlen - LZ_MIN_MATCH >= 15u) {
+            *token |= 15u;
+            op = LZ_PutLen(op, mlen - LZ_MIN_MATCH - 15u);
+        } else {
+            *token |= (uint8_t)(mlen - LZ_MIN_MATCH);
+        }
+
+        ip += mlen;
+        anchor = ip;
+        /* one position inside the match, helps the next repeat of it */
+        if (ip - 2u + LZ_MIN_MATCH <= end) z->hash[LZ_Hash(&win[ip - 2u])] = (uint16_t)(ip - 2u);
+    }
+
+    /* last sequence, literals only */
+    lit = end - anchor;
+    if (op + 1u + lit / 255u + 1u + lit > limit) return 0;
+    token = op++;
+    *token = (uint8_t)(((lit < 15u) ? lit : 15u) << 4);
+    if (lit >= 15u) op = LZ_PutLen(op, lit - 15u);
+    memcpy(op, &win[anchor], lit);
+    op += lit;
+    return (UINT)(op - &z->out[2]);
+}
+
+/**
+  * @brief  Write the buffered input as one block and slide the window
+  */
+static bool LZ_Block(LZ_t *z)
+{
+    UINT n = z->fill, len, keep, i;
+    uint16_t hdr;
+    bool ok;
+
+    if (n == 0u) return true;
+
+    len = LZ_Compress(z, n);
+    if (len == 0u) {
+        memcpy(&z->out[2], &z->win[LZ_WINDOW], n);
+        len = n;
+        hdr = (uint16_t)(len | LZ_BLOCK_STORED);
+        z->stats.stored++;
+    } else {
+        hdr = (uint16_t)len;
+    }
+    if (z->reset) hdr |= LZ_BLOCK_RESET;
+    z->out[0] = (uint8_t)hdr;
+    z->out[1] = (uint8_t)(hdr >> 8);
+
+    ok = z->sink(z->ctx, z->out, len + 2u);
+    if (ok) {
+        z->stats.blocks++;
+        z->stats.bytes_out += len + 2u;
+        z->reset = false;
+    } else {
+        z->stats.dropped++;
+    }
+
+    /* keep the last LZ_WINDOW bytes as history, move the table along */
+    keep = z->hist + n;
+    if (keep > LZ_WINDOW) keep = LZ_WINDOW;
+    memmove(&z->win[LZ_WINDOW - keep], &z->win[LZ_WINDOW + n - keep], keep);
+    for (i = 0; i < LZ_HASH_SIZE; i++) {
+        z->hash[i] = (z->hash[i] >= n) ? (uint16_t)(z->hash[i] - n) : 0u;
+    }
+    z->hist = (uint16_t)keep;
+    z->fill = 0;
+
+    /* the reader lost this block, so nothing may refer back past it */
+    if (!ok) {
+        z->hist = 0;
+        z->reset = true;
+    }
+    return ok;
+}
+
+/**
+  * @brief  Set up a compressor in front of a sink
+  */
+void LZ_Init(LZ_t *z, LZ_Sink_t sink, void *ctx)
+{
+    z->sink = sink;
+    z->ctx = ctx;
+    z->fill = 0;
+    z->hist = 0;
+    z->reset = true;
+    memset(&z->stats, 0, sizeof(z->stats));
+    memset(z->hash, 0, sizeof(z->hash));
+}
+
+/**
+  * @brief  Compress bytes into the stream
+  */
+void LZ_Write(LZ_t *z, const void *data, UINT len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    UINT n;
+
+    z->stats.bytes_in += len;
+    while (len) {
+        n = LZ_WINDOW - z->fill;
+        if (n > len) n = len;
+        memcpy(&z->win[LZ_WINDOW + z->fill], p, n);
+        z->fill = (uint16_t)(z->fill + n);
+        p += n;
+        len -= n;
+        if (z->fill == LZ_WINDOW) LZ_Block(z);
+    }
+}
+
+/**
+  * @brief  LZ_Write for use as a sink
+  * @note   The bytes are in the window whatever happens to the block they
+  *         end up in, so they are always taken.
+  */
+bool LZ_Sink(void *z, const void *data, UINT len)
+{
+    LZ_Write((LZ_t *)z, data, len);
+    return true;
+}
+
+/**
+  * @brief  Compress and hand over what is buffered
+  */
+bool LZ_Flush(LZ_t *z, bool reset)
+{
+    bool ok = LZ_Block(z);
+
+    if (reset) {
+        z->hist = 0;
+        z->reset = true;
+    }
+    return ok;
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void LZ_GetStats(LZ_t *z, LZ_Stats_t *stats, bool clear)
+{
+    *stats = z->stats;
+    if (clear) memset(&z->stats, 0, sizeof(z->stats));
+}
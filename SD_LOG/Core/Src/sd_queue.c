@@ -0,0 +1,245 @@
+/**
+  ******************************************************************************
+  * @file           : sd_queue.c
+  * @brief          : Lock-free record queue between interrupt producers and
+  *                    the SD logging loop
+  ******************************************************************************
+  * @note           : A power-of-two byte ring of variable-length records. Each
+  *                   record is a header word (span in words << 16 | payload
+  *                   length) followed by the payload padded to a word; a
+  *                   record that would cross the end of the ring is preceded
+  *                   by a skip record filling the rest. head and tail only
+  *                   grow, producers own head, the consumer owns tail.
+  *
+  *                   A header reads 0 until its producer has written it: the
+  *                   consumer zeroes every span it releases, so after a
+  *                   reservation is published the consumer sees either 0 or
+  *                   BUSY (reserved) and stops there until the commit. That
+  *                   lets LOGQ_ReserveMP publish first (LDREX/STREX on head)
+  *                   and write the header afterwards, which is what keeps a
+  *                   preempting producer's record intact.
+  ******************************************************************************
+  */
+
+#include "sd_queue.h"
+#include "main.h"
+#include <string.h>
+
+#define LOGQ_LEN_BUSY           0xFFFFu   // reserved, not committed
+#define LOGQ_LEN_SKIP           0xFFFEu   // filler up to the end of the ring
+#define LOGQ_HDR(span, len)     ((((uint32_t)(span) >> 2) << 16) | (uint32_t)(len))
+#define LOGQ_HDR_SPAN(hdr)      (((hdr) >> 16) << 2)
+#define LOGQ_HDR_LEN(hdr)       ((hdr) & 0xFFFFu)
+
+/* Private function prototypes */
+static uint32_t LOGQ_Span(uint32_t len);
+static bool LOGQ_Fit(LOGQ_t *q, uint32_t head, uint32_t span, uint32_t *skip);
+static void *LOGQ_Place(LOGQ_t *q, uint32_t head, uint32_t skip, uint32_t span);
+static void LOGQ_Add(volatile uint32_t *p, uint32_t n);
+static void LOGQ_Free(LOGQ_t *q, uint32_t tail, uint32_t span);
+
+/**
+  * @brief  Ring bytes taken by a record with len payload bytes
+  */
+static uint32_t LOGQ_Span(uint32_t len)
+{
+    return 4u + ((len + 3u) & ~3u);
+}
+
+/**
+  * @brief  Check a record of span bytes fits behind head
+  * @note   skip is set to the filler needed to avoid wrapping the record.
+  */
+static bool LOGQ_Fit(LOGQ_t *q, uint32_t head, uint32_t span, uint32_t *skip)
+{
+    uint32_t room = q->size - (head & (q->size - 1u));
+
+    *skip = (span > room) ? room : 0u;
+    return (head + *skip + span - q->tail) <= q->size;
+}
+
+/**
+  * @brief  Write the skip and BUSY headers of a claimed reservation
+  */
+static void *LOGQ_Place(LOGQ_t *q, uint32_t head, uint32_t skip, uint32_t span)
+{
+    uint32_t *hdr;
+
+    if (skip) {
+        q->buf[(head & (q->size - 1u)) >> 2] = LOGQ_HDR(skip, LOGQ_LEN_SKIP);
+        head += skip;
+    }
+    hdr = &q->buf[(head & (q->size - 1u)) >> 2];
+    *hdr = LOGQ_HDR(span, LOGQ_LEN_BUSY);
+    return hdr + 1;
+}
+
+/**
+  * @brief  Atomic add, for counters shared between producers
+  */
+static void LOGQ_Add(volatile uint32_t *p, uint32_t n)
+{
+    uint32_t v;
+
+    do {
+        v = __LDREXW(p);
+    } while (__STREXW(v + n, p));
+}
+
+/**
+  * @brief  Zero a released span and give it back to the producers
+  */
+static void LOGQ_Free(LOGQ_t *q, uint32_t tail, uint32_t span)
+{
+    memset(&q->buf[(tail & (q->size - 1u)) >> 2], 0, span);
+    __DMB();  /* zeros visible before the space is */
+    q->tail = tail + span;
+}
+
+/**
+  * @brief  Set up a queue on a caller-provided ring
+  */
+bool LOGQ_Init(LOGQ_t *q, void *buf, uint32_t size)
+{
+    if (!buf || ((uintptr_t)buf & 3u) || size < 16u || size > LOGQ_MAX_SIZE || (size & (size - 1u))) {
+        return false;
+    }
+    memset(q, 0, sizeof(*q));
+    memset(buf, 0, size);
+    q->buf = (uint32_t *)buf;
+    q->size = size;
+    return true;
+}
+
+/**
+  * @brief  Reserve room for a record, single producer
+  */
+void *LOGQ_Reserve(LOGQ_t *q, uint32_t len)
+{
+    uint32_t head = q->head;
+    uint32_t span = LOGQ_Span(len);
+    uint32_t skip;
+    void *rec;
+
+    if (len > LOGQ_MAX_RECORD || !LOGQ_Fit(q, head, span, &skip)) {
+        q->dropped++;
+        q->dropped_bytes += len;
+        return NULL;
+    }
+    rec = LOGQ_Place(q, head, skip, span);
+    __DMB();  /* headers before the new head */
+    q->head = head + skip + span;
+    return rec;
+}
+
+/**
+  * @brief  Reserve room for a record, any number of producers
+  */
+void *LOGQ_ReserveMP(LOGQ_t *q, uint32_t len)
+{
+    uint32_t head;
+    uint32_t span = LOGQ_Span(len);
+    uint32_t skip;
+
+    if (len > LOGQ_MAX_RECORD) {
+        LOGQ_Add(&q->dropped, 1u);
+        LOGQ_Add(&q->dropped_bytes, len);
+        return NULL;
+    }
+    do {
+        head = __LDREXW(&q->head);
+        if (!LOGQ_Fit(q, head, span, &skip)) {
+            __CLREX();
+            LOGQ_Add(&q->dropped, 1u);
+            LOGQ_Add(&q->dropped_bytes, len);
+            return NULL;
+        }
+    } while (__STREXW(head + skip + span, &q->head));
+
+    /* the space is ours; the consumer reads 0 there until the headers land */
+    return LOGQ_Place(q, head, skip, span);
+}
+
+/**
+  * @brief  Hand a reserved record to the consumer
+  */
+void LOGQ_Commit(LOGQ_t *q, void *rec, uint32_t len)
+{
+    uint32_t *hdr = (uint32_t *)rec - 1;
+    uint32_t span = LOGQ_HDR_SPAN(*hdr);
+
+    (void)q;
+    if (len > span - 4u) len = span - 4u;
+    __DMB();  /* payload before the header */
+    *hdr = LOGQ_HDR(span, len);
+}
+
+/**
+  * @brief  Copy a record into the queue
+  */
+bool LOGQ_Push(LOGQ_t *q, const void *data, uint32_t len)
+{
+    void *rec = LOGQ_ReserveMP(q, len);
+
+    if (!rec) return false;
+    memcpy(rec, data, len);
+    LOGQ_Commit(q, rec, len);
+    return true;
+}
+
+/**
+  * @brief  Oldest committed record
+  */
+const void *LOGQ_Peek(LOGQ_t *q, uint32_t *len)
+{
+    uint32_t tail, used, hdr;
+    uint32_t *p;
+
+    for (;;) {
+        tail = q->tail;
+        used = q->head - tail;
+        if (used == 0u) return NULL;
+        if (used > q->max_used) q->max_used = used;
+        __DMB();  /* head before the header it covers */
+        p = &q->buf[(tail & (q->size - 1u)) >> 2];
+        hdr = *p;
+        if (hdr == 0u || LOGQ_HDR_LEN(hdr) == LOGQ_LEN_BUSY) return NULL;
+        __DMB();  /* header before the payload */
+        if (LOGQ_HDR_LEN(hdr) != LOGQ_LEN_SKIP) break;
+        LOGQ_Free(q, tail, LOGQ_HDR_SPAN(hdr));
+    }
+    *len = LOGQ_HDR_LEN(hdr);
+    return p + 1;
+}
+
+/**
+  * @brief  Drop the record returned by LOGQ_Peek and free its space
+  */
+void LOGQ_Release(LOGQ_t *q)
+{
+    uint32_t tail = q->tail;
+    uint32_t hdr = q->buf[(tail & (q->size - 1u)) >> 2];
+
+    q->records++;
+    q->bytes += LOGQ_HDR_LEN(hdr);
+    LOGQ_Free(q, tail, LOGQ_HDR_SPAN(hdr));
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void LOGQ_GetStats(LOGQ_t *q, LOGQ_Stats_t *stats, bool clear)
+{
+    stats->records = q->records;
+    stats->bytes = q->bytes;
+    stats->dropped = q->dropped;
+    stats->dropped_bytes = q->dropped_bytes;
+    stats->max_used = q->max_used;
+    if (clear) {
+        q->records = 0;
+        q->bytes = 0;
+        q->dropped = 0;
+        q->dropped_bytes = 0;
+        q->max_used = 0;
+    }
+}
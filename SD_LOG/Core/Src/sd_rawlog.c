@@ -0,0 +1,313 @@
+/**
+  ******************************************************************************
+  * @file           : sd_rawlog.c
+  * @brief          : Preallocated log file written as raw consecutive sectors
+  ******************************************************************************
+  * @note           : f_write on a growing file allocates a cluster, rewrites a
+  *                   FAT sector and, on f_sync, the directory sector, all in
+  *                   AUs away from the data. Here the whole extent is taken
+  *                   up front with f_expand, so the data sectors are known and
+  *                   consecutive and go straight to disk_write. The directory
+  *                   entry keeps the size of the whole extent until
+  *                   RAWLOG_Close, so the chain (FAT) or the extent (exFAT,
+  *                   which has no chain) stays a valid file for any checker;
+  *                   the size logged is kept in a record in the extent's last
+  *                   sector, and RAWLOG_Recover finds the end past it after a
+  *                   power cut by looking for the trimmed (erased) part.
+  ******************************************************************************
+  */
+
+#include "sd_rawlog.h"
+#include "sd_ffpriv.h"
+#include "diskio.h"
+#include <string.h>
+
+#if _MAX_SS == _MIN_SS
+#define RAWLOG_SS(fs)   ((UINT)_MAX_SS)
+#else
+#define RAWLOG_SS(fs)   ((UINT)(fs)->ssize)
+#endif
+
+/* Private function prototypes */
+static DWORD RAWLOG_ClustLba(FATFS *fs, DWORD clst);
+static bool RAWLOG_Blank(const BYTE *p, UINT from, UINT ss);
+static uint32_t RAWLOG_Get32(const BYTE *p);
+static void RAWLOG_Put32(BYTE *p, uint32_t v);
+static FRESULT RAWLOG_PutSize(RAWLOG_t *log, FSIZE_t size);
+
+/**
+  * @brief  First sector of cluster clst
+  */
+static DWORD RAWLOG_ClustLba(FATFS *fs, DWORD clst)
+{
+    return fs->database + (clst - 2u) * fs->csize;
+}
+
+/**
+  * @brief  Bytes from..ss-1 of a sector all read as erased (0x00 or 0xFF)
+  */
+static bool RAWLOG_Blank(const BYTE *p, UINT from, UINT ss)
+{
+    BYTE v;
+    UINT i;
+
+    if (from >= ss) return true;
+    v = p[from];
+    if (v != 0x00u && v != 0xFFu) return false;
+    for (i = from + 1u; i < ss; i++) {
+        if (p[i] != v) return false;
+    }
+    return true;
+}
+
+/**
+  * @brief  Little endian u32
+  */
+static uint32_t RAWLOG_Get32(const BYTE *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+  * @brief  Store a little endian u32
+  */
+static void RAWLOG_Put32(BYTE *p, uint32_t v)
+{
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+    p[2] = (BYTE)(v >> 16);
+    p[3] = (BYTE)(v >> 24);
+}
+
+/**
+  * @brief  Write the size record
+  */
+static FRESULT RAWLOG_PutSize(RAWLOG_t *log, FSIZE_t size)
+{
+    memset(log->rec, 0, log->ss);
+    RAWLOG_Put32(&log->rec[0], RAWLOG_MAGIC);
+    RAWLOG_Put32(&log->rec[4], log->lba_rec);
+    RAWLOG_Put32(&log->rec[8], (uint32_t)size);
+    RAWLOG_Put32(&log->rec[12], (uint32_t)(size >> 32));
+    return (disk_write(log->fs->drv, log->rec, log->lba_rec, 1) == RES_OK) ? FR_OK : FR_DISK_ERR;
+}
+
+/**
+  * @brief  Create a log file with a contiguous extent of reserve bytes
+  */
+FRESULT RAWLOG_Open(RAWLOG_t *log, const TCHAR *path, FSIZE_t reserve)
+{
+    DWORD range[2];
+    DWORD bcs, ncl;
+    FRESULT fr;
+
+    memset(log, 0, sizeof(*log));
+    if (reserve == 0) return FR_INVALID_PARAMETER;
+
+    fr = f_open(&log->fil, path, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK) return fr;
+    log->fs = log->fil.obj.fs;
+    log->ss = RAWLOG_SS(log->fs);
+    bcs = (DWORD)log->fs->csize * log->ss;
+    /* whole clusters and the size record, the directory entry covers them */
+    ncl = (DWORD)((reserve + log->ss + bcs - 1u) / bcs);
+    reserve = (FSIZE_t)ncl * bcs;
+
+    fr = f_expand(&log->fil, reserve, 1);
+    if (fr != FR_OK) {
+        f_close(&log->fil);
+        f_unlink(path);
+        return fr;
+    }
+
+    log->lba_base = RAWLOG_ClustLba(log->fs, log->fil.obj.sclust);
+    log->lba_count = ncl * log->fs->csize;
+
+    /* stale data in the extent would look like logged data to recovery */
+    range[0] = log->lba_base;
+    range[1] = log->lba_base + log->lba_count - 1u;
+    log->erased = (disk_ioctl(log->fs->drv, CTRL_TRIM, range) == RES_OK);
+
+    log->lba_count--;
+    log->lba_rec = log->lba_base + log->lba_count;
+    fr = RAWLOG_PutSize(log, 0);
+    if (fr == FR_OK) fr = f_sync(&log->fil);
+    if (fr != FR_OK) {
+        f_close(&log->fil);
+        f_unlink(path);
+    }
+    return fr;
+}
+
+/**
+  * @brief  Append data
+  */
+FRESULT RAWLOG_Write(RAWLOG_t *log, const void *data, UINT len)
+{
+    const BYTE *p = (const BYTE *)data;
+    BYTE drv = log->fs->drv;
+    UINT n;
+
+    if (log->size + len > (FSIZE_t)log->lba_count * log->ss) return FR_DENIED;
+
+    /* top up the partial sector first */
+    if (log->tail_len) {
+        n = log->ss - log->tail_len;
+        if (n > len) n = len;
+        memcpy(&log->tail[log->tail_len], p, n);
+        log->tail_len += n;
+        log->size += n;
+        p += n;
+        len -= n;
+        if (log->tail_len < log->ss) return FR_OK;
+        if (disk_write(drv, log->tail, log->lba_base + log->lba_next, 1) != RES_OK) return FR_DISK_ERR;
+        log->lba_next++;
+        log->tail_len = 0;
+    }
+
+    /* whole sectors straight from the caller's buffer */
+    n = len / log->ss;
+    if (n) {
+        if (disk_write(drv, p, log->lba_base + log->lba_next, n) != RES_OK) return FR_DISK_ERR;
+        log->lba_next += n;
+        log->size += (FSIZE_t)n * log->ss;
+        p += n * log->ss;
+        len -= n * log->ss;
+    }
+
+    if (len) {
+        memcpy(log->tail, p, len);
+        log->tail_len = len;
+        log->size += len;
+    }
+    return FR_OK;
+}
+
+/**
+  * @brief  Make everything logged so far survive a power cut
+  */
+FRESULT RAWLOG_Checkpoint(RAWLOG_t *log)
+{
+    FRESULT fr;
+
+    /* the sector is written again in full once the tail fills up */
+    if (log->tail_len) {
+        memset(&log->tail[log->tail_len], RAWLOG_PAD, log->ss - log->tail_len);
+        if (disk_write(log->fs->drv, log->tail, log->lba_base + log->lba_next, 1) != RES_OK) {
+            return FR_DISK_ERR;
+        }
+    }
+
+    if (log->size != log->committed) {
+        fr = RAWLOG_PutSize(log, log->size);
+        if (fr != FR_OK) return fr;
+        log->committed = log->size;
+    }
+    if (disk_ioctl(log->fs->drv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;
+    return FR_OK;
+}
+
+/**
+  * @brief  Checkpoint, release the unused part of the extent and close
+  */
+FRESULT RAWLOG_Close(RAWLOG_t *log)
+{
+    FRESULT fr;
+
+    fr = RAWLOG_Checkpoint(log);
+    if (fr != FR_OK) return fr;
+
+    fr = f_lseek(&log->fil, log->size);
+    if (fr == FR_OK) fr = f_truncate(&log->fil);
+    if (fr == FR_OK) fr = f_close(&log->fil);
+    return fr;
+}
+
+/**
+  * @brief  Fix the size of a log that was not closed
+  */
+FRESULT RAWLOG_Recover(const TCHAR *path, void *work, UINT len, FSIZE_t *size)
+{
+    BYTE *buf = (BYTE *)work;
+    DWORD clmt[4];
+    DWORD lba, count, first, end, s, i, n, chunk, run = 0;
+    FSIZE_t fsz, rec;
+    FATFS *fs;
+    FIL fil;
+    UINT ss, ofs;
+    FRESULT fr;
+
+    /* R0.12c f_open leaves obj.n_frag unset for an existing exFAT file */
+    memset(&fil, 0, sizeof(fil));
+    fr = f_open(&fil, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING);
+    if (fr != FR_OK) return fr;
+    fs = fil.obj.fs;
+    ss = RAWLOG_SS(fs);
+    fsz = f_size(&fil);
+    chunk = len / ss;
+    if (chunk == 0) {
+        f_close(&fil);
+        return FR_INVALID_PARAMETER;
+    }
+
+    /* a RAWLOG extent is one fragment: { size, ncl, start, 0 } */
+    clmt[0] = sizeof(clmt) / sizeof(clmt[0]);
+    fil.cltbl = clmt;
+    fr = f_lseek(&fil, CREATE_LINKMAP);
+    fil.cltbl = 0;
+    if (fr == FR_NOT_ENOUGH_CORE) fr = FR_OK;
+    else if (fr == FR_OK && clmt[1] != 0) {
+        lba = RAWLOG_ClustLba(fs, clmt[2]);
+        count = clmt[1] * fs->csize;
+        /* an open log covers its whole extent and ends in the size record,
+           the scan starts at the size recorded there */
+        if (fsz != (FSIZE_t)count * ss) {
+            count = 0;
+        } else if (disk_read(fs->drv, buf, lba + count - 1u, 1) != RES_OK) {
+            fr = FR_DISK_ERR;
+            count = 0;
+        } else {
+            rec = (FSIZE_t)RAWLOG_Get32(&buf[8]) | (FSIZE_t)RAWLOG_Get32(&buf[12]) << 32;
+            count--;
+            if (RAWLOG_Get32(&buf[0]) != RAWLOG_MAGIC || RAWLOG_Get32(&buf[4]) != lba + count ||
+                rec > (FSIZE_t)count * ss) {
+                count = 0;
+            } else {
+                fsz = rec;
+            }
+        }
+        first = (DWORD)(fsz / ss);
+        ofs = (UINT)(fsz % ss);
+        end = 0;
+
+        /* the last checkpointed sector only counts if written past its padding */
+        for (s = first; s < count && run < RAWLOG_GUARD_SECTORS; s += n) {
+            n = count - s;
+            if (n > chunk) n = chunk;
+            if (disk_read(fs->drv, buf, lba + s, n) != RES_OK) {
+                fr = FR_DISK_ERR;
+                break;
+            }
+            for (i = 0; i < n && run < RAWLOG_GUARD_SECTORS; i++) {
+                if (RAWLOG_Blank(&buf[i * ss], (s + i == first) ? ofs : 0u, ss)) {
+                    run++;
+                } else {
+                    run = 0;
+                    end = s + i + 1u;
+                }
+            }
+        }
+
+        if (fr == FR_OK && (FSIZE_t)end * ss > fsz) fsz = (FSIZE_t)end * ss;
+        /* cut the extent to the log, as RAWLOG_Close does */
+        if (fr == FR_OK && count) {
+            fr = f_lseek(&fil, fsz);
+            if (fr == FR_OK) fr = f_truncate(&fil);
+        }
+    }
+
+    if (fr == FR_OK) fr = f_close(&fil);
+    else f_close(&fil);
+    if (fr == FR_OK && size) *size = fsz;
+    return fr;
+}
@@ -0,0 +1,307 @@
+/**
+  ******************************************************************************
+  * @file           : sd_rotlog.c
+  * @brief          : Size-capped rotating set of log files
+  ******************************************************************************
+  * @note           : Rotation has to be cheap where the records are produced,
+  *                   so the slow parts happen in ROTLOG_Service, one bounded
+  *                   step per call, on the spare of two FILs:
+  *
+  *                   IDLE    nothing open; next step trims the oldest file if
+  *                           the set is full or the volume short of space,
+  *                           otherwise creates the next file
+  *                   TRIM    oldest file open, cut back ROTLOG_TRIM_BYTES per
+  *                           step (f_truncate + f_sync, so a power loss
+  *                           leaves a consistent shorter file), removed once
+  *                           it is small; the freed clusters are not erased
+  *                           (USER_TRIM_HOLD), a CMD38 would keep the card
+  *                           busy for up to seconds under the logger
+  *                   READY   next file open and empty, waiting for ROTLOG_Due
+  *                   RETIRE  previous file open until the logger has written
+  *                           its last buffer, then closed
+  *
+  *                   The rotation itself only swaps the logger's FIL pointer
+  *                   (SDLOG_Switch), so records keep flowing while files are
+  *                   closed, cut back and created. Free space comes from the
+  *                   count FatFs keeps in step with FSINFO, never from a FAT
+  *                   scan.
+  ******************************************************************************
+  */
+
+#include "sd_rotlog.h"
+#include "sd_ffpriv.h"
+#include "fatfs.h"
+#include <string.h>
+
+#define ROTLOG_IDLE             0u
+#define ROTLOG_TRIM             1u
+#define ROTLOG_READY            2u
+#define ROTLOG_RETIRE           3u
+
+#define ROTLOG_NO_SEQ           0xFFFFFFFFu
+
+#if _MAX_SS == _MIN_SS
+#define ROTLOG_SS(fs)   ((FSIZE_t)_MAX_SS)
+#else
+#define ROTLOG_SS(fs)   ((FSIZE_t)(fs)->ssize)
+#endif
+
+/* Private function prototypes */
+static const char *ROTLOG_Path(ROTLOG_t *r, uint32_t seq);
+static uint32_t ROTLOG_Seq(const char *name);
+static bool ROTLOG_Short(ROTLOG_t *r);
+static FRESULT ROTLOG_TrimStep(ROTLOG_t *r, FIL *fp);
+
+/**
+  * @brief  "dir/NNNNNNNN.LOG" of a sequence number, in r->path
+  */
+static const char *ROTLOG_Path(ROTLOG_t *r, uint32_t seq)
+{
+    char *p = r->path;
+    int i;
+
+    for (i = 0; r->dir[i]; i++) *p++ = r->dir[i];
+    *p++ = '/';
+    for (i = 7; i >= 0; i--) {
+        p[i] = (char)('0' + seq % 10u);
+        seq /= 10u;
+    }
+    memcpy(p + 8, ".LOG", 5);
+    return r->path;
+}
+
+/**
+  * @brief  Sequence number of a set file name, ROTLOG_NO_SEQ for others
+  */
+static uint32_t ROTLOG_Seq(const char *name)
+{
+    uint32_t seq = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        if (name[i] < '0' || name[i] > '9') return ROTLOG_NO_SEQ;
+        seq = seq * 10u + (uint32_t)(name[i] - '0');
+    }
+    if (strcmp(&name[8], ".LOG") != 0) return ROTLOG_NO_SEQ;
+    return seq;
+}
+
+/**
+  * @brief  Check the volume has less than a file's worth of space left
+  */
+static bool ROTLOG_Short(ROTLOG_t *r)
+{
+    DWORD free = ROTLOG_FreeClusters(r->fs);
+
+    if (free == ROTLOG_FREE_UNKNOWN) return false;  // only the file count caps the set
+    return (FSIZE_t)free * r->fs->csize * ROTLOG_SS(r->fs) < r->max_size + ROTLOG_RESERVE_BYTES;
+}
+
+/**
+  * @brief  Cut the oldest file back by one step, remove it when small
+  */
+static FRESULT ROTLOG_TrimStep(ROTLOG_t *r, FIL *fp)
+{
+    FSIZE_t size = f_size(fp);
+    BYTE hold = 1;
+    FRESULT fr;
+
+    /* FatFs trims what it frees (_USE_TRIM); the logger overwrites it anyway */
+    disk_ioctl(r->fs->drv, USER_TRIM_HOLD, &hold);
+    if (size > ROTLOG_TRIM_BYTES) {
+        fr = f_lseek(fp, ((size - 1u) / ROTLOG_TRIM_BYTES) * ROTLOG_TRIM_BYTES);
+        if (fr == FR_OK) fr = f_truncate(fp);
+        if (fr == FR_OK) fr = f_sync(fp);
+        r->stats.trim_steps++;
+    } else {
+        fr = f_close(fp);
+        r->state = ROTLOG_IDLE;
+        if (fr == FR_OK) fr = f_unlink(ROTLOG_Path(r, r->oldest));
+        if (fr == FR_OK) {
+            r->oldest++;
+            r->count--;
+            r->stats.deleted++;
+        }
+    }
+    hold = 0;
+    disk_ioctl(r->fs->drv, USER_TRIM_HOLD, &hold);
+    return fr;
+}
+
+/**
+  * @brief  Open a rotating set and start a new file in it
+  */
+FRESULT ROTLOG_Open(ROTLOG_t *r, const char *dir, UINT nfiles, FSIZE_t max_size)
+{
+    DIR dj;
+    FILINFO fno;
+    FRESULT fr;
+    uint32_t seq, oldest = ROTLOG_NO_SEQ, newest = 0;
+    UINT count = 0;
+
+    if (nfiles < 2u || max_size == 0u || strlen(dir) > ROTLOG_MAX_DIR) return FR_INVALID_PARAMETER;
+    memset(r, 0, sizeof(*r));
+    strcpy(r->dir, dir);
+    r->nfiles = nfiles;
+    r->max_size = max_size;
+
+    fr = f_mkdir(dir);
+    if (fr != FR_OK && fr != FR_EXIST) return fr;
+
+    /* one pass over the directory, dropping files a power loss left empty */
+    fr = f_opendir(&dj, dir);
+    while (fr == FR_OK) {
+        fr = f_readdir(&dj, &fno);
+        if (fr != FR_OK || fno.fname[0] == 0) break;
+        if ((fno.fattrib & AM_DIR) || (seq = ROTLOG_Seq(fno.fname)) == ROTLOG_NO_SEQ) continue;
+        if (fno.fsize == 0u) {
+            fr = f_unlink(ROTLOG_Path(r, seq));
+            continue;
+        }
+        if (seq < oldest) oldest = seq;
+        if (seq > newest) newest = seq;
+        count++;
+    }
+    f_closedir(&dj);
+    if (fr != FR_OK) return fr;
+
+    r->oldest = (count != 0u) ? oldest : newest + 1u;
+    r->newest = newest;
+    r->count = count;
+
+    /* make room for the new file; a gap in the numbers is skipped over */
+    while (fr == FR_OK && r->count >= nfiles) {
+        fr = f_unlink(ROTLOG_Path(r, r->oldest));
+        if (fr == FR_OK) {
+            r->count--;
+            r->stats.deleted++;
+        }
+        if (fr == FR_NO_FILE) fr = FR_OK;
+        r->oldest++;
+    }
+
+    if (fr == FR_OK) fr = f_open(&r->fil[0], ROTLOG_Path(r, r->newest + 1u), FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK) return fr;
+    r->fs = r->fil[0].obj.fs;
+
+    /* FAT12/16 has no FSINFO, but its FAT is at most 256 sectors, and exFAT
+       keeps a bitmap, one bit per cluster: count it once and FatFs keeps
+       the number up to date from then on */
+    if (r->fs->fs_type != FS_FAT32 && ROTLOG_FreeClusters(r->fs) == ROTLOG_FREE_UNKNOWN) {
+        DWORD nclst;
+        FATFS *fs;
+        f_getfree(r->path, &nclst, &fs);
+    }
+    r->newest++;
+    r->count++;
+    r->cur = 0;
+    r->state = ROTLOG_IDLE;
+    return FR_OK;
+}
+
+/**
+  * @brief  File being written, for SDLOG_Init
+  */
+FIL *ROTLOG_File(ROTLOG_t *r)
+{
+    return &r->fil[r->cur];
+}
+
+/**
+  * @brief  Check if the current file is full and the next one is ready
+  */
+bool ROTLOG_Due(ROTLOG_t *r, SDLOG_t *log)
+{
+    return r->state == ROTLOG_READY && !log->next && log->pos + log->fill >= r->max_size;
+}
+
+/**
+  * @brief  Continue the log in the next file
+  */
+bool ROTLOG_Rotate(ROTLOG_t *r, SDLOG_t *log)
+{
+    FSIZE_t size = log->pos + log->fill;
+
+    if (r->state != ROTLOG_READY || !SDLOG_Switch(log, &r->fil[r->cur ^ 1u])) return false;
+
+    if (size > r->max_size && size - r->max_size > r->stats.max_overrun) {
+        r->stats.max_overrun = (uint32_t)(size - r->max_size);
+    }
+    r->cur ^= 1u;
+    r->newest++;
+    r->count++;
+    r->state = ROTLOG_RETIRE;
+    r->stats.rotations++;
+    return true;
+}
+
+/**
+  * @brief  One step of background work
+  */
+FRESULT ROTLOG_Service(ROTLOG_t *r, SDLOG_t *log)
+{
+    FIL *spare = &r->fil[r->cur ^ 1u];
+    FRESULT fr;
+
+    switch (r->state) {
+    case ROTLOG_RETIRE:
+        /* the logger may still be writing the old file's last buffers */
+        if (log->next || log->fil == spare) return FR_OK;
+        r->state = ROTLOG_IDLE;
+        return f_close(spare);
+
+    case ROTLOG_TRIM:
+        return ROTLOG_TrimStep(r, spare);
+
+    case ROTLOG_IDLE:
+        if (r->count > 1u && (r->count >= r->nfiles || ROTLOG_Short(r))) {
+            fr = f_open(spare, ROTLOG_Path(r, r->oldest), FA_WRITE);
+            if (fr == FR_NO_FILE) {
+                r->oldest++;  // gap in the numbers
+                return FR_OK;
+            }
+            if (fr == FR_OK) r->state = ROTLOG_TRIM;
+            return fr;
+        }
+        if (r->count >= r->nfiles) return FR_OK;
+        fr = f_open(spare, ROTLOG_Path(r, r->newest + 1u), FA_WRITE | FA_CREATE_ALWAYS);
+        if (fr == FR_OK) r->state = ROTLOG_READY;
+        return fr;
+
+    default:
+        return FR_OK;
+    }
+}
+
+/**
+  * @brief  Close the logger and the set
+  */
+FRESULT ROTLOG_Close(ROTLOG_t *r, SDLOG_t *log)
+{
+    FIL *spare;
+    FRESULT fr, fr2 = FR_OK;
+
+    fr = SDLOG_Close(log);
+    spare = &r->fil[r->cur ^ 1u];
+    if (r->state != ROTLOG_IDLE) fr2 = f_close(spare);
+    if (fr2 == FR_OK && r->state == ROTLOG_READY) fr2 = f_unlink(ROTLOG_Path(r, r->newest + 1u));
+    r->state = ROTLOG_IDLE;
+    return (fr != FR_OK) ? fr : fr2;
+}
+
+/**
+  * @brief  Free clusters on a mounted volume, without scanning the FAT
+  */
+DWORD ROTLOG_FreeClusters(FATFS *fs)
+{
+    if (fs->free_clst > fs->n_fatent - 2u) return ROTLOG_FREE_UNKNOWN;
+    return fs->free_clst;
+}
+
+/**
+  * @brief  Copy the statistics
+  */
+void ROTLOG_GetStats(ROTLOG_t *r, ROTLOG_Stats_t *stats)
+{
+    *stats = r->stats;
+}
@@ -41,7 +41,10 @@
 
 /* Private variables ---------------------------------------------------------*/
 /* USER CODE BEGIN PV */
-
+DMA_HandleTypeDef hdma_spi1_rx;
+DMA_HandleTypeDef hdma_spi1_tx;
+DMA_HandleTypeDef hdma_spi2_rx;
+DMA_HandleTypeDef hdma_spi2_tx;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -108,7 +111,50 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi)
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
   /* USER CODE BEGIN SPI1_MspInit 1 */
-
+    /* SPI1 DMA Init (SD card data blocks) */
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    /* SPI1_RX Init: DMA2 Stream0 Channel3 */
+    hdma_spi1_rx.Instance = DMA2_Stream0;
+    hdma_spi1_rx.Init.Channel = DMA_CHANNEL_3;
+    hdma_spi1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_spi1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_spi1_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_spi1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_spi1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_spi1_rx.Init.Mode = DMA_NORMAL;
+    hdma_spi1_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_spi1_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_spi1_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(hspi,hdmarx,hdma_spi1_rx);
+
+    /* SPI1_TX Init: DMA2 Stream3 Channel3 */
+    hdma_spi1_tx.Instance = DMA2_Stream3;
+    hdma_spi1_tx.Init.Channel = DMA_CHANNEL_3;
+    hdma_spi1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_spi1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_spi1_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_spi1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_spi1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_spi1_tx.Init.Mode = DMA_NORMAL;
+    hdma_spi1_tx.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_spi1_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_spi1_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(hspi,hdmatx,hdma_spi1_tx);
+
+    /* DMA and SPI1 interrupt Init */
+    HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+    HAL_NVIC_SetPriority(DMA2_Stream3_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(DMA2_Stream3_IRQn);
+    HAL_NVIC_SetPriority(SPI1_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(SPI1_IRQn);
   /* USER CODE END SPI1_MspInit 1 */
 
   }
@@ -139,12 +185,134 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* hspi)
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_5|GPIO_PIN_6|GPIO_PIN_7);
 
   /* USER CODE BEGIN SPI1_MspDeInit 1 */
+    /* SPI1 DMA DeInit */
+    HAL_DMA_DeInit(hspi->hdmarx);
+    HAL_DMA_DeInit(hspi->hdmatx);
 
+    /* SPI1 interrupt DeInit */
+    HAL_NVIC_DisableIRQ(SPI1_IRQn);
   /* USER CODE END SPI1_MspDeInit 1 */
   }
 
 }
 
 /* USER CODE BEGIN 1 */
+/**
+* @brief SPI2 MSP Initialization (second SD card), called by MX_SPI2_Init
+*        before HAL_SPI_Init since SPI2 is not part of the .ioc
+* @param hspi: SPI handle pointer
+* @retval None
+*/
+void SPI2_MspInit(SPI_HandleTypeDef* hspi)
+{
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  /* Peripheral clock enable */
+  __HAL_RCC_SPI2_CLK_ENABLE();
+
+  __HAL_RCC_GPIOB_CLK_ENABLE();
+  /**SPI2 GPIO Configuration
+  PB13     ------> SPI2_SCK
+  PB14     ------> SPI2_MISO
+  PB15     ------> SPI2_MOSI
+  */
+  GPIO_InitStruct.Pin = GPIO_PIN_13|GPIO_PIN_14|GPIO_PIN_15;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF5_SPI2;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+  /* PB12: SD card 2 chip select, idle high */
+  HAL_GPIO_WritePin(GPIOB, GPIO_PIN_12, GPIO_PIN_SET);
+  GPIO_InitStruct.Pin = GPIO_PIN_12;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Alternate = 0;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+  /* SPI2 DMA Init */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* SPI2_RX Init: DMA1 Stream3 Channel0 */
+  hdma_spi2_rx.Instance = DMA1_Stream3;
+  hdma_spi2_rx.Init.Channel = DMA_CHANNEL_0;
+  hdma_spi2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  hdma_spi2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_spi2_rx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_spi2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_spi2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_spi2_rx.Init.Mode = DMA_NORMAL;
+  hdma_spi2_rx.Init.Priority = DMA_PRIORITY_HIGH;
+  hdma_spi2_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  if (HAL_DMA_Init(&hdma_spi2_rx) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  __HAL_LINKDMA(hspi,hdmarx,hdma_spi2_rx);
+
+  /* SPI2_TX Init: DMA1 Stream4 Channel0 */
+  hdma_spi2_tx.Instance = DMA1_Stream4;
+  hdma_spi2_tx.Init.Channel = DMA_CHANNEL_0;
+  hdma_spi2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_spi2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_spi2_tx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_spi2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_spi2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_spi2_tx.Init.Mode = DMA_NORMAL;
+  hdma_spi2_tx.Init.Priority = DMA_PRIORITY_HIGH;
+  hdma_spi2_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  if (HAL_DMA_Init(&hdma_spi2_tx) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  __HAL_LINKDMA(hspi,hdmatx,hdma_spi2_tx);
+
+  /* DMA and SPI2 interrupt Init */
+  HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+  HAL_NVIC_SetPriority(DMA1_Stream4_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream4_IRQn);
+  HAL_NVIC_SetPriority(SPI2_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(SPI2_IRQn);
+}
+
+/**
+* @brief SDIO MSP Initialization (FATFS_SDIO.c backend), pins, SDIO and
+*        DMA2 clocks. The driver programs SDIO and DMA2 Stream6 itself and
+*        polls their flags, so no interrupt is enabled here.
+* @retval None
+*/
+void SDIO_MspInit(void)
+{
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
 
+  /* Peripheral clock enable, SDIOCLK = PLL48CK */
+  __HAL_RCC_SDIO_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  __HAL_RCC_GPIOD_CLK_ENABLE();
+  /**SDIO GPIO Configuration
+  PC8      ------> SDIO_D0
+  PC9      ------> SDIO_D1
+  PC10     ------> SDIO_D2
+  PC11     ------> SDIO_D3
+  PC12     ------> SDIO_CK
+  PD2      ------> SDIO_CMD
+  */
+  GPIO_InitStruct.Pin = GPIO_PIN_8|GPIO_PIN_9|GPIO_PIN_10|GPIO_PIN_11;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF12_SDIO;
+  HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = GPIO_PIN_12;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = GPIO_PIN_2;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
+}
 /* USER CODE END 1 */
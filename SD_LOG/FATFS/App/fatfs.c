@@ -20,10 +20,16 @@
 
 uint8_t retUSER;    /* Return value for USER */
 char USERPath[4];   /* USER logical drive path */
-FATFS USERFatFS;    /* File system object for USER logical drive */
-FIL USERFile;       /* File object for USER */
 
 /* USER CODE BEGIN Variables */
+uint8_t retSD2;     /* Return value for the second SD card */
+char SD2Path[4];    /* second SD card (SPI2) logical drive path */
+
+/* Each drive's FAT volume is the first FAT partition of its MBR, or the
+   whole card without one; a black-box partition (sd_bbox.h) can follow it */
+#if _MULTI_PARTITION
+PARTITION VolToPart[_VOLUMES] = { {0, 0}, {1, 0} };
+#endif
 
 /* USER CODE END Variables */
 
@@ -33,7 +39,8 @@ void MX_FATFS_Init(void)
   retUSER = FATFS_LinkDriver(&USER_Driver, USERPath);
 
   /* USER CODE BEGIN Init */
-  /* additional user code for init */
+  /* second SD card on SPI2, same driver as drive lun 1 */
+  retSD2 = FATFS_LinkDriverEx(&USER_Driver, SD2Path, 1);
   /* USER CODE END Init */
 }
 
@@ -33,12 +33,12 @@
 
 extern uint8_t retUSER; /* Return value for USER */
 extern char USERPath[4]; /* USER logical drive path */
-extern FATFS USERFatFS; /* File system object for USER logical drive */
-extern FIL USERFile; /* File object for USER */
 
 void MX_FATFS_Init(void);
 
 /* USER CODE BEGIN Prototypes */
+extern uint8_t retSD2; /* Return value for the second SD card */
+extern char SD2Path[4]; /* second SD card (SPI2) logical drive path */
 
 /* USER CODE END Prototypes */
 #ifdef __cplusplus
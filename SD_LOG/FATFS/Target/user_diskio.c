@@ -35,6 +35,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include <string.h>
 #include "ff_gen_drv.h"
+#include "user_diskio.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -42,6 +43,301 @@
 /* Private variables ---------------------------------------------------------*/
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
+/* USER_TRIM_HOLD: CTRL_TRIM does not reach the card (no CMD38 busy wait) */
+static BYTE TrimHeld[SD_DRIVES];
+
+#if USER_CACHE_SECTORS > 0
+/*
+ * Sector cache. Single sector transfers are FatFs window and file buffer
+ * traffic; they are cached with LRU replacement. Sectors from the volume
+ * boot record up to the data area (reserved sectors, FSINFO, FATs and the
+ * FAT12/16 root directory; on exFAT the boot region and the FAT) are
+ * metadata: they are pinned against other sectors and their writes are held
+ * back until CTRL_SYNC. All other writes go straight to the card, but a
+ * single sector one first writes back the held metadata: FatFs writes the
+ * FAT before a directory entry that points into it, and a FAT32 or exFAT
+ * directory sector is in the data area. Multi sector transfers are file
+ * data, which may reach the card ahead of the FAT; they bypass the cache
+ * and only keep the cached copies coherent.
+ */
+#define CACHE_SS  512
+
+typedef struct {
+  BYTE valid;
+  BYTE dirty;
+  BYTE pdrv;
+  DWORD sector;
+  DWORD used;             /* LRU stamp */
+  BYTE data[CACHE_SS];
+} CacheLine_t;
+
+static CacheLine_t Cache[USER_CACHE_SECTORS];
+static DWORD CacheClock;
+static USER_CacheStats_t CacheStats;
+static DWORD MetaStart[SD_DRIVES], MetaEnd[SD_DRIVES];  /* pinned range [start, end) */
+static BYTE MetaHeld[SD_DRIVES];                        /* metadata writes waiting for CTRL_SYNC */
+static DWORD VolBase[SD_DRIVES][4];                     /* partition starts in the MBR */
+
+static WORD ld_word(const BYTE *p) { return (WORD)(p[0] | (p[1] << 8)); }
+static DWORD ld_dword(const BYTE *p) { return (DWORD)ld_word(p) | ((DWORD)ld_word(p + 2) << 16); }
+
+static int Cache_IsMeta(BYTE pdrv, DWORD sector)
+{
+  return sector >= MetaStart[pdrv] && sector < MetaEnd[pdrv];
+}
+
+/* sectors from a FAT or exFAT volume boot record to the data area, 0 if buf is not one */
+static DWORD Cache_VbrMeta(const BYTE *buf)
+{
+  DWORD fatsz, rootsec;
+
+  if (ld_word(buf + 510) != 0xAA55 || (buf[0] != 0xEB && buf[0] != 0xE9)) return 0;
+  if (!memcmp(buf + 3, "EXFAT   ", 8))
+  {
+    /* 512 byte sectors, everything before the cluster heap */
+    if (buf[108] != 9) return 0;
+    return ld_dword(buf + 88);
+  }
+  if (ld_word(buf + 11) != CACHE_SS || buf[16] == 0 || buf[16] > 2 || buf[13] == 0) return 0;
+  if (memcmp(buf + 54, "FAT", 3) && memcmp(buf + 82, "FAT32", 5)) return 0;
+
+  fatsz = ld_word(buf + 22);
+  if (fatsz == 0) fatsz = ld_dword(buf + 36);
+  rootsec = ((DWORD)ld_word(buf + 17) * 32 + CACHE_SS - 1) / CACHE_SS;
+  return ld_word(buf + 14) + fatsz * buf[16] + rootsec;
+}
+
+/* pick up the metadata range from a boot record where FatFs looks for a volume:
+   sector 0, else a partition the MBR in sector 0 lists. Data sectors that only
+   look like a boot record are ignored. */
+static void Cache_Learn(BYTE pdrv, DWORD sector, const BYTE *buf)
+{
+  DWORD len;
+  int i;
+
+  if (sector != 0)
+  {
+    for (i = 0; i < 4 && VolBase[pdrv][i] != sector; i++) ;
+    if (i == 4) return;
+  }
+  len = Cache_VbrMeta(buf);
+  if (sector == 0)
+  {
+    /* a volume in sector 0 has no partition table */
+    for (i = 0; i < 4; i++)
+    {
+      VolBase[pdrv][i] = (!len && ld_word(buf + 510) == 0xAA55) ? ld_dword(buf + 446 + 16 * i + 8) : 0;
+    }
+  }
+  if (len == 0) return;
+  MetaStart[pdrv] = sector;
+  MetaEnd[pdrv] = sector + len;
+}
+
+static CacheLine_t *Cache_Find(BYTE pdrv, DWORD sector)
+{
+  for (int i = 0; i < USER_CACHE_SECTORS; i++)
+  {
+    if (Cache[i].valid && Cache[i].pdrv == pdrv && Cache[i].sector == sector) return &Cache[i];
+  }
+  return NULL;
+}
+
+/* write a dirty line to the card */
+static DRESULT Cache_Clean(CacheLine_t *ln)
+{
+  DRESULT res;
+  if (!ln->dirty) return RES_OK;
+  res = SD_disk_write(ln->pdrv, ln->data, ln->sector, 1);
+  if (res == RES_OK)
+  {
+    ln->dirty = 0;
+    CacheStats.writebacks++;
+  }
+  return res;
+}
+
+/* free line for a new sector: an empty one, else the LRU line a metadata sector may not keep */
+static CacheLine_t *Cache_Victim(BYTE meta)
+{
+  CacheLine_t *v = NULL;
+  for (int i = 0; i < USER_CACHE_SECTORS; i++)
+  {
+    CacheLine_t *ln = &Cache[i];
+    if (!ln->valid) return ln;
+    if (!meta && Cache_IsMeta(ln->pdrv, ln->sector)) continue;
+    if (!v || (DWORD)(CacheClock - ln->used) > (DWORD)(CacheClock - v->used)) v = ln;
+  }
+  if (v)
+  {
+    if (Cache_Clean(v) != RES_OK) return NULL;
+    v->valid = 0;
+    CacheStats.evictions++;
+  }
+  return v;
+}
+
+static void Cache_Touch(CacheLine_t *ln)
+{
+  ln->used = ++CacheClock;
+}
+
+/* write back all dirty lines of a drive in ascending LBA order */
+static DRESULT Cache_Flush(BYTE pdrv)
+{
+  for (;;)
+  {
+    CacheLine_t *next = NULL;
+    for (int i = 0; i < USER_CACHE_SECTORS; i++)
+    {
+      CacheLine_t *ln = &Cache[i];
+      if (ln->valid && ln->dirty && ln->pdrv == pdrv && (!next || ln->sector < next->sector)) next = ln;
+    }
+    if (!next)
+    {
+      MetaHeld[pdrv] = 0;
+      return RES_OK;
+    }
+    if (Cache_Clean(next) != RES_OK) return RES_ERROR;
+  }
+}
+
+static void Cache_Invalidate(BYTE pdrv)
+{
+  for (int i = 0; i < USER_CACHE_SECTORS; i++)
+  {
+    if (Cache[i].pdrv == pdrv) Cache[i].valid = 0;
+  }
+  MetaStart[pdrv] = MetaEnd[pdrv] = 0;
+  MetaHeld[pdrv] = 0;
+  memset(VolBase[pdrv], 0, sizeof(VolBase[pdrv]));
+}
+
+static DRESULT Cache_Read(BYTE pdrv, BYTE *buff, DWORD sector)
+{
+  CacheLine_t *ln = Cache_Find(pdrv, sector);
+  DRESULT res;
+
+  if (ln)
+  {
+    CacheStats.hits++;
+  }
+  else
+  {
+    CacheStats.misses++;
+    ln = Cache_Victim(Cache_IsMeta(pdrv, sector));
+    if (!ln)
+    {
+      res = SD_disk_read(pdrv, buff, sector, 1);
+      if (res == RES_OK) Cache_Learn(pdrv, sector, buff);
+      return res;
+    }
+    res = SD_disk_read(pdrv, ln->data, sector, 1);
+    if (res != RES_OK) return res;
+    ln->valid = 1;
+    ln->dirty = 0;
+    ln->pdrv = pdrv;
+    ln->sector = sector;
+  }
+  /* also on a hit: the MBR may have been rewritten since the line was filled */
+  Cache_Learn(pdrv, sector, ln->data);
+  Cache_Touch(ln);
+  memcpy(buff, ln->data, CACHE_SS);
+  return RES_OK;
+}
+
+#if _USE_WRITE == 1
+static DRESULT Cache_Write(BYTE pdrv, const BYTE *buff, DWORD sector)
+{
+  CacheLine_t *ln = Cache_Find(pdrv, sector);
+  DRESULT res;
+
+  Cache_Learn(pdrv, sector, buff);
+  if (Cache_IsMeta(pdrv, sector))
+  {
+    /* hold metadata back until CTRL_SYNC */
+    if (!ln) ln = Cache_Victim(1);
+    if (ln)
+    {
+      memcpy(ln->data, buff, CACHE_SS);
+      ln->valid = 1;
+      ln->dirty = 1;
+      ln->pdrv = pdrv;
+      ln->sector = sector;
+      Cache_Touch(ln);
+      CacheStats.absorbed++;
+      MetaHeld[pdrv] = 1;
+      return RES_OK;
+    }
+  }
+  /* the FAT goes before the directory sector that may follow it */
+  if (MetaHeld[pdrv] && Cache_Flush(pdrv) != RES_OK) return RES_ERROR;
+  /* write through, refresh a cached copy */
+  res = SD_disk_write(pdrv, buff, sector, 1);
+  if (res == RES_OK && ln)
+  {
+    memcpy(ln->data, buff, CACHE_SS);
+    ln->dirty = 0;
+  }
+  return res;
+}
+#endif /* _USE_WRITE == 1 */
+
+/* multi sector transfers: cached copies win on read, are replaced on write */
+static void Cache_Overlap(BYTE pdrv, BYTE *buff, DWORD sector, UINT count, BYTE write)
+{
+  for (int i = 0; i < USER_CACHE_SECTORS; i++)
+  {
+    CacheLine_t *ln = &Cache[i];
+    if (!ln->valid || ln->pdrv != pdrv || ln->sector < sector || ln->sector - sector >= count) continue;
+    if (write)
+    {
+      memcpy(ln->data, buff + (ln->sector - sector) * CACHE_SS, CACHE_SS);
+      ln->dirty = 0;
+    }
+    else
+    {
+      memcpy(buff + (ln->sector - sector) * CACHE_SS, ln->data, CACHE_SS);
+    }
+  }
+}
+
+static DRESULT Cache_Ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+  switch (cmd)
+  {
+  case USER_GET_CACHE_STATS:
+    CacheStats.lines = USER_CACHE_SECTORS;
+    CacheStats.pinned = 0;
+    for (int i = 0; i < USER_CACHE_SECTORS; i++)
+    {
+      if (Cache[i].valid && Cache_IsMeta(Cache[i].pdrv, Cache[i].sector)) CacheStats.pinned++;
+    }
+    memcpy(buff, &CacheStats, sizeof(CacheStats));
+    return RES_OK;
+  case USER_RESET_CACHE_STATS:
+    memset(&CacheStats, 0, sizeof(CacheStats));
+    return RES_OK;
+  case CTRL_SYNC:
+    if (Cache_Flush(pdrv) != RES_OK) return RES_ERROR;
+    break;
+  case CTRL_TRIM:
+    /* freed sectors, drop cached copies without writing them back */
+    for (int i = 0; i < USER_CACHE_SECTORS; i++)
+    {
+      CacheLine_t *ln = &Cache[i];
+      if (ln->valid && ln->pdrv == pdrv && ln->sector >= ((DWORD*)buff)[0] && ln->sector <= ((DWORD*)buff)[1])
+      {
+        ln->valid = 0;
+        ln->dirty = 0;
+      }
+    }
+    if (TrimHeld[pdrv]) return RES_OK;
+    break;
+  }
+  return SD_disk_ioctl(pdrv, cmd, buff);
+}
+#endif /* USER_CACHE_SECTORS > 0 */
 
 /* USER CODE END DECL */
 
@@ -81,7 +377,22 @@ DSTATUS USER_initialize (
 )
 {
   /* USER CODE BEGIN INIT */
+#if USER_CACHE_SECTORS > 0
+	DSTATUS st;
+	if (pdrv >= SD_DRIVES) return STA_NOINIT;
+	/* held metadata goes to the card before the cache is forgotten: while the
+	   card still answers, else once it is up again; if it cannot be written
+	   the drive stays down and keeps it for the next attempt */
+	if (MetaHeld[pdrv] && !(SD_disk_status(pdrv) & STA_NOINIT) && Cache_Flush(pdrv) != RES_OK) return STA_NOINIT;
+	st = SD_disk_initialize(pdrv);
+	if (st & STA_NOINIT) return st;
+	if (MetaHeld[pdrv] && Cache_Flush(pdrv) != RES_OK) return STA_NOINIT;
+	/* new card or remount, forget what was cached */
+	Cache_Invalidate(pdrv);
+	return st;
+#else
 	return SD_disk_initialize(pdrv);
+#endif
   /* USER CODE END INIT */
 }
 
@@ -115,7 +426,16 @@ DRESULT USER_read (
 )
 {
   /* USER CODE BEGIN READ */
+#if USER_CACHE_SECTORS > 0
+	DRESULT res;
+	if (pdrv >= SD_DRIVES) return RES_PARERR;
+	if (count == 1) return Cache_Read(pdrv, buff, sector);
+	res = SD_disk_read(pdrv, buff, sector, count);
+	if (res == RES_OK) Cache_Overlap(pdrv, buff, sector, count, 0);
+	return res;
+#else
 	return SD_disk_read(pdrv, buff, sector, count);
+#endif
   /* USER CODE END READ */
 }
 
@@ -137,7 +457,16 @@ DRESULT USER_write (
 {
   /* USER CODE BEGIN WRITE */
   /* USER CODE HERE */
+#if USER_CACHE_SECTORS > 0
+	DRESULT res;
+	if (pdrv >= SD_DRIVES) return RES_PARERR;
+	if (count == 1) return Cache_Write(pdrv, buff, sector);
+	res = SD_disk_write(pdrv, buff, sector, count);
+	if (res == RES_OK) Cache_Overlap(pdrv, (BYTE*)buff, sector, count, 1);
+	return res;
+#else
 	return SD_disk_write(pdrv, buff, sector, count);
+#endif
   /* USER CODE END WRITE */
 }
 #endif /* _USE_WRITE == 1 */
@@ -157,7 +486,18 @@ DRESULT USER_ioctl (
 )
 {
   /* USER CODE BEGIN IOCTL */
+	if (pdrv >= SD_DRIVES) return RES_PARERR;
+	if (cmd == USER_TRIM_HOLD)
+	{
+		TrimHeld[pdrv] = *(BYTE *)buff;
+		return RES_OK;
+	}
+#if USER_CACHE_SECTORS > 0
+	return Cache_Ioctl(pdrv, cmd, buff);
+#else
+	if (cmd == CTRL_TRIM && TrimHeld[pdrv]) return RES_OK;
 	return SD_disk_ioctl(pdrv, cmd, buff);
+#endif
   /* USER CODE END IOCTL */
 }
 #endif /* _USE_IOCTL == 1 */
@@ -30,7 +30,28 @@
 
 /* Includes ------------------------------------------------------------------*/
 /* Exported types ------------------------------------------------------------*/
+/* Sector cache counters (USER_GET_CACHE_STATS) */
+typedef struct {
+  uint32_t hits;        /* single sector reads served from the cache */
+  uint32_t misses;      /* single sector reads that went to the card */
+  uint32_t evictions;   /* valid lines replaced */
+  uint32_t writebacks;  /* dirty lines written to the card */
+  uint32_t absorbed;    /* metadata writes held back in the cache */
+  uint16_t lines;       /* USER_CACHE_SECTORS */
+  uint16_t pinned;      /* lines currently holding metadata sectors */
+} USER_CacheStats_t;
+
 /* Exported constants --------------------------------------------------------*/
+/* Sectors in the write-back cache between FatFs and the SD driver, 0 disables it */
+#ifndef USER_CACHE_SECTORS
+#define USER_CACHE_SECTORS      8
+#endif
+
+/* USER_ioctl codes, next to the driver's SD_GET_xxx range */
+#define USER_GET_CACHE_STATS    60  /* Get cache counters (USER_CacheStats_t) */
+#define USER_RESET_CACHE_STATS  61  /* Clear cache counters */
+#define USER_TRIM_HOLD          62  /* BYTE: 1 leaves sectors freed by CTRL_TRIM unerased until 0 */
+
 /* Exported functions ------------------------------------------------------- */
 extern Diskio_drvTypeDef  USER_Driver;
 
@@ -10,88 +10,698 @@
 #include "main.h"
 #include "diskio.h"
 #include "FATFS_SD.h"
+#include <string.h>
+
+#if !SD_USE_SDIO
 
 #define TRUE  1
 #define FALSE 0
 #define bool BYTE
 
-static volatile DSTATUS Stat = STA_NOINIT;  /* Disk Status */
-uint16_t Timer1, Timer2; 		/* 1ms Timer Counters */
-static uint8_t CardType; 		/* Type 0:MMC, 1:SDC, 2:Block addressing */
-static uint8_t PowerFlag = 0;	/* Power flag */
+/* one SD card on its own SPI bus */
+typedef struct {
+  SPI_HandleTypeDef *hspi;		/* SPI bus, each bus with its own DMA streams */
+  GPIO_TypeDef *cs_port;		/* chip select */
+  uint16_t cs_pin;
+  volatile DSTATUS Stat;		/* Disk Status */
+  volatile uint16_t Timer1, Timer2;	/* 1ms Timer Counters, see SD_disk_timerproc */
+  uint8_t CardType;				/* Type 0:MMC, 1:SDC, 2:Block addressing */
+  uint8_t PowerFlag;			/* Power flag */
+  uint8_t SpiBr;				/* SPI BR[2:0], SCK = PCLK / (2 << SpiBr) */
+  uint8_t SpiBrMax;				/* fastest BR the card accepts in data mode */
+  uint8_t SpiErrors;			/* consecutive data errors at the current clock */
+  uint16_t SpiFallbacks;		/* times the clock was lowered */
+  uint8_t DataMode;				/* identification done, error fallback armed */
+  SD_AuInfo_t Au;				/* erase geometry, read at initialization */
+  uint32_t EraseUnit;			/* CMD38 granularity in sectors, 0: no erase */
+  uint8_t CrcOn;				/* CMD59 accepted, data blocks carry a checked CRC16 */
+  uint32_t CrcErrors;			/* data blocks that failed CRC16, either direction */
+  uint32_t Overruns;			/* polled receives that lost a frame to SPI OVR */
+  uint8_t PumpOne;				/* after an overrun: one frame in flight until a block is read */
+
+  uint8_t BusyPending;			/* card left programming, not yet seen ready */
+  uint32_t BusyMark;			/* DWT cycle count when programming started */
+  uint32_t BusyBlocks;			/* write-behinds started */
+  uint32_t BusyStalls;			/* times a caller had to wait for the card */
+  uint64_t BusyHidden;			/* busy cycles overlapped with other work */
+  uint64_t BusyExposed;			/* busy cycles spent in SD_ReadyWait */
+
+#if SD_STREAM_WRITE
+  uint8_t WrOpen;				/* CMD25 session open */
+  DWORD WrNext;					/* LBA that continues the session */
+  uint32_t WrTick;				/* HAL tick of the last block written */
+#endif
+
+#if SD_USE_DMA
+  volatile uint8_t SpiDmaBusy;	/* DMA block in flight */
+  volatile uint8_t SpiDmaError;	/* DMA/SPI error reported by HAL */
+#endif
+
+#if SD_USE_STATS
+  SD_Stats_t Stats;				/* SD_GET_STATS */
+#endif
+} SD_Drive_t;
+
+/* drive table, indexed by the FatFs driver lun (pdrv) */
+static SD_Drive_t SdDrv[SD_DRIVES] = {
+  { .hspi = HSPI_SDCARD, .cs_port = SD_CS_PORT, .cs_pin = SD_CS_PIN, .Stat = STA_NOINIT },
+#if SD_DRIVES > 1
+  { .hspi = HSPI_SDCARD2, .cs_port = SD_CS_PORT2, .cs_pin = SD_CS_PIN2, .Stat = STA_NOINIT },
+#endif
+};
+
+#if SD_USE_STATS
+#define STAT_ADD(sd, f, n)	((sd)->Stats.f += (n))
+#else
+#define STAT_ADD(sd, f, n)	((void)0)
+#endif
+
+#if SD_USE_DMA
+/* CCM RAM (0x1000xxxx) is not reachable by the DMA controllers */
+#define SD_DMA_CAPABLE(p)	((((uint32_t)(uintptr_t)(p)) & 0xFFFF0000UL) != 0x10000000UL)
+#endif
+
+/* polled builds check data blocks in the SPI CRC unit, DMA builds with a table */
+#define SD_CRC_HW 			(SD_USE_CRC && !SD_USE_DMA)
+
+#if SD_USE_DMA || (SD_CRC_HW && !SD_SPI_PUMP)
+static const uint8_t SpiDummyTx[512] = { [0 ... 511] = 0xFF };	/* clocks out 0xFF while receiving */
+#endif
+#if SD_CRC_HW
+static uint8_t SpiCrcTx[512];	/* write block in 16-bit frame order */
+#endif
+
+//-----[ Register Access ]-----
+#ifndef SPI_RD
+/* the host shim (Tools/sdsim) brings its own, modelling DR and SR */
+#define SPI_RD(spi, reg) 		((spi)->reg)
+#define SPI_WR(spi, reg, val) 	((spi)->reg = (val))
+#endif
+#ifndef SD_CRC16_CHARGE
+/* the host shim charges the CPU time of the CRC16 table loop here */
+#define SD_CRC16_CHARGE(n) 		((void)0)
+#endif
 
 //-----[ SPI Functions ]-----
 
 /* slave select */
-static void SELECT(void)
+static void SELECT(SD_Drive_t *sd)
 {
-  HAL_GPIO_WritePin(SD_CS_PORT, SD_CS_PIN, GPIO_PIN_RESET);
+  HAL_GPIO_WritePin(sd->cs_port, sd->cs_pin, GPIO_PIN_RESET);
 }
 
 /* slave deselect */
-static void DESELECT(void)
+static void DESELECT(SD_Drive_t *sd)
 {
-  HAL_GPIO_WritePin(SD_CS_PORT, SD_CS_PIN, GPIO_PIN_SET);
+  HAL_GPIO_WritePin(sd->cs_port, sd->cs_pin, GPIO_PIN_SET);
 }
 
+#if SD_SPI_PUMP
+/* SR polls without a frame moving before a pump gives up, several frame
+   times at the slowest (identification) clock */
+#define SPI_PUMP_SPINS		100000u
+
+/* full duplex at register level: the TX buffer is reloaded as soon as its
+   frame moves to the shift register and RX is drained behind it, two frames
+   in flight at most. An interrupt that delays the RXNE read by more than a
+   frame time lets the second one overrun RX: both are then complete, DR
+   holds the first and the second is lost. OVR is cleared and the pump
+   carries on in step with the card; the return value says whether every
+   frame was received. The retry runs one frame in flight, which cannot
+   overrun, until a block has been read whole. */
+static bool SPI_Pump(SD_Drive_t *sd, const uint8_t *tx, uint8_t *rx, UINT len)
+{
+  SPI_TypeDef *spi = sd->hspi->Instance;
+  UINT ti = 0, ri = 0, depth = sd->PumpOne ? 1u : 2u;
+  uint32_t sr, spins = 0;
+  uint8_t data;
+  bool ok = TRUE;
+
+  while (ri < len)
+  {
+    sr = SPI_RD(spi, SR);
+    if (sr & SPI_SR_OVR)
+    {
+      /* let the frame on the wire finish (it is lost as well), then DR
+         and SR clear OVR with nothing left in flight */
+      while ((SPI_RD(spi, SR) & SPI_SR_BSY) && ++spins < SPI_PUMP_SPINS);
+      data = (uint8_t)SPI_RD(spi, DR);
+      (void)SPI_RD(spi, SR);
+      if (rx)
+      {
+        rx[ri] = data;
+        for (UINT i = ri + 1; i < ti; i++) rx[i] = 0xFF;
+        ok = FALSE;
+      }
+      ri = ti;
+      spins = 0;
+      continue;
+    }
+    if (sr & SPI_SR_RXNE)
+    {
+      data = (uint8_t)SPI_RD(spi, DR);
+      if (rx) rx[ri] = data;
+      ri++;
+      spins = 0;
+    }
+    if ((sr & SPI_SR_TXE) && ti < len && ti - ri < depth)
+    {
+      SPI_WR(spi, DR, tx ? tx[ti] : 0xFF);
+      ti++;
+    }
+    else if (++spins > SPI_PUMP_SPINS)
+    {
+      /* no clock: the rest reads as an idle bus */
+      if (rx) memset(&rx[ri], 0xFF, len - ri);
+      STAT_ADD(sd, data_errors, 1);
+      return FALSE;
+    }
+  }
+  if (!ok)
+  {
+    STAT_ADD(sd, data_errors, 1);
+    sd->Overruns++;
+    sd->PumpOne = TRUE;
+  }
+  return ok;
+}
+
+/* SPI transmit a byte */
+static void SPI_TxByte(SD_Drive_t *sd, uint8_t data)
+{
+  SPI_Pump(sd, &data, NULL, 1);
+}
+
+/* SPI transmit buffer */
+static void SPI_TxBuffer(SD_Drive_t *sd, uint8_t *buffer, uint16_t len)
+{
+  SPI_Pump(sd, buffer, NULL, len);
+}
+
+/* SPI receive a byte */
+static uint8_t SPI_RxByte(SD_Drive_t *sd)
+{
+  uint8_t data;
+  SPI_Pump(sd, NULL, &data, 1);
+  return data;
+}
+#else
 /* SPI transmit a byte */
-static void SPI_TxByte(uint8_t data)
+static void SPI_TxByte(SD_Drive_t *sd, uint8_t data)
 {
-  while(!__HAL_SPI_GET_FLAG(HSPI_SDCARD, SPI_FLAG_TXE));
-  HAL_SPI_Transmit(HSPI_SDCARD, &data, 1, SPI_TIMEOUT);
+  while(!__HAL_SPI_GET_FLAG(sd->hspi, SPI_FLAG_TXE));
+  HAL_SPI_Transmit(sd->hspi, &data, 1, SPI_TIMEOUT);
 }
 
 /* SPI transmit buffer */
-static void SPI_TxBuffer(uint8_t *buffer, uint16_t len)
+static void SPI_TxBuffer(SD_Drive_t *sd, uint8_t *buffer, uint16_t len)
 {
-  while(!__HAL_SPI_GET_FLAG(HSPI_SDCARD, SPI_FLAG_TXE));
-  HAL_SPI_Transmit(HSPI_SDCARD, buffer, len, SPI_TIMEOUT);
+  while(!__HAL_SPI_GET_FLAG(sd->hspi, SPI_FLAG_TXE));
+  HAL_SPI_Transmit(sd->hspi, buffer, len, SPI_TIMEOUT);
 }
 
 /* SPI receive a byte */
-static uint8_t SPI_RxByte(void)
+static uint8_t SPI_RxByte(SD_Drive_t *sd)
 {
   uint8_t dummy, data;
   dummy = 0xFF;
-  while(!__HAL_SPI_GET_FLAG(HSPI_SDCARD, SPI_FLAG_TXE));
-  HAL_SPI_TransmitReceive(HSPI_SDCARD, &dummy, &data, 1, SPI_TIMEOUT);
+  while(!__HAL_SPI_GET_FLAG(sd->hspi, SPI_FLAG_TXE));
+  HAL_SPI_TransmitReceive(sd->hspi, &dummy, &data, 1, SPI_TIMEOUT);
   return data;
 }
 
 /* SPI receive a byte via pointer */
-static void SPI_RxBytePtr(uint8_t *buff)
+static void SPI_RxBytePtr(SD_Drive_t *sd, uint8_t *buff)
 {
-  *buff = SPI_RxByte();
+  *buff = SPI_RxByte(sd);
+}
+#endif /* SD_SPI_PUMP */
+
+//-----[ CRC Functions ]-----
+#if SD_USE_CRC
+
+/* CRC7 of a command frame, returned as the last frame byte (end bit set) */
+static uint8_t SD_Crc7(const uint8_t *p, UINT n)
+{
+  uint8_t crc = 0, d;
+  while (n--)
+  {
+    d = *p++;
+    for (int b = 0; b < 8; b++, d <<= 1)
+    {
+      crc <<= 1;
+      if ((d ^ crc) & 0x80) crc ^= 0x09;
+    }
+  }
+  return (uint8_t)((crc << 1) | 1);
+}
+
+#if SD_USE_DMA
+/* CRC16-CCITT (x^16 + x^12 + x^5 + 1), one step per byte */
+static const uint16_t Crc16Table[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+/* data block CRC16, its cost in DWT cycles goes to the stats */
+static uint16_t SD_Crc16(SD_Drive_t *sd, const uint8_t *p, UINT n)
+{
+  uint32_t t0 = DWT->CYCCNT;
+  uint16_t crc = 0;
+  SD_CRC16_CHARGE(n);
+  STAT_ADD(sd, crc_bytes, n);
+  while (n--)
+  {
+    crc = (uint16_t)(crc << 8) ^ Crc16Table[(uint8_t)(crc >> 8) ^ *p++];
+  }
+  STAT_ADD(sd, crc_cycles, DWT->CYCCNT - t0);
+  (void)t0;
+  return crc;
+}
+#endif /* SD_USE_DMA */
+
+#if SD_CRC_HW
+/* CRC unit on/off, its width follows DFF so CRC16 needs 16-bit frames;
+   setting CRCEN clears RXCRCR/TXCRCR */
+static void SPI_CrcMode(SD_Drive_t *sd, bool on)
+{
+  SPI_TypeDef *spi = sd->hspi->Instance;
+  __HAL_SPI_DISABLE(sd->hspi);
+  CLEAR_BIT(spi->CR1, SPI_CR1_CRCEN | SPI_CR1_DFF);
+  if (on)
+  {
+    spi->CRCPR = 0x1021;
+    SET_BIT(spi->CR1, SPI_CR1_DFF | SPI_CR1_CRCEN);
+  }
+  sd->hspi->Init.DataSize = on ? SPI_DATASIZE_16BIT : SPI_DATASIZE_8BIT;
+  __HAL_SPI_ENABLE(sd->hspi);
+}
+
+#if SD_SPI_PUMP
+/* SPI_Pump for 16-bit frames (CR1 DFF), len in bytes, halfwords in CPU order */
+static bool SPI_Pump16(SD_Drive_t *sd, const uint8_t *tx, uint8_t *rx, UINT len)
+{
+  SPI_TypeDef *spi = sd->hspi->Instance;
+  const uint16_t *t = (const uint16_t*)tx;
+  uint16_t *r = (uint16_t*)rx;
+  UINT ti = 0, ri = 0, depth = sd->PumpOne ? 1u : 2u;
+  uint32_t sr, spins = 0;
+  uint16_t data;
+  bool ok = TRUE;
+
+  len /= 2;
+  while (ri < len)
+  {
+    sr = SPI_RD(spi, SR);
+    if (sr & SPI_SR_OVR)
+    {
+      while ((SPI_RD(spi, SR) & SPI_SR_BSY) && ++spins < SPI_PUMP_SPINS);
+      data = (uint16_t)SPI_RD(spi, DR);
+      (void)SPI_RD(spi, SR);
+      if (r)
+      {
+        r[ri] = data;
+        for (UINT i = ri + 1; i < ti; i++) r[i] = 0xFFFF;
+        ok = FALSE;
+      }
+      ri = ti;
+      spins = 0;
+      continue;
+    }
+    if (sr & SPI_SR_RXNE)
+    {
+      data = (uint16_t)SPI_RD(spi, DR);
+      if (r) r[ri] = data;
+      ri++;
+      spins = 0;
+    }
+    if ((sr & SPI_SR_TXE) && ti < len && ti - ri < depth)
+    {
+      SPI_WR(spi, DR, t ? t[ti] : 0xFFFF);
+      ti++;
+    }
+    else if (++spins > SPI_PUMP_SPINS)
+    {
+      if (r) memset(&r[ri], 0xFF, (len - ri) * 2u);
+      STAT_ADD(sd, data_errors, 1);
+      return FALSE;
+    }
+  }
+  if (!ok)
+  {
+    STAT_ADD(sd, data_errors, 1);
+    sd->Overruns++;
+    sd->PumpOne = TRUE;
+  }
+  return ok;
+}
+#endif
+
+/* swap the bytes of each halfword, 16-bit frames go out high byte first */
+static void SPI_Swap16(uint8_t *dst, const uint8_t *src, UINT len)
+{
+  uint8_t t;
+  for (UINT i = 0; i < len; i += 2)
+  {
+    t = src[i];
+    dst[i] = src[i + 1];
+    dst[i + 1] = t;
+  }
+}
+#endif /* SD_CRC_HW */
+
+#endif /* SD_USE_CRC */
+
+/* SPI receive a block by polling, *crc gets its CRC16 in CRC mode;
+   FALSE if a frame was lost */
+static bool SPI_RxBlock(SD_Drive_t *sd, uint8_t *buff, UINT len, uint16_t *crc)
+{
+  bool ok = TRUE;
+#if SD_CRC_HW
+  if (sd->CrcOn)
+  {
+    SPI_CrcMode(sd, TRUE);
+#if SD_SPI_PUMP
+    ok = SPI_Pump16(sd, NULL, buff, len);
+#else
+    HAL_SPI_TransmitReceive(sd->hspi, (uint8_t*)SpiDummyTx, buff, len / 2, SPI_TIMEOUT);
+#endif
+    *crc = (uint16_t)sd->hspi->Instance->RXCRCR;
+    SPI_CrcMode(sd, FALSE);
+    SPI_Swap16(buff, buff, len);
+    return ok;
+  }
+#endif
+#if SD_SPI_PUMP
+  ok = SPI_Pump(sd, NULL, buff, len);
+#else
+  for (UINT i = 0; i < len; i++)
+  {
+    SPI_RxBytePtr(sd, &buff[i]);
+  }
+#endif
+#if SD_USE_CRC && !SD_CRC_HW
+  if (sd->CrcOn) *crc = SD_Crc16(sd, buff, len);
+#endif
+  (void)crc;
+  return ok;
+}
+
+/* SPI transmit a block by polling, *crc gets its CRC16 in CRC mode;
+   FALSE if the SPI stopped clocking */
+static bool SPI_TxBlock(SD_Drive_t *sd, const uint8_t *buff, UINT len, uint16_t *crc)
+{
+#if SD_CRC_HW
+  bool ok = TRUE;
+  if (sd->CrcOn)
+  {
+    SPI_Swap16(SpiCrcTx, buff, len);
+    SPI_CrcMode(sd, TRUE);
+#if SD_SPI_PUMP
+    ok = SPI_Pump16(sd, SpiCrcTx, NULL, len);
+#else
+    HAL_SPI_Transmit(sd->hspi, SpiCrcTx, len / 2, SPI_TIMEOUT);
+#endif
+    *crc = (uint16_t)sd->hspi->Instance->TXCRCR;
+    SPI_CrcMode(sd, FALSE);
+    return ok;
+  }
+#elif SD_USE_CRC
+  if (sd->CrcOn) *crc = SD_Crc16(sd, buff, len);
+#endif
+  (void)crc;
+#if SD_SPI_PUMP
+  return SPI_Pump(sd, buff, NULL, len);
+#else
+  SPI_TxBuffer(sd, (uint8_t*)buff, len);
+  return TRUE;
+#endif
+}
+
+#if SD_USE_DMA
+/* default idle hook, does nothing */
+__weak void SD_IdleHook(void)
+{
+}
+
+/* wait for the DMA block to complete, the CPU is handed to SD_IdleHook meanwhile */
+static bool SPI_DmaWait(SD_Drive_t *sd)
+{
+  /* timeout 200ms */
+  sd->Timer1 = SD_DMA_TIMEOUT;
+  while (sd->SpiDmaBusy && sd->Timer1)
+  {
+    SD_IdleHook();
+  }
+  /* transfer stuck, release the SPI */
+  if (sd->SpiDmaBusy)
+  {
+    HAL_SPI_Abort(sd->hspi);
+    sd->SpiDmaBusy = 0;
+    sd->SpiDmaError = 1;
+  }
+  if (sd->SpiDmaError)
+  {
+    STAT_ADD(sd, dma_errors, 1);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* SPI receive a block via DMA, 0xFF is clocked out meanwhile; *crc as SPI_RxBlock */
+static bool SPI_RxBlockDma(SD_Drive_t *sd, uint8_t *buff, uint16_t len, uint16_t *crc)
+{
+  sd->SpiDmaError = 0;
+  sd->SpiDmaBusy = 1;
+  if (HAL_SPI_TransmitReceive_DMA(sd->hspi, (uint8_t*)SpiDummyTx, buff, len) != HAL_OK)
+  {
+    sd->SpiDmaBusy = 0;
+    return FALSE;
+  }
+  if (!SPI_DmaWait(sd)) return FALSE;
+#if SD_USE_CRC
+  if (sd->CrcOn) *crc = SD_Crc16(sd, buff, len);
+#endif
+  (void)crc;
+  return TRUE;
+}
+
+/* SPI transmit a block via DMA, its CRC16 is computed while the DMA runs */
+static bool SPI_TxBlockDma(SD_Drive_t *sd, const uint8_t *buff, uint16_t len, uint16_t *crc)
+{
+  sd->SpiDmaError = 0;
+  sd->SpiDmaBusy = 1;
+  if (HAL_SPI_Transmit_DMA(sd->hspi, (uint8_t*)buff, len) != HAL_OK)
+  {
+    sd->SpiDmaBusy = 0;
+    return FALSE;
+  }
+#if SD_USE_CRC
+  if (sd->CrcOn) *crc = SD_Crc16(sd, buff, len);
+#endif
+  (void)crc;
+  return SPI_DmaWait(sd);
+}
+
+/* drive owning an SPI handle */
+static SD_Drive_t *SD_DriveForSpi(SPI_HandleTypeDef *hspi)
+{
+  for (int i = 0; i < SD_DRIVES; i++)
+  {
+    if (SdDrv[i].hspi == hspi) return &SdDrv[i];
+  }
+  return NULL;
+}
+
+/* DMA completion callbacks */
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  SD_Drive_t *sd = SD_DriveForSpi(hspi);
+  if (sd) sd->SpiDmaBusy = 0;
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  SD_Drive_t *sd = SD_DriveForSpi(hspi);
+  if (sd) sd->SpiDmaBusy = 0;
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+  SD_Drive_t *sd = SD_DriveForSpi(hspi);
+  if (sd)
+  {
+    sd->SpiDmaError = 1;
+    sd->SpiDmaBusy = 0;
+  }
+}
+#endif /* SD_USE_DMA */
+
+//-----[ SPI Clock Functions ]-----
+
+/* SPI kernel clock, SPI1/4/5/6 sit on APB2 */
+static uint32_t SPI_PclkHz(SD_Drive_t *sd)
+{
+  SPI_TypeDef *spi = sd->hspi->Instance;
+  if (spi == SPI1
+#ifdef SPI4
+      || spi == SPI4
+#endif
+#ifdef SPI5
+      || spi == SPI5
+#endif
+#ifdef SPI6
+      || spi == SPI6
+#endif
+     ) return HAL_RCC_GetPCLK2Freq();
+  return HAL_RCC_GetPCLK1Freq();
+}
+
+/* slowest divider not exceeding hz */
+static uint8_t SPI_BrForHz(SD_Drive_t *sd, uint32_t hz)
+{
+  uint32_t pclk = SPI_PclkHz(sd);
+  uint8_t br = 0;
+  while (br < 7 && (pclk >> (br + 1)) > hz) br++;
+  return br;
+}
+
+/* re-program the prescaler, only between transactions */
+static void SPI_SetBr(SD_Drive_t *sd, uint8_t br)
+{
+  __HAL_SPI_DISABLE(sd->hspi);
+  MODIFY_REG(sd->hspi->Instance->CR1, SPI_CR1_BR, (uint32_t)br << SPI_CR1_BR_Pos);
+  sd->hspi->Init.BaudRatePrescaler = (uint32_t)br << SPI_CR1_BR_Pos;
+  __HAL_SPI_ENABLE(sd->hspi);
+  sd->SpiBr = br;
+  sd->SpiErrors = 0;
+}
+
+/* CSD TRAN_SPEED to bit/s */
+static uint32_t SD_TranSpeedHz(uint8_t tran_speed)
+{
+  static const uint8_t value[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+  static const uint32_t unit[4] = { 10000, 100000, 1000000, 10000000 };
+  if ((tran_speed & 7) > 3) return SD_MAX_CLK_HZ;
+  return unit[tran_speed & 7] * value[(tran_speed >> 3) & 15];
+}
+
+/* data token / CRC error seen, slow down after SD_CLK_ERR_LIMIT in a row */
+static void SD_ClockError(SD_Drive_t *sd)
+{
+  if (!sd->DataMode) return;
+  if (++sd->SpiErrors >= SD_CLK_ERR_LIMIT && sd->SpiBr < 7)
+  {
+    SPI_SetBr(sd, sd->SpiBr + 1);
+    sd->SpiFallbacks++;
+  }
+}
+
+//-----[ Statistics Functions ]-----
+
+/* account one operation of class op that started at DWT cycle t0 */
+static void SD_StatOp(SD_Drive_t *sd, uint8_t op, uint32_t t0)
+{
+#if SD_USE_STATS
+  SD_OpStats_t *st = &sd->Stats.op[op];
+  uint32_t us = (DWT->CYCCNT - t0) / (SystemCoreClock / 1000000u);
+  uint8_t b = us ? 31 - __builtin_clz(us) : 0;
+  if (b >= SD_STAT_BUCKETS) b = SD_STAT_BUCKETS - 1;
+  st->hist[b]++;
+  st->count++;
+  st->total_us += us;
+  if (us > st->max_us) st->max_us = us;
+#else
+  (void)sd; (void)op; (void)t0;
+#endif
 }
 
 //-----[ SD Card Functions ]-----
 
+/* card programming started, check it later */
+static void SD_BusyBegin(SD_Drive_t *sd)
+{
+  sd->BusyPending = 1;
+  sd->BusyMark = DWT->CYCCNT;
+  sd->BusyBlocks++;
+}
+
+/* card seen ready at t0: the time since SD_BusyBegin ran behind the caller */
+static void SD_BusyEnd(SD_Drive_t *sd, uint32_t t0)
+{
+  sd->BusyHidden += t0 - sd->BusyMark;
+  sd->BusyPending = 0;
+}
+
 /* wait SD ready */
-static uint8_t SD_ReadyWait(void)
+static uint8_t SD_ReadyWait(SD_Drive_t *sd)
 {
   uint8_t res;
+  uint32_t t0 = DWT->CYCCNT;
   /* timeout 500ms */
-  Timer2 = 500;
+  sd->Timer2 = 500;
   /* if SD goes ready, receives 0xFF */
-  do {
-    res = SPI_RxByte();
-  } while ((res != 0xFF) && Timer2);
+  res = SPI_RxByte(sd);
+  if (res != 0xFF)
+  {
+    do {
+      res = SPI_RxByte(sd);
+    } while ((res != 0xFF) && sd->Timer2);
+    SD_StatOp(sd, SD_OP_BUSY, t0);
+    /* write-behind caught up with us */
+    if (sd->BusyPending)
+    {
+      sd->BusyExposed += DWT->CYCCNT - t0;
+      sd->BusyStalls++;
+    }
+  }
+  if (sd->BusyPending && res == 0xFF) SD_BusyEnd(sd, t0);
   return res;
 }
 
 /* power on */
-static void SD_PowerOn(void)
+static void SD_PowerOn(SD_Drive_t *sd)
 {
   uint8_t args[6];
   uint32_t cnt = 0x1FFF;
   /* transmit bytes to wake up */
-  DESELECT();
+  DESELECT(sd);
   for(int i = 0; i < 10; i++)
   {
-    SPI_TxByte(0xFF);
+    SPI_TxByte(sd, 0xFF);
   }
   /* slave select */
-  SELECT();
+  SELECT(sd);
   /* make idle state */
   args[0] = CMD0;   /* CMD0:GO_IDLE_STATE */
   args[1] = 0;
@@ -99,159 +709,322 @@ static void SD_PowerOn(void)
   args[3] = 0;
   args[4] = 0;
   args[5] = 0x95;
-  SPI_TxBuffer(args, sizeof(args));
+  SPI_TxBuffer(sd, args, sizeof(args));
   /* wait response */
-  while ((SPI_RxByte() != 0x01) && cnt)
+  while ((SPI_RxByte(sd) != 0x01) && cnt)
   {
     cnt--;
   }
-  DESELECT();
-  SPI_TxByte(0XFF);
-  PowerFlag = 1;
+  DESELECT(sd);
+  SPI_TxByte(sd, 0XFF);
+  sd->PowerFlag = 1;
 }
 
 /* power off */
-static void SD_PowerOff(void)
+static void SD_PowerOff(SD_Drive_t *sd)
 {
-  PowerFlag = 0;
+  sd->PowerFlag = 0;
 }
 
 /* check power flag */
-static uint8_t SD_CheckPower(void)
+static uint8_t SD_CheckPower(SD_Drive_t *sd)
 {
-  return PowerFlag;
+  return sd->PowerFlag;
 }
 
 /* receive data block */
-static bool SD_RxDataBlock(BYTE *buff, UINT len)
+static bool SD_RxDataBlock(SD_Drive_t *sd, BYTE *buff, UINT len)
 {
   uint8_t token;
+  uint16_t crc = 0;
+  bool ok = TRUE;
   /* timeout 200ms */
-  Timer1 = 200;
+  sd->Timer1 = 200;
   /* loop until receive a response or timeout */
   do {
-    token = SPI_RxByte();
-  } while((token == 0xFF) && Timer1);
+    token = SPI_RxByte(sd);
+  } while((token == 0xFF) && sd->Timer1);
   /* invalid response */
-  if(token != 0xFE) return FALSE;
+  if(token != 0xFE)
+  {
+    STAT_ADD(sd, data_errors, 1);
+    SD_ClockError(sd);
+    return FALSE;
+  }
+  STAT_ADD(sd, bytes_read, len);
+  /* register reads are not retried: one frame in flight, it cannot overrun */
+  if (len < 512) sd->PumpOne = TRUE;
   /* receive data */
-  do {
-    SPI_RxBytePtr(buff++);
-  } while(len--);
+#if SD_USE_DMA
+  if (len == 512 && SD_DMA_CAPABLE(buff))
+  {
+    if (!SPI_RxBlockDma(sd, buff, len, &crc)) return FALSE;
+  }
+  else
+#endif
+  {
+    /* overrun: the block is incomplete, its CRC is still clocked out */
+    ok = SPI_RxBlock(sd, buff, len, &crc);
+  }
+#if SD_USE_CRC
+  /* CRC16, checked in CRC mode */
+  uint16_t card_crc = (uint16_t)SPI_RxByte(sd) << 8;
+  card_crc |= SPI_RxByte(sd);
+  if (sd->CrcOn && ok && card_crc != crc)
+  {
+    STAT_ADD(sd, crc_errors, 1);
+    sd->CrcErrors++;
+    SD_ClockError(sd);
+    return FALSE;
+  }
+#else
   /* discard CRC */
-  SPI_RxByte();
-  SPI_RxByte();
+  SPI_RxByte(sd);
+  SPI_RxByte(sd);
+#endif
+  if (!ok) return FALSE;
+  sd->SpiErrors = 0;
+  sd->PumpOne = FALSE;
   return TRUE;
 }
 
 /* transmit data block */
 #if _USE_WRITE == 1
-static bool SD_TxDataBlock(const uint8_t *buff, BYTE token)
+static bool SD_TxDataBlock(SD_Drive_t *sd, const uint8_t *buff, BYTE token)
 {
-  uint8_t resp;
+  uint8_t resp = 0x05;	/* STOP token gets no data response */
   uint8_t i = 0;
   /* wait SD ready */
-  if (SD_ReadyWait() != 0xFF) return FALSE;
+  if (SD_ReadyWait(sd) != 0xFF) return FALSE;
   /* transmit token */
-  SPI_TxByte(token);
+  SPI_TxByte(sd, token);
   /* if it's not STOP token, transmit data */
   if (token != 0xFD)
   {
-    SPI_TxBuffer((uint8_t*)buff, 512);
-    /* discard CRC */
-    SPI_RxByte();
-    SPI_RxByte();
+    uint16_t crc = 0xFFFF;	/* don't care outside CRC mode */
+    uint8_t crc_bytes[2];
+#if SD_USE_DMA
+    if (SD_DMA_CAPABLE(buff))
+    {
+      if (!SPI_TxBlockDma(sd, buff, 512, &crc)) return FALSE;
+    }
+    else
+#endif
+    {
+      if (!SPI_TxBlock(sd, buff, 512, &crc)) return FALSE;
+    }
+    /* CRC16, checked by the card in CRC mode */
+    crc_bytes[0] = (uint8_t)(crc >> 8);
+    crc_bytes[1] = (uint8_t)crc;
+    SPI_TxBuffer(sd, crc_bytes, 2);
     /* receive response */
     while (i <= 64)
     {
-      resp = SPI_RxByte();
-      /* transmit 0x05 accepted */
-      if ((resp & 0x1F) == 0x05) break;
+      resp = SPI_RxByte(sd);
+      /* data response xxx0sss1: 0x05 accepted, 0x0B CRC error, 0x0D write error */
+      if ((resp & 0x11) == 0x01) break;
       i++;
     }
-    /* recv buffer clear */
-    while (SPI_RxByte() == 0);
   }
   /* transmit 0x05 accepted */
-  if ((resp & 0x1F) == 0x05) return TRUE;
+  if ((resp & 0x1F) == 0x05)
+  {
+    /* don't wait for programming, the next SD_ReadyWait or SD_disk_poll does */
+    SD_BusyBegin(sd);
+    if (token != 0xFD) STAT_ADD(sd, bytes_written, 512);
+    sd->SpiErrors = 0;
+    return TRUE;
+  }
 
+  /* data response 0x0B: the card got a block that fails CRC16 */
+  if ((resp & 0x1F) == 0x0B)
+  {
+    STAT_ADD(sd, crc_errors, 1);
+    sd->CrcErrors++;
+  }
+  STAT_ADD(sd, data_errors, 1);
+  SD_ClockError(sd);
   return FALSE;
 }
 #endif /* _USE_WRITE */
 
 /* transmit command */
-static BYTE SD_SendCmd(BYTE cmd, uint32_t arg)
+static BYTE SD_SendCmd(SD_Drive_t *sd, BYTE cmd, uint32_t arg)
 {
-  uint8_t crc, res;
+  uint8_t frame[6], res;
   /* wait SD ready */
-  if (SD_ReadyWait() != 0xFF) return 0xFF;
-  /* transmit command */
-  SPI_TxByte(cmd);          /* Command */
-  SPI_TxByte((uint8_t)(arg >> 24));   /* Argument[31..24] */
-  SPI_TxByte((uint8_t)(arg >> 16));   /* Argument[23..16] */
-  SPI_TxByte((uint8_t)(arg >> 8));  /* Argument[15..8] */
-  SPI_TxByte((uint8_t)arg);       /* Argument[7..0] */
+  if (SD_ReadyWait(sd) != 0xFF) return 0xFF;
+  frame[0] = cmd;                   /* Command */
+  frame[1] = (uint8_t)(arg >> 24);  /* Argument[31..24] */
+  frame[2] = (uint8_t)(arg >> 16);  /* Argument[23..16] */
+  frame[3] = (uint8_t)(arg >> 8);   /* Argument[15..8] */
+  frame[4] = (uint8_t)arg;          /* Argument[7..0] */
   /* prepare CRC */
-  if(cmd == CMD0) crc = 0x95; /* CRC for CMD0(0) */
-  else if(cmd == CMD8) crc = 0x87;  /* CRC for CMD8(0x1AA) */
-  else crc = 1;
-  /* transmit CRC */
-  SPI_TxByte(crc);
+#if SD_USE_CRC
+  frame[5] = SD_Crc7(frame, 5);     /* checked on every command once CMD59 is on */
+#else
+  if(cmd == CMD0) frame[5] = 0x95;  /* CRC for CMD0(0) */
+  else if(cmd == CMD8) frame[5] = 0x87;  /* CRC for CMD8(0x1AA) */
+  else frame[5] = 1;
+#endif
+  /* transmit command */
+  SPI_TxBuffer(sd, frame, sizeof(frame));
   /* Skip a stuff byte when STOP_TRANSMISSION */
-  if (cmd == CMD12) SPI_RxByte();
+  if (cmd == CMD12) SPI_RxByte(sd);
   /* receive response */
   uint8_t n = 10;
   do {
-    res = SPI_RxByte();
+    res = SPI_RxByte(sd);
   } while ((res & 0x80) && --n);
 
+  /* identification probes with commands that may be refused, count data mode only */
+  if (sd->DataMode && ((res & 0x80) || (res & 0x7E))) STAT_ADD(sd, cmd_errors, 1);
   return res;
 }
 
+/* switch to data mode: fastest clock allowed by CSD TRAN_SPEED */
+static void SD_SetDataClock(SD_Drive_t *sd)
+{
+  uint8_t csd[16];
+  uint32_t max_hz = SD_MAX_CLK_HZ;
+  /* SEND_CSD, still at identification speed */
+  if ((SD_SendCmd(sd, CMD9, 0) == 0) && SD_RxDataBlock(sd, csd, 16))
+  {
+    uint32_t card_hz = SD_TranSpeedHz(csd[3]);
+    if (card_hz && card_hz < max_hz) max_hz = card_hz;
+  }
+  sd->SpiBrMax = SPI_BrForHz(sd, max_hz);
+  sd->SpiFallbacks = 0;
+  SPI_SetBr(sd, sd->SpiBrMax);
+  sd->DataMode = 1;
+}
+
+/* largest power of two dividing n, capped at the f_mkfs erase block limit */
+static uint32_t SD_AlignOf(uint32_t n)
+{
+  n &= ~(n - 1);
+  return (n > 32768) ? 32768 : n;
+}
+
+/* allocation unit from SD_STATUS (ACMD13), erase group from the CSD */
+static void SD_ReadAuInfo(SD_Drive_t *sd)
+{
+  static const uint8_t au_mb[6] = { 8, 12, 16, 24, 32, 64 };	/* AU_SIZE 0xA..0xF */
+  SD_AuInfo_t *au = &sd->Au;
+  uint8_t csd[16], sts[64], code;
+
+  memset(au, 0, sizeof(*au));
+  sd->EraseUnit = 0;
+  if ((SD_SendCmd(sd, CMD9, 0) == 0) && SD_RxDataBlock(sd, csd, 16))
+  {
+    if (sd->CardType & CT_SDC)
+    {
+      /* (SECTOR_SIZE + 1) write blocks of 2^WRITE_BL_LEN bytes */
+      au->erase_sectors = ((((csd[10] & 63) << 1) | (csd[11] >> 7)) + 1)
+                          << ((((csd[12] & 3) << 2) | (csd[13] >> 6)) - 9);
+      /* ERASE_BLK_EN: single blocks, otherwise whole erase sectors only */
+      sd->EraseUnit = (csd[10] & 0x40) ? 1 : au->erase_sectors;
+    }
+    else
+    {
+      /* MMC: (ERASE_GRP_SIZE + 1) * (ERASE_GRP_MULT + 1) */
+      au->erase_sectors = (((csd[10] & 124) >> 2) + 1) * ((((csd[10] & 3) << 3) | (csd[11] >> 5)) + 1);
+    }
+  }
+  /* SD_STATUS: R2 response, then a 64-byte data block */
+  if ((sd->CardType & CT_SD2) && SD_SendCmd(sd, CMD55, 0) <= 1 && SD_SendCmd(sd, CMD13, 0) == 0)
+  {
+    SPI_RxByte(sd);
+    if (SD_RxDataBlock(sd, sts, 64))
+    {
+      code = sts[10] >> 4;
+      if (code >= 1 && code <= 9) au->au_sectors = 16UL << code;
+      else if (code > 9) au->au_sectors = (uint32_t)au_mb[code - 10] << 11;
+      au->erase_size = ((uint16_t)sts[11] << 8) | sts[12];
+      au->erase_timeout_s = sts[13] >> 2;
+      au->erase_offset_s = sts[13] & 3;
+      au->speed_class = sts[8];
+    }
+  }
+  au->align_sectors = SD_AlignOf(au->au_sectors ? au->au_sectors : au->erase_sectors);
+  if (!au->align_sectors) au->align_sectors = 1;
+}
+
+#if SD_STREAM_WRITE
+/* close the open CMD25 session with STOP_TRAN */
+static bool SD_StreamClose(SD_Drive_t *sd)
+{
+  bool ok;
+  if (!sd->WrOpen) return TRUE;
+  sd->WrOpen = 0;
+  SELECT(sd);
+  ok = SD_TxDataBlock(sd, 0, 0xFD);
+  DESELECT(sd);
+  SPI_RxByte(sd);
+  return ok;
+}
+#endif
+
 //-----[ user_diskio.c Functions ]-----
 
 /* initialize SD */
 DSTATUS SD_disk_initialize(BYTE drv)
 {
+  SD_Drive_t *sd;
   uint8_t n, type, ocr[4];
-  /* single drive, drv should be 0 */
-  if(drv) return STA_NOINIT;
+  uint32_t t0;
+  /* drv indexes the drive table */
+  if(drv >= SD_DRIVES) return STA_NOINIT;
+  sd = &SdDrv[drv];
   /* no disk */
-  if(Stat & STA_NODISK) return Stat;
+  if(sd->Stat & STA_NODISK) return sd->Stat;
+  /* cycle counter for the busy accounting */
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  t0 = DWT->CYCCNT;
+  sd->BusyPending = 0;
+
+  /* identification at <= 400kHz */
+  sd->DataMode = 0;
+  sd->CrcOn = 0;
+#if SD_STREAM_WRITE
+  sd->WrOpen = 0;
+#endif
+  SPI_SetBr(sd, SPI_BrForHz(sd, SD_INIT_CLK_HZ));
   /* power on */
-  SD_PowerOn();
+  SD_PowerOn(sd);
   /* slave select */
-  SELECT();
+  SELECT(sd);
   /* check disk type */
   type = 0;
   /* send GO_IDLE_STATE command */
-  if (SD_SendCmd(CMD0, 0) == 1)
+  if (SD_SendCmd(sd, CMD0, 0) == 1)
   {
     /* timeout 1 sec */
-    Timer1 = 1000;
+    sd->Timer1 = 1000;
     /* SDC V2+ accept CMD8 command, http://elm-chan.org/docs/mmc/mmc_e.html */
-    if (SD_SendCmd(CMD8, 0x1AA) == 1)
+    if (SD_SendCmd(sd, CMD8, 0x1AA) == 1)
     {
       /* operation condition register */
       for (n = 0; n < 4; n++)
       {
-        ocr[n] = SPI_RxByte();
+        ocr[n] = SPI_RxByte(sd);
       }
       /* voltage range 2.7-3.6V */
       if (ocr[2] == 0x01 && ocr[3] == 0xAA)
       {
         /* ACMD41 with HCS bit */
         do {
-          if (SD_SendCmd(CMD55, 0) <= 1 && SD_SendCmd(CMD41, 1UL << 30) == 0) break;
-        } while (Timer1);
+          if (SD_SendCmd(sd, CMD55, 0) <= 1 && SD_SendCmd(sd, CMD41, 1UL << 30) == 0) break;
+        } while (sd->Timer1);
 
         /* READ_OCR */
-        if (Timer1 && SD_SendCmd(CMD58, 0) == 0)
+        if (sd->Timer1 && SD_SendCmd(sd, CMD58, 0) == 0)
         {
           /* Check CCS bit */
           for (n = 0; n < 4; n++)
           {
-            ocr[n] = SPI_RxByte();
+            ocr[n] = SPI_RxByte(sd);
           }
 
           /* SDv2 (HC or SC) */
@@ -262,129 +1035,219 @@ DSTATUS SD_disk_initialize(BYTE drv)
     else
     {
       /* SDC V1 or MMC */
-      type = (SD_SendCmd(CMD55, 0) <= 1 && SD_SendCmd(CMD41, 0) <= 1) ? CT_SD1 : CT_MMC;
+      type = (SD_SendCmd(sd, CMD55, 0) <= 1 && SD_SendCmd(sd, CMD41, 0) <= 1) ? CT_SD1 : CT_MMC;
       do
       {
         if (type == CT_SD1)
         {
-          if (SD_SendCmd(CMD55, 0) <= 1 && SD_SendCmd(CMD41, 0) == 0) break; /* ACMD41 */
+          if (SD_SendCmd(sd, CMD55, 0) <= 1 && SD_SendCmd(sd, CMD41, 0) == 0) break; /* ACMD41 */
         }
         else
         {
-          if (SD_SendCmd(CMD1, 0) == 0) break; /* CMD1 */
+          if (SD_SendCmd(sd, CMD1, 0) == 0) break; /* CMD1 */
         }
-      } while (Timer1);
+      } while (sd->Timer1);
       /* SET_BLOCKLEN */
-      if (!Timer1 || SD_SendCmd(CMD16, 512) != 0) type = 0;
+      if (!sd->Timer1 || SD_SendCmd(sd, CMD16, 512) != 0) type = 0;
     }
   }
-  CardType = type;
+  sd->CardType = type;
+  /* data mode clock, then the erase geometry at full speed */
+  if (type)
+  {
+#if SD_USE_CRC
+    /* CRC_ON_OFF: the card checks CRC7/CRC16 from now on, we check its CRC16 */
+    sd->CrcOn = (SD_SendCmd(sd, CMD59, 1) == 0);
+#endif
+    SD_SetDataClock(sd);
+    SD_ReadAuInfo(sd);
+  }
   /* Idle */
-  DESELECT();
-  SPI_RxByte();
+  DESELECT(sd);
+  SPI_RxByte(sd);
   /* Clear STA_NOINIT */
   if (type)
   {
-    Stat &= ~STA_NOINIT;
+    sd->Stat &= ~STA_NOINIT;
   }
   else
   {
     /* Initialization failed */
-    SD_PowerOff();
+    SD_PowerOff(sd);
   }
-  return Stat;
+  SD_StatOp(sd, SD_OP_INIT, t0);
+  return sd->Stat;
 }
 
 /* return disk status */
 DSTATUS SD_disk_status(BYTE drv)
 {
-  if (drv) return STA_NOINIT;
-  return Stat;
+  if (drv >= SD_DRIVES) return STA_NOINIT;
+  return SdDrv[drv].Stat;
 }
 
-/* read sector */
-DRESULT SD_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+/* read blocks, returns the number of blocks not transferred */
+static UINT SD_ReadBlocks(SD_Drive_t *sd, BYTE* buff, DWORD sector, UINT count)
 {
-  /* pdrv should be 0 */
-  if (pdrv || !count) return RES_PARERR;
-
-  /* no disk */
-  if (Stat & STA_NOINIT) return RES_NOTRDY;
+#if SD_STREAM_WRITE
+  /* a read ends the write session */
+  SD_StreamClose(sd);
+#endif
 
   /* convert to byte address */
-  if (!(CardType & CT_SD2)) sector *= 512;
+  if (!(sd->CardType & CT_BLOCK)) sector *= 512;
 
-  SELECT();
+  SELECT(sd);
 
   if (count == 1)
   {
     /* READ_SINGLE_BLOCK */
-    if ((SD_SendCmd(CMD17, sector) == 0) && SD_RxDataBlock(buff, 512)) count = 0;
+    if ((SD_SendCmd(sd, CMD17, sector) == 0) && SD_RxDataBlock(sd, buff, 512)) count = 0;
   }
   else
   {
     /* READ_MULTIPLE_BLOCK */
-    if (SD_SendCmd(CMD18, sector) == 0)
+    if (SD_SendCmd(sd, CMD18, sector) == 0)
     {
       do {
-        if (!SD_RxDataBlock(buff, 512)) break;
+        if (!SD_RxDataBlock(sd, buff, 512)) break;
         buff += 512;
       } while (--count);
 
       /* STOP_TRANSMISSION */
-      SD_SendCmd(CMD12, 0);
+      SD_SendCmd(sd, CMD12, 0);
     }
   }
 
   /* Idle */
-  DESELECT();
-  SPI_RxByte();
+  DESELECT(sd);
+  SPI_RxByte(sd);
 
-  return count ? RES_ERROR : RES_OK;
+  return count;
 }
 
-/* write sector */
-#if _USE_WRITE == 1
-DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+/* read sector */
+DRESULT SD_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
 {
-  /* pdrv should be 0 */
-  if (pdrv || !count) return RES_PARERR;
+  SD_Drive_t *sd;
+  DRESULT res = RES_OK;
+  uint16_t fallbacks;
+  uint32_t t0, crc_errors;
+  uint8_t crc_tries = 0;
+  UINT todo, left;
+
+  /* pdrv indexes the drive table */
+  if (pdrv >= SD_DRIVES || !count) return RES_PARERR;
+  sd = &SdDrv[pdrv];
 
   /* no disk */
-  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
 
-  /* write protection */
-  if (Stat & STA_PROTECT) return RES_WRPRT;
+  /* retry as long as errors keep lowering the clock, CRC errors and RX overruns SD_CRC_RETRIES
+     times in a row */
+  t0 = DWT->CYCCNT;
+  todo = count;
+  for (;;)
+  {
+    fallbacks = sd->SpiFallbacks;
+    crc_errors = sd->CrcErrors + sd->Overruns;
+    left = SD_ReadBlocks(sd, buff, sector, todo);
+    if (left == 0) break;
+    if (left < todo) crc_tries = 0;
+    if (fallbacks == sd->SpiFallbacks &&
+        (crc_errors == sd->CrcErrors + sd->Overruns || ++crc_tries > SD_CRC_RETRIES))
+    {
+      res = RES_ERROR;
+      break;
+    }
+    STAT_ADD(sd, retries, 1);
+    /* resume at the first block not transferred */
+    buff += (todo - left) * 512;
+    sector += todo - left;
+    todo = left;
+  }
+  SD_StatOp(sd, (count == 1) ? SD_OP_RD_SINGLE : SD_OP_RD_MULTI, t0);
+
+  return res;
+}
+
+#if _USE_WRITE == 1
+#if SD_STREAM_WRITE
+/* write blocks, appending to the open CMD25 session when contiguous */
+static UINT SD_WriteBlocks(SD_Drive_t *sd, const BYTE* buff, DWORD sector, UINT count)
+{
+  /* non-contiguous, start over */
+  if (sd->WrOpen && sector != sd->WrNext) SD_StreamClose(sd);
+
+  SELECT(sd);
+
+  if (!sd->WrOpen)
+  {
+    /* pre-erase hint for the blocks of this call (ACMD23) */
+    if (sd->CardType & CT_SDC)
+    {
+      SD_SendCmd(sd, CMD55, 0);
+      SD_SendCmd(sd, CMD23, count);
+    }
+    /* WRITE_MULTIPLE_BLOCK, byte address on non-block cards */
+    if (SD_SendCmd(sd, CMD25, (sd->CardType & CT_BLOCK) ? sector : sector * 512) != 0)
+    {
+      DESELECT(sd);
+      SPI_RxByte(sd);
+      return count;
+    }
+    sd->WrOpen = 1;
+  }
+
+  sd->WrNext = sector + count;
+  do {
+    if (!SD_TxDataBlock(sd, buff, 0xFC)) break;
+    buff += 512;
+  } while (--count);
+  sd->WrTick = HAL_GetTick();
 
+  /* Idle */
+  DESELECT(sd);
+  SPI_RxByte(sd);
+
+  /* failed block ends the session */
+  if (count) SD_StreamClose(sd);
+
+  return count;
+}
+#else
+/* write blocks, returns the number of blocks not transferred */
+static UINT SD_WriteBlocks(SD_Drive_t *sd, const BYTE* buff, DWORD sector, UINT count)
+{
   /* convert to byte address */
-  if (!(CardType & CT_SD2)) sector *= 512;
+  if (!(sd->CardType & CT_BLOCK)) sector *= 512;
 
-  SELECT();
+  SELECT(sd);
 
   if (count == 1)
   {
     /* WRITE_BLOCK */
-    if ((SD_SendCmd(CMD24, sector) == 0) && SD_TxDataBlock(buff, 0xFE))
+    if ((SD_SendCmd(sd, CMD24, sector) == 0) && SD_TxDataBlock(sd, buff, 0xFE))
       count = 0;
   }
   else
   {
     /* WRITE_MULTIPLE_BLOCK */
-    if (CardType & CT_SD1)
+    if (sd->CardType & CT_SDC)
     {
-      SD_SendCmd(CMD55, 0);
-      SD_SendCmd(CMD23, count); /* ACMD23 */
+      SD_SendCmd(sd, CMD55, 0);
+      SD_SendCmd(sd, CMD23, count); /* ACMD23 */
     }
 
-    if (SD_SendCmd(CMD25, sector) == 0)
+    if (SD_SendCmd(sd, CMD25, sector) == 0)
     {
       do {
-        if(!SD_TxDataBlock(buff, 0xFC)) break;
+        if(!SD_TxDataBlock(sd, buff, 0xFC)) break;
         buff += 512;
       } while (--count);
 
       /* STOP_TRAN token */
-      if(!SD_TxDataBlock(0, 0xFD))
+      if(!SD_TxDataBlock(sd, 0, 0xFD))
       {
         count = 1;
       }
@@ -392,38 +1255,187 @@ DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
   }
 
   /* Idle */
-  DESELECT();
-  SPI_RxByte();
+  DESELECT(sd);
+  SPI_RxByte(sd);
 
-  return count ? RES_ERROR : RES_OK;
+  return count;
+}
+#endif /* SD_STREAM_WRITE */
+
+/* CMD38 busy limit for n sectors, from the SD_STATUS erase timing when given */
+static uint16_t SD_EraseTimeout(SD_Drive_t *sd, DWORD n)
+{
+  SD_AuInfo_t *au = &sd->Au;
+  uint32_t ms = SD_ERASE_TIMEOUT_MS;
+  if (au->au_sectors && au->erase_size && au->erase_timeout_s)
+  {
+    /* ERASE_TIMEOUT / ERASE_SIZE per AU, plus ERASE_OFFSET, 1 s margin */
+    ms = ((uint32_t)au->erase_timeout_s * ((n + au->au_sectors - 1) / au->au_sectors) / au->erase_size
+          + au->erase_offset_s + 1) * 1000u;
+  }
+  return (ms > 0xFFFF) ? 0xFFFF : (uint16_t)ms;
+}
+
+/* erase [start, end], shrunk to whole erase units so neighbours survive */
+static bool SD_EraseBlocks(SD_Drive_t *sd, DWORD start, DWORD end)
+{
+  DWORD unit = sd->EraseUnit, stop, last;
+  uint8_t res = 0xFF;
+
+  /* MMC erase groups use CMD35/36, not supported */
+  if (!unit || !(sd->CardType & CT_SDC) || end < start) return FALSE;
+  start = (start + unit - 1) / unit * unit;
+  stop = (end + 1) / unit * unit;
+
+  while (start < stop && res == 0xFF)
+  {
+    last = (stop - start > SD_ERASE_MAX_SECTORS) ? start + SD_ERASE_MAX_SECTORS - 1 : stop - 1;
+    SELECT(sd);
+    /* ERASE_WR_BLK_START/END, byte address on non-block cards */
+    if (SD_SendCmd(sd, CMD32, (sd->CardType & CT_BLOCK) ? start : start * 512) == 0 &&
+        SD_SendCmd(sd, CMD33, (sd->CardType & CT_BLOCK) ? last : last * 512) == 0 &&
+        SD_SendCmd(sd, CMD38, 0) == 0)
+    {
+      /* R1b, busy until the range is erased */
+      sd->Timer2 = SD_EraseTimeout(sd, last - start + 1);
+      do {
+        res = SPI_RxByte(sd);
+      } while (res != 0xFF && sd->Timer2);
+    }
+    else
+    {
+      res = 0;
+    }
+    DESELECT(sd);
+    SPI_RxByte(sd);
+    start = last + 1;
+  }
+  return res == 0xFF;
+}
+
+/* write sector */
+DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+  SD_Drive_t *sd;
+  DRESULT res = RES_OK;
+  uint16_t fallbacks;
+  uint32_t t0, crc_errors;
+  uint8_t crc_tries = 0;
+  UINT todo, left;
+
+  /* pdrv indexes the drive table */
+  if (pdrv >= SD_DRIVES || !count) return RES_PARERR;
+  sd = &SdDrv[pdrv];
+
+  /* no disk */
+  if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
+
+  /* write protection */
+  if (sd->Stat & STA_PROTECT) return RES_WRPRT;
+
+  /* retry as long as errors keep lowering the clock, CRC errors SD_CRC_RETRIES times in a row */
+  t0 = DWT->CYCCNT;
+  todo = count;
+  for (;;)
+  {
+    fallbacks = sd->SpiFallbacks;
+    crc_errors = sd->CrcErrors;
+    left = SD_WriteBlocks(sd, buff, sector, todo);
+    if (left == 0) break;
+    if (left < todo) crc_tries = 0;
+    if (fallbacks == sd->SpiFallbacks && (crc_errors == sd->CrcErrors || ++crc_tries > SD_CRC_RETRIES))
+    {
+      res = RES_ERROR;
+      break;
+    }
+    STAT_ADD(sd, retries, 1);
+    /* resume at the first block not transferred */
+    buff += (todo - left) * 512;
+    sector += todo - left;
+    todo = left;
+  }
+  SD_StatOp(sd, (count == 1) ? SD_OP_WR_SINGLE : SD_OP_WR_MULTI, t0);
+
+  return res;
 }
 #endif /* _USE_WRITE */
 
+/* driver specific ioctl codes */
+static DRESULT SD_InfoIoctl(SD_Drive_t *sd, BYTE ctrl, void *buff)
+{
+  uint32_t cyc_us = SystemCoreClock / 1000000u;
+
+  switch (ctrl)
+  {
+  case SD_GET_SPI_CLOCK:
+  {
+    SD_SpiClock_t *clk = buff;
+    clk->divider = (uint16_t)(2u << sd->SpiBr);
+    clk->hz = SPI_PclkHz(sd) / clk->divider;
+    clk->max_hz = SPI_PclkHz(sd) / (2u << sd->SpiBrMax);
+    clk->fallbacks = sd->SpiFallbacks;
+    return RES_OK;
+  }
+#if SD_USE_STATS
+  case SD_GET_STATS:
+  case SD_GET_STATS_CLEAR:
+    memcpy(buff, &sd->Stats, sizeof(SD_Stats_t));
+    if (ctrl == SD_GET_STATS_CLEAR) memset(&sd->Stats, 0, sizeof(SD_Stats_t));
+    return RES_OK;
+#endif
+  case SD_GET_BUSY_STATS:
+  {
+    SD_BusyStats_t *bs = buff;
+    bs->blocks = sd->BusyBlocks;
+    bs->stalls = sd->BusyStalls;
+    bs->hidden_us = sd->BusyHidden / cyc_us;
+    bs->exposed_us = sd->BusyExposed / cyc_us;
+    return RES_OK;
+  }
+  case SD_GET_AU_INFO:
+    if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
+    memcpy(buff, &sd->Au, sizeof(SD_AuInfo_t));
+    return RES_OK;
+  default:
+    return RES_PARERR;
+  }
+}
+
 /* ioctl */
 DRESULT SD_disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
 {
+  SD_Drive_t *sd;
   DRESULT res;
   uint8_t n, csd[16], *ptr = buff;
   WORD csize;
 
-  /* pdrv should be 0 */
-  if (drv) return RES_PARERR;
+  /* pdrv indexes the drive table */
+  if (drv >= SD_DRIVES) return RES_PARERR;
+  sd = &SdDrv[drv];
   res = RES_ERROR;
 
+  /* driver counters, no bus traffic */
+  if (ctrl >= SD_GET_SPI_CLOCK) return SD_InfoIoctl(sd, ctrl, buff);
+
+#if SD_STREAM_WRITE
+  /* any control request ends the write session, CTRL_SYNC reports its result */
+  if (!SD_StreamClose(sd) && ctrl == CTRL_SYNC) return RES_ERROR;
+#endif
+
   if (ctrl == CTRL_POWER)
   {
     switch (*ptr)
     {
     case 0:
-      SD_PowerOff();    /* Power Off */
+      SD_PowerOff(sd);    /* Power Off */
       res = RES_OK;
       break;
     case 1:
-      SD_PowerOn();   /* Power On */
+      SD_PowerOn(sd);   /* Power On */
       res = RES_OK;
       break;
     case 2:
-      *(ptr + 1) = SD_CheckPower();
+      *(ptr + 1) = SD_CheckPower(sd);
       res = RES_OK;   /* Power Check */
       break;
     default:
@@ -433,15 +1445,26 @@ DRESULT SD_disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
   else
   {
     /* no disk */
-    if (Stat & STA_NOINIT){
+    if (sd->Stat & STA_NOINIT){
     	return RES_NOTRDY;
     }
-    SELECT();
+#if _USE_WRITE == 1
+    /* DWORD[2]: first and last sector of the freed area */
+    if (ctrl == CTRL_TRIM)
+    {
+      uint32_t t0 = DWT->CYCCNT;
+      if (sd->Stat & STA_PROTECT) return RES_WRPRT;
+      if (SD_EraseBlocks(sd, ((DWORD*) buff)[0], ((DWORD*) buff)[1])) res = RES_OK;
+      SD_StatOp(sd, SD_OP_ERASE, t0);
+      return res;
+    }
+#endif
+    SELECT(sd);
     switch (ctrl)
     {
     case GET_SECTOR_COUNT:
       /* SEND_CSD */
-      if ((SD_SendCmd(CMD9, 0) == 0) && SD_RxDataBlock(csd, 16))
+      if ((SD_SendCmd(sd, CMD9, 0) == 0) && SD_RxDataBlock(sd, csd, 16))
       {
         if ((csd[0] >> 6) == 1)
         {
@@ -463,32 +1486,72 @@ DRESULT SD_disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
       *(WORD*) buff = 512;
       res = RES_OK;
       break;
+    case GET_BLOCK_SIZE:
+      /* f_mkfs aligns the data area to this many sectors */
+      *(DWORD*) buff = sd->Au.align_sectors;
+      res = RES_OK;
+      break;
     case CTRL_SYNC:
-      if (SD_ReadyWait() == 0xFF) res = RES_OK;
+      if (SD_ReadyWait(sd) == 0xFF) res = RES_OK;
       break;
     case MMC_GET_CSD:
       /* SEND_CSD */
-      if (SD_SendCmd(CMD9, 0) == 0 && SD_RxDataBlock(ptr, 16)) res = RES_OK;
+      if (SD_SendCmd(sd, CMD9, 0) == 0 && SD_RxDataBlock(sd, ptr, 16)) res = RES_OK;
       break;
     case MMC_GET_CID:
       /* SEND_CID */
-      if (SD_SendCmd(CMD10, 0) == 0 && SD_RxDataBlock(ptr, 16)) res = RES_OK;
+      if (SD_SendCmd(sd, CMD10, 0) == 0 && SD_RxDataBlock(sd, ptr, 16)) res = RES_OK;
       break;
     case MMC_GET_OCR:
       /* READ_OCR */
-      if (SD_SendCmd(CMD58, 0) == 0)
+      if (SD_SendCmd(sd, CMD58, 0) == 0)
       {
         for (n = 0; n < 4; n++)
         {
-          *ptr++ = SPI_RxByte();
+          *ptr++ = SPI_RxByte(sd);
         }
         res = RES_OK;
       }
+      break;
     default:
       res = RES_PARERR;
     }
-    DESELECT();
-    SPI_RxByte();
+    DESELECT(sd);
+    SPI_RxByte(sd);
   }
   return res;
 }
+
+/* background service, call from the main loop */
+void SD_disk_poll(BYTE drv)
+{
+  SD_Drive_t *sd;
+  if (drv >= SD_DRIVES) return;
+  sd = &SdDrv[drv];
+  if (sd->Stat & STA_NOINIT) return;
+#if SD_STREAM_WRITE
+  /* close a write session nobody appended to for a while */
+  if (sd->WrOpen && (HAL_GetTick() - sd->WrTick) >= SD_STREAM_IDLE_MS) SD_StreamClose(sd);
+#endif
+  /* retire a finished write-behind without blocking */
+  if (sd->BusyPending)
+  {
+    uint32_t t0 = DWT->CYCCNT;
+    SELECT(sd);
+    if (SPI_RxByte(sd) == 0xFF) SD_BusyEnd(sd, t0);
+    DESELECT(sd);
+    SPI_RxByte(sd);
+  }
+}
+
+/* 1 ms tick for every drive, call from SysTick_Handler */
+void SD_disk_timerproc(void)
+{
+  for (int i = 0; i < SD_DRIVES; i++)
+  {
+    if (SdDrv[i].Timer1 > 0) SdDrv[i].Timer1--;
+    if (SdDrv[i].Timer2 > 0) SdDrv[i].Timer2--;
+  }
+}
+
+#endif /* !SD_USE_SDIO */
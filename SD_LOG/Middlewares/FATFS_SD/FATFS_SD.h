@@ -12,12 +12,70 @@
 
 //-----[ SD Card SPI Interface Cfgs ]-----
 #include "stm32f4xx_hal.h"
+#include "diskio.h"
+#ifndef SD_USE_SDIO
+#define SD_USE_SDIO 		0	/* 1: drive 0 on the 4-bit SDIO slot (FATFS_SDIO.c), SPI driver left out */
+#endif
+#ifndef SD_DRIVES
+#if SD_USE_SDIO
+#define SD_DRIVES 			1	/* the SDIO slot only, drive 1's SPI driver is left out */
+#else
+#define SD_DRIVES 			2	/* cards, one per SPI bus, pdrv 0..SD_DRIVES-1 */
+#endif
+#endif
+#if SD_USE_SDIO && SD_DRIVES > 1
+#error "SD_USE_SDIO serves drive 0 only, the SPI driver for drive 1 is not built: SD_DRIVES must be 1"
+#endif
+/* drive 0 */
 extern SPI_HandleTypeDef 	hspi1;
 #define HSPI_SDCARD 		&hspi1
 #define SD_CS_PORT 			GPIOG
 #define SD_CS_PIN 			GPIO_PIN_13
+/* drive 1 */
+extern SPI_HandleTypeDef 	hspi2;
+#define HSPI_SDCARD2 		&hspi2
+#define SD_CS_PORT2 		GPIOB
+#define SD_CS_PIN2 			GPIO_PIN_12
 #define SPI_TIMEOUT 		100
 
+//-----[ Data Block Transfer Cfgs ]-----
+#ifndef SD_USE_DMA
+#define SD_USE_DMA 			1	/* 1: 512-byte blocks over SPI DMA, 0: polled byte loop */
+#endif
+#define SD_DMA_TIMEOUT 		200	/* ms allowed for one DMA block */
+#ifndef SD_SPI_PUMP
+#define SD_SPI_PUMP 		1	/* 1: polled transfers drive SPI DR directly, 0: through HAL_SPI_TransmitReceive */
+#endif
+
+//-----[ Streaming Write Cfgs ]-----
+#ifndef SD_STREAM_WRITE
+#define SD_STREAM_WRITE 	1	/* 1: keep CMD25 open across LBA-contiguous writes */
+#endif
+#define SD_STREAM_IDLE_MS 	100	/* SD_disk_poll closes a session idle this long */
+
+//-----[ SPI Clock Cfgs ]-----
+#define SD_INIT_CLK_HZ 		400000		/* CMD0/CMD8/ACMD41 identification limit */
+#ifndef SD_MAX_CLK_HZ
+#define SD_MAX_CLK_HZ 		25000000	/* data mode ceiling, further capped by CSD TRAN_SPEED */
+#endif
+#define SD_CLK_ERR_LIMIT 	2			/* consecutive data errors before slowing down */
+
+//-----[ Data Integrity Cfgs ]-----
+#ifndef SD_USE_CRC
+#define SD_USE_CRC 			1	/* 1: CMD59 CRC mode, CRC7 on commands, CRC16 on every data block */
+#endif
+#define SD_CRC_RETRIES 		3	/* transfers repeated after CRC errors at the same clock */
+
+//-----[ Statistics Cfgs ]-----
+#ifndef SD_USE_STATS
+#define SD_USE_STATS 		1	/* 1: DWT latency histograms and counters (SD_GET_STATS) */
+#endif
+#define SD_STAT_BUCKETS 	16	/* log2(us) buckets, the last one is open ended */
+
+//-----[ Erase Cfgs ]-----
+#define SD_ERASE_TIMEOUT_MS 	30000	/* CMD38 busy limit when SD_STATUS gives no ERASE_TIMEOUT */
+#define SD_ERASE_MAX_SECTORS 	65536	/* sectors per CMD38, bounds a single busy wait */
+
 //-----[ MMC/SDC Commands ]-----
 #define CMD0     (0x40+0)     	/* GO_IDLE_STATE */
 #define CMD1     (0x40+1)     	/* SEND_OP_COND */
@@ -25,15 +83,20 @@ extern SPI_HandleTypeDef 	hspi1;
 #define CMD9     (0x40+9)     	/* SEND_CSD */
 #define CMD10    (0x40+10)    	/* SEND_CID */
 #define CMD12    (0x40+12)    	/* STOP_TRANSMISSION */
+#define CMD13    (0x40+13)    	/* SEND_STATUS, SD_STATUS (ACMD) */
 #define CMD16    (0x40+16)    	/* SET_BLOCKLEN */
 #define CMD17    (0x40+17)    	/* READ_SINGLE_BLOCK */
 #define CMD18    (0x40+18)    	/* READ_MULTIPLE_BLOCK */
 #define CMD23    (0x40+23)    	/* SET_BLOCK_COUNT */
 #define CMD24    (0x40+24)    	/* WRITE_BLOCK */
 #define CMD25    (0x40+25)    	/* WRITE_MULTIPLE_BLOCK */
+#define CMD32    (0x40+32)    	/* ERASE_WR_BLK_START */
+#define CMD33    (0x40+33)    	/* ERASE_WR_BLK_END */
+#define CMD38    (0x40+38)    	/* ERASE */
 #define CMD41    (0x40+41)    	/* SEND_OP_COND (ACMD) */
 #define CMD55    (0x40+55)    	/* APP_CMD */
 #define CMD58    (0x40+58)    	/* READ_OCR */
+#define CMD59    (0x40+59)    	/* CRC_ON_OFF */
 
 //-----[ MMC Card Types (MMC_GET_TYPE) ]-----
 #define CT_MMC		0x01	/* MMC ver 3 */
@@ -42,11 +105,82 @@ extern SPI_HandleTypeDef 	hspi1;
 #define CT_SDC		0x06	/* SD */
 #define CT_BLOCK	0x08	/* Block addressing */
 
+//-----[ Driver Specific ioctl Codes ]-----
+#define SD_GET_SPI_CLOCK	50	/* Get SPI clock state (SD_SpiClock_t) */
+
+typedef struct {
+  uint32_t hz;			/* current SCK frequency */
+  uint32_t max_hz;		/* data mode limit (CSD TRAN_SPEED, SD_MAX_CLK_HZ) */
+  uint16_t divider;		/* current PCLK divider, 2..256 */
+  uint16_t fallbacks;	/* times the clock was lowered after data errors */
+} SD_SpiClock_t;
+
+#define SD_GET_BUSY_STATS	51	/* Get write-behind busy accounting (SD_BusyStats_t) */
+
+typedef struct {
+  uint32_t blocks;		/* blocks/stop tokens left to program in the background */
+  uint32_t stalls;		/* times a command had to wait for programming */
+  uint64_t hidden_us;	/* busy time overlapped with other work (upper bound) */
+  uint64_t exposed_us;	/* busy time spent waiting in the driver */
+} SD_BusyStats_t;
+
+#define SD_GET_STATS		52	/* Get latency histograms and counters (SD_Stats_t) */
+#define SD_GET_STATS_CLEAR	53	/* Same, then clear them */
+
+/* operation classes of SD_Stats_t.op[] */
+enum {
+  SD_OP_RD_SINGLE,		/* SD_disk_read, 1 sector */
+  SD_OP_RD_MULTI,		/* SD_disk_read, several sectors */
+  SD_OP_WR_SINGLE,		/* SD_disk_write, 1 sector */
+  SD_OP_WR_MULTI,		/* SD_disk_write, several sectors */
+  SD_OP_BUSY,			/* SD_ReadyWait that found the card busy */
+  SD_OP_INIT,			/* SD_disk_initialize */
+  SD_OP_ERASE,			/* CTRL_TRIM */
+  SD_OP_CLASSES
+};
+
+typedef struct {
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint32_t hist[SD_STAT_BUCKETS];	/* [0]: 0..1 us, [n]: 2^n..2^(n+1)-1 us */
+} SD_OpStats_t;
+
+typedef struct {
+  SD_OpStats_t op[SD_OP_CLASSES];
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint32_t cmd_errors;	/* R1 error bits or no response after identification */
+  uint32_t data_errors;	/* bad data token or rejected data block */
+  uint32_t dma_errors;	/* DMA timeout or HAL SPI error */
+  uint32_t crc_errors;	/* data blocks with a bad CRC16, either direction */
+  uint32_t retries;		/* transfers repeated after a clock fallback or CRC error */
+  uint64_t crc_bytes;	/* bytes through the CRC16 table (DMA builds) */
+  uint64_t crc_cycles;	/* DWT cycles spent on them */
+} SD_Stats_t;
+
+#define SD_GET_AU_INFO		54	/* Get allocation unit and erase parameters (SD_AuInfo_t) */
+
+typedef struct {
+  uint32_t au_sectors;		/* SD status AU_SIZE, 0 if the card does not report one */
+  uint32_t erase_sectors;	/* CSD erase sector/group size */
+  uint32_t align_sectors;	/* GET_BLOCK_SIZE answer: power of two <= 32768 dividing the AU */
+  uint16_t erase_size;		/* AUs erased within erase_timeout_s (0: not supported) */
+  uint8_t erase_timeout_s;
+  uint8_t erase_offset_s;
+  uint8_t speed_class;		/* SD status SPEED_CLASS code */
+} SD_AuInfo_t;
+
 //-----[ Prototypes For All User External Functions ]-----
-//DSTATUS SD_disk_initialize(BYTE pdrv);
-//DSTATUS SD_disk_status(BYTE pdrv);
-//DRESULT SD_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
-//DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
-//DRESULT SD_disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
+DSTATUS SD_disk_initialize(BYTE pdrv);
+DSTATUS SD_disk_status(BYTE pdrv);
+DRESULT SD_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
+DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
+DRESULT SD_disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
+void SD_disk_poll(BYTE pdrv);
+void SD_disk_timerproc(void);
+
+/* called repeatedly while a DMA block is in flight, override to run other work */
+void SD_IdleHook(void);
 
 #endif /* FATFS_SD_H_ */
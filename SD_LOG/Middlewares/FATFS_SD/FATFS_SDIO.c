@@ -0,0 +1,916 @@
+/*
+ * File: FATFS_SDIO.c
+ * Driver Name: [[ FATFS_SD SDIO ]]
+ * SW Layer:   MIDWARE
+ * -------------------------------------------
+ * SD bus mode backend: 4-bit wide bus, DMA2 Stream6 data path and the
+ * CMD6 high-speed switch. Same SD_disk_* entry points, ioctls and
+ * statistics as the SPI driver, registers only go through SDIO_RD/SDIO_WR
+ * so the command/data state machine also runs against Tools/sdsim.
+ */
+#include "main.h"
+#include "diskio.h"
+#include "FATFS_SD.h"
+#include "FATFS_SDIO.h"
+#include <string.h>
+
+#if SD_USE_SDIO
+
+#define TRUE  1
+#define FALSE 0
+#define bool BYTE
+
+/* the SD card in the SDIO slot */
+typedef struct {
+  volatile DSTATUS Stat;		/* Disk Status */
+  volatile uint16_t Timer1, Timer2;	/* 1ms Timer Counters, see SD_disk_timerproc */
+  uint8_t CardType;				/* Type 0:MMC, 1:SDC, 2:Block addressing */
+  uint8_t PowerFlag;			/* Power flag */
+  uint16_t Rca;					/* relative card address from CMD3 */
+  uint8_t Width4;				/* 4-bit bus selected (ACMD6) */
+  uint8_t HighSpeed;			/* CMD6 high-speed function active */
+  uint8_t Bypass;				/* SDIO_CK = SDIOCLK, divider bypassed */
+  uint8_t ClkDiv;				/* CLKDIV, SDIO_CK = SDIOCLK / (ClkDiv + 2) */
+  uint32_t MaxHz;				/* bus clock chosen at initialization */
+  uint8_t ClkErrors;			/* consecutive data errors at the current clock */
+  uint16_t Fallbacks;			/* times the clock was lowered */
+  uint8_t DataMode;				/* identification done, error fallback armed */
+  uint8_t Csd[16], Cid[16], Ocr[4];	/* read once, the card is selected afterwards */
+  SD_AuInfo_t Au;				/* erase geometry, read at initialization */
+  uint32_t EraseUnit;			/* CMD38 granularity in sectors, 0: no erase */
+
+  uint8_t BusyPending;			/* card left programming, not yet seen ready */
+  uint32_t BusyMark;			/* DWT cycle count when programming started */
+  uint32_t BusyBlocks;			/* write-behinds started */
+  uint32_t BusyStalls;			/* times a caller had to wait for the card */
+  uint64_t BusyHidden;			/* busy cycles overlapped with other work */
+  uint64_t BusyExposed;			/* busy cycles spent in SDIO_ReadyWait */
+
+#if SD_USE_STATS
+  SD_Stats_t Stats;				/* SD_GET_STATS */
+#endif
+} SDIO_Drive_t;
+
+static SDIO_Drive_t SdioDrv[SDIO_DRIVES] = {
+  { .Stat = STA_NOINIT },
+};
+
+#if SD_USE_STATS
+#define STAT_ADD(sd, f, n)	((sd)->Stats.f += (n))
+#else
+#define STAT_ADD(sd, f, n)	((void)0)
+#endif
+
+/* identification clock, SDIOCLK / (CLKDIV + 2) <= 400 kHz */
+#define SDIO_INIT_CLKDIV	((SDIO_KERNEL_HZ + SD_INIT_CLK_HZ - 1) / SD_INIT_CLK_HZ - 2)
+/* DLEN is 25 bits wide */
+#define SDIO_MAX_BLOCKS		32768
+
+/* response handling, SDIO_Cmd flags */
+#define RESP_NONE	0
+#define RESP_SHORT	SDIO_CMD_WAITRESP_0
+#define RESP_LONG	SDIO_CMD_WAITRESP
+#define RESP_NOCRC	0x10000		/* R3: no CRC, CCRCFAIL is the normal outcome */
+#define RESP_R1		0x20000		/* R1/R1b: check the echoed index and the card status */
+
+/* card status (R1) */
+#define R1_ERRORS			0xFDFFE008UL	/* error and exception bits */
+#define R1_READY_FOR_DATA	0x00000100UL
+#define R1_STATE(r)			(((r) >> 9) & 15)
+#define R1_STATE_TRAN		4
+
+#define SDIO_CMD_FLAGS	(SDIO_STA_CCRCFAIL | SDIO_STA_CTIMEOUT | SDIO_STA_CMDREND | SDIO_STA_CMDSENT)
+#define SDIO_DATA_ERRORS	(SDIO_STA_DCRCFAIL | SDIO_STA_DTIMEOUT | SDIO_STA_TXUNDERR | SDIO_STA_RXOVERR | SDIO_STA_STBITERR)
+#define SDIO_DATA_FLAGS	(SDIO_DATA_ERRORS | SDIO_STA_DATAEND | SDIO_STA_DBCKEND)
+
+/* word aligned and outside CCM RAM (0x1000xxxx), which DMA2 cannot reach */
+#define SDIO_DMA_CAPABLE(p)	((((uint32_t)(uintptr_t)(p)) & 3u) == 0 && \
+                             (((uint32_t)(uintptr_t)(p)) & 0xFFFF0000UL) != 0x10000000UL)
+
+static uint32_t SdioBounce[128];	/* one sector for buffers DMA cannot use */
+
+static bool SDIO_ReadyWait(SDIO_Drive_t *sd, uint16_t ms);
+
+//-----[ DMA Functions ]-----
+
+#ifndef SDIO_MOCK
+/* arm the stream, SDIO is the flow controller so the length comes from DLEN */
+static void SDIO_DmaStart(const void *buff, uint32_t len, bool tx)
+{
+  DMA_Stream_TypeDef *s = SDIO_DMA_STREAM;
+
+  s->CR &= ~DMA_SxCR_EN;
+  while (s->CR & DMA_SxCR_EN);
+  SDIO_DMA_IFCR = SDIO_DMA_FLAGS;
+  s->PAR = (uint32_t)(uintptr_t)&SDIO->FIFO;
+  s->M0AR = (uint32_t)(uintptr_t)buff;
+  s->NDTR = len / 4;
+  /* FIFO mode, full threshold: 4-word bursts towards the SDIO FIFO, single words to memory */
+  s->FCR = DMA_SxFCR_DMDIS | DMA_SxFCR_FTH;
+  s->CR = (SDIO_DMA_CHANNEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PBURST_0 | DMA_SxCR_PL |
+          DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_MINC | DMA_SxCR_PFCTRL |
+          (tx ? DMA_SxCR_DIR_0 : 0);
+  s->CR |= DMA_SxCR_EN;
+}
+
+/* 0: in flight, 1: complete, 2: bus or FIFO error */
+static uint8_t SDIO_DmaStatus(void)
+{
+  uint32_t isr = SDIO_DMA_ISR;
+  if (isr & SDIO_DMA_ERRORS) return 2;
+  return (isr & DMA_HISR_TCIF6) ? 1 : 0;
+}
+
+/* release the stream */
+static void SDIO_DmaStop(void)
+{
+  SDIO_DMA_STREAM->CR &= ~DMA_SxCR_EN;
+  while (SDIO_DMA_STREAM->CR & DMA_SxCR_EN);
+  SDIO_DMA_IFCR = SDIO_DMA_FLAGS;
+}
+#else
+#define SDIO_DmaStart(buff, len, tx)	SdioMock_DmaStart(buff, len, tx)
+#define SDIO_DmaStatus()				SdioMock_DmaStatus()
+#define SDIO_DmaStop()					SdioMock_DmaStop()
+#endif
+
+//-----[ SDIO Functions ]-----
+
+/* SDIO_CK in Hz */
+static uint32_t SDIO_BusHz(SDIO_Drive_t *sd)
+{
+  return sd->Bypass ? SDIO_KERNEL_HZ : SDIO_KERNEL_HZ / (sd->ClkDiv + 2u);
+}
+
+/* program CLKCR from the current clock and bus width */
+static void SDIO_SetClock(SDIO_Drive_t *sd)
+{
+  uint32_t clkcr = SDIO_CLKCR_CLKEN;
+  if (sd->Width4) clkcr |= SDIO_CLKCR_WIDBUS_0;
+  clkcr |= sd->Bypass ? SDIO_CLKCR_BYPASS : sd->ClkDiv;
+  SDIO_WR(CLKCR, clkcr);
+  sd->ClkErrors = 0;
+}
+
+/* data CRC/timeout error, halve the clock after SD_CLK_ERR_LIMIT in a row */
+static void SDIO_ClockError(SDIO_Drive_t *sd)
+{
+  if (!sd->DataMode || ++sd->ClkErrors < SD_CLK_ERR_LIMIT) return;
+  if (sd->Bypass)
+  {
+    /* 48 MHz -> 24 MHz */
+    sd->Bypass = 0;
+    sd->ClkDiv = 0;
+  }
+  else if (sd->ClkDiv < 127)
+  {
+    /* SDIOCLK / (d + 2) -> SDIOCLK / (2d + 4) */
+    sd->ClkDiv = sd->ClkDiv * 2 + 2;
+  }
+  else return;
+  SDIO_SetClock(sd);
+  sd->Fallbacks++;
+}
+
+/* power up the interface at identification speed */
+static void SDIO_PowerOn(SDIO_Drive_t *sd)
+{
+  SDIO_WR(POWER, SDIO_POWER_PWRCTRL);
+  sd->Width4 = 0;
+  sd->Bypass = 0;
+  sd->ClkDiv = SDIO_INIT_CLKDIV;
+  SDIO_SetClock(sd);
+  /* 74+ clocks before the first command */
+  HAL_Delay(2);
+  sd->PowerFlag = 1;
+}
+
+/* power off */
+static void SDIO_PowerOff(SDIO_Drive_t *sd)
+{
+  SDIO_WR(CLKCR, 0);
+  SDIO_WR(POWER, 0);
+  sd->PowerFlag = 0;
+}
+
+/* send a command, 0 or the failing STA / card status bits */
+static uint32_t SDIO_Cmd(SDIO_Drive_t *sd, BYTE cmd, uint32_t arg, uint32_t resp)
+{
+  uint32_t sta, done, err, t0, limit;
+
+  /* write-behind: only SEND_STATUS is accepted while the card programs */
+  if (sd->BusyPending && cmd != CMD13) SDIO_ReadyWait(sd, 500);
+
+  /* ACMD<n> = APP_CMD + CMD<n>, addressed to the selected card */
+  if (cmd & ACMD)
+  {
+    err = SDIO_Cmd(sd, CMD55, (uint32_t)sd->Rca << 16, RESP_SHORT | RESP_R1);
+    if (err) return err;
+  }
+
+  SDIO_WR(ICR, SDIO_CMD_FLAGS);
+  SDIO_WR(ARG, arg);
+  SDIO_WR(CMD, (cmd & SDIO_CMD_CMDINDEX) | (resp & SDIO_CMD_WAITRESP) | SDIO_CMD_CPSMEN);
+
+  /* the CPSM times out by itself after 64 clocks, this only guards a dead clock */
+  done = (resp & SDIO_CMD_WAITRESP) ? (SDIO_STA_CMDREND | SDIO_STA_CCRCFAIL | SDIO_STA_CTIMEOUT) : SDIO_STA_CMDSENT;
+  t0 = DWT->CYCCNT;
+  limit = SDIO_CMD_TIMEOUT_MS * (SystemCoreClock / 1000u);
+  do {
+    sta = SDIO_RD(STA);
+  } while (!(sta & done) && (DWT->CYCCNT - t0) < limit);
+  SDIO_WR(ICR, SDIO_CMD_FLAGS);
+
+  if (!(sta & done)) err = SDIO_STA_CTIMEOUT;
+  else if ((resp & RESP_NOCRC) && !(sta & SDIO_STA_CTIMEOUT)) err = 0;
+  else err = sta & (SDIO_STA_CCRCFAIL | SDIO_STA_CTIMEOUT);
+
+  if (!err && (resp & RESP_R1))
+  {
+    if ((SDIO_RD(RESPCMD) & SDIO_CMD_CMDINDEX) != (cmd & SDIO_CMD_CMDINDEX)) err = SDIO_STA_CCRCFAIL;
+    else err = SDIO_RD(RESP1) & R1_ERRORS;
+  }
+  if (err && sd->DataMode) STAT_ADD(sd, cmd_errors, 1);
+  return err;
+}
+
+/* 128-bit R2 response (CID/CSD), most significant byte first */
+static void SDIO_ReadLong(uint8_t *reg)
+{
+  uint32_t r[4];
+  r[0] = SDIO_RD(RESP1);
+  r[1] = SDIO_RD(RESP2);
+  r[2] = SDIO_RD(RESP3);
+  r[3] = SDIO_RD(RESP4);
+  for (int i = 0; i < 16; i++) reg[i] = (uint8_t)(r[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* block or byte address of a sector */
+static uint32_t SDIO_Addr(SDIO_Drive_t *sd, DWORD sector)
+{
+  return (sd->CardType & CT_BLOCK) ? sector : sector * 512;
+}
+
+//-----[ Statistics Functions ]-----
+
+/* account one operation of class op that started at DWT cycle t0 */
+static void SD_StatOp(SDIO_Drive_t *sd, uint8_t op, uint32_t t0)
+{
+#if SD_USE_STATS
+  SD_OpStats_t *st = &sd->Stats.op[op];
+  uint32_t us = (DWT->CYCCNT - t0) / (SystemCoreClock / 1000000u);
+  uint8_t b = us ? 31 - __builtin_clz(us) : 0;
+  if (b >= SD_STAT_BUCKETS) b = SD_STAT_BUCKETS - 1;
+  st->hist[b]++;
+  st->count++;
+  st->total_us += us;
+  if (us > st->max_us) st->max_us = us;
+#else
+  (void)sd; (void)op; (void)t0;
+#endif
+}
+
+//-----[ SD Card Functions ]-----
+
+/* default idle hook, does nothing */
+__weak void SD_IdleHook(void)
+{
+}
+
+/* card programming started, check it later */
+static void SD_BusyBegin(SDIO_Drive_t *sd)
+{
+  sd->BusyPending = 1;
+  sd->BusyMark = DWT->CYCCNT;
+  sd->BusyBlocks++;
+}
+
+/* card seen ready at t0: the time since SD_BusyBegin ran behind the caller */
+static void SD_BusyEnd(SDIO_Drive_t *sd, uint32_t t0)
+{
+  sd->BusyHidden += t0 - sd->BusyMark;
+  sd->BusyPending = 0;
+}
+
+/* one SEND_STATUS: ready for data in transfer state */
+static bool SDIO_CardReady(SDIO_Drive_t *sd)
+{
+  uint32_t st;
+  if (SDIO_Cmd(sd, CMD13, (uint32_t)sd->Rca << 16, RESP_SHORT | RESP_R1) != 0) return FALSE;
+  st = SDIO_RD(RESP1);
+  return (st & R1_READY_FOR_DATA) && R1_STATE(st) == R1_STATE_TRAN;
+}
+
+/* poll SEND_STATUS until the card is back in transfer state */
+static bool SDIO_WaitTran(SDIO_Drive_t *sd, uint16_t ms)
+{
+  sd->Timer2 = ms;
+  for (;;)
+  {
+    if (SDIO_CardReady(sd)) return TRUE;
+    if (!sd->Timer2) return FALSE;
+  }
+}
+
+/* wait SD ready, D0 busy is not visible to the CPSM so the card is asked */
+static bool SDIO_ReadyWait(SDIO_Drive_t *sd, uint16_t ms)
+{
+  uint32_t t0 = DWT->CYCCNT;
+  bool ready;
+
+  ready = SDIO_CardReady(sd);
+  if (!ready)
+  {
+    ready = SDIO_WaitTran(sd, ms);
+    SD_StatOp(sd, SD_OP_BUSY, t0);
+    /* write-behind caught up with us */
+    if (sd->BusyPending)
+    {
+      sd->BusyExposed += DWT->CYCCNT - t0;
+      sd->BusyStalls++;
+    }
+  }
+  if (sd->BusyPending && ready) SD_BusyEnd(sd, t0);
+  return ready;
+}
+
+/* data command: DMA for sectors, FIFO reads for the short status registers */
+static bool SDIO_Transfer(SDIO_Drive_t *sd, BYTE cmd, uint32_t arg, void *buff, uint32_t len, bool rx)
+{
+  bool dma = (len >= 512), ok, started;
+  uint32_t dctrl, sta = 0, n = 0, w;
+
+  /* the data timer would run while an earlier write is still programming */
+  if (sd->BusyPending) SDIO_ReadyWait(sd, 500);
+
+  /* 512-byte blocks, or one block of the register size (8/64 bytes) */
+  dctrl = ((dma ? 9u : 31u - __builtin_clz(len)) << SDIO_DCTRL_DBLOCKSIZE_Pos) | SDIO_DCTRL_DTEN;
+  if (rx) dctrl |= SDIO_DCTRL_DTDIR;
+  if (dma) dctrl |= SDIO_DCTRL_DMAEN;
+
+  SDIO_WR(DCTRL, 0);
+  SDIO_WR(ICR, SDIO_DATA_FLAGS);
+  SDIO_WR(DTIMER, SDIO_BusHz(sd) / 1000u * SDIO_DATA_TIMEOUT_MS);
+  SDIO_WR(DLEN, len);
+  if (dma) SDIO_DmaStart(buff, len, !rx);
+
+  /* reads: DPSM armed first so the start bit is not missed, writes: after the response */
+  if (rx) SDIO_WR(DCTRL, dctrl);
+  ok = started = (SDIO_Cmd(sd, cmd, arg, RESP_SHORT | RESP_R1) == 0);
+  if (ok && !rx) SDIO_WR(DCTRL, dctrl);
+
+  /* DATAEND or an error, the CPU is handed to SD_IdleHook meanwhile */
+  sd->Timer1 = SDIO_DATA_TIMEOUT_MS;
+  while (ok)
+  {
+    sta = SDIO_RD(STA);
+    if (!dma && (sta & SDIO_STA_RXDAVL))
+    {
+      w = SDIO_RD(FIFO);
+      if (n < len) memcpy((uint8_t*)buff + n, &w, 4);
+      n += 4;
+      continue;
+    }
+    if (sta & (SDIO_STA_DATAEND | SDIO_DATA_ERRORS)) break;
+    if (!sd->Timer1)
+    {
+      sta = SDIO_STA_DTIMEOUT;
+      break;
+    }
+    if (dma) SD_IdleHook();
+  }
+
+  if (dma)
+  {
+    /* receive: the stream still drains its FIFO after DATAEND */
+    if (ok && !(sta & SDIO_DATA_ERRORS))
+    {
+      while (SDIO_DmaStatus() == 0 && sd->Timer1);
+      if (SDIO_DmaStatus() != 1)
+      {
+        STAT_ADD(sd, dma_errors, 1);
+        ok = FALSE;
+      }
+    }
+    SDIO_DmaStop();
+  }
+  SDIO_WR(DCTRL, 0);
+  SDIO_WR(ICR, SDIO_DATA_FLAGS);
+
+  if (sta & SDIO_DATA_ERRORS)
+  {
+    STAT_ADD(sd, data_errors, 1);
+    /* SD bus mode always carries CRC16, checked by the DPSM */
+    if (sta & SDIO_STA_DCRCFAIL) STAT_ADD(sd, crc_errors, 1);
+    SDIO_ClockError(sd);
+    ok = FALSE;
+  }
+  else if (ok)
+  {
+    sd->ClkErrors = 0;
+    if (dma && rx) STAT_ADD(sd, bytes_read, len);
+    if (dma && !rx) STAT_ADD(sd, bytes_written, len);
+  }
+
+  if (started)
+  {
+    /* open-ended transfers end with STOP_TRANSMISSION, also after an error;
+       a read may run past the last sector, so only the write result counts */
+    if ((cmd == CMD18 || cmd == CMD25) &&
+        SDIO_Cmd(sd, CMD12, 0, RESP_SHORT | RESP_R1) != 0 && !rx) ok = FALSE;
+    /* writes leave the card programming, retired by the next command or SD_disk_poll */
+    if (!rx) SD_BusyBegin(sd);
+  }
+  return ok;
+}
+
+/* read blocks, DMA straight into buff when it can, else sector by sector */
+static bool SDIO_ReadBlocks(SDIO_Drive_t *sd, BYTE *buff, DWORD sector, UINT count)
+{
+  UINT n;
+  BYTE *dst;
+
+  while (count)
+  {
+    dst = SDIO_DMA_CAPABLE(buff) ? buff : (BYTE*)SdioBounce;
+    n = (dst != buff) ? 1 : (count > SDIO_MAX_BLOCKS) ? SDIO_MAX_BLOCKS : count;
+    /* READ_SINGLE_BLOCK / READ_MULTIPLE_BLOCK */
+    if (!SDIO_Transfer(sd, (n == 1) ? CMD17 : CMD18, SDIO_Addr(sd, sector), dst, n * 512, TRUE)) return FALSE;
+    if (dst != buff) memcpy(buff, dst, 512);
+    buff += n * 512;
+    sector += n;
+    count -= n;
+  }
+  return TRUE;
+}
+
+#if _USE_WRITE == 1
+/* write blocks, DMA straight from buff when it can, else sector by sector */
+static bool SDIO_WriteBlocks(SDIO_Drive_t *sd, const BYTE *buff, DWORD sector, UINT count)
+{
+  UINT n;
+  const BYTE *src;
+
+  while (count)
+  {
+    src = SDIO_DMA_CAPABLE(buff) ? buff : (const BYTE*)SdioBounce;
+    n = (src != buff) ? 1 : (count > SDIO_MAX_BLOCKS) ? SDIO_MAX_BLOCKS : count;
+    if (src != buff) memcpy(SdioBounce, buff, 512);
+    /* pre-erase hint for the blocks of this call (ACMD23) */
+    if (n > 1 && (sd->CardType & CT_SDC)) SDIO_Cmd(sd, ACMD23, n, RESP_SHORT | RESP_R1);
+    /* WRITE_BLOCK / WRITE_MULTIPLE_BLOCK */
+    if (!SDIO_Transfer(sd, (n == 1) ? CMD24 : CMD25, SDIO_Addr(sd, sector), (void*)src, n * 512, FALSE)) return FALSE;
+    buff += n * 512;
+    sector += n;
+    count -= n;
+  }
+  return TRUE;
+}
+
+/* CMD38 busy limit for n sectors, from the SD_STATUS erase timing when given */
+static uint16_t SDIO_EraseTimeout(SDIO_Drive_t *sd, DWORD n)
+{
+  SD_AuInfo_t *au = &sd->Au;
+  uint32_t ms = SD_ERASE_TIMEOUT_MS;
+  if (au->au_sectors && au->erase_size && au->erase_timeout_s)
+  {
+    /* ERASE_TIMEOUT / ERASE_SIZE per AU, plus ERASE_OFFSET, 1 s margin */
+    ms = ((uint32_t)au->erase_timeout_s * ((n + au->au_sectors - 1) / au->au_sectors) / au->erase_size
+          + au->erase_offset_s + 1) * 1000u;
+  }
+  return (ms > 0xFFFF) ? 0xFFFF : (uint16_t)ms;
+}
+
+/* erase [start, end], shrunk to whole erase units so neighbours survive */
+static bool SDIO_EraseBlocks(SDIO_Drive_t *sd, DWORD start, DWORD end)
+{
+  DWORD unit = sd->EraseUnit, stop, last;
+  bool ok = TRUE;
+
+  if (!unit || !(sd->CardType & CT_SDC) || end < start) return FALSE;
+  start = (start + unit - 1) / unit * unit;
+  stop = (end + 1) / unit * unit;
+
+  while (start < stop && ok)
+  {
+    last = (stop - start > SD_ERASE_MAX_SECTORS) ? start + SD_ERASE_MAX_SECTORS - 1 : stop - 1;
+    /* ERASE_WR_BLK_START/END, ERASE, then R1b busy until the range is erased */
+    ok = SDIO_Cmd(sd, CMD32, SDIO_Addr(sd, start), RESP_SHORT | RESP_R1) == 0 &&
+         SDIO_Cmd(sd, CMD33, SDIO_Addr(sd, last), RESP_SHORT | RESP_R1) == 0 &&
+         SDIO_Cmd(sd, CMD38, 0, RESP_SHORT | RESP_R1) == 0 &&
+         SDIO_WaitTran(sd, SDIO_EraseTimeout(sd, last - start + 1));
+    start = last + 1;
+  }
+  return ok;
+}
+#endif /* _USE_WRITE */
+
+/* largest power of two dividing n, capped at the f_mkfs erase block limit */
+static uint32_t SD_AlignOf(uint32_t n)
+{
+  n &= ~(n - 1);
+  return (n > 32768) ? 32768 : n;
+}
+
+/* allocation unit from SD_STATUS (ACMD13), erase sector from the CSD */
+static void SDIO_ReadAuInfo(SDIO_Drive_t *sd)
+{
+  static const uint8_t au_mb[6] = { 8, 12, 16, 24, 32, 64 };	/* AU_SIZE 0xA..0xF */
+  SD_AuInfo_t *au = &sd->Au;
+  const uint8_t *csd = sd->Csd;
+  uint8_t sts[64], code;
+
+  memset(au, 0, sizeof(*au));
+  /* (SECTOR_SIZE + 1) write blocks of 2^WRITE_BL_LEN bytes */
+  au->erase_sectors = ((((csd[10] & 63) << 1) | (csd[11] >> 7)) + 1)
+                      << ((((csd[12] & 3) << 2) | (csd[13] >> 6)) - 9);
+  /* ERASE_BLK_EN: single blocks, otherwise whole erase sectors only */
+  sd->EraseUnit = (csd[10] & 0x40) ? 1 : au->erase_sectors;
+
+  /* SD_STATUS, a 64-byte block on the data lines */
+  if ((sd->CardType & CT_SD2) && SDIO_Transfer(sd, ACMD13, 0, sts, 64, TRUE))
+  {
+    code = sts[10] >> 4;
+    if (code >= 1 && code <= 9) au->au_sectors = 16UL << code;
+    else if (code > 9) au->au_sectors = (uint32_t)au_mb[code - 10] << 11;
+    au->erase_size = ((uint16_t)sts[11] << 8) | sts[12];
+    au->erase_timeout_s = sts[13] >> 2;
+    au->erase_offset_s = sts[13] & 3;
+    au->speed_class = sts[8];
+  }
+  au->align_sectors = SD_AlignOf(au->au_sectors ? au->au_sectors : au->erase_sectors);
+  if (!au->align_sectors) au->align_sectors = 1;
+}
+
+/* ALL_SEND_CID, SEND_RELATIVE_ADDR, SEND_CSD, SELECT_CARD: stand-by to transfer state */
+static bool SDIO_Identify(SDIO_Drive_t *sd)
+{
+  if (SDIO_Cmd(sd, CMD2, 0, RESP_LONG) != 0) return FALSE;
+  SDIO_ReadLong(sd->Cid);
+  /* R6: published RCA in the upper half */
+  if (SDIO_Cmd(sd, CMD3, 0, RESP_SHORT) != 0) return FALSE;
+  sd->Rca = (uint16_t)(SDIO_RD(RESP1) >> 16);
+  if (SDIO_Cmd(sd, CMD9, (uint32_t)sd->Rca << 16, RESP_LONG) != 0) return FALSE;
+  SDIO_ReadLong(sd->Csd);
+  if (SDIO_Cmd(sd, CMD7, (uint32_t)sd->Rca << 16, RESP_SHORT | RESP_R1) != 0) return FALSE;
+  /* SET_BLOCKLEN, block addressed cards are fixed at 512 */
+  if (!(sd->CardType & CT_BLOCK) && SDIO_Cmd(sd, CMD16, 512, RESP_SHORT | RESP_R1) != 0) return FALSE;
+  return TRUE;
+}
+
+/* data mode: 24 MHz default speed, then 4-bit bus and high speed when both sides allow */
+static void SDIO_SetBus(SDIO_Drive_t *sd)
+{
+  uint8_t scr[8];
+#if SDIO_HIGH_SPEED
+  uint8_t sw[64];
+#endif
+
+  sd->HighSpeed = 0;
+  sd->Bypass = 0;
+  sd->ClkDiv = 0;
+  SDIO_SetClock(sd);
+  sd->Fallbacks = 0;
+  sd->DataMode = 1;
+
+  /* SEND_SCR: SD_SPEC in byte 0, SD_BUS_WIDTHS in byte 1 */
+  if (SDIO_Transfer(sd, ACMD51, 0, scr, 8, TRUE))
+  {
+#if SDIO_BUS_4BIT
+    /* SET_BUS_WIDTH 4 bit */
+    if ((scr[1] & 0x04) && SDIO_Cmd(sd, ACMD6, 2, RESP_SHORT | RESP_R1) == 0)
+    {
+      sd->Width4 = 1;
+      SDIO_SetClock(sd);
+    }
+#endif
+#if SDIO_HIGH_SPEED
+    /* SWITCH_FUNC needs SD 1.10+ and command class 10: check group 1, then set it */
+    if ((scr[0] & 0x0F) >= 1 && (sd->Csd[4] & 0x40) &&
+        SDIO_Transfer(sd, CMD6, 0x00FFFFF1, sw, 64, TRUE) && (sw[13] & 0x02) &&
+        SDIO_Transfer(sd, CMD6, 0x80FFFFF1, sw, 64, TRUE) && (sw[16] & 0x0F) == 1)
+    {
+      /* up to 50 MHz, the closest SDIOCLK gives is 48 MHz undivided */
+      sd->HighSpeed = 1;
+      sd->Bypass = 1;
+      SDIO_SetClock(sd);
+    }
+#endif
+  }
+  sd->MaxHz = SDIO_BusHz(sd);
+}
+
+//-----[ user_diskio.c Functions ]-----
+
+/* initialize SD */
+DSTATUS SD_disk_initialize(BYTE drv)
+{
+  SDIO_Drive_t *sd;
+  uint32_t t0, hcs = 0, ocr = 0;
+  uint8_t type = 0;
+
+  /* drv indexes the drive table */
+  if (drv >= SDIO_DRIVES) return STA_NOINIT;
+  sd = &SdioDrv[drv];
+  /* no disk */
+  if (sd->Stat & STA_NODISK) return sd->Stat;
+  /* cycle counter for the busy accounting and the CPSM guard */
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  t0 = DWT->CYCCNT;
+  sd->BusyPending = 0;
+  sd->DataMode = 0;
+  sd->Rca = 0;
+
+  /* identification at <= 400kHz on D0 only */
+  SDIO_PowerOn(sd);
+  /* GO_IDLE_STATE, no response in SD mode */
+  SDIO_Cmd(sd, CMD0, 0, RESP_NONE);
+  /* timeout 1 sec */
+  sd->Timer1 = 1000;
+  /* SDC V2+ echo the SEND_IF_COND check pattern */
+  if (SDIO_Cmd(sd, CMD8, 0x1AA, RESP_SHORT) == 0 && (SDIO_RD(RESP1) & 0xFFF) == 0x1AA) hcs = 1UL << 30;
+  /* ACMD41 until the card leaves busy, MMC does not answer it and is not supported here */
+  do {
+    if (SDIO_Cmd(sd, ACMD41, 0x80100000UL | hcs, RESP_SHORT | RESP_NOCRC) != 0) break;
+    ocr = SDIO_RD(RESP1);
+  } while (!(ocr & 0x80000000UL) && sd->Timer1);
+
+  if (ocr & 0x80000000UL)
+  {
+    /* CCS bit: SDv2 block addressed */
+    type = hcs ? ((ocr & 0x40000000UL) ? CT_SD2 | CT_BLOCK : CT_SD2) : CT_SD1;
+    sd->Ocr[0] = (uint8_t)(ocr >> 24);
+    sd->Ocr[1] = (uint8_t)(ocr >> 16);
+    sd->Ocr[2] = (uint8_t)(ocr >> 8);
+    sd->Ocr[3] = (uint8_t)ocr;
+  }
+  sd->CardType = type;
+  if (type && !SDIO_Identify(sd)) sd->CardType = type = 0;
+
+  /* data mode clock and bus, then the erase geometry at full speed */
+  if (type)
+  {
+    SDIO_SetBus(sd);
+    SDIO_ReadAuInfo(sd);
+    /* Clear STA_NOINIT */
+    sd->Stat &= ~STA_NOINIT;
+  }
+  else
+  {
+    /* Initialization failed */
+    SDIO_PowerOff(sd);
+  }
+  SD_StatOp(sd, SD_OP_INIT, t0);
+  return sd->Stat;
+}
+
+/* return disk status */
+DSTATUS SD_disk_status(BYTE drv)
+{
+  if (drv >= SDIO_DRIVES) return STA_NOINIT;
+  return SdioDrv[drv].Stat;
+}
+
+/* read sector */
+DRESULT SD_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+  SDIO_Drive_t *sd;
+  DRESULT res = RES_OK;
+  uint16_t fallbacks;
+  uint32_t t0;
+
+  /* pdrv indexes the drive table */
+  if (pdrv >= SDIO_DRIVES || !count) return RES_PARERR;
+  sd = &SdioDrv[pdrv];
+
+  /* no disk */
+  if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
+
+  /* retry as long as errors keep lowering the clock */
+  t0 = DWT->CYCCNT;
+  for (;;)
+  {
+    fallbacks = sd->Fallbacks;
+    if (SDIO_ReadBlocks(sd, buff, sector, count)) break;
+    if (fallbacks == sd->Fallbacks)
+    {
+      res = RES_ERROR;
+      break;
+    }
+    STAT_ADD(sd, retries, 1);
+  }
+  SD_StatOp(sd, (count == 1) ? SD_OP_RD_SINGLE : SD_OP_RD_MULTI, t0);
+
+  return res;
+}
+
+#if _USE_WRITE == 1
+/* write sector */
+DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+  SDIO_Drive_t *sd;
+  DRESULT res = RES_OK;
+  uint16_t fallbacks;
+  uint32_t t0;
+
+  /* pdrv indexes the drive table */
+  if (pdrv >= SDIO_DRIVES || !count) return RES_PARERR;
+  sd = &SdioDrv[pdrv];
+
+  /* no disk */
+  if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
+
+  /* write protection */
+  if (sd->Stat & STA_PROTECT) return RES_WRPRT;
+
+  /* retry as long as errors keep lowering the clock */
+  t0 = DWT->CYCCNT;
+  for (;;)
+  {
+    fallbacks = sd->Fallbacks;
+    if (SDIO_WriteBlocks(sd, buff, sector, count)) break;
+    if (fallbacks == sd->Fallbacks)
+    {
+      res = RES_ERROR;
+      break;
+    }
+    STAT_ADD(sd, retries, 1);
+  }
+  SD_StatOp(sd, (count == 1) ? SD_OP_WR_SINGLE : SD_OP_WR_MULTI, t0);
+
+  return res;
+}
+#endif /* _USE_WRITE */
+
+/* driver specific ioctl codes */
+static DRESULT SD_InfoIoctl(SDIO_Drive_t *sd, BYTE ctrl, void *buff)
+{
+  uint32_t cyc_us = SystemCoreClock / 1000000u;
+
+  switch (ctrl)
+  {
+  case SD_GET_SPI_CLOCK:
+  {
+    /* SDIO_CK, divider of SDIOCLK */
+    SD_SpiClock_t *clk = buff;
+    clk->divider = sd->Bypass ? 1 : (uint16_t)(sd->ClkDiv + 2u);
+    clk->hz = SDIO_BusHz(sd);
+    clk->max_hz = sd->MaxHz;
+    clk->fallbacks = sd->Fallbacks;
+    return RES_OK;
+  }
+#if SD_USE_STATS
+  case SD_GET_STATS:
+  case SD_GET_STATS_CLEAR:
+    memcpy(buff, &sd->Stats, sizeof(SD_Stats_t));
+    if (ctrl == SD_GET_STATS_CLEAR) memset(&sd->Stats, 0, sizeof(SD_Stats_t));
+    return RES_OK;
+#endif
+  case SD_GET_BUSY_STATS:
+  {
+    SD_BusyStats_t *bs = buff;
+    bs->blocks = sd->BusyBlocks;
+    bs->stalls = sd->BusyStalls;
+    bs->hidden_us = sd->BusyHidden / cyc_us;
+    bs->exposed_us = sd->BusyExposed / cyc_us;
+    return RES_OK;
+  }
+  case SD_GET_AU_INFO:
+    if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
+    memcpy(buff, &sd->Au, sizeof(SD_AuInfo_t));
+    return RES_OK;
+  default:
+    return RES_PARERR;
+  }
+}
+
+/* ioctl */
+DRESULT SD_disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+  SDIO_Drive_t *sd;
+  DRESULT res;
+  uint8_t n, *csd, *ptr = buff;
+  WORD csize;
+
+  /* drv indexes the drive table */
+  if (drv >= SDIO_DRIVES) return RES_PARERR;
+  sd = &SdioDrv[drv];
+  res = RES_ERROR;
+
+  /* driver counters, no bus traffic */
+  if (ctrl >= SD_GET_SPI_CLOCK) return SD_InfoIoctl(sd, ctrl, buff);
+
+  if (ctrl == CTRL_POWER)
+  {
+    switch (*ptr)
+    {
+    case 0:
+      SDIO_PowerOff(sd);    /* Power Off */
+      res = RES_OK;
+      break;
+    case 1:
+      SDIO_PowerOn(sd);   /* Power On */
+      res = RES_OK;
+      break;
+    case 2:
+      *(ptr + 1) = sd->PowerFlag;
+      res = RES_OK;   /* Power Check */
+      break;
+    default:
+      res = RES_PARERR;
+    }
+    return res;
+  }
+
+  /* no disk */
+  if (sd->Stat & STA_NOINIT) return RES_NOTRDY;
+
+  switch (ctrl)
+  {
+  case GET_SECTOR_COUNT:
+    /* from the CSD read at initialization */
+    csd = sd->Csd;
+    if ((csd[0] >> 6) == 1)
+    {
+      /* SDC V2 */
+      csize = csd[9] + ((WORD) csd[8] << 8) + 1;
+      *(DWORD*) buff = (DWORD) csize << 10;
+    }
+    else
+    {
+      /* SDC V1 */
+      n = (csd[5] & 15) + ((csd[10] & 128) >> 7) + ((csd[9] & 3) << 1) + 2;
+      csize = (csd[8] >> 6) + ((WORD) csd[7] << 2) + ((WORD) (csd[6] & 3) << 10) + 1;
+      *(DWORD*) buff = (DWORD) csize << (n - 9);
+    }
+    res = RES_OK;
+    break;
+  case GET_SECTOR_SIZE:
+    *(WORD*) buff = 512;
+    res = RES_OK;
+    break;
+  case GET_BLOCK_SIZE:
+    /* f_mkfs aligns the data area to this many sectors */
+    *(DWORD*) buff = sd->Au.align_sectors;
+    res = RES_OK;
+    break;
+  case CTRL_SYNC:
+    if (!sd->BusyPending || SDIO_ReadyWait(sd, 500)) res = RES_OK;
+    break;
+#if _USE_WRITE == 1
+  case CTRL_TRIM:
+  {
+    /* DWORD[2]: first and last sector of the freed area */
+    uint32_t t0 = DWT->CYCCNT;
+    if (sd->Stat & STA_PROTECT) return RES_WRPRT;
+    if (sd->BusyPending) SDIO_ReadyWait(sd, 500);
+    if (SDIO_EraseBlocks(sd, ((DWORD*) buff)[0], ((DWORD*) buff)[1])) res = RES_OK;
+    SD_StatOp(sd, SD_OP_ERASE, t0);
+    break;
+  }
+#endif
+  case MMC_GET_CSD:
+    memcpy(ptr, sd->Csd, 16);
+    res = RES_OK;
+    break;
+  case MMC_GET_CID:
+    memcpy(ptr, sd->Cid, 16);
+    res = RES_OK;
+    break;
+  case MMC_GET_OCR:
+    memcpy(ptr, sd->Ocr, 4);
+    res = RES_OK;
+    break;
+  default:
+    res = RES_PARERR;
+  }
+  return res;
+}
+
+/* background service, call from the main loop */
+void SD_disk_poll(BYTE drv)
+{
+  SDIO_Drive_t *sd;
+  if (drv >= SDIO_DRIVES) return;
+  sd = &SdioDrv[drv];
+  if (sd->Stat & STA_NOINIT) return;
+  /* retire a finished write-behind with one SEND_STATUS */
+  if (sd->BusyPending)
+  {
+    uint32_t t0 = DWT->CYCCNT;
+    if (SDIO_CardReady(sd)) SD_BusyEnd(sd, t0);
+  }
+}
+
+/* 1 ms tick, call from SysTick_Handler */
+void SD_disk_timerproc(void)
+{
+  for (int i = 0; i < SDIO_DRIVES; i++)
+  {
+    if (SdioDrv[i].Timer1 > 0) SdioDrv[i].Timer1--;
+    if (SdioDrv[i].Timer2 > 0) SdioDrv[i].Timer2--;
+  }
+}
+
+#endif /* SD_USE_SDIO */
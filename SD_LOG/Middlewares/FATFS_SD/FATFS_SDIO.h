@@ -0,0 +1,58 @@
+/*
+ * File: FATFS_SDIO.h
+ * Driver Name: [[ FATFS_SD SDIO ]]
+ * SW Layer:   MIDWARE
+ * -------------------------------------------
+ * 4-bit SDIO + DMA backend behind the FATFS_SD.h SD_disk_* interface.
+ * Build with SD_USE_SDIO=1 (FATFS_SD.h) to serve drive 0 from the SDIO
+ * slot instead of SPI1; the SPI driver is compiled out then, and with it
+ * drive 1 (SD_DRIVES is 1).
+ */
+#ifndef FATFS_SDIO_H_
+#define FATFS_SDIO_H_
+
+#include "FATFS_SD.h"
+
+//-----[ SDIO Interface Cfgs ]-----
+#define SDIO_DRIVES 		1			/* one slot: PC8..PC11 D0..D3, PC12 CK, PD2 CMD */
+#define SDIO_KERNEL_HZ 		48000000	/* SDIOCLK = PLL48CK (PLLQ = 7) */
+#ifndef SDIO_BUS_4BIT
+#define SDIO_BUS_4BIT 		1	/* 1: ACMD6 to 4-bit when the SCR allows it */
+#endif
+#ifndef SDIO_HIGH_SPEED
+#define SDIO_HIGH_SPEED 	1	/* 1: CMD6 high-speed switch, clock divider bypassed (48 MHz) */
+#endif
+#define SDIO_CMD_TIMEOUT_MS 	10		/* CPSM stuck, the hardware timeout is 64 clocks */
+#define SDIO_DATA_TIMEOUT_MS 	500		/* one transfer incl. card busy between blocks */
+
+//-----[ SDIO DMA Cfgs ]-----
+/* DMA2 Stream3 is taken by SPI1 TX, SDIO uses Stream6 for both directions */
+#define SDIO_DMA_STREAM 	DMA2_Stream6
+#define SDIO_DMA_CHANNEL 	4
+#define SDIO_DMA_ISR 		(DMA2->HISR)
+#define SDIO_DMA_IFCR 		(DMA2->HIFCR)
+#define SDIO_DMA_FLAGS 		(DMA_HISR_TCIF6 | DMA_HISR_HTIF6 | DMA_HISR_TEIF6 | DMA_HISR_DMEIF6 | DMA_HISR_FEIF6)
+#define SDIO_DMA_ERRORS 	(DMA_HISR_TEIF6 | DMA_HISR_DMEIF6)
+
+//-----[ Register Access ]-----
+#ifdef SDIO_MOCK
+/* host build: every access goes through the card model in Tools/sdsim */
+#include "sdio_mock.h"
+#else
+#define SDIO_RD(reg) 			(SDIO->reg)
+#define SDIO_WR(reg, val) 		(SDIO->reg = (val))
+#endif
+
+//-----[ SD Bus Mode Commands ]-----
+#define ACMD     0x80         	/* flag: APP_CMD (CMD55) sent first */
+#define CMD2     (0x40+2)     	/* ALL_SEND_CID */
+#define CMD3     (0x40+3)     	/* SEND_RELATIVE_ADDR */
+#define CMD6     (0x40+6)     	/* SWITCH_FUNC */
+#define CMD7     (0x40+7)     	/* SELECT/DESELECT_CARD */
+#define ACMD6    (ACMD+0x40+6) 	/* SET_BUS_WIDTH */
+#define ACMD13   (ACMD+CMD13) 	/* SD_STATUS */
+#define ACMD23   (ACMD+CMD23) 	/* SET_WR_BLK_ERASE_COUNT */
+#define ACMD41   (ACMD+CMD41) 	/* SD_SEND_OP_COND */
+#define ACMD51   (ACMD+0x40+51)	/* SEND_SCR */
+
+#endif /* FATFS_SDIO_H_ */
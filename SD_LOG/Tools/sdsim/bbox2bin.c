@@ -0,0 +1,135 @@
+/**
+  ******************************************************************************
+  * @file           : bbox2bin.c
+  * @brief          : Extract the black-box ring from a card image
+  ******************************************************************************
+  * @note           : Reads the MBR of a card image (dd of the whole card, or
+  *                   sd_bench -o), finds the SDFMT_RAW_TYPE partition and
+  *                   checks every block of the ring (sd_bbox.h). The valid
+  *                   payloads are written oldest first as one binary log for
+  *                   binlog2csv. When the ring has wrapped past the start of
+  *                   the oldest session, the preamble kept in block 0 (sync
+  *                   frame and schemas) goes first; the decoder then drops
+  *                   the cut segment at the join and resyncs at the next
+  *                   sync frame.
+  *
+  *                   usage: bbox2bin IMAGE [OUT]     (stdout without OUT)
+  ******************************************************************************
+  */
+
+#include "sd_bbox.h"
+#include "sd_binlog.h"
+#include "sd_format.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t Get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t Get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+/* seq of a valid block of a ring of n blocks, 0 if it is not one */
+static uint32_t Check(const uint8_t *p, uint32_t magic, uint32_t n)
+{
+    if (Get32(&p[0]) != magic || Get32(&p[8]) != n || Get16(&p[16]) > BBOX_PAYLOAD) return 0;
+    if (BINLOG_Crc16(0xFFFFu, p, BBOX_BLOCK - 2u) != Get16(&p[BBOX_BLOCK - 2u])) return 0;
+    return Get32(&p[4]);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t mbr[BBOX_BLOCK], *ring, *p;
+    uint32_t base = 0, size = 0, n, seq, head = 0, first, valid = 0, bad = 0, missing = 0, sessions = 0;
+    uint64_t bytes = 0;
+    int preamble = 0;
+    FILE *f, *out;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s IMAGE [OUT]\n", argv[0]);
+        return 2;
+    }
+    if (!(f = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(mbr, 1, sizeof(mbr), f) != sizeof(mbr) || mbr[SDFMT_MBR_SIG] != 0x55 || mbr[SDFMT_MBR_SIG + 1] != 0xAA) {
+        fprintf(stderr, "%s: no MBR\n", argv[1]);
+        return 1;
+    }
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *pte = &mbr[SDFMT_MBR_TABLE + SDFMT_PTE_SIZE * i];
+        if (pte[SDFMT_PTE_TYPE] == SDFMT_RAW_TYPE) {
+            base = Get32(&pte[SDFMT_PTE_START]);
+            size = Get32(&pte[SDFMT_PTE_SECTORS]);
+            break;
+        }
+    }
+    if (size < 3) {
+        fprintf(stderr, "%s: no black-box partition (type 0x%02X)\n", argv[1], SDFMT_RAW_TYPE);
+        return 1;
+    }
+    n = size - 1;
+    ring = malloc((size_t)size * BBOX_BLOCK);
+    if (!ring || fseek(f, (long)base * BBOX_BLOCK, SEEK_SET) != 0 ||
+        fread(ring, BBOX_BLOCK, size, f) != size) {
+        fprintf(stderr, "%s: cannot read the partition (LBA %u, %u blocks)\n", argv[1], (unsigned)base,
+                (unsigned)size);
+        return 1;
+    }
+    fclose(f);
+
+    /* every slot: valid and in its place, or bad; erased slots are neither */
+    for (uint32_t i = 0; i < n; i++) {
+        p = ring + (size_t)(i + 1) * BBOX_BLOCK;
+        seq = Check(p, BBOX_MAGIC, n);
+        if (seq && (seq - 1) % n == i) {
+            valid++;
+            if (seq > head) head = seq;
+        } else if (Get32(&p[0]) == BBOX_MAGIC) {
+            bad++;
+        }
+    }
+    if (!head) {
+        fprintf(stderr, "black box empty: %u ring blocks, %u bad\n", (unsigned)n, (unsigned)bad);
+        return 1;
+    }
+
+    out = (argc == 3) ? fopen(argv[2], "wb") : stdout;
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    /* oldest first, the first block of a session starts its stream */
+    first = (head > n) ? head - n + 1 : 1;
+    for (seq = first; seq <= head; seq++) {
+        p = ring + (size_t)((seq - 1) % n + 1) * BBOX_BLOCK;
+        if (Check(p, BBOX_MAGIC, n) != seq) {
+            missing++;
+            continue;
+        }
+        if (!bytes && !(Get16(&p[18]) & BBOX_FLAG_START)) {
+            if (Check(ring, BBOX_HDR_MAGIC, n)) {
+                fwrite(&ring[BBOX_HEAD_SIZE], 1, Get16(&ring[16]), out);
+                preamble = 1;
+            }
+        }
+        if (Get16(&p[18]) & BBOX_FLAG_START) sessions++;
+        fwrite(&p[BBOX_HEAD_SIZE], 1, Get16(&p[16]), out);
+        bytes += Get16(&p[16]);
+    }
+    if (out != stdout) fclose(out);
+
+    fprintf(stderr, "%u ring blocks at LBA %u: %u valid, %u bad; seq %u..%u, %u missing; "
+            "%u session starts; %llu bytes%s\n", (unsigned)n, (unsigned)(base + 1), (unsigned)valid,
+            (unsigned)bad, (unsigned)first, (unsigned)head, (unsigned)missing, (unsigned)sessions,
+            (unsigned long long)bytes, preamble ? " after the preamble from block 0" : "");
+    free(ring);
+    return 0;
+}
@@ -0,0 +1,476 @@
+/**
+  ******************************************************************************
+  * @file           : binlog2csv.c
+  * @brief          : Decode sd_binlog.c log files to CSV
+  ******************************************************************************
+  * @note           : The whole file is read into memory and decoded one sync
+  *                   segment at a time. A segment's rows are only printed once
+  *                   the next sync frame confirms its CRC; after a bad CRC or
+  *                   a record that does not parse, the decoder drops the
+  *                   segment and scans for the next valid sync frame. The
+  *                   last segment of a log that was not closed has no sync
+  *                   after it and is printed unverified unless -s is given.
+  *                   Index records are checked with their segment and
+  *                   skipped; version 1 logs (no index) decode as before.
+  *
+  *                   -b runs the firmware encoder (Core/Src/sd_binlog.c) on
+  *                   synthetic samples and reports encode cost, decode speed
+  *                   and bytes per record against the sprintf CSV line the
+  *                   firmware used to write.
+  ******************************************************************************
+  */
+
+#include "sd_binlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    int defined;
+    char name[32];
+    uint8_t nfields;
+    uint8_t types[BINLOG_MAX_FIELDS];
+    char fields[BINLOG_MAX_FIELDS][32];
+} Schema_t;
+
+typedef struct {
+    Schema_t schema[BINLOG_MAX_SCHEMA + 1];
+    int filter;              // schema id to print, 0 = all
+    const char *filter_name;
+    int strict;
+    FILE *out;
+    char *seg;               // rows of the segment being checked
+    size_t seg_len, seg_cap;
+    uint64_t seg_rows;
+    /* results */
+    uint64_t rows, unverified, dropped_rows;
+    uint64_t segments, bad_segments, resyncs, skipped, indexes;
+} Decoder_t;
+
+static void Usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] FILE      decode FILE to CSV on stdout\n"
+            "       %s -b [options]        encoder/decoder benchmark\n"
+            "  -S NAME    only records of schema NAME, with a header row\n"
+            "  -s         strict: drop the last segment if no sync confirms it\n"
+            "  -n N       benchmark records (default 1000000)\n"
+            "  -e N       benchmark: flip a bit every N bytes before decoding\n", prog, prog);
+}
+
+static double NowSec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//-----[ Output ]-----
+
+static char *SegReserve(Decoder_t *d, size_t n)
+{
+    if (d->seg_len + n > d->seg_cap) {
+        d->seg_cap = (d->seg_len + n) * 2;
+        d->seg = realloc(d->seg, d->seg_cap);
+        if (!d->seg) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    return d->seg + d->seg_len;
+}
+
+static char *PutU64(char *p, uint64_t v)
+{
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10u);
+        v /= 10u;
+    } while (v);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+static char *PutI64(char *p, int64_t v)
+{
+    if (v < 0) {
+        *p++ = '-';
+        return PutU64(p, (uint64_t)0 - (uint64_t)v);
+    }
+    return PutU64(p, (uint64_t)v);
+}
+
+/* segment confirmed (or accepted unverified): print its rows */
+static void SegCommit(Decoder_t *d, int verified)
+{
+    fwrite(d->seg, 1, d->seg_len, d->out);
+    d->rows += d->seg_rows;
+    if (!verified) d->unverified += d->seg_rows;
+    d->seg_len = 0;
+    d->seg_rows = 0;
+}
+
+static void SegDrop(Decoder_t *d)
+{
+    d->dropped_rows += d->seg_rows;
+    d->seg_len = 0;
+    d->seg_rows = 0;
+}
+
+//-----[ Parsing ]-----
+
+static size_t GetVar(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t x = 0;
+    for (size_t i = 0; i < 5 && p + i < end; i++) {
+        x |= (uint32_t)(p[i] & 0x7Fu) << (7 * i);
+        if (!(p[i] & 0x80u)) {
+            *v = x;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* sync frame at p, returns its length (version 1 or 2) or 0 */
+static size_t ParseSync(const uint8_t *p, const uint8_t *end, uint16_t *segcrc, uint32_t *ts)
+{
+    size_t n;
+
+    if (end - p < (long)BINLOG_SYNC_SIZE_V1) return 0;
+    if (p[0] != BINLOG_TAG_SYNC || p[1] != 0xA5u || p[2] != 0x5Au || p[3] != 0xC3u) return 0;
+    if (p[4] == 1u) n = BINLOG_SYNC_SIZE_V1;
+    else if (p[4] == BINLOG_VERSION) n = BINLOG_SYNC_SIZE;
+    else return 0;
+    if (end - p < (long)n || BINLOG_Crc16(0xFFFFu, &p[4], (UINT)n - 6u) != (uint16_t)(p[n - 2] | p[n - 1] << 8)) return 0;
+    *segcrc = (uint16_t)(p[5] | p[6] << 8);
+    *ts = (uint32_t)p[7] | (uint32_t)p[8] << 8 | (uint32_t)p[9] << 16 | (uint32_t)p[10] << 24;
+    return n;
+}
+
+/* index record at p, returns its length or 0 */
+static size_t ParseIndex(Decoder_t *d, const uint8_t *p, const uint8_t *end)
+{
+    size_t n;
+
+    if (end - p < 3) return 0;
+    n = 3u + 8u * ((size_t)p[1] + p[2]);
+    if ((size_t)(end - p) < n) return 0;
+    d->indexes++;
+    return n;
+}
+
+/* schema record at p, returns its length or 0 */
+static size_t ParseSchema(Decoder_t *d, const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *q = p + 3;
+    Schema_t s;
+
+    if (end - p < 3 || p[1] == 0 || p[1] > BINLOG_MAX_SCHEMA || p[2] > BINLOG_MAX_FIELDS) return 0;
+    memset(&s, 0, sizeof(s));
+    s.nfields = p[2];
+    if (end - q < s.nfields) return 0;
+    for (int i = 0; i < s.nfields; i++) {
+        s.types[i] = *q++;
+        if (s.types[i] < BINLOG_U8 || s.types[i] > BINLOG_BYTES) return 0;
+    }
+    for (int i = 0; i <= s.nfields; i++) {
+        const uint8_t *z = memchr(q, 0, (size_t)(end - q));
+        char *dst = i ? s.fields[i - 1] : s.name;
+        if (!z || z - q >= 32) return 0;
+        memcpy(dst, q, (size_t)(z - q) + 1);
+        q = z + 1;
+    }
+    s.defined = 1;
+    d->schema[p[1]] = s;
+    if (d->filter_name && !strcmp(d->filter_name, s.name) && !d->filter) {
+        d->filter = p[1];
+        fprintf(d->out, "ts");
+        for (int i = 0; i < s.nfields; i++) fprintf(d->out, ",%s", s.fields[i]);
+        fprintf(d->out, "\n");
+    }
+    return (size_t)(q - p);
+}
+
+/* data record at p, appends a CSV row, returns its length or 0 */
+static size_t ParseRecord(Decoder_t *d, const uint8_t *p, const uint8_t *end, uint64_t *ts)
+{
+    const Schema_t *s = &d->schema[p[0]];
+    const uint8_t *q = p + 1;
+    uint32_t dt, v, len;
+    size_t n;
+    char *o, *o0;
+    int show = !d->filter || d->filter == p[0];
+
+    if (!s->defined || !(n = GetVar(q, end, &dt))) return 0;
+    q += n;
+    *ts += dt;
+    o = o0 = SegReserve(d, 64 + (size_t)s->nfields * 24 + BINLOG_MAX_RECORD * 2);
+    o = PutU64(o, *ts);
+    if (!d->filter) {
+        *o++ = ',';
+        n = strlen(s->name);
+        memcpy(o, s->name, n);
+        o += n;
+    }
+    for (int i = 0; i < s->nfields; i++) {
+        *o++ = ',';
+        switch (s->types[i]) {
+        case BINLOG_U8:  if (end - q < 1) return 0; o = PutU64(o, q[0]); q += 1; break;
+        case BINLOG_I8:  if (end - q < 1) return 0; o = PutI64(o, (int8_t)q[0]); q += 1; break;
+        case BINLOG_U16: if (end - q < 2) return 0; o = PutU64(o, (uint16_t)(q[0] | q[1] << 8)); q += 2; break;
+        case BINLOG_I16: if (end - q < 2) return 0; o = PutI64(o, (int16_t)(q[0] | q[1] << 8)); q += 2; break;
+        case BINLOG_U32:
+        case BINLOG_I32:
+        case BINLOG_F32:
+            if (end - q < 4) return 0;
+            v = (uint32_t)q[0] | (uint32_t)q[1] << 8 | (uint32_t)q[2] << 16 | (uint32_t)q[3] << 24;
+            q += 4;
+            if (s->types[i] == BINLOG_U32) o = PutU64(o, v);
+            else if (s->types[i] == BINLOG_I32) o = PutI64(o, (int32_t)v);
+            else {
+                float f;
+                memcpy(&f, &v, 4);
+                o += sprintf(o, "%.9g", f);
+            }
+            break;
+        case BINLOG_UVAR:
+            if (!(n = GetVar(q, end, &v))) return 0;
+            q += n;
+            o = PutU64(o, v);
+            break;
+        case BINLOG_SVAR:
+            if (!(n = GetVar(q, end, &v))) return 0;
+            q += n;
+            o = PutI64(o, (int32_t)((v >> 1) ^ (uint32_t)-(int32_t)(v & 1u)));
+            break;
+        case BINLOG_BYTES:
+            if (!(n = GetVar(q, end, &len)) || len > BINLOG_MAX_RECORD || (size_t)(end - q) < n + len) return 0;
+            q += n;
+            for (uint32_t k = 0; k < len; k++) {
+                *o++ = "0123456789abcdef"[q[k] >> 4];
+                *o++ = "0123456789abcdef"[q[k] & 15];
+            }
+            q += len;
+            break;
+        default:
+            return 0;
+        }
+    }
+    *o++ = '\n';
+    if (show) {
+        d->seg_len += (size_t)(o - o0);
+        d->seg_rows++;
+    }
+    return (size_t)(q - p);
+}
+
+static void Decode(Decoder_t *d, const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len, *p = data, *seg_start = NULL;
+    uint64_t ts = 0;
+    uint16_t segcrc;
+    uint32_t ts32;
+    int in_sync = 0, ever = 0;
+    size_t n;
+
+    while (p < end) {
+        if (!in_sync) {
+            const uint8_t *s = p;
+            while ((s = memchr(s, BINLOG_TAG_SYNC, (size_t)(end - s))) && !(n = ParseSync(s, end, &segcrc, &ts32))) s++;
+            if (!s) {
+                d->skipped += (size_t)(end - p);
+                break;
+            }
+            d->skipped += (size_t)(s - p);
+            if (ever) d->resyncs++;
+            ever = in_sync = 1;
+            ts = ts32;
+            p = seg_start = s + n;
+            continue;
+        }
+
+        if (*p == BINLOG_TAG_SYNC && (n = ParseSync(p, end, &segcrc, &ts32)) != 0) {
+            if (BINLOG_Crc16(0xFFFFu, seg_start, (UINT)(p - seg_start)) == segcrc) SegCommit(d, 1);
+            else {
+                SegDrop(d);
+                d->bad_segments++;
+            }
+            d->segments++;
+            ts += (uint32_t)(ts32 - (uint32_t)ts);
+            p = seg_start = p + n;
+            continue;
+        }
+        if (*p == BINLOG_TAG_PAD) n = 1;
+        else if (*p == BINLOG_TAG_SCHEMA) n = ParseSchema(d, p, end);
+        else if (*p == BINLOG_TAG_INDEX) n = ParseIndex(d, p, end);
+        else if (*p >= 1 && *p <= BINLOG_MAX_SCHEMA) n = ParseRecord(d, p, end, &ts);
+        else n = 0;
+
+        if (n) {
+            p += n;
+        } else {
+            /* lost: drop the segment and look for a sync frame inside it */
+            SegDrop(d);
+            d->bad_segments++;
+            in_sync = 0;
+            p = seg_start;
+        }
+    }
+    if (in_sync && d->seg_rows) {
+        if (d->strict) SegDrop(d);
+        else SegCommit(d, 0);
+    }
+}
+
+//-----[ Benchmark ]-----
+
+typedef struct {
+    uint8_t *buf;
+    size_t len, cap;
+} Mem_t;
+
+static bool MemSink(void *ctx, const void *data, UINT len)
+{
+    Mem_t *m = (Mem_t *)ctx;
+    if (m->len + len > m->cap) return false;
+    memcpy(m->buf + m->len, data, len);
+    m->len += len;
+    return true;
+}
+
+static int Bench(uint32_t count, uint32_t flip_every)
+{
+    static const uint8_t types[] = { BINLOG_UVAR, BINLOG_I16, BINLOG_I16, BINLOG_I16, BINLOG_I16, BINLOG_F32 };
+    static const char *const fields[] = { "index", "adc0", "adc1", "adc2", "adc3", "temp" };
+    static const BINLOG_Schema_t sample = { 1, "sample", 6, types, fields };
+    static const BINLOG_Schema_t *const schemas[] = { &sample };
+    BINLOG_t b;
+    BINLOG_Stats_t st;
+    Decoder_t d;
+    Mem_t m;
+    char line[128];
+    uint64_t csv_bytes = 0;
+    uint32_t ts = 0, rng = 1;
+    char *text;
+    size_t text_len;
+    double t0, t_enc, t_dec;
+
+    m.cap = (size_t)count * 24 + 4096;
+    m.buf = malloc(m.cap);
+    m.len = 0;
+    if (!m.buf || !BINLOG_Init(&b, MemSink, &m, schemas, 1)) {
+        fprintf(stderr, "encoder setup failed\n");
+        return 1;
+    }
+
+    t0 = NowSec();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t v[6];
+        rng = rng * 1664525u + 1013904223u;
+        ts += 1000u + (rng >> 28);                 /* 1 ms sampling with jitter, us ticks */
+        v[0] = i;
+        for (int k = 0; k < 4; k++) v[1 + k] = (uint32_t)(int32_t)(int16_t)(2048 + (int)((rng >> (4 * k)) & 255u) - 128);
+        v[5] = BINLOG_Float(21.5f + (float)(rng & 1023u) / 1024.0f);
+        BINLOG_Write(&b, 1, ts, v);
+    }
+    BINLOG_Sync(&b);
+    t_enc = NowSec() - t0;
+    BINLOG_GetStats(&b, &st);
+
+    /* what SD_Card_Test's sprintf line would have cost on the card */
+    ts = 0;
+    rng = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        float temp;
+        int16_t a[4];
+        rng = rng * 1664525u + 1013904223u;
+        ts += 1000u + (rng >> 28);
+        for (int k = 0; k < 4; k++) a[k] = (int16_t)(2048 + (int)((rng >> (4 * k)) & 255u) - 128);
+        temp = 21.5f + (float)(rng & 1023u) / 1024.0f;
+        csv_bytes += (uint64_t)snprintf(line, sizeof(line), "%lu,%lu,%d,%d,%d,%d,%.2f\r\n", (unsigned long)ts,
+                                        (unsigned long)i, a[0], a[1], a[2], a[3], temp);
+    }
+
+    if (flip_every) {
+        for (size_t i = flip_every; i < m.len; i += flip_every) m.buf[i] ^= 0x10u;
+    }
+
+    memset(&d, 0, sizeof(d));
+    d.out = open_memstream(&text, &text_len);
+    t0 = NowSec();
+    Decode(&d, m.buf, m.len);
+    fflush(d.out);
+    t_dec = NowSec() - t0;
+    fclose(d.out);
+
+    printf("records             : %u (%u dropped by the encoder)\n", (unsigned)st.records, (unsigned)st.dropped);
+    printf("bytes per record    : %.2f binary (%u sync frames, %u index records), %.2f sprintf CSV\n",
+           (double)m.len / count, (unsigned)st.syncs, (unsigned)st.indexes, (double)csv_bytes / count);
+    printf("encode              : %.1f ns/record on this host\n", t_enc * 1e9 / count);
+    printf("decode              : %.1f MB/s binary in, %.1f MB/s CSV out, %.2f M rows/s\n",
+           m.len / 1e6 / t_dec, text_len / 1e6 / t_dec, d.rows / 1e6 / t_dec);
+    printf("integrity           : %llu rows, %llu segments, %llu bad, %llu resyncs, %llu rows dropped\n",
+           (unsigned long long)d.rows, (unsigned long long)d.segments, (unsigned long long)d.bad_segments,
+           (unsigned long long)d.resyncs, (unsigned long long)d.dropped_rows);
+    free(text);
+    free(m.buf);
+    free(d.seg);
+    return (!flip_every && d.rows != count) ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    Decoder_t d;
+    const char *path = NULL;
+    uint32_t count = 1000000, flip = 0;
+    int bench = 0;
+    uint8_t *data;
+    long size;
+    FILE *f;
+
+    memset(&d, 0, sizeof(d));
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "-b")) { bench = 1; continue; }
+        if (!strcmp(a, "-s")) { d.strict = 1; continue; }
+        if (a[0] != '-') { path = a; continue; }
+        if (!v) { Usage(argv[0]); return 2; }
+        i++;
+        if (!strcmp(a, "-S")) d.filter_name = v;
+        else if (!strcmp(a, "-n")) count = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-e")) flip = (uint32_t)strtoul(v, NULL, 0);
+        else { Usage(argv[0]); return 2; }
+    }
+    if (bench) return Bench(count ? count : 1, flip);
+    if (!path) { Usage(argv[0]); return 2; }
+
+    if (!(f = fopen(path, "rb"))) {
+        perror(path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size > 0 ? (size_t)size : 1);
+    if (!data || fread(data, 1, (size_t)size, f) != (size_t)size) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return 1;
+    }
+    fclose(f);
+
+    d.out = stdout;
+    Decode(&d, data, (size_t)size);
+    fflush(stdout);
+    fprintf(stderr, "%llu rows (%llu unverified), %llu segments, %llu bad, %llu resyncs, "
+            "%llu rows and %llu bytes skipped\n",
+            (unsigned long long)d.rows, (unsigned long long)d.unverified, (unsigned long long)d.segments,
+            (unsigned long long)d.bad_segments, (unsigned long long)d.resyncs,
+            (unsigned long long)d.dropped_rows, (unsigned long long)d.skipped);
+    free(data);
+    free(d.seg);
+    return d.bad_segments ? 3 : 0;
+}
@@ -0,0 +1,34 @@
+/**
+  ******************************************************************************
+  * @file           : ffconf.h
+  * @brief          : Host-side FatFs configuration: the firmware's, plus the
+  *                   overrides a bench mode asks for
+  ******************************************************************************
+  * @note           : FATFS/Target/ffconf.h is generated from SD_LOG.ioc and
+  *                   takes no -D overrides. This one is found first on the
+  *                   include path, pulls it in and replaces what the SDSIM_
+  *                   macros below give.
+  ******************************************************************************
+  */
+
+#ifndef SDSIM_FFCONF_H
+#define SDSIM_FFCONF_H
+
+#include "../../../FATFS/Target/ffconf.h"
+
+#ifdef SDSIM_FS_EXFAT
+#undef _FS_EXFAT
+#define _FS_EXFAT       SDSIM_FS_EXFAT
+#endif
+
+#ifdef SDSIM_MAX_SS
+#undef _MAX_SS
+#define _MAX_SS         SDSIM_MAX_SS
+#endif
+
+#ifdef SDSIM_MAX_LFN
+#undef _MAX_LFN
+#define _MAX_LFN        SDSIM_MAX_LFN
+#endif
+
+#endif /* SDSIM_FFCONF_H */
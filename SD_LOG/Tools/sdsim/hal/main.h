@@ -0,0 +1,15 @@
+/**
+  ******************************************************************************
+  * @file           : main.h
+  * @brief          : Host-side stand-in for Core/Inc/main.h
+  ******************************************************************************
+  */
+
+#ifndef SDSIM_MAIN_H
+#define SDSIM_MAIN_H
+
+#include "stm32f4xx_hal.h"
+
+void Error_Handler(void);
+
+#endif /* SDSIM_MAIN_H */
@@ -0,0 +1,248 @@
+/**
+  ******************************************************************************
+  * @file           : stm32f4xx_hal.h
+  * @brief          : Host-side HAL shim for the SD card simulator
+  ******************************************************************************
+  * @note           : Only what FATFS_SD.c, user_diskio.c and FatFs pull in is
+  *                   provided. SPI traffic is routed to sd_card_sim.c, time is
+  *                   simulated (see SdSim_NowNs) and SysTick is emulated.
+  *                   FATFS_SDIO.c only takes the SDIO register layout and bit
+  *                   names from here, its accesses go to sdio_mock.c.
+  ******************************************************************************
+  */
+
+#ifndef SDSIM_STM32F4XX_HAL_H
+#define SDSIM_STM32F4XX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef __weak
+#define __weak          __attribute__((weak))
+#endif
+#define __IO            volatile
+#define __NOP()         do { } while (0)
+#define __WFI()         do { } while (0)
+#define __DMB()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __DSB()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef enum { HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+typedef enum { RESET = 0, SET = !RESET } FlagStatus;
+
+#define SET_BIT(REG, BIT)               ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT)             ((REG) &= ~(BIT))
+#define READ_BIT(REG, BIT)              ((REG) & (BIT))
+#define MODIFY_REG(REG, CLR, SETM)      ((REG) = (((REG) & (~(CLR))) | (SETM)))
+
+/* System / clocks ---------------------------------------------------------*/
+extern uint32_t SystemCoreClock;
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+
+/* DWT cycle counter -------------------------------------------------------*/
+typedef struct { volatile uint32_t CTRL; volatile uint32_t CYCCNT; } DWT_Type;
+typedef struct { volatile uint32_t DEMCR; } CoreDebug_Type;
+extern DWT_Type SdSim_DWT;
+extern CoreDebug_Type SdSim_CoreDebug;
+#define DWT                             (&SdSim_DWT)
+#define CoreDebug                       (&SdSim_CoreDebug)
+#define DWT_CTRL_CYCCNTENA_Msk          (1UL)
+#define CoreDebug_DEMCR_TRCENA_Msk      (1UL << 24)
+
+/* Exclusive monitor: STREX succeeds if the word still holds what LDREX
+   read, which is what a lock-free retry loop needs from it. Per thread, so
+   the queue stress test can run producers on real threads. */
+static __thread volatile uint32_t *SdSim_ExclAddr;
+static __thread uint32_t SdSim_ExclValue;
+static inline uint32_t __LDREXW(volatile uint32_t *addr)
+{
+    SdSim_ExclAddr = addr;
+    SdSim_ExclValue = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+    return SdSim_ExclValue;
+}
+static inline uint32_t __STREXW(uint32_t value, volatile uint32_t *addr)
+{
+    uint32_t expect = SdSim_ExclValue;
+    if (SdSim_ExclAddr != addr) return 1;
+    SdSim_ExclAddr = NULL;
+    return __atomic_compare_exchange_n(addr, &expect, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ? 0 : 1;
+}
+static inline void __CLREX(void) { SdSim_ExclAddr = NULL; }
+
+/* Interrupt masking is meaningless on the single-threaded host */
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t m) { (void)m; }
+static inline void __disable_irq(void) { }
+static inline void __enable_irq(void) { }
+
+/* GPIO --------------------------------------------------------------------*/
+typedef struct { volatile uint32_t ODR; } GPIO_TypeDef;
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+extern GPIO_TypeDef SdSim_GPIO[9];
+#define GPIOA           (&SdSim_GPIO[0])
+#define GPIOB           (&SdSim_GPIO[1])
+#define GPIOC           (&SdSim_GPIO[2])
+#define GPIOD           (&SdSim_GPIO[3])
+#define GPIOE           (&SdSim_GPIO[4])
+#define GPIOF           (&SdSim_GPIO[5])
+#define GPIOG           (&SdSim_GPIO[6])
+#define GPIOH           (&SdSim_GPIO[7])
+#define GPIOI           (&SdSim_GPIO[8])
+#define GPIO_PIN_0      ((uint16_t)0x0001)
+#define GPIO_PIN_1      ((uint16_t)0x0002)
+#define GPIO_PIN_2      ((uint16_t)0x0004)
+#define GPIO_PIN_3      ((uint16_t)0x0008)
+#define GPIO_PIN_4      ((uint16_t)0x0010)
+#define GPIO_PIN_5      ((uint16_t)0x0020)
+#define GPIO_PIN_6      ((uint16_t)0x0040)
+#define GPIO_PIN_7      ((uint16_t)0x0080)
+#define GPIO_PIN_8      ((uint16_t)0x0100)
+#define GPIO_PIN_9      ((uint16_t)0x0200)
+#define GPIO_PIN_10     ((uint16_t)0x0400)
+#define GPIO_PIN_11     ((uint16_t)0x0800)
+#define GPIO_PIN_12     ((uint16_t)0x1000)
+#define GPIO_PIN_13     ((uint16_t)0x2000)
+#define GPIO_PIN_14     ((uint16_t)0x4000)
+#define GPIO_PIN_15     ((uint16_t)0x8000)
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+/* SPI ---------------------------------------------------------------------*/
+typedef struct
+{
+  volatile uint32_t CR1;
+  volatile uint32_t CR2;
+  volatile uint32_t SR;
+  volatile uint32_t DR;
+  volatile uint32_t CRCPR;
+  volatile uint32_t RXCRCR;
+  volatile uint32_t TXCRCR;
+} SPI_TypeDef;
+
+extern SPI_TypeDef SdSim_SPI[3];
+#define SPI1            (&SdSim_SPI[0])
+#define SPI2            (&SdSim_SPI[1])
+#define SPI3            (&SdSim_SPI[2])
+
+#define SPI_CR1_BR_Pos  (3U)
+#define SPI_CR1_BR      (0x7UL << SPI_CR1_BR_Pos)
+#define SPI_CR1_SPE     (0x1UL << 6U)
+#define SPI_CR1_DFF     (0x1UL << 11U)
+#define SPI_CR1_CRCEN   (0x1UL << 13U)
+#define SPI_DATASIZE_8BIT           (0x00000000U)
+#define SPI_DATASIZE_16BIT          SPI_CR1_DFF
+#define SPI_BAUDRATEPRESCALER_2     (0x00000000U)
+#define SPI_BAUDRATEPRESCALER_4     (0x00000008U)
+#define SPI_BAUDRATEPRESCALER_8     (0x00000010U)
+#define SPI_BAUDRATEPRESCALER_16    (0x00000018U)
+#define SPI_BAUDRATEPRESCALER_32    (0x00000020U)
+#define SPI_BAUDRATEPRESCALER_64    (0x00000028U)
+#define SPI_BAUDRATEPRESCALER_128   (0x00000030U)
+#define SPI_BAUDRATEPRESCALER_256   (0x00000038U)
+
+#define SPI_FLAG_RXNE   (0x1UL << 0U)
+#define SPI_FLAG_TXE    (0x1UL << 1U)
+#define SPI_FLAG_BSY    (0x1UL << 7U)
+#define SPI_SR_RXNE     (0x1UL << 0U)
+#define SPI_SR_TXE      (0x1UL << 1U)
+#define SPI_SR_OVR      (0x1UL << 6U)
+#define SPI_SR_BSY      (0x1UL << 7U)
+
+typedef struct { uint32_t DataSize; uint32_t BaudRatePrescaler; } SPI_InitTypeDef;
+typedef struct { void *Instance; } DMA_HandleTypeDef;
+
+typedef struct __SPI_HandleTypeDef
+{
+  SPI_TypeDef       *Instance;
+  SPI_InitTypeDef   Init;
+  DMA_HandleTypeDef *hdmatx;
+  DMA_HandleTypeDef *hdmarx;
+  volatile uint32_t ErrorCode;
+} SPI_HandleTypeDef;
+
+/* the simulated SPI is always ready */
+#define __HAL_SPI_GET_FLAG(__HANDLE__, __FLAG__)    (((__FLAG__) & (SPI_FLAG_TXE | SPI_FLAG_RXNE)) ? 1U : 0U)
+#define __HAL_SPI_ENABLE(__HANDLE__)                SET_BIT((__HANDLE__)->Instance->CR1, SPI_CR1_SPE)
+#define __HAL_SPI_DISABLE(__HANDLE__)               CLEAR_BIT((__HANDLE__)->Instance->CR1, SPI_CR1_SPE)
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi);
+
+/* register access for drivers that bypass HAL, DR and SR are modelled in hal_shim.c */
+uint32_t SdSim_SpiRead(SPI_TypeDef *spi, uint32_t offset);
+void SdSim_SpiWrite(SPI_TypeDef *spi, uint32_t offset, uint32_t value);
+#define SPI_RD(spi, reg)        SdSim_SpiRead((spi), offsetof(SPI_TypeDef, reg))
+#define SPI_WR(spi, reg, val)   SdSim_SpiWrite((spi), offsetof(SPI_TypeDef, reg), (val))
+
+/* CPU time of FATFS_SD.c's CRC16 table loop, charged in hal_shim.c */
+void SdSim_Crc16Bytes(uint32_t n);
+#define SD_CRC16_CHARGE(n)      SdSim_Crc16Bytes(n)
+
+/* SDIO (register layout for sdio_mock.c) ----------------------------------*/
+typedef struct
+{
+  volatile uint32_t POWER;
+  volatile uint32_t CLKCR;
+  volatile uint32_t ARG;
+  volatile uint32_t CMD;
+  volatile const uint32_t RESPCMD;
+  volatile const uint32_t RESP1;
+  volatile const uint32_t RESP2;
+  volatile const uint32_t RESP3;
+  volatile const uint32_t RESP4;
+  volatile uint32_t DTIMER;
+  volatile uint32_t DLEN;
+  volatile uint32_t DCTRL;
+  volatile const uint32_t DCOUNT;
+  volatile const uint32_t STA;
+  volatile uint32_t ICR;
+  volatile uint32_t MASK;
+  uint32_t RESERVED0[2];
+  volatile const uint32_t FIFOCNT;
+  uint32_t RESERVED1[13];
+  volatile uint32_t FIFO;
+} SDIO_TypeDef;
+
+#define SDIO_POWER_PWRCTRL          (0x3UL << 0U)
+#define SDIO_CLKCR_CLKDIV           (0xFFUL << 0U)
+#define SDIO_CLKCR_CLKEN            (0x1UL << 8U)
+#define SDIO_CLKCR_PWRSAV           (0x1UL << 9U)
+#define SDIO_CLKCR_BYPASS           (0x1UL << 10U)
+#define SDIO_CLKCR_WIDBUS           (0x3UL << 11U)
+#define SDIO_CLKCR_WIDBUS_0         (0x1UL << 11U)
+#define SDIO_CLKCR_WIDBUS_1         (0x2UL << 11U)
+#define SDIO_CMD_CMDINDEX           (0x3FUL << 0U)
+#define SDIO_CMD_WAITRESP           (0x3UL << 6U)
+#define SDIO_CMD_WAITRESP_0         (0x1UL << 6U)
+#define SDIO_CMD_WAITRESP_1         (0x2UL << 6U)
+#define SDIO_CMD_CPSMEN             (0x1UL << 10U)
+#define SDIO_DCTRL_DTEN             (0x1UL << 0U)
+#define SDIO_DCTRL_DTDIR            (0x1UL << 1U)
+#define SDIO_DCTRL_DMAEN            (0x1UL << 3U)
+#define SDIO_DCTRL_DBLOCKSIZE_Pos   (4U)
+#define SDIO_DCTRL_DBLOCKSIZE       (0xFUL << SDIO_DCTRL_DBLOCKSIZE_Pos)
+#define SDIO_STA_CCRCFAIL           (0x1UL << 0U)
+#define SDIO_STA_DCRCFAIL           (0x1UL << 1U)
+#define SDIO_STA_CTIMEOUT           (0x1UL << 2U)
+#define SDIO_STA_DTIMEOUT           (0x1UL << 3U)
+#define SDIO_STA_TXUNDERR           (0x1UL << 4U)
+#define SDIO_STA_RXOVERR            (0x1UL << 5U)
+#define SDIO_STA_CMDREND            (0x1UL << 6U)
+#define SDIO_STA_CMDSENT            (0x1UL << 7U)
+#define SDIO_STA_DATAEND            (0x1UL << 8U)
+#define SDIO_STA_STBITERR           (0x1UL << 9U)
+#define SDIO_STA_DBCKEND            (0x1UL << 10U)
+#define SDIO_STA_CMDACT             (0x1UL << 11U)
+#define SDIO_STA_TXACT              (0x1UL << 12U)
+#define SDIO_STA_RXACT              (0x1UL << 13U)
+#define SDIO_STA_RXDAVL             (0x1UL << 21U)
+
+#endif /* SDSIM_STM32F4XX_HAL_H */
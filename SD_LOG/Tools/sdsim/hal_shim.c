@@ -0,0 +1,364 @@
+/**
+  ******************************************************************************
+  * @file           : hal_shim.c
+  * @brief          : Host-side HAL shim: simulated clock, GPIO and SPI
+  ******************************************************************************
+  * @note           : Every byte on the bus advances the simulated clock by
+  *                   8 SPI clocks at the prescaler currently programmed in
+  *                   CR1. Polled HAL calls additionally charge SdSim_HalCallNs
+  *                   of CPU time; DMA transfers only cost the wire time and
+  *                   complete synchronously through the HAL callbacks.
+  *                   CR1 DFF selects 16-bit frames (high byte on the wire
+  *                   first); with CRCEN set every frame is folded into
+  *                   RXCRCR/TXCRCR (polynomial CRCPR), which start from 0
+  *                   each time CRCEN is switched on.
+  *                   Drivers that bypass HAL reach DR/SR through SPI_RD and
+  *                   SPI_WR; the register model below gives them TXE/RXNE/BSY
+  *                   timing from the same wire clock and charges
+  *                   SdSim_RegAccessNs of CPU time per access. RX holds one
+  *                   frame as on the chip: OVR is set when the next one
+  *                   completes before DR is read, and cleared by reading DR
+  *                   then SR.
+  *                   The CRC16 table loop the DMA builds run on every data
+  *                   block costs SdSim_Crc16Cycles per byte, less the wire
+  *                   time left of the transmit DMA it runs behind.
+  ******************************************************************************
+  */
+
+#include "stm32f4xx_hal.h"
+#include "sd_card_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+uint32_t SystemCoreClock = 84000000u;
+uint32_t SdSim_HalCallNs = 1500u;   /* ~125 cycles of HAL state machine per call */
+uint32_t SdSim_RegAccessNs = 60u;   /* ~5 cycles per APB peripheral access */
+uint32_t SdSim_IrqEvery = 0u;
+uint32_t SdSim_IrqNs = 0u;
+/* ldrb, eor, ldrh from the table in flash (2 wait states, ART hit), lsl,
+   eor, uxth, subs, bne: ~8 cycles on the M4 */
+uint32_t SdSim_Crc16Cycles = 8u;
+
+DWT_Type SdSim_DWT;
+CoreDebug_Type SdSim_CoreDebug;
+GPIO_TypeDef SdSim_GPIO[9];
+SPI_TypeDef SdSim_SPI[3];
+
+static uint64_t SimNs;
+static uint64_t DmaTxLeftNs;    /* transmit DMA wire time the CPU can still use */
+
+/* Simulated time ------------------------------------------------------------*/
+
+__weak void SdSim_SysTick(void)
+{
+}
+
+uint64_t SdSim_NowNs(void)
+{
+    return SimNs;
+}
+
+void SdSim_Advance(uint64_t ns)
+{
+    uint64_t ms = SimNs / 1000000u;
+    SimNs += ns;
+    SdSim_DWT.CYCCNT = (uint32_t)(SimNs * (SystemCoreClock / 1000000u) / 1000u);
+    while (ms < SimNs / 1000000u) {
+        ms++;
+        SdSim_SysTick();
+    }
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t)(SimNs / 1000000u);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    SdSim_Advance((uint64_t)Delay * 1000000u);
+}
+
+/* SystemClock_Config(): HCLK 84 MHz, APB1 /2, APB2 /4 */
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+    return SystemCoreClock / 2u;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+    return SystemCoreClock / 4u;
+}
+
+void Error_Handler(void)
+{
+    fprintf(stderr, "Error_Handler()\n");
+    exit(1);
+}
+
+/* GPIO ----------------------------------------------------------------------*/
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    if (PinState == GPIO_PIN_SET) GPIOx->ODR |= GPIO_Pin;
+    else GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+    SdSim_ChipSelect(GPIOx, GPIO_Pin, PinState == GPIO_PIN_SET);
+}
+
+/* SPI -----------------------------------------------------------------------*/
+
+static int SpiIndex(SPI_TypeDef *spi)
+{
+    return (int)(spi - SdSim_SPI);
+}
+
+/* wire time of one frame at the prescaler and frame size in CR1 */
+static uint64_t SpiFrameNs(SPI_TypeDef *spi)
+{
+    uint32_t pclk = (SpiIndex(spi) == 0) ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+    uint32_t div = 2u << ((spi->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos);
+    uint64_t bits = (spi->CR1 & SPI_CR1_DFF) ? 16u : 8u;
+    return bits * 1000000000ull * div / pclk;
+}
+
+/* one byte into a CRC register, MSB first */
+static uint32_t SpiCrcByte(uint32_t crc, uint32_t poly, uint8_t b)
+{
+    crc ^= (uint32_t)b << 8;
+    for (int i = 0; i < 8; i++) crc = (crc & 0x8000u) ? (crc << 1) ^ poly : crc << 1;
+    return crc & 0xFFFFu;
+}
+
+/* CRC registers restart whenever CRCEN goes from 0 to 1 */
+static int SpiCrcArm(SPI_TypeDef *spi)
+{
+    static uint8_t was_on[3];
+    int idx = SpiIndex(spi);
+    int on = (spi->CR1 & SPI_CR1_CRCEN) != 0;
+    if (on && !was_on[idx]) spi->RXCRCR = spi->TXCRCR = 0;
+    was_on[idx] = (uint8_t)on;
+    return on;
+}
+
+/* one byte each way on the wire, folded into the CRC registers if enabled */
+static uint8_t SpiWire(SPI_TypeDef *spi, int card, uint8_t mosi, int crc_on)
+{
+    uint8_t miso = SdSim_Xchg(card, mosi);
+    if (crc_on) {
+        spi->TXCRCR = SpiCrcByte(spi->TXCRCR, spi->CRCPR, mosi);
+        spi->RXCRCR = SpiCrcByte(spi->RXCRCR, spi->CRCPR, miso);
+    }
+    return miso;
+}
+
+static uint64_t SpiXfer(SPI_HandleTypeDef *hspi, const uint8_t *tx, uint8_t *rx, uint16_t n, int dma)
+{
+    SPI_TypeDef *spi = hspi->Instance;
+    int card = SdSim_CardForSpi(SpiIndex(spi));
+    int wide = (spi->CR1 & SPI_CR1_DFF) != 0;
+    uint64_t frame_ns = SpiFrameNs(spi);
+    SdSim_Stats_t *st = (card >= 0) ? SdSim_Stats(card) : NULL;
+    int crc_on = SpiCrcArm(spi);
+
+    DmaTxLeftNs = 0;
+    SdSim_Advance(SdSim_HalCallNs);
+    if (st) st->cpu_spi_ns += SdSim_HalCallNs;
+    /* Size counts frames, a 16-bit frame is a little-endian halfword in memory */
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j <= (uint32_t)wide; j++) {
+            uint32_t k = wide ? 2u * i + 1u - j : i;
+            uint8_t b = SpiWire(spi, card, tx ? tx[k] : 0xFF, crc_on);
+            if (rx) rx[k] = b;
+        }
+        SdSim_Advance(frame_ns);
+    }
+    if (st) {
+        if (dma) {
+            st->dma_spi_ns += frame_ns * n;
+            st->dma_bytes += wide ? 2u * n : n;
+        }
+        else st->cpu_spi_ns += frame_ns * n;
+    }
+    return frame_ns * n;
+}
+
+/* The transfer above has already been clocked, so work the driver does
+   between HAL_SPI_Transmit_DMA and the wait only costs what the DMA would
+   not have covered. */
+void SdSim_Crc16Bytes(uint32_t n)
+{
+    uint64_t ns = (uint64_t)n * SdSim_Crc16Cycles * 1000000000u / SystemCoreClock;
+    uint64_t hidden = (ns < DmaTxLeftNs) ? ns : DmaTxLeftNs;
+
+    DmaTxLeftNs -= hidden;
+    SdSim_Advance(ns - hidden);
+}
+
+/* SPI registers (SPI_RD/SPI_WR) ---------------------------------------------*/
+
+/* Frames written to DR queue behind the one shifting; TXE is set once the
+   last written frame has started, RXNE once the oldest unread one is done. */
+typedef struct {
+    uint64_t tx_start;          /* last frame written leaves the TX buffer */
+    uint64_t shift_end;         /* ... and is completely on the wire */
+    uint64_t rx_done[2];        /* receive queue: completion times */
+    uint16_t rx_data[2];
+    int      rx_n;
+    int      ovr_dr;            /* DR read with OVR set, the next SR read clears it */
+} SpiRegs_t;
+
+static SpiRegs_t SpiRegs[3];
+
+/* every register access costs the CPU SdSim_RegAccessNs, and every
+   SdSim_IrqEvery-th one is held up by an interrupt for SdSim_IrqNs */
+static void SpiRegAccess(SPI_TypeDef *spi)
+{
+    static uint32_t accesses;
+    int card = SdSim_CardForSpi(SpiIndex(spi));
+    DmaTxLeftNs = 0;
+    SdSim_Advance(SdSim_RegAccessNs);
+    if (card >= 0) SdSim_Stats(card)->cpu_spi_ns += SdSim_RegAccessNs;
+    if (SdSim_IrqEvery && ++accesses % SdSim_IrqEvery == 0) SdSim_Advance(SdSim_IrqNs);
+}
+
+/* RX holds one frame: a second one completing before DR is read is lost,
+   DR keeps the first, and so is every frame completing while OVR is set */
+static void SpiOverrun(SPI_TypeDef *spi, SpiRegs_t *m, uint64_t now)
+{
+    if (m->rx_n == 2 && now >= m->rx_done[1]) {
+        spi->SR |= SPI_SR_OVR;
+        spi->DR = m->rx_data[0];
+        m->rx_n = 0;
+    }
+    while ((spi->SR & SPI_SR_OVR) && m->rx_n && now >= m->rx_done[0]) {
+        m->rx_done[0] = m->rx_done[1];
+        m->rx_data[0] = m->rx_data[1];
+        m->rx_n--;
+    }
+}
+
+uint32_t SdSim_SpiRead(SPI_TypeDef *spi, uint32_t offset)
+{
+    SpiRegs_t *m = &SpiRegs[SpiIndex(spi)];
+    uint64_t now;
+    uint32_t v;
+
+    SpiRegAccess(spi);
+    now = SdSim_NowNs();
+    SpiOverrun(spi, m, now);
+    if (offset == offsetof(SPI_TypeDef, SR)) {
+        v = spi->SR & SPI_SR_OVR;
+        if (now >= m->tx_start) v |= SPI_SR_TXE;
+        if ((m->rx_n && now >= m->rx_done[0]) || ((v & SPI_SR_OVR) && !m->ovr_dr)) v |= SPI_SR_RXNE;
+        if (now < m->shift_end) v |= SPI_SR_BSY;
+        if (m->ovr_dr) {
+            spi->SR &= ~SPI_SR_OVR;
+            m->ovr_dr = 0;
+        }
+        return v;
+    }
+    if (offset == offsetof(SPI_TypeDef, DR)) {
+        if (spi->SR & SPI_SR_OVR) m->ovr_dr = 1;
+        if (!m->rx_n || now < m->rx_done[0]) return spi->DR;
+        spi->DR = m->rx_data[0];
+        m->rx_done[0] = m->rx_done[1];
+        m->rx_data[0] = m->rx_data[1];
+        m->rx_n--;
+        return spi->DR;
+    }
+    return *(volatile uint32_t *)((uint8_t *)spi + offset);
+}
+
+void SdSim_SpiWrite(SPI_TypeDef *spi, uint32_t offset, uint32_t value)
+{
+    SpiRegs_t *m = &SpiRegs[SpiIndex(spi)];
+    int card = SdSim_CardForSpi(SpiIndex(spi));
+    uint64_t now, start;
+    uint16_t miso;
+
+    SpiRegAccess(spi);
+    if (offset != offsetof(SPI_TypeDef, DR)) {
+        *(volatile uint32_t *)((uint8_t *)spi + offset) = value;
+        return;
+    }
+    /* the card sees the frame now, the CPU gets its answer when it is shifted */
+    now = SdSim_NowNs();
+    SpiOverrun(spi, m, now);
+    start = (now > m->shift_end) ? now : m->shift_end;
+    m->tx_start = start;
+    m->shift_end = start + SpiFrameNs(spi);
+    if (spi->CR1 & SPI_CR1_DFF) {
+        int crc_on = SpiCrcArm(spi);
+        miso = (uint16_t)(SpiWire(spi, card, (uint8_t)(value >> 8), crc_on) << 8);
+        miso |= SpiWire(spi, card, (uint8_t)value, crc_on);
+    } else {
+        miso = SpiWire(spi, card, (uint8_t)value, SpiCrcArm(spi));
+    }
+    /* a frame not read before the next one completes is lost */
+    if (m->rx_n == 2) {
+        spi->SR |= SPI_SR_OVR;
+        m->rx_done[0] = m->rx_done[1];
+        m->rx_data[0] = m->rx_data[1];
+        m->rx_n = 1;
+    }
+    m->rx_done[m->rx_n] = m->shift_end;
+    m->rx_data[m->rx_n] = miso;
+    m->rx_n++;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void)Timeout;
+    SpiXfer(hspi, pData, NULL, Size, 0);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void)Timeout;
+    SpiXfer(hspi, NULL, pData, Size, 0);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size, uint32_t Timeout)
+{
+    (void)Timeout;
+    SpiXfer(hspi, pTxData, pRxData, Size, 0);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+    uint64_t wire_ns = SpiXfer(hspi, pData, NULL, Size, 1);
+    HAL_SPI_TxCpltCallback(hspi);
+    DmaTxLeftNs = wire_ns;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size)
+{
+    SpiXfer(hspi, pTxData, pRxData, Size, 1);
+    HAL_SPI_TxRxCpltCallback(hspi);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+    return HAL_OK;
+}
+
+__weak void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+__weak void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+__weak void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
@@ -0,0 +1,251 @@
+/**
+  ******************************************************************************
+  * @file           : logq_bench.c
+  * @brief          : Stress test and throughput benchmark for sd_queue.c
+  ******************************************************************************
+  * @note           : The firmware queue is compiled unmodified; LDREX/STREX
+  *                   come from the HAL shim, where STREX is a compare and
+  *                   swap. Stress mode runs producers on real threads against
+  *                   one consumer (the main thread) with a small ring, so the
+  *                   full, wrap and not-yet-committed paths are hit all the
+  *                   time, and checks every record's producer, sequence number
+  *                   and payload. Bench mode reports the cost per record on a
+  *                   single thread and the rate across two threads.
+  ******************************************************************************
+  */
+
+#include "sd_queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PRODUCERS   8
+#define HDR_BYTES       5u   /* producer id, sequence number */
+
+typedef struct {
+    LOGQ_t *q;
+    int id;
+    int mp;
+    uint32_t count;
+    uint32_t max_len;
+    uint32_t full;
+} Producer_t;
+
+static void Usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p N       producer threads (default 4, 1 uses LOGQ_Reserve)\n"
+            "  -n N       records per producer (default 200000)\n"
+            "  -l BYTES   longest record (default 100)\n"
+            "  -r BYTES   ring size (default 1024, 16384 with -b)\n"
+            "  -b         throughput benchmark instead of the stress test\n", prog);
+}
+
+static uint32_t XorShift(uint32_t *s)
+{
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static uint8_t PatternByte(int id, uint32_t seq, uint32_t i)
+{
+    return (uint8_t)(id * 31u + seq * 7u + i);
+}
+
+static double NowSec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *ProducerThread(void *arg)
+{
+    Producer_t *p = (Producer_t *)arg;
+    uint32_t rng = 0x9E3779B9u * (uint32_t)(p->id + 1);
+
+    for (uint32_t seq = 0; seq < p->count; seq++) {
+        uint32_t len = HDR_BYTES + XorShift(&rng) % (p->max_len - HDR_BYTES + 1u);
+        /* every other record reserves more than it commits */
+        uint32_t res = len + ((seq & 1u) ? XorShift(&rng) % 16u : 0u);
+        uint8_t *rec;
+
+        while (!(rec = p->mp ? LOGQ_ReserveMP(p->q, res) : LOGQ_Reserve(p->q, res))) {
+            p->full++;
+            sched_yield();
+        }
+        rec[0] = (uint8_t)p->id;
+        memcpy(&rec[1], &seq, 4);
+        for (uint32_t i = HDR_BYTES; i < len; i++) rec[i] = PatternByte(p->id, seq, i);
+        LOGQ_Commit(p->q, rec, len);
+    }
+    return NULL;
+}
+
+static int Stress(int producers, uint32_t count, uint32_t max_len, uint32_t ring)
+{
+    static uint32_t buf[LOGQ_MAX_SIZE / 4];
+    pthread_t th[MAX_PRODUCERS];
+    Producer_t prod[MAX_PRODUCERS];
+    uint32_t expect[MAX_PRODUCERS] = { 0 };
+    uint64_t total = (uint64_t)producers * count, got = 0, full = 0;
+    uint32_t errors = 0;
+    LOGQ_Stats_t st;
+    LOGQ_t q;
+    double t0;
+
+    if (!LOGQ_Init(&q, buf, ring)) {
+        fprintf(stderr, "bad ring size %u\n", (unsigned)ring);
+        return 2;
+    }
+    t0 = NowSec();
+    for (int i = 0; i < producers; i++) {
+        prod[i] = (Producer_t){ &q, i, producers > 1, count, max_len, 0 };
+        pthread_create(&th[i], NULL, ProducerThread, &prod[i]);
+    }
+
+    while (got < total) {
+        const uint8_t *rec;
+        uint32_t len, seq;
+
+        if (!(rec = LOGQ_Peek(&q, &len))) {
+            sched_yield();
+            continue;
+        }
+        memcpy(&seq, &rec[1], 4);
+        if (len < HDR_BYTES || len > max_len || rec[0] >= producers || seq != expect[rec[0]]) {
+            if (errors++ < 10)
+                fprintf(stderr, "record %llu: len %u producer %u seq %u, expected seq %u\n",
+                        (unsigned long long)got, (unsigned)len, (unsigned)rec[0], (unsigned)seq,
+                        rec[0] < producers ? (unsigned)expect[rec[0]] : 0u);
+        } else {
+            for (uint32_t i = HDR_BYTES; i < len; i++) {
+                if (rec[i] != PatternByte(rec[0], seq, i)) {
+                    if (errors++ < 10) fprintf(stderr, "record %llu: payload byte %u\n", (unsigned long long)got, (unsigned)i);
+                    break;
+                }
+            }
+            expect[rec[0]]++;
+        }
+        LOGQ_Release(&q);
+        got++;
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_join(th[i], NULL);
+        full += prod[i].full;
+    }
+    LOGQ_GetStats(&q, &st, false);
+
+    printf("stress: %d producer%s (%s), %llu records in %.2f s, %llu B, ring %u B (peak %u), "
+           "%llu full retries, %u errors\n",
+           producers, producers > 1 ? "s" : "", producers > 1 ? "LOGQ_ReserveMP" : "LOGQ_Reserve",
+           (unsigned long long)st.records, NowSec() - t0, (unsigned long long)st.bytes, (unsigned)ring,
+           (unsigned)st.max_used, (unsigned long long)full, (unsigned)errors);
+    return (errors || st.records != total || LOGQ_Peek(&q, &(uint32_t){ 0 })) ? 1 : 0;
+}
+
+typedef struct {
+    LOGQ_t *q;
+    int mp;
+    uint32_t len;
+    uint32_t count;
+} Stream_t;
+
+static void *StreamThread(void *arg)
+{
+    Stream_t *s = (Stream_t *)arg;
+
+    for (uint32_t i = 0; i < s->count; i++) {
+        uint8_t *rec;
+        while (!(rec = s->mp ? LOGQ_ReserveMP(s->q, s->len) : LOGQ_Reserve(s->q, s->len))) sched_yield();
+        memset(rec, (int)i, s->len);
+        LOGQ_Commit(s->q, rec, s->len);
+    }
+    return NULL;
+}
+
+static void Bench(uint32_t ring)
+{
+    static uint32_t buf[LOGQ_MAX_SIZE / 4];
+    static const uint32_t sizes[] = { 8, 32, 128, 512 };
+    const uint32_t count = 2000000u;
+    LOGQ_t q;
+
+    printf("%-6s %-4s %14s %16s\n", "record", "", "1 thread ns/rec", "2 threads MB/s");
+    for (unsigned k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        for (int mp = 0; mp < 2; mp++) {
+            uint32_t len = sizes[k], n;
+            const void *rec;
+            double t0, t1, t2;
+            pthread_t th;
+            Stream_t s = { &q, mp, len, count };
+
+            /* reserve, fill, commit, peek, release on one thread */
+            LOGQ_Init(&q, buf, ring);
+            t0 = NowSec();
+            for (uint32_t i = 0; i < count; i++) {
+                uint8_t *p = mp ? LOGQ_ReserveMP(&q, len) : LOGQ_Reserve(&q, len);
+                memset(p, (int)i, len);
+                LOGQ_Commit(&q, p, len);
+                rec = LOGQ_Peek(&q, &n);
+                LOGQ_Release(&q);
+            }
+            t1 = NowSec() - t0;
+
+            /* producer thread against this one as consumer */
+            LOGQ_Init(&q, buf, ring);
+            t0 = NowSec();
+            pthread_create(&th, NULL, StreamThread, &s);
+            for (uint32_t got = 0; got < count; ) {
+                if ((rec = LOGQ_Peek(&q, &n))) {
+                    LOGQ_Release(&q);
+                    got++;
+                } else {
+                    sched_yield();
+                }
+            }
+            pthread_join(th, NULL);
+            t2 = NowSec() - t0;
+            (void)rec;
+
+            printf("%4u B %-4s %14.1f %16.1f\n", (unsigned)len, mp ? "MP" : "SP",
+                   t1 * 1e9 / count, (double)count * len / 1e6 / t2);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int producers = 4, bench = 0;
+    uint32_t count = 200000, max_len = 100, ring = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "-b")) { bench = 1; continue; }
+        if (!v) { Usage(argv[0]); return 2; }
+        i++;
+        if (!strcmp(a, "-p")) producers = atoi(v);
+        else if (!strcmp(a, "-n")) count = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-l")) max_len = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-r")) ring = (uint32_t)strtoul(v, NULL, 0);
+        else { Usage(argv[0]); return 2; }
+    }
+    if (producers < 1 || producers > MAX_PRODUCERS || max_len < HDR_BYTES || max_len > LOGQ_MAX_RECORD) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    if (bench) {
+        Bench(ring ? ring : 16384u);
+        return 0;
+    }
+    return Stress(producers, count, max_len, ring ? ring : 1024u);
+}
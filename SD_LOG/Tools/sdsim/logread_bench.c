@@ -0,0 +1,330 @@
+/**
+  ******************************************************************************
+  * @file           : logread_bench.c
+  * @brief          : Seek cost in a long log, with and without the cluster map
+  ******************************************************************************
+  * @note           : Writes a binary log (sd_binlog.c, one record per tick)
+  *                   through the double-buffered logger onto a simulated card,
+  *                   power-cycles it, then times random seeks:
+  *
+  *                     f_lseek      plain FatFs, following the FAT chain
+  *                     LOGRD        by offset through the cluster map
+  *                     by time      LOGRD_SeekTime, with and without the map
+  *
+  *                   Every seek by time is checked by decoding forward to the
+  *                   first record at or after the target, which must be the
+  *                   record written at that tick. -f interleaves a second
+  *                   file so the log ends up in many fragments.
+  ******************************************************************************
+  */
+
+#include "main.h"
+#include "fatfs.h"
+#include "sd_card_sim.h"
+#include "FATFS_SD.h"
+#include "sd_format.h"
+#include "sd_logger.h"
+#include "sd_binlog.h"
+#include "sd_logread.h"
+#include "ff_gen_drv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern Disk_drvTypeDef disk;  /* diskio.c, to power-cycle the drive */
+
+SPI_HandleTypeDef hspi1;
+SPI_HandleTypeDef hspi2;
+
+/* Firmware SysTick_Handler() equivalent */
+void SdSim_SysTick(void)
+{
+    SD_disk_timerproc();
+}
+
+typedef struct {
+    uint64_t ns;
+    uint64_t reads;
+    uint32_t n;
+} Cost_t;
+
+static void Usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s MB      log size (default 64)\n"
+            "  -n N       seeks per method (default 200)\n"
+            "  -f KB      write a cluster of another file every KB of log (fragments it)\n"
+            "  -m N       cluster map DWORDs (default 4096)\n"
+            "  -z MB      card size (default 256)\n", prog);
+}
+
+static uint32_t Rand(uint32_t *rng)
+{
+    *rng = *rng * 1664525u + 1013904223u;
+    return *rng >> 1;
+}
+
+static uint32_t SectorReads(void)
+{
+    SD_Stats_t st;
+
+    disk_ioctl(0, SD_GET_STATS_CLEAR, &st);
+    return st.op[SD_OP_RD_SINGLE].count + st.op[SD_OP_RD_MULTI].count;
+}
+
+static void CostStart(uint64_t *t0)
+{
+    SectorReads();
+    *t0 = SdSim_NowNs();
+}
+
+static void CostEnd(Cost_t *c, uint64_t t0)
+{
+    c->ns += SdSim_NowNs() - t0;
+    c->reads += SectorReads();
+    c->n++;
+}
+
+static void CostPrint(const char *name, const Cost_t *c)
+{
+    printf("%-20s: %8.3f ms/seek  %7.2f sector reads/seek\n", name,
+           c->n ? c->ns / 1e6 / c->n : 0.0, c->n ? (double)c->reads / c->n : 0.0);
+}
+
+/* power cycle and mount again, the sector cache starts empty */
+static FRESULT Boot(FATFS *fs)
+{
+    f_mount(NULL, USERPath, 0);
+    disk.is_initialized[0] = 0;
+    return f_mount(fs, USERPath, 1);
+}
+
+/* decode from the reader's position to the first record at or after ts,
+   returns its seq field and the bytes decoded on the way */
+static int FindRecord(LOGRD_t *r, uint32_t base, uint32_t ts, uint32_t *seq, uint32_t *decoded)
+{
+    static uint8_t buf[4096];
+    uint32_t t = base, dt;
+    UINT got, i = 0, k;
+
+    *decoded = 0;
+    if (LOGRD_Read(r, buf, sizeof(buf), &got) != FR_OK) return -1;
+    for (;;) {
+        /* keep a whole record in the buffer */
+        if (got - i < BINLOG_INDEX_SIZE && got == sizeof(buf)) {
+            memmove(buf, buf + i, got - i);
+            got -= i;
+            i = 0;
+            if (LOGRD_Read(r, buf + got, sizeof(buf) - got, &k) != FR_OK) return -1;
+            got += k;
+        }
+        if (i >= got) return -1;
+        switch (buf[i]) {
+        case BINLOG_TAG_PAD:
+            k = 1;
+            break;
+        case BINLOG_TAG_SYNC:
+            t = (uint32_t)buf[i + 7] | (uint32_t)buf[i + 8] << 8 | (uint32_t)buf[i + 9] << 16 |
+                (uint32_t)buf[i + 10] << 24;
+            k = BINLOG_SYNC_SIZE;
+            break;
+        case BINLOG_TAG_INDEX:
+            k = 3u + 8u * ((UINT)buf[i + 1] + buf[i + 2]);
+            break;
+        case BINLOG_TAG_SCHEMA:
+            k = 3u + buf[i + 2];
+            for (UINT s = 0; s <= buf[i + 2]; s++) k += (UINT)strlen((const char *)&buf[i + k]) + 1u;
+            break;
+        case 1:
+            dt = 0;
+            for (k = 1; buf[i + k] & 0x80u; k++) dt |= (uint32_t)(buf[i + k] & 0x7Fu) << (7 * (k - 1));
+            dt |= (uint32_t)buf[i + k] << (7 * (k - 1));
+            k++;
+            t += dt;
+            if (t >= ts) {
+                *seq = (uint32_t)buf[i + k] | (uint32_t)buf[i + k + 1] << 8 | (uint32_t)buf[i + k + 2] << 16 |
+                       (uint32_t)buf[i + k + 3] << 24;
+                return 0;
+            }
+            k += 4;
+            break;
+        default:
+            return -1;
+        }
+        i += k;
+        *decoded += k;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const uint8_t types[] = { BINLOG_U32 };
+    static const char *const fields[] = { "seq" };
+    static const BINLOG_Schema_t tick = { 1, "tick", 1, types, fields };
+    static const BINLOG_Schema_t *const schemas[] = { &tick };
+    static uint8_t work[_MAX_SS];
+    static SDLOG_t lg;
+    static BINLOG_t b;
+    static LOGRD_t rd;
+    static DWORD map[65536];
+    SdSim_Config_t cfg;
+    SDFMT_Layout_t layout;
+    BINLOG_Stats_t bst;
+    LOGRD_Stats_t rst;
+    FATFS fs;
+    FIL fil, filler;
+    FSIZE_t size;
+    FRESULT fr;
+    UINT bw;
+    Cost_t plain = { 0 }, by_ofs = { 0 }, by_time = { 0 }, by_time_nomap = { 0 }, open_map = { 0 };
+    uint32_t total_mb = 64, seeks = 200, frag_kb = 0, map_len = 4096;
+    uint32_t records, rng, fill_at, seq, decoded, max_decoded = 0, base, hops_nomap;
+    uint64_t t0, sum_decoded = 0;
+    int bad = 0;
+
+    SdSim_DefaultConfig(&cfg);
+    cfg.capacity_mb = 256;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!v) { Usage(argv[0]); return 2; }
+        i++;
+        if (!strcmp(a, "-s")) total_mb = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-n")) seeks = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-f")) frag_kb = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-m")) map_len = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-z")) cfg.capacity_mb = (uint32_t)strtoul(v, NULL, 0);
+        else { Usage(argv[0]); return 2; }
+    }
+    if (!total_mb || !seeks || map_len > sizeof(map) / sizeof(map[0])) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    if (SdSim_Init(0, &cfg) != 0) {
+        fprintf(stderr, "cannot allocate card image\n");
+        return 1;
+    }
+    SdSim_Bind(0, 0, SD_CS_PORT, SD_CS_PIN);
+    hspi1.Instance = SPI1;
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256;
+    hspi1.Instance->CR1 = SPI_BAUDRATEPRESCALER_256 | SPI_CR1_SPE;
+
+    MX_FATFS_Init();
+    fr = SDFMT_Format(USERPath, work, sizeof(work), NULL);
+    if (fr == FR_OK) fr = f_mount(&fs, USERPath, 1);
+    if (fr == FR_OK) fr = SDFMT_GetLayout(&fs, &layout);
+    if (fr == FR_OK) fr = f_open(&fil, "LOG.BIN", FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr == FR_OK && frag_kb) fr = f_open(&filler, "FILL.BIN", FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr == FR_OK) fr = SDLOG_Init(&lg, &fil);
+    if (fr == FR_OK && !BINLOG_Init(&b, SDLOG_Sink, &lg, schemas, 1)) fr = FR_DENIED;
+    if (fr != FR_OK) {
+        fprintf(stderr, "setup failed: %d\n", fr);
+        return 1;
+    }
+
+    /* one record per tick, ts == seq */
+    fill_at = frag_kb * 1024u;
+    for (records = 1; fr == FR_OK && b.pos < total_mb * 1024u * 1024u; records++) {
+        BINLOG_Write(&b, 1, records, &records);
+        fr = SDLOG_Service(&lg);
+        if (fr == FR_OK && frag_kb && lg.out >= fill_at) {
+            fr = f_lseek(&filler, f_tell(&filler) + layout.cluster_bytes);  // allocates one cluster
+            fill_at += frag_kb * 1024u;
+        }
+    }
+    records--;
+    if (b.stats.dropped) fr = FR_DENIED;
+    BINLOG_Sync(&b);
+    if (fr == FR_OK) fr = SDLOG_Close(&lg);
+    if (fr == FR_OK && frag_kb) fr = f_close(&filler);
+    BINLOG_GetStats(&b, &bst);
+    if (fr != FR_OK) {
+        fprintf(stderr, "write failed: %d\n", fr);
+        return 1;
+    }
+
+    /* plain f_lseek, 16 bytes read at each offset */
+    fr = Boot(&fs);
+    if (fr == FR_OK) fr = f_open(&fil, "LOG.BIN", FA_READ);
+    size = f_size(&fil);
+    rng = 1;
+    for (uint32_t i = 0; fr == FR_OK && i < seeks; i++) {
+        uint8_t tmp[16];
+        FSIZE_t ofs = Rand(&rng) % size;
+        CostStart(&t0);
+        fr = f_lseek(&fil, ofs);
+        if (fr == FR_OK) fr = f_read(&fil, tmp, sizeof(tmp), &bw);
+        CostEnd(&plain, t0);
+    }
+    f_close(&fil);
+
+    /* without the map, by time */
+    if (fr == FR_OK) fr = Boot(&fs);
+    if (fr == FR_OK) fr = LOGRD_Open(&rd, "LOG.BIN", NULL, 0);
+    rng = 2;
+    for (uint32_t i = 0; fr == FR_OK && i < seeks; i++) {
+        uint32_t ts = 1u + Rand(&rng) % records;
+        CostStart(&t0);
+        fr = LOGRD_SeekTime(&rd, ts, &base);
+        CostEnd(&by_time_nomap, t0);
+        if (fr == FR_OK && (FindRecord(&rd, base, ts, &seq, &decoded) || seq != ts)) bad = 1;
+    }
+    LOGRD_GetStats(&rd, &rst);
+    hops_nomap = rst.hops;
+    LOGRD_Close(&rd);
+
+    /* with the map */
+    if (fr == FR_OK) fr = Boot(&fs);
+    CostStart(&t0);
+    if (fr == FR_OK) fr = LOGRD_Open(&rd, "LOG.BIN", map, map_len);
+    CostEnd(&open_map, t0);
+    rng = 1;
+    for (uint32_t i = 0; fr == FR_OK && i < seeks; i++) {
+        uint8_t tmp[16];
+        CostStart(&t0);
+        fr = LOGRD_Seek(&rd, Rand(&rng) % size);
+        if (fr == FR_OK) fr = LOGRD_Read(&rd, tmp, sizeof(tmp), &bw);
+        CostEnd(&by_ofs, t0);
+    }
+    rng = 2;
+    memset(&rd.stats, 0, sizeof(rd.stats));
+    for (uint32_t i = 0; fr == FR_OK && i < seeks; i++) {
+        uint32_t ts = 1u + Rand(&rng) % records;
+        CostStart(&t0);
+        fr = LOGRD_SeekTime(&rd, ts, &base);
+        CostEnd(&by_time, t0);
+        if (fr == FR_OK && (FindRecord(&rd, base, ts, &seq, &decoded) || seq != ts)) bad = 1;
+        sum_decoded += decoded;
+        if (decoded > max_decoded) max_decoded = decoded;
+    }
+    LOGRD_GetStats(&rd, &rst);
+    LOGRD_Close(&rd);
+    f_mount(NULL, USERPath, 0);
+    if (fr != FR_OK) {
+        fprintf(stderr, "read failed: %d\n", fr);
+        return 1;
+    }
+
+    printf("log                 : %.1f MB, %u records, %u KB clusters%s\n", size / 1048576.0,
+           (unsigned)records, (unsigned)(layout.cluster_bytes / 1024u), frag_kb ? ", fragmented" : "");
+    printf("index               : %u records for %u sync frames, %.2f%% of the log\n",
+           (unsigned)bst.indexes, (unsigned)bst.syncs,
+           100.0 * bst.indexes * BINLOG_INDEX_SIZE / (double)size);
+    if (rd.mapped)
+        printf("cluster map         : %u DWORDs (%u fragments), built in %.3f ms / %u sector reads\n",
+               (unsigned)map[0], (unsigned)((map[0] - 2u) / 2u), open_map.ns / 1e6, (unsigned)open_map.reads);
+    else
+        printf("cluster map         : needs %u DWORDs, %u given; not used\n", (unsigned)rd.map_need, (unsigned)map_len);
+    CostPrint("f_lseek", &plain);
+    CostPrint("LOGRD_Seek", &by_ofs);
+    CostPrint("by time, no map", &by_time_nomap);
+    CostPrint("by time", &by_time);
+    printf("by time             : %.1f index records/seek (%.1f without the map), decoded %.0f B avg / %u B max "
+           "to the record\n", (double)rst.hops / seeks, (double)hops_nomap / seeks,
+           (double)sum_decoded / seeks, (unsigned)max_decoded);
+    printf("verify              : %s\n", bad ? "FAIL" : "ok");
+    SdSim_Free(0);
+    return bad ? 1 : 0;
+}
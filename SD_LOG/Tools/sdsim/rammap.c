@@ -0,0 +1,224 @@
+/**
+  ******************************************************************************
+  * @file           : rammap.c
+  * @brief          : RAM use per module from the GNU ld map file
+  ******************************************************************************
+  * @note           : Reads the map the firmware link writes (Debug/SD_LOG.map,
+  *                   -Wl,-Map) and adds up the input sections that landed in
+  *                   a writable memory region, per object file: initialised
+  *                   data, zeroed data, and CCM RAM. Sections --gc-sections
+  *                   dropped are listed under "Discarded input sections" and
+  *                   do not count. The stack and heap minimums of the linker
+  *                   script show up as their own line. Run it after every
+  *                   build (make rammap, or as a post-build step in the IDE:
+  *                   rammap ${ProjName}.map) to see where the RAM went.
+  *
+  *                   usage: rammap [-v] [-n N] MAP
+  *                     -v    every input section of size N or more as well
+  *                     -n N  threshold for -v (default 64)
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_REGIONS     8
+#define MAX_MODULES     256
+#define MAX_ITEMS       2048
+
+typedef struct {
+    char name[32];
+    unsigned long origin, length, used;
+} Region_t;
+
+/* per module: .data, .bss, CCM (what goes in a region other than the first) */
+typedef struct {
+    char name[96];
+    unsigned long data, bss, ccm;
+} Module_t;
+
+typedef struct {
+    char name[64];
+    unsigned long size;
+    int module;
+} Item_t;
+
+static Region_t Regions[MAX_REGIONS];
+static int NRegions;
+static Module_t Modules[MAX_MODULES];
+static int NModules;
+static Item_t Items[MAX_ITEMS];
+static int NItems;
+static int Order[MAX_MODULES];
+
+/* the object file, without the directories the toolchain put in front */
+static const char *ModuleName(const char *path, const char *out_sect)
+{
+    const char *p, *base = path;
+
+    if (!path || !*path) return strcmp(out_sect, "._user_heap_stack") ? "(alignment)" : "(stack and heap minimum)";
+    for (p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+        if (*p == '(') break;  /* libc.a(lib_a-impure.o): keep the archive name */
+    }
+    if (strncmp(path, "./", 2) == 0) return path + 2;
+    return base;
+}
+
+static int ModuleIndex(const char *name)
+{
+    for (int i = 0; i < NModules; i++)
+        if (!strcmp(Modules[i].name, name)) return i;
+    if (NModules == MAX_MODULES) return MAX_MODULES - 1;
+    snprintf(Modules[NModules].name, sizeof(Modules[0].name), "%s", name);
+    return NModules++;
+}
+
+static Region_t *RegionOf(unsigned long addr)
+{
+    for (int i = 0; i < NRegions; i++)
+        if (addr >= Regions[i].origin && addr - Regions[i].origin < Regions[i].length) return &Regions[i];
+    return NULL;
+}
+
+static void Add(const char *in_sect, unsigned long addr, unsigned long size, const char *path,
+                const char *out_sect)
+{
+    Region_t *r = RegionOf(addr);
+    int m;
+
+    if (!r || !size) return;
+    r->used += size;
+    m = ModuleIndex(ModuleName(path, out_sect));
+    if (r != &Regions[0]) Modules[m].ccm += size;
+    else if (!strncmp(out_sect, ".data", 5)) Modules[m].data += size;
+    else Modules[m].bss += size;
+    if (NItems < MAX_ITEMS) {
+        snprintf(Items[NItems].name, sizeof(Items[0].name), "%s", in_sect);
+        Items[NItems].size = size;
+        Items[NItems].module = m;
+        NItems++;
+    }
+}
+
+static int ByTotal(const void *a, const void *b)
+{
+    const Module_t *x = &Modules[*(const int *)a], *y = &Modules[*(const int *)b];
+    unsigned long tx = x->data + x->bss + x->ccm, ty = y->data + y->bss + y->ccm;
+    return (tx < ty) - (tx > ty);
+}
+
+int main(int argc, char **argv)
+{
+    static char line[1024], pending[256];
+    char out_sect[64] = "", tok[4][256];
+    const char *path = NULL;
+    unsigned long threshold = 64, addr, size;
+    int verbose = 0, state = 0, n;
+    unsigned long tot_data = 0, tot_bss = 0, tot_ccm = 0;
+    FILE *f;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v")) verbose = 1;
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) threshold = strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-') path = argv[i];
+        else path = NULL, i = argc;
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-v] [-n N] MAP\n", argv[0]);
+        return 2;
+    }
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        return 1;
+    }
+
+    /* state 0: before the memory configuration, 1: in it, 2: in the memory map */
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!strncmp(line, "Memory Configuration", 20)) { state = 1; continue; }
+        if (!strncmp(line, "Linker script and memory map", 28)) { state = 2; continue; }
+        if (state == 1) {
+            char name[32], attr[16] = "";
+            n = sscanf(line, "%31s %lx %lx %15s", name, &addr, &size, attr);
+            /* writable regions; the first one listed that is not CCM is the main RAM */
+            if (n == 4 && strchr(attr, 'w') && NRegions < MAX_REGIONS) {
+                Region_t *r = &Regions[NRegions++];
+                memcpy(r->name, name, sizeof(r->name));
+                r->origin = addr;
+                r->length = size;
+                r->used = 0;
+                if (strcmp(r->name, "CCMRAM") && NRegions > 1) {
+                    Region_t t = Regions[0];
+                    Regions[0] = *r;
+                    *r = t;
+                }
+            }
+            continue;
+        }
+        if (state != 2 || !line[0]) continue;
+
+        /* output section: ".bss  0x20000164  0x20e4", the name may stand alone */
+        if (line[0] == '.') {
+            sscanf(line, "%63s", out_sect);
+            pending[0] = 0;
+            continue;
+        }
+        if (line[0] != ' ') {
+            out_sect[0] = 0;
+            continue;
+        }
+
+        n = sscanf(line, "%255s %255s %255s %255s", tok[0], tok[1], tok[2], tok[3]);
+        if (n <= 0) continue;
+        if (!strcmp(tok[0], "*fill*") && n >= 3) {
+            Add("*fill*", strtoul(tok[1], NULL, 16), strtoul(tok[2], NULL, 16), NULL, out_sect);
+            continue;
+        }
+        if (tok[0][0] == '.' || !strcmp(tok[0], "COMMON")) {
+            /* " .bss.x  0x..  0x..  file.o", or the name alone and the rest on the next line */
+            if (n == 1) {
+                snprintf(pending, sizeof(pending), "%s", tok[0]);
+                continue;
+            }
+            if (n >= 4 && !strncmp(tok[1], "0x", 2) && !strncmp(tok[2], "0x", 2)) {
+                const char *file = strstr(line, tok[3]);
+                Add(tok[0], strtoul(tok[1], NULL, 16), strtoul(tok[2], NULL, 16), file, out_sect);
+            }
+            pending[0] = 0;
+            continue;
+        }
+        if (pending[0] && n >= 3 && !strncmp(tok[0], "0x", 2) && !strncmp(tok[1], "0x", 2)) {
+            const char *file = strstr(line, tok[2]);
+            Add(pending, strtoul(tok[0], NULL, 16), strtoul(tok[1], NULL, 16), file, out_sect);
+        }
+        pending[0] = 0;
+    }
+    fclose(f);
+    if (!NRegions) {
+        fprintf(stderr, "%s: no writable memory regions, not a GNU ld map?\n", path);
+        return 1;
+    }
+
+    for (int i = 0; i < NModules; i++) Order[i] = i;
+    qsort(Order, NModules, sizeof(Order[0]), ByTotal);
+    printf("%-64s %8s %8s %8s %8s\n", "module", ".data", ".bss", "CCM", "total");
+    for (int i = 0; i < NModules; i++) {
+        Module_t *m = &Modules[Order[i]];
+        printf("%-64.64s %8lu %8lu %8lu %8lu\n", m->name, m->data, m->bss, m->ccm, m->data + m->bss + m->ccm);
+        tot_data += m->data;
+        tot_bss += m->bss;
+        tot_ccm += m->ccm;
+        if (!verbose) continue;
+        for (int k = 0; k < NItems; k++) {
+            if (Items[k].module != Order[i] || Items[k].size < threshold) continue;
+            printf("    %-60.60s %8lu\n", Items[k].name, Items[k].size);
+        }
+    }
+    printf("%-64s %8lu %8lu %8lu %8lu\n", "total", tot_data, tot_bss, tot_ccm, tot_data + tot_bss + tot_ccm);
+    for (int i = 0; i < NRegions; i++)
+        printf("%-8s %7lu of %7lu bytes used, %7lu free\n", Regions[i].name, Regions[i].used, Regions[i].length,
+               Regions[i].length - Regions[i].used);
+    return 0;
+}
@@ -0,0 +1,794 @@
+/**
+  ******************************************************************************
+  * @file           : sd_bench.c
+  * @brief          : FatFs-on-simulated-card throughput benchmark
+  ******************************************************************************
+  * @note           : Formats a simulated card through the real FatFs and
+  *                   FATFS_SD driver, appends a log file in fixed-size chunks,
+  *                   reads it back and reports simulated throughput, SPI bytes
+  *                   per sector and the command mix. Driver modes are selected
+  *                   at build time with the usual FATFS_SD.h switches (see
+  *                   Tools/Makefile for the variants that are built).
+  ******************************************************************************
+  */
+
+#include "main.h"
+#include "fatfs.h"
+#include "sd_card_sim.h"
+#include "FATFS_SD.h"
+#include "sd_format.h"
+#include "sd_rawlog.h"
+#include "sd_logger.h"
+#include "sd_rotlog.h"
+#include "sd_fastmount.h"
+#include "sd_binlog.h"
+#include "sd_bbox.h"
+#include "ff_gen_drv.h"
+#if SD_USE_SDIO
+#include "sdio_mock.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern Disk_drvTypeDef disk;  /* diskio.c, to power-cycle the drive */
+
+/* Static buffers in ff.c: LfnBuf with _USE_LFN 1, and DirBuf (MAXDIRB) for
+   the exFAT directory entry set */
+#if _USE_LFN == 1
+#define BENCH_FF_STATIC     ((_MAX_LFN + 1u) * 2u + (_FS_EXFAT ? (_MAX_LFN + 44u) / 15u * 32u : 0u))
+#else
+#define BENCH_FF_STATIC     0u
+#endif
+
+SPI_HandleTypeDef hspi1;
+SPI_HandleTypeDef hspi2;
+
+/* Firmware SysTick_Handler() equivalent */
+void SdSim_SysTick(void)
+{
+    SD_disk_timerproc();
+}
+
+typedef struct {
+    uint32_t total_kb;
+    uint32_t chunk;
+    uint32_t work_us;
+    uint32_t sync_every;
+    int mirror;
+    int plain_mkfs;
+    int exfat;
+    int pre_erase;
+    int raw;
+    int logger;
+    int power_cut;
+    int fast_mount;
+    uint32_t rot_files;
+    uint32_t rot_kb;
+    uint32_t bbox_mb;
+    const char *policy;
+    SDLOG_Policy_t sync;
+    uint32_t commit_every;
+    const char *image;
+    int quiet;
+} Bench_Args_t;
+
+static void Usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s KB      bytes to log (default 4096 KB)\n"
+            "  -c BYTES   f_write chunk size (default 4096)\n"
+            "  -a US      application work between chunks, polling the driver\n"
+            "  -y N       f_sync after every N chunks\n"
+            "  -m         mirror the log to a second card on SPI2 (drive 1:)\n"
+            "  -g         plain f_mkfs(FM_ANY) instead of the AU-aligned format\n"
+            "  -X         AU-aligned exFAT, whatever the card size\n"
+            "  -u CODE    card AU_SIZE code (default 9 = 4 MB)\n"
+            "  -z MB      card size (default 128)\n"
+            "  -e         reserve and pre-erase the log file before writing\n"
+            "  -R         raw log: contiguous extent, sectors written past FatFs\n"
+            "  -k         with -R, -L or -B: cut power instead of closing, recover at mount\n"
+            "  -M         boot three times before logging: f_mount, FMOUNT_Mount without\n"
+            "             and with a cache, and report each mount time\n"
+            "  -L         chunks are records through the queue and the double-buffered logger\n"
+            "  -O N:KB    with -L: rotating set of N files of KB each in LOGS/\n"
+            "  -P LIST    with -L: durability policy, comma separated ms:N, kb:N,\n"
+            "             ev:N (SDLOG_Commit every Nth record), fsi:N, or never\n"
+            "  -B MB      black box: chunks are binary log records in a raw partition of\n"
+            "             MB, written in two sessions with a reboot between them\n"
+            "  -w US      card write busy per block (default 250)\n"
+            "  -r US      card read access latency (default 300)\n"
+            "  -t N:US    every Nth block stalls for US microseconds\n"
+            "  -I N:NS    every Nth SPI register access is held up NS by an interrupt\n"
+            "  -x N       flip a bit in every Nth data block on the wire\n"
+            "  -h NS      CPU cost per HAL SPI call (default 1500)\n"
+            "  -o FILE    save the card image after the run\n"
+            "  -q         one-line summary\n", prog);
+}
+
+/* power cycle and mount again: the driver identifies the card again and
+   the sector cache starts empty; a FAT12/16 free count is made up by a
+   scan, as SD_Card_Test and ROTLOG_Open do */
+static FRESULT Boot(FATFS *fs, FMOUNT_Cache_t *cache, BYTE *how, uint64_t *ns, uint32_t *reads, uint32_t *init_us)
+{
+    SD_Stats_t st;
+    FATFS *fsp;
+    DWORD nclst;
+    uint64_t t0;
+    FRESULT fr;
+
+    f_mount(NULL, USERPath, 0);
+    disk.is_initialized[0] = 0;
+    disk_ioctl(0, SD_GET_STATS_CLEAR, &st);
+    t0 = SdSim_NowNs();
+    fr = cache ? FMOUNT_Mount(fs, USERPath, cache, how) : f_mount(fs, USERPath, 1);
+    if (fr == FR_OK && ROTLOG_FreeClusters(fs) == ROTLOG_FREE_UNKNOWN && fs->fs_type != FS_FAT32) {
+        fr = f_getfree(USERPath, &nclst, &fsp);
+        if (cache) FMOUNT_Save(fs, cache);
+    }
+    *ns = SdSim_NowNs() - t0;
+    disk_ioctl(0, SD_GET_STATS, &st);
+    *reads = st.op[SD_OP_RD_SINGLE].count + st.op[SD_OP_RD_MULTI].count;
+    *init_us = (uint32_t)st.op[SD_OP_INIT].total_us;
+    return fr;
+}
+
+/* "ms:100,kb:64,ev:50,fsi:4" or "never" */
+static int ParsePolicy(Bench_Args_t *args, const char *spec)
+{
+    char key[8];
+    unsigned long v;
+    int n;
+
+    memset(&args->sync, 0, sizeof(args->sync));
+    args->commit_every = 0;
+    args->policy = spec;
+    if (!strcmp(spec, "never")) return 0;
+    while (*spec) {
+        if (sscanf(spec, "%7[a-z]:%lu%n", key, &v, &n) != 2) return 1;
+        if (!strcmp(key, "ms")) args->sync.sync_ms = (uint32_t)v;
+        else if (!strcmp(key, "kb")) args->sync.sync_bytes = (uint32_t)v * 1024u;
+        else if (!strcmp(key, "ev")) args->commit_every = (uint32_t)v;
+        else if (!strcmp(key, "fsi")) args->sync.fsinfo_every = (uint32_t)v;
+        else return 1;
+        spec += n;
+        if (*spec == ',') spec++;
+        else if (*spec) return 1;
+    }
+    return 0;
+}
+
+/* CPU cycles spent per byte the CPU clocked itself */
+static double CyclesPerByte(const SdSim_Stats_t *st)
+{
+    uint64_t wire = st->spi_bytes - st->dma_bytes;
+    if (!st->cpu_spi_ns || !wire) return 0.0;
+    return st->cpu_spi_ns * (SystemCoreClock / 1e9) / (double)wire;
+}
+
+static void Pattern(uint8_t *buf, uint32_t len, uint32_t offset)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t x = offset + i;
+        buf[i] = (uint8_t)(x ^ (x >> 8) ^ (x >> 16));
+    }
+}
+
+static double Seconds(uint64_t ns)
+{
+    return (double)ns / 1e9;
+}
+
+/* the set holds the last bytes logged, oldest file first, in sequence */
+static int VerifySet(uint8_t *buf, uint32_t size, uint32_t total, uint32_t max_files, uint32_t *nfiles)
+{
+    static uint32_t seqs[256];
+    static char path[32];
+    uint8_t expect[512];
+    FSIZE_t sum = 0;
+    uint32_t n = 0, off;
+    DIR dj;
+    FILINFO fno;
+    FIL fil;
+    UINT br;
+
+    if (f_opendir(&dj, "LOGS") != FR_OK) return 1;
+    while (f_readdir(&dj, &fno) == FR_OK && fno.fname[0] && n < 256) {
+        seqs[n++] = (uint32_t)strtoul(fno.fname, NULL, 10);
+        sum += fno.fsize;
+    }
+    f_closedir(&dj);
+    *nfiles = n;
+    if (n == 0 || n > max_files || sum > total) return 1;
+    for (uint32_t i = 1; i < n; i++) {          /* insertion sort, directory order is not creation order */
+        uint32_t v = seqs[i], j = i;
+        for (; j > 0 && seqs[j - 1] > v; j--) seqs[j] = seqs[j - 1];
+        seqs[j] = v;
+    }
+
+    off = total - (uint32_t)sum;
+    for (uint32_t i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "LOGS/%08u.LOG", (unsigned)seqs[i]);
+        if (f_open(&fil, path, FA_READ) != FR_OK) return 1;
+        for (;;) {
+            if (f_read(&fil, buf, size, &br) != FR_OK) return 1;
+            if (br == 0) break;
+            for (uint32_t k = 0; k < br; k += sizeof(expect)) {
+                uint32_t m = (br - k < sizeof(expect)) ? br - k : (uint32_t)sizeof(expect);
+                Pattern(expect, m, off + k);
+                if (memcmp(expect, buf + k, m)) return 1;
+            }
+            off += br;
+        }
+        f_close(&fil);
+    }
+    return off != total;
+}
+
+static void PrintOpStats(const SD_Stats_t *st)
+{
+    static const char *names[SD_OP_CLASSES] = { "read 1", "read N", "write 1", "write N", "busy", "init", "erase" };
+    for (int op = 0; op < SD_OP_CLASSES; op++) {
+        const SD_OpStats_t *o = &st->op[op];
+        if (!o->count) continue;
+        printf("  %-8s n=%-7u avg %6.0f us  max %6u us |", names[op], (unsigned)o->count,
+               (double)o->total_us / o->count, (unsigned)o->max_us);
+        for (int b = 0; b < SD_STAT_BUCKETS; b++) {
+            if (o->hist[b]) printf(" %s%u:%u", b == SD_STAT_BUCKETS - 1 ? ">=" : "", 1u << b, (unsigned)o->hist[b]);
+        }
+        printf("\n");
+    }
+}
+
+/* black box (-B): the log goes into the raw partition as BINLOG_WriteBytes
+   records, in two sessions with a power cycle after each; every boot must
+   find the block the previous session wrote last */
+static int BlackBox(const Bench_Args_t *args, FATFS *fs, const SDFMT_Layout_t *layout, uint8_t *buf)
+{
+    static const uint8_t types[] = { BINLOG_BYTES };
+    static const char *const fields[] = { "data" };
+    static const BINLOG_Schema_t chunk = { 1, "chunk", 1, types, fields };
+    static const BINLOG_Schema_t *const schemas[] = { &chunk };
+    static BBOX_t bb;
+    static BINLOG_t bl;
+    BBOX_Stats_t bst;
+    uint32_t total = args->total_kb * 1024u, done = 0, end, n;
+    uint32_t expect = 0, probes[3], heads[3], blocks = 0, writes = 0, peak = 0, dropped = 0;
+    uint64_t t0, t_write = 0;
+    FRESULT fr = FR_OK;
+    int bad = 0;
+
+    for (int boot = 0; fr == FR_OK && boot < 3; boot++) {
+        if (boot) {
+            f_mount(NULL, USERPath, 0);
+            disk.is_initialized[0] = 0;
+            fr = f_mount(fs, USERPath, 1);
+        }
+        if (fr == FR_OK) fr = BBOX_Open(&bb, 0);
+        if (fr != FR_OK) break;
+        heads[boot] = bb.last_seq;
+        probes[boot] = bb.stats.probes;
+        if (bb.last_seq != expect) bad = 1;
+        if (boot == 2) break;
+
+        /* a session: preamble, half of the log, then flush or power cut */
+        if (!BINLOG_Init(&bl, BBOX_Sink, &bb, schemas, 1) || !BINLOG_Sync(&bl)) fr = FR_DENIED;
+        if (fr == FR_OK) fr = BBOX_SavePreamble(&bb);
+        end = boot ? total : total / 2u;
+        t0 = SdSim_NowNs();
+        for (; fr == FR_OK && done < end; done += n) {
+            n = (end - done < args->chunk) ? end - done : args->chunk;
+            Pattern(buf, n, done);
+            if (!BINLOG_WriteBytes(&bl, 1, done / args->chunk, buf, n)) fr = FR_DENIED;
+            else fr = BBOX_Service(&bb);
+        }
+        if (fr == FR_OK && !args->power_cut) {
+            if (!BINLOG_Sync(&bl)) fr = FR_DENIED;
+            else fr = BBOX_Flush(&bb);
+        }
+        t_write += SdSim_NowNs() - t0;
+        BBOX_GetStats(&bb, &bst);
+        blocks += bst.blocks;
+        writes += bst.writes;
+        dropped += bst.dropped;
+        if (bst.max_pending > peak) peak = bst.max_pending;
+        expect = bb.last_seq;
+    }
+    if (fr != FR_OK) {
+        fprintf(stderr, "black box failed: %d\n", fr);
+        return 1;
+    }
+    if (dropped) bad = 1;
+
+    if (args->quiet) {
+        printf("write %.1f KB/s  %.1f blocks/write  head found in %u reads  verify %s\n",
+               total / 1024.0 / Seconds(t_write), writes ? (double)blocks / writes : 0.0,
+               (unsigned)probes[2], bad ? "FAIL" : "ok");
+        return bad;
+    }
+    printf("volume layout       : %u KB clusters, data at LBA %u, AU %u sectors (%s)\n",
+           (unsigned)(layout->cluster_bytes / 1024u), (unsigned)layout->data_base,
+           (unsigned)layout->au_sectors, layout->aligned ? "aligned" : "not aligned");
+    printf("black box           : %u ring blocks at LBA %u, %u B payload each\n",
+           (unsigned)bb.blocks, (unsigned)(bb.base + 1u), (unsigned)BBOX_PAYLOAD);
+    printf("bytes logged        : %u (chunk %u) in 2 sessions, %s\n", (unsigned)total, (unsigned)args->chunk,
+           args->power_cut ? "each ended by a power cut" : "each flushed");
+    printf("write throughput    : %.1f KB/s (%.3f s simulated)\n", total / 1024.0 / Seconds(t_write),
+           Seconds(t_write));
+    printf("block writes        : %u blocks in %u SD_disk_write calls, peak %u of %u RAM blocks, %u dropped\n",
+           (unsigned)blocks, (unsigned)writes, (unsigned)peak, (unsigned)BBOX_RING_BLOCKS, (unsigned)dropped);
+    for (int boot = 0; boot < 3; boot++)
+        printf("boot %d head          : seq %u in %u block reads%s\n", boot + 1, (unsigned)heads[boot],
+               (unsigned)probes[boot], boot ? "" : " (empty ring)");
+    printf("verify              : %s\n", bad ? "FAIL" : "ok");
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t work[_MAX_SS];
+    static uint8_t buf[65536];
+    SdSim_Config_t cfg;
+    Bench_Args_t args = { 4096, 4096, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, { 0, 0, 0 }, 0, NULL, 0 };
+    USER_CacheStats_t cache;
+    SD_Stats_t ops, rops;
+    SD_BusyStats_t busy0, busy1;
+    SD_SpiClock_t clk;
+    SDFMT_Layout_t layout;
+    SdSim_Stats_t *st;
+    FATFS fs, fs2;
+    FIL fil, fil2;
+    RAWLOG_t raw;
+    static SDLOG_t lg;
+    static uint32_t qbuf[LOGQ_MAX_SIZE / 4];
+    LOGQ_t q;
+    SDLOG_Stats_t lgst;
+    static ROTLOG_t rot;
+    ROTLOG_Stats_t rotst;
+    DWORD free_tracked = 0, free_scanned = 0;
+    uint64_t t_step, t_step_max = 0, t_scan = 0;
+    uint32_t set_files = 0;
+    uint64_t mount_ns[3];
+    uint32_t mount_reads[3], mount_init_us[3];
+    BYTE mount_how[3];
+    FSIZE_t recorded = 0, recovered = 0;
+    FRESULT fr;
+    UINT bw;
+    uint64_t t0, t_write, t_read, t_work = 0, t_erase = 0;
+    uint32_t total, kept, done, erases = 0, cut_age = 0;
+    int bad = 0;
+
+    SdSim_DefaultConfig(&cfg);
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "-q")) { args.quiet = 1; continue; }
+        if (!strcmp(a, "-m")) { args.mirror = 1; continue; }
+        if (!strcmp(a, "-g")) { args.plain_mkfs = 1; continue; }
+        if (!strcmp(a, "-X")) { args.exfat = 1; continue; }
+        if (!strcmp(a, "-e")) { args.pre_erase = 1; continue; }
+        if (!strcmp(a, "-R")) { args.raw = 1; continue; }
+        if (!strcmp(a, "-k")) { args.power_cut = 1; continue; }
+        if (!strcmp(a, "-L")) { args.logger = 1; continue; }
+        if (!strcmp(a, "-M")) { args.fast_mount = 1; continue; }
+        if (!v) { Usage(argv[0]); return 2; }
+        i++;
+        if (!strcmp(a, "-s")) args.total_kb = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-c")) args.chunk = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-y")) args.sync_every = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-a")) args.work_us = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-w")) cfg.write_busy_us = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-r")) cfg.read_latency_us = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-x")) cfg.corrupt_every = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-u")) cfg.au_size = (uint8_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-z")) cfg.capacity_mb = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-h")) SdSim_HalCallNs = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-o")) args.image = v;
+        else if (!strcmp(a, "-B")) args.bbox_mb = (uint32_t)strtoul(v, NULL, 0);
+        else if (!strcmp(a, "-P")) {
+            if (ParsePolicy(&args, v)) { Usage(argv[0]); return 2; }
+        }
+        else if (!strcmp(a, "-O")) {
+            char *end;
+            args.rot_files = (uint32_t)strtoul(v, &end, 0);
+            args.rot_kb = (*end == ':') ? (uint32_t)strtoul(end + 1, NULL, 0) : 0;
+        }
+        else if (!strcmp(a, "-I")) {
+            char *end;
+            SdSim_IrqEvery = (uint32_t)strtoul(v, &end, 0);
+            SdSim_IrqNs = (*end == ':') ? (uint32_t)strtoul(end + 1, NULL, 0) : 0;
+        }
+        else if (!strcmp(a, "-t")) {
+            char *end;
+            cfg.stall_every = (uint32_t)strtoul(v, &end, 0);
+            cfg.stall_us = (*end == ':') ? (uint32_t)strtoul(end + 1, NULL, 0) : 0;
+        }
+        else { Usage(argv[0]); return 2; }
+    }
+    if (args.chunk == 0 || args.chunk > sizeof(buf)) {
+        fprintf(stderr, "chunk must be 1..%u\n", (unsigned)sizeof(buf));
+        return 2;
+    }
+    if (args.raw && (args.mirror || args.pre_erase)) {
+        fprintf(stderr, "-R logs to drive 0 only and trims its own extent\n");
+        return 2;
+    }
+    if (args.logger && args.chunk > LOGQ_MAX_RECORD) {
+        fprintf(stderr, "-L records are at most %u bytes\n", (unsigned)LOGQ_MAX_RECORD);
+        return 2;
+    }
+    if (args.logger && (args.raw || args.mirror)) {
+        fprintf(stderr, "-L writes one ordinary file on drive 0\n");
+        return 2;
+    }
+    if (args.rot_files && (!args.logger || args.rot_files < 2 || !args.rot_kb)) {
+        fprintf(stderr, "-O needs -L, 2 or more files and a size\n");
+        return 2;
+    }
+    if (args.policy && !args.logger) {
+        fprintf(stderr, "-P needs -L\n");
+        return 2;
+    }
+    if (args.power_cut && !args.raw && !args.bbox_mb && (!args.logger || args.rot_files)) {
+        fprintf(stderr, "-k needs -R, -B, or -L without -O\n");
+        return 2;
+    }
+    if (args.bbox_mb && (args.raw || args.logger || args.mirror || args.plain_mkfs || args.pre_erase)) {
+        fprintf(stderr, "-B logs to its own partition on drive 0 only\n");
+        return 2;
+    }
+    if (args.bbox_mb && args.chunk > BINLOG_MAX_RECORD - 11u) {
+        fprintf(stderr, "-B records carry at most %u bytes\n", (unsigned)(BINLOG_MAX_RECORD - 11u));
+        return 2;
+    }
+    if (args.exfat && (args.plain_mkfs || !_FS_EXFAT)) {
+        fprintf(stderr, "-X needs a build with _FS_EXFAT and no -g\n");
+        return 2;
+    }
+
+#if SD_USE_SDIO
+    if (args.mirror) {
+        fprintf(stderr, "-m needs the SPI driver, the SDIO backend serves drive 0 only\n");
+        return 2;
+    }
+#endif
+    if (SdSim_Init(0, &cfg) != 0 || (args.mirror && SdSim_Init(1, &cfg) != 0)) {
+        fprintf(stderr, "cannot allocate card image\n");
+        return 1;
+    }
+    SdSim_Bind(0, 0, SD_CS_PORT, SD_CS_PIN);
+    hspi1.Instance = SPI1;
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256;
+    hspi1.Instance->CR1 = SPI_BAUDRATEPRESCALER_256 | SPI_CR1_SPE;
+    SdSim_Bind(1, 1, SD_CS_PORT2, SD_CS_PIN2);
+    hspi2.Instance = SPI2;
+    hspi2.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256;
+    hspi2.Instance->CR1 = SPI_BAUDRATEPRESCALER_256 | SPI_CR1_SPE;
+#if SD_USE_SDIO
+    SdioMock_Attach(0);
+#endif
+
+    MX_FATFS_Init();
+    if (args.plain_mkfs) {
+        fr = f_mkfs(USERPath, FM_ANY, 0, work, sizeof(work));
+    } else {
+        fr = SDFMT_FormatAs(USERPath, args.exfat ? FS_EXFAT : 0, args.bbox_mb * 2048u, work, sizeof(work), NULL);
+    }
+    if (fr == FR_OK) fr = f_mount(&fs, USERPath, 1);
+    if (fr == FR_OK && args.mirror) {
+        if (args.plain_mkfs) {
+            fr = f_mkfs(SD2Path, FM_ANY, 0, work, sizeof(work));
+        } else {
+            fr = SDFMT_FormatAs(SD2Path, args.exfat ? FS_EXFAT : 0, 0, work, sizeof(work), NULL);
+        }
+        if (fr == FR_OK) fr = f_mount(&fs2, SD2Path, 1);
+    }
+    if (fr != FR_OK) {
+        fprintf(stderr, "format/mount failed: %d\n", fr);
+        return 1;
+    }
+    SDFMT_GetLayout(&fs, &layout);
+
+    if (args.bbox_mb) {
+        bad = BlackBox(&args, &fs, &layout, buf);
+        if (args.image && SdSim_SaveImage(0, args.image) != 0) {
+            fprintf(stderr, "cannot save image %s\n", args.image);
+        }
+        SdSim_Free(0);
+        return bad;
+    }
+
+    /* boot with f_mount, then twice with FMOUNT_Mount: fills the cache, uses it */
+    if (args.fast_mount) {
+        static FMOUNT_Cache_t fmc;
+        for (int b = 0; fr == FR_OK && b < 3; b++) {
+            mount_how[b] = FMOUNT_NO_CACHE;
+            fr = Boot(&fs, b ? &fmc : NULL, &mount_how[b], &mount_ns[b], &mount_reads[b], &mount_init_us[b]);
+        }
+        if (fr != FR_OK) {
+            fprintf(stderr, "remount failed: %d\n", fr);
+            return 1;
+        }
+    }
+
+    /* append phase */
+    total = args.total_kb * 1024u;
+    kept = total;
+    if (args.raw) fr = RAWLOG_Open(&raw, "LOG.BIN", total);
+    else if (args.rot_files) fr = ROTLOG_Open(&rot, "LOGS", args.rot_files, (FSIZE_t)args.rot_kb * 1024u);
+    else fr = f_open(&fil, "LOG.BIN", FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr == FR_OK && args.logger) {
+        LOGQ_Init(&q, qbuf, sizeof(qbuf));
+        fr = SDLOG_Init(&lg, args.rot_files ? ROTLOG_File(&rot) : &fil);
+        SDLOG_SetPolicy(&lg, &args.sync);
+        SDLOG_SetContiguous(&lg, args.rot_files ? (FSIZE_t)args.rot_kb * 1024u + SDLOG_BUF_COUNT * SDLOG_BUF_BYTES
+                                                : (FSIZE_t)total);
+    }
+    if (fr == FR_OK && args.mirror) fr = f_open(&fil2, "1:LOG.BIN", FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr == FR_OK && args.pre_erase) {
+        disk_ioctl(0, SD_GET_STATS_CLEAR, &ops);
+        t0 = SdSim_NowNs();
+        fr = SDFMT_PreErase(&fil, total);
+        if (fr == FR_OK && args.mirror) fr = SDFMT_PreErase(&fil2, total);
+        t_erase = SdSim_NowNs() - t0;
+        disk_ioctl(0, SD_GET_STATS, &ops);
+        erases = ops.op[SD_OP_ERASE].count;
+    }
+    SdSim_ResetStats(0);
+    SdSim_Watch(0, layout.fat_base, layout.fat_sectors * fs.n_fats);
+    disk_ioctl(0, SD_GET_BUSY_STATS, &busy0);
+    disk_ioctl(0, USER_RESET_CACHE_STATS, NULL);
+    disk_ioctl(0, SD_GET_STATS_CLEAR, &ops);
+    t0 = SdSim_NowNs();
+    for (done = 0; fr == FR_OK && done < total; done += bw) {
+        uint32_t n = (total - done < args.chunk) ? total - done : args.chunk;
+        Pattern(buf, n, done);
+        if (args.raw) {
+            fr = RAWLOG_Write(&raw, buf, n);
+            bw = n;
+        } else if (args.logger) {
+            /* an interrupt queues the record, the main loop drains and writes */
+            if (!LOGQ_Push(&q, buf, n)) fr = FR_DENIED;
+            else if (SDLOG_Drain(&lg, &q) != 1 || lg.stats.dropped) fr = FR_DENIED;
+            else {
+                if (args.commit_every && (done / args.chunk + 1) % args.commit_every == 0) SDLOG_Commit(&lg);
+                fr = SDLOG_Service(&lg);
+            }
+            /* rotation between records, then one background step */
+            if (fr == FR_OK && args.rot_files) {
+                if (ROTLOG_Due(&rot, &lg)) ROTLOG_Rotate(&rot, &lg);
+                t_step = SdSim_NowNs();
+                fr = ROTLOG_Service(&rot, &lg);
+                t_step = SdSim_NowNs() - t_step;
+                if (t_step > t_step_max) t_step_max = t_step;
+            }
+            bw = n;
+        } else {
+            fr = f_write(&fil, buf, n, &bw);
+            if (fr == FR_OK && bw != n) fr = FR_DENIED;
+        }
+        if (fr == FR_OK && args.sync_every && (done / args.chunk + 1) % args.sync_every == 0) {
+            if (args.raw) fr = RAWLOG_Checkpoint(&raw);
+            else if (args.logger) fr = SDLOG_Flush(&lg);
+            else fr = f_sync(&fil);
+        }
+        /* card 0 programs in the background while card 1 takes its copy */
+        if (fr == FR_OK && args.mirror) {
+            UINT bw2;
+            fr = f_write(&fil2, buf, n, &bw2);
+            if (fr == FR_OK && bw2 != n) fr = FR_DENIED;
+        }
+        /* main loop work (ADC, USB) between chunks, polling in 100 us steps */
+        for (uint32_t us = 0; us < args.work_us; us += 100) {
+            uint64_t w = SdSim_NowNs();
+            SdSim_Advance(100000u);
+            SD_disk_poll(0);
+            if (args.mirror) SD_disk_poll(1);
+            t_work += SdSim_NowNs() - w;
+        }
+    }
+    if (fr == FR_OK && args.power_cut) {
+        /* the unsynced data is lost, the oldest of it waited since dirty_tick */
+        if (args.logger) recorded = total - SDLOG_Unsynced(&lg);
+        if (args.logger && SDLOG_Unsynced(&lg)) cut_age = HAL_GetTick() - lg.dirty_tick;
+    }
+    else if (fr == FR_OK && args.raw) fr = RAWLOG_Close(&raw);
+    else if (fr == FR_OK && args.rot_files) fr = ROTLOG_Close(&rot, &lg);
+    else if (fr == FR_OK && args.logger) fr = SDLOG_Close(&lg);
+    else if (fr == FR_OK && !args.raw) fr = f_close(&fil);
+    if (fr == FR_OK && args.mirror) fr = f_close(&fil2);
+    t_write = SdSim_NowNs() - t0;
+    disk_ioctl(0, SD_GET_BUSY_STATS, &busy1);
+    disk_ioctl(0, SD_GET_SPI_CLOCK, &clk);
+    memset(&cache, 0, sizeof(cache));
+    disk_ioctl(0, USER_GET_CACHE_STATS, &cache);
+    disk_ioctl(0, SD_GET_STATS, &ops);
+    if (fr != FR_OK) {
+        fprintf(stderr, "write failed after %u bytes: %d\n", (unsigned)done, fr);
+        return 1;
+    }
+    st = SdSim_Stats(0);
+    SdSim_Stats_t wst = *st;
+
+    /* power cut: the volume is mounted again and the log size recovered */
+    if (args.power_cut) {
+        if (args.raw) recorded = raw.committed;
+        f_mount(NULL, USERPath, 0);
+        fr = f_mount(&fs, USERPath, 1);
+        if (fr == FR_OK && args.raw) fr = RAWLOG_Recover("LOG.BIN", buf, sizeof(buf), &recovered);
+        if (fr == FR_OK && args.logger) {
+            /* what the last sync recorded in the directory entry survives */
+            FILINFO fno;
+            fr = f_stat("LOG.BIN", &fno);
+            recovered = fno.fsize;
+        }
+        if (fr != FR_OK) {
+            fprintf(stderr, "recovery failed: %d\n", fr);
+            return 1;
+        }
+        if (args.raw ? recovered < total : recovered != recorded) bad = 1;
+        if (args.logger) kept = (uint32_t)recovered;
+    }
+
+    /* rotating set: the count FatFs kept against a full FAT scan */
+    if (args.rot_files) {
+        FATFS *fsp;
+        free_tracked = ROTLOG_FreeClusters(&fs);
+        fs.free_clst = 0xFFFFFFFF;
+        t0 = SdSim_NowNs();
+        f_getfree(USERPath, &free_scanned, &fsp);
+        t_scan = SdSim_NowNs() - t0;
+        if (free_tracked != ROTLOG_FREE_UNKNOWN && free_tracked != free_scanned) bad = 1;
+    }
+
+    /* read-back phase */
+    SdSim_ResetStats(0);
+    t0 = SdSim_NowNs();
+    if (args.rot_files) {
+        if (VerifySet(buf, sizeof(buf), total, args.rot_files, &set_files)) bad = 1;
+        fr = FR_NO_FILE;  /* the pass below is for LOG.BIN */
+    } else {
+        fr = f_open(&fil, "LOG.BIN", FA_READ);
+    }
+    for (done = 0; fr == FR_OK && done < kept; done += bw) {
+        uint8_t expect[512];
+        uint32_t n = (kept - done < args.chunk) ? kept - done : args.chunk;
+        fr = f_read(&fil, buf, n, &bw);
+        if (fr != FR_OK || bw != n) {
+            bad = 1;
+            break;
+        }
+        for (uint32_t off = 0; off < n && !bad; off += sizeof(expect)) {
+            uint32_t m = (n - off < sizeof(expect)) ? n - off : (uint32_t)sizeof(expect);
+            Pattern(expect, m, done + off);
+            if (memcmp(expect, buf + off, m)) bad = 1;
+        }
+    }
+    if (!args.rot_files) f_close(&fil);
+    t_read = SdSim_NowNs() - t0;
+    disk_ioctl(0, SD_GET_STATS, &rops);
+    f_mount(NULL, USERPath, 0);
+
+    if (args.image && SdSim_SaveImage(0, args.image) != 0) {
+        fprintf(stderr, "cannot save image %s\n", args.image);
+    }
+
+    if (args.logger) {
+        SDLOG_GetStats(&lg, &lgst, false);
+        if (cut_age > lgst.max_unsynced_ms) lgst.max_unsynced_ms = cut_age;
+    }
+    if (args.quiet && args.policy) {
+        printf("write %.1f KB/s  %u syncs  %u 1-sector writes  at risk max %u B / %u ms",
+               total / 1024.0 / Seconds(t_write), (unsigned)lgst.syncs, (unsigned)ops.op[SD_OP_WR_SINGLE].count,
+               (unsigned)lgst.max_unsynced, (unsigned)lgst.max_unsynced_ms);
+        if (args.power_cut) printf("  lost %u B at cut", (unsigned)(total - kept));
+        printf("  verify %s\n", bad ? "FAIL" : "ok");
+    } else if (args.quiet) {
+        printf("write %.1f KB/s  read %.1f KB/s  spi/sector %.1f  verify %s\n",
+               total / 1024.0 / Seconds(t_write), kept / 1024.0 / Seconds(t_read),
+               (double)wst.spi_bytes / (total / 512.0), bad ? "FAIL" : "ok");
+    } else {
+        uint32_t data_blocks = (total + 511u) / 512u;
+        printf("volume layout       : %s, %u KB clusters, data at LBA %u, AU %u sectors (%s)\n",
+               layout.fs_type == FS_EXFAT ? "exFAT" : layout.fs_type == FS_FAT32 ? "FAT32" :
+               layout.fs_type == FS_FAT16 ? "FAT16" : "FAT12",
+               (unsigned)(layout.cluster_bytes / 1024u), (unsigned)layout.data_base,
+               (unsigned)layout.au_sectors, layout.aligned ? "aligned" : "not aligned");
+        if (args.fast_mount) {
+            static const char *names[3] = { "f_mount", "FMOUNT, no cache", "FMOUNT, cached" };
+            static const char *hows[4] = { "cached count", "no cache", "mismatch", "stale count" };
+            for (int b = 0; b < 3; b++)
+                printf("mount %-16s: %.2f ms (card init %.2f ms), %u sector reads%s%s%s\n", names[b],
+                       mount_ns[b] / 1e6, mount_init_us[b] / 1e3, (unsigned)mount_reads[b],
+                       b ? " (" : "", b ? hows[mount_how[b]] : "", b ? ")" : "");
+        }
+        printf("bytes logged        : %u (chunk %u)%s\n", (unsigned)total, (unsigned)args.chunk,
+               args.mirror ? ", mirrored to 1:" : "");
+        if (args.power_cut)
+            printf("power cut           : size %llu recorded, %llu after recovery\n",
+                   (unsigned long long)recorded, (unsigned long long)recovered);
+        if (args.logger) {
+            printf("logger              : %u x %u B buffers, %u writes (%u short), peak %u full / %u B, %u dropped, "
+                   "%u files fragmented\n", (unsigned)SDLOG_BUF_COUNT, (unsigned)SDLOG_BUF_BYTES,
+                   (unsigned)lgst.writes, (unsigned)lgst.short_writes, (unsigned)lgst.max_pending,
+                   (unsigned)lgst.max_level, (unsigned)lgst.dropped, (unsigned)lgst.fragmented);
+            printf("durability          : policy %s, %u syncs, at risk max %u B / %u ms%s\n",
+                   args.policy ? args.policy : "never", (unsigned)lgst.syncs, (unsigned)lgst.max_unsynced,
+                   (unsigned)lgst.max_unsynced_ms, args.sync.fsinfo_every ? "" : ", FSINFO on close");
+        }
+        if (args.rot_files) {
+            ROTLOG_GetStats(&rot, &rotst);
+            printf("rotating set        : %u x %u KB, %u rotations (max %u B late), %u deleted in %u trim steps, "
+                   "%u files left\n", (unsigned)args.rot_files, (unsigned)args.rot_kb, (unsigned)rotst.rotations,
+                   (unsigned)rotst.max_overrun, (unsigned)rotst.deleted, (unsigned)rotst.trim_steps,
+                   (unsigned)set_files);
+            printf("background step     : %.2f ms max per ROTLOG_Service\n", t_step_max / 1e6);
+            printf("card erase (CMD38)  : %u trims while logging, %.2f ms busy, %.2f ms max\n",
+                   (unsigned)ops.op[SD_OP_ERASE].count, ops.op[SD_OP_ERASE].total_us / 1e3,
+                   ops.op[SD_OP_ERASE].max_us / 1e3);
+            if (free_tracked == ROTLOG_FREE_UNKNOWN)
+                printf("free clusters       : not tracked (FAT%s, no FSINFO), %u by FAT scan (f_getfree scan %.3f s)\n",
+                       layout.fs_type == FS_FAT16 ? "16" : "12", (unsigned)free_scanned, Seconds(t_scan));
+            else
+                printf("free clusters       : %u tracked, %u by FAT scan (f_getfree scan %.3f s)\n",
+                       (unsigned)free_tracked, (unsigned)free_scanned, Seconds(t_scan));
+        }
+        if (args.pre_erase)
+            printf("pre-erase           : %.3f s in %u trims before the write phase\n",
+                   Seconds(t_erase), (unsigned)erases);
+        printf("write throughput    : %.1f KB/s (%.3f s simulated)\n", total / 1024.0 / Seconds(t_write), Seconds(t_write));
+        if (args.work_us)
+            printf("time in FatFs/driver: %.3f s (%.3f s application work)\n",
+                   Seconds(t_write - t_work), Seconds(t_work));
+        printf("read throughput     : %.1f KB/s (%.3f s simulated)\n", kept / 1024.0 / Seconds(t_read), Seconds(t_read));
+        printf("SPI bytes / sector  : %.1f written, %.1f read\n",
+               (double)wst.spi_bytes / (total / 512.0), (double)st->spi_bytes / (total / 512.0));
+        printf("blocks              : %llu written, %llu read back\n",
+               (unsigned long long)wst.blocks_written, (unsigned long long)st->blocks_read);
+        printf("metadata writes     : %llu FAT blocks, %llu other blocks past the %u of log data\n",
+               (unsigned long long)wst.watch_written,
+               (unsigned long long)(wst.blocks_written - wst.watch_written > data_blocks ?
+                                    wst.blocks_written - wst.watch_written - data_blocks : 0),
+               (unsigned)data_blocks);
+        printf("FatFs RAM (host)    : FATFS %u B, FIL %u B, DIR %u B, FILINFO %u B, ff.c buffers %u B\n",
+               (unsigned)sizeof(FATFS), (unsigned)sizeof(FIL), (unsigned)sizeof(DIR), (unsigned)sizeof(FILINFO),
+               (unsigned)BENCH_FF_STATIC);
+        printf("write commands      : CMD24 %llu  CMD25 %llu  ACMD23 %llu  CMD17 %llu  CMD18 %llu\n",
+               (unsigned long long)wst.cmd_count[24], (unsigned long long)wst.cmd_count[25],
+               (unsigned long long)wst.acmd_count[23], (unsigned long long)wst.cmd_count[17],
+               (unsigned long long)wst.cmd_count[18]);
+        printf("SPI clock           : %.2f MHz (limit %.2f MHz, %u fallbacks)\n",
+               clk.hz / 1e6, clk.max_hz / 1e6, (unsigned)clk.fallbacks);
+        printf("sector cache        : %u lines, %u hits, %u misses, %u evictions, %u absorbed, %u write-backs\n",
+               (unsigned)cache.lines, (unsigned)cache.hits, (unsigned)cache.misses,
+               (unsigned)cache.evictions, (unsigned)cache.absorbed, (unsigned)cache.writebacks);
+        printf("card busy           : %.3f s during the write phase\n", Seconds(wst.busy_ns));
+        printf("write-behind        : %u blocks, %.3f s hidden, %.3f s exposed in %u stalls\n",
+               (unsigned)(busy1.blocks - busy0.blocks),
+               (busy1.hidden_us - busy0.hidden_us) / 1e6, (busy1.exposed_us - busy0.exposed_us) / 1e6,
+               (unsigned)(busy1.stalls - busy0.stalls));
+        printf("CPU clocking bytes  : %.3f s (DMA %.3f s)\n", Seconds(wst.cpu_spi_ns), Seconds(wst.dma_spi_ns));
+        printf("CPU per SPI byte    : %.1f cycles written, %.1f cycles read (polled bytes, HAL calls, wire time)\n",
+               CyclesPerByte(&wst), CyclesPerByte(st));
+        printf("driver latency (us) : write phase, log2 buckets 'from:count'\n");
+        PrintOpStats(&ops);
+        printf("driver counters     : %llu B written, %u cmd / %u data / %u DMA errors, %u retries\n",
+               (unsigned long long)ops.bytes_written, (unsigned)ops.cmd_errors, (unsigned)ops.data_errors,
+               (unsigned)ops.dma_errors, (unsigned)ops.retries);
+        printf("CRC errors          : %u seen by the card, %u by the driver, %u blocks corrupted on the wire\n",
+               (unsigned)(wst.crc_errors + st->crc_errors), (unsigned)rops.crc_errors,
+               (unsigned)(wst.corrupted + st->corrupted));
+        if (rops.crc_bytes)
+            printf("CRC16 table loop    : %.1f cycles/byte written, %.1f read (not hidden behind the DMA)\n",
+                   ops.crc_bytes ? (double)ops.crc_cycles / ops.crc_bytes : 0.0,
+                   (rops.crc_bytes > ops.crc_bytes) ?
+                   (double)(rops.crc_cycles - ops.crc_cycles) / (rops.crc_bytes - ops.crc_bytes) : 0.0);
+        printf("retries             : %u write phase, %u read phase\n",
+               (unsigned)ops.retries, (unsigned)(rops.retries - ops.retries));
+        printf("verify              : %s\n", bad ? "FAIL" : "ok");
+    }
+    SdSim_Free(0);
+    if (args.mirror) SdSim_Free(1);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,595 @@
+/**
+  ******************************************************************************
+  * @file           : sd_card_sim.c
+  * @brief          : Behavioral SD card (SPI mode) model for host benchmarking
+  ******************************************************************************
+  */
+
+#include "sd_card_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OUTQ_SIZE       2048
+#define WR_NONE         0
+#define WR_SINGLE       1
+#define WR_MULTI        2
+
+typedef struct {
+    int      used;
+    SdSim_Config_t cfg;
+    uint8_t  *img;
+    uint32_t sectors;
+
+    /* wiring */
+    int      spi;
+    void     *cs_port;
+    uint16_t cs_pin;
+    int      selected;
+
+    /* command state */
+    uint8_t  cmd[6];
+    int      cmd_len;
+    int      app;
+    int      ready;
+    uint32_t acmd41_polls;
+    int      crc_on;
+
+    /* MISO queue */
+    uint8_t  out[OUTQ_SIZE];
+    int      out_head, out_tail;
+    uint64_t busy_until;
+
+    /* data block waiting for its access latency */
+    int      pend_active;
+    uint8_t  pend_data[512];
+    int      pend_len;
+    uint64_t pend_ready_at;
+
+    /* CMD18 stream */
+    int      rd_stream;
+    uint32_t rd_lba;
+
+    /* CMD24/25 state */
+    int      wr_mode;
+    int      wr_data;
+    uint8_t  wr_buf[514];
+    int      wr_len;
+    uint32_t wr_lba;
+    uint64_t wr_blocks;
+
+    /* CMD32/33 */
+    uint32_t erase_start, erase_end;
+
+    /* line noise, see corrupt_every */
+    uint64_t wire_blocks;
+
+    /* SdSim_Watch range */
+    uint32_t watch_lba, watch_count;
+
+    SdSim_Stats_t st;
+} SdSim_Card_t;
+
+static SdSim_Card_t Cards[SDSIM_MAX_CARDS];
+
+/* Private function prototypes */
+static uint8_t Crc7(const uint8_t *data, int len);
+static uint16_t Crc16(const uint8_t *data, int len);
+static void OutPush(SdSim_Card_t *c, uint8_t b);
+static void Noise(SdSim_Card_t *c, uint8_t *data);
+static void OutFlush(SdSim_Card_t *c);
+static void PushR1(SdSim_Card_t *c, uint8_t r1);
+static void SetBusy(SdSim_Card_t *c, uint32_t us);
+static void PendBlock(SdSim_Card_t *c, const uint8_t *data, int len, uint32_t latency_us);
+static void Execute(SdSim_Card_t *c);
+
+/**
+  * @brief  CRC7 over command bytes (poly x^7 + x^3 + 1)
+  */
+static uint8_t Crc7(const uint8_t *data, int len)
+{
+    uint8_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        uint8_t d = data[i];
+        for (int b = 0; b < 8; b++) {
+            crc <<= 1;
+            if ((d ^ crc) & 0x80) crc ^= 0x09;
+            d <<= 1;
+        }
+    }
+    return crc & 0x7F;
+}
+
+/**
+  * @brief  CRC16-CCITT over data blocks (poly 0x1021, init 0)
+  */
+static uint16_t Crc16(const uint8_t *data, int len)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static void OutPush(SdSim_Card_t *c, uint8_t b)
+{
+    int next = (c->out_head + 1) % OUTQ_SIZE;
+    if (next == c->out_tail) return;
+    c->out[c->out_head] = b;
+    c->out_head = next;
+}
+
+static void OutFlush(SdSim_Card_t *c)
+{
+    c->out_head = c->out_tail = 0;
+    c->pend_active = 0;
+}
+
+static void PushR1(SdSim_Card_t *c, uint8_t r1)
+{
+    for (uint32_t i = 0; i < c->cfg.ncr_bytes; i++) OutPush(c, 0xFF);
+    OutPush(c, r1);
+}
+
+static void SetBusy(SdSim_Card_t *c, uint32_t us)
+{
+    uint64_t now = SdSim_NowNs();
+    uint64_t until = now + (uint64_t)us * 1000u;
+    if (until > c->busy_until) {
+        c->st.busy_ns += until - (c->busy_until > now ? c->busy_until : now);
+        c->busy_until = until;
+    }
+}
+
+static void PendBlock(SdSim_Card_t *c, const uint8_t *data, int len, uint32_t latency_us)
+{
+    memcpy(c->pend_data, data, (size_t)len);
+    c->pend_len = len;
+    c->pend_ready_at = SdSim_NowNs() + (uint64_t)latency_us * 1000u;
+    c->pend_active = 1;
+}
+
+static void BuildCsd(SdSim_Card_t *c, uint8_t *csd)
+{
+    uint32_t csize = c->sectors / 1024u - 1u;      /* 512 KB units */
+    memset(csd, 0, 16);
+    csd[0] = 0x40;                  /* CSD version 2.0 */
+    csd[1] = 0x0E;                  /* TAAC */
+    csd[3] = c->cfg.tran_speed;
+    csd[4] = 0x5B;                  /* CCC */
+    csd[5] = 0x59;                  /* READ_BL_LEN = 9 */
+    csd[7] = (uint8_t)((csize >> 16) & 0x3F);
+    csd[8] = (uint8_t)(csize >> 8);
+    csd[9] = (uint8_t)csize;
+    csd[10] = 0x7F;                 /* ERASE_BLK_EN, SECTOR_SIZE */
+    csd[11] = 0x80;
+    csd[12] = 0x0A;                 /* R2W_FACTOR, WRITE_BL_LEN = 9 */
+    csd[13] = 0x40;
+    csd[15] = (uint8_t)((Crc7(csd, 15) << 1) | 1);
+}
+
+static void BuildCid(uint8_t *cid)
+{
+    static const uint8_t id[15] = { 0x03, 'S', 'D', 'S', 'I', 'M', '0', '1',
+                                    0x10, 0x12, 0x34, 0x56, 0x78, 0x01, 0x9A };
+    memcpy(cid, id, 15);
+    cid[15] = (uint8_t)((Crc7(cid, 15) << 1) | 1);
+}
+
+static void BuildSdStatus(SdSim_Card_t *c, uint8_t *sts)
+{
+    memset(sts, 0, 64);
+    sts[8] = 0x02;                  /* SPEED_CLASS 4 */
+    sts[10] = (uint8_t)(c->cfg.au_size << 4);
+    sts[11] = 0x00;                 /* ERASE_SIZE = 1 AU */
+    sts[12] = 0x01;
+    sts[13] = (0x02 << 2) | 0x01;   /* ERASE_TIMEOUT 2 s, ERASE_OFFSET 1 s */
+}
+
+/**
+  * @brief  Act on a complete 6-byte command frame
+  */
+static void Execute(SdSim_Card_t *c)
+{
+    uint8_t idx = c->cmd[0] & 0x3F;
+    uint32_t arg = ((uint32_t)c->cmd[1] << 24) | ((uint32_t)c->cmd[2] << 16) |
+                   ((uint32_t)c->cmd[3] << 8) | c->cmd[4];
+    int app = c->app;
+    uint8_t r1 = c->ready ? 0x00 : 0x01;
+    uint8_t blk[64];
+
+    c->app = 0;
+
+    /* CMD0/CMD8 are checked before SPI mode is entered, the rest only with CMD59 */
+    if ((c->crc_on || idx == 0 || idx == 8) && Crc7(c->cmd, 5) != (c->cmd[5] >> 1)) {
+        c->st.crc_errors++;
+        PushR1(c, r1 | 0x08);
+        return;
+    }
+
+    if (app) c->st.acmd_count[idx]++;
+    else c->st.cmd_count[idx]++;
+
+    if (!c->ready && !app && idx != 0 && idx != 1 && idx != 8 && idx != 55 && idx != 58 && idx != 59) {
+        PushR1(c, 0x05);
+        return;
+    }
+
+    switch (app ? 0x40 | idx : idx) {
+    case 0:
+        c->ready = 0;
+        c->crc_on = 0;
+        c->acmd41_polls = 0;
+        c->rd_stream = 0;
+        c->wr_mode = WR_NONE;
+        PushR1(c, 0x01);
+        break;
+    case 8:
+        PushR1(c, r1);
+        OutPush(c, 0x00);
+        OutPush(c, 0x00);
+        OutPush(c, (uint8_t)((arg >> 8) & 0x0F));
+        OutPush(c, (uint8_t)arg);
+        break;
+    case 55:
+        c->app = 1;
+        PushR1(c, r1);
+        break;
+    case 0x40 | 41:
+        if (++c->acmd41_polls >= c->cfg.init_polls) c->ready = 1;
+        PushR1(c, c->ready ? 0x00 : 0x01);
+        break;
+    case 58:
+        PushR1(c, r1);
+        OutPush(c, c->ready ? 0xC0 : 0x00);
+        OutPush(c, 0xFF);
+        OutPush(c, 0x80);
+        OutPush(c, 0x00);
+        break;
+    case 59:
+        c->crc_on = arg & 1;
+        PushR1(c, r1);
+        break;
+    case 9:
+        PushR1(c, r1);
+        BuildCsd(c, blk);
+        PendBlock(c, blk, 16, 10);
+        break;
+    case 10:
+        PushR1(c, r1);
+        BuildCid(blk);
+        PendBlock(c, blk, 16, 10);
+        break;
+    case 0x40 | 13:
+        PushR1(c, r1);
+        OutPush(c, 0x00);           /* second byte of R2 */
+        BuildSdStatus(c, blk);
+        PendBlock(c, blk, 64, 50);
+        break;
+    case 16:
+        PushR1(c, arg == 512 ? r1 : (uint8_t)(r1 | 0x40));
+        break;
+    case 0x40 | 23:
+        PushR1(c, r1);
+        break;
+    case 17:
+    case 18:
+        if (arg >= c->sectors) {
+            PushR1(c, r1 | 0x20);
+            break;
+        }
+        PushR1(c, r1);
+        if (idx == 17) {
+            PendBlock(c, c->img + (size_t)arg * 512u, 512, c->cfg.read_latency_us);
+            c->st.blocks_read++;
+        } else {
+            c->rd_stream = 1;
+            c->rd_lba = arg;
+        }
+        break;
+    case 12:
+        OutFlush(c);
+        c->rd_stream = 0;
+        c->wr_mode = WR_NONE;
+        OutPush(c, 0xFF);           /* stuff byte */
+        PushR1(c, r1);
+        SetBusy(c, 5);
+        break;
+    case 24:
+    case 25:
+        if (arg >= c->sectors) {
+            PushR1(c, r1 | 0x20);
+            break;
+        }
+        PushR1(c, r1);
+        c->wr_mode = (idx == 24) ? WR_SINGLE : WR_MULTI;
+        c->wr_data = 0;
+        c->wr_lba = arg;
+        break;
+    case 32:
+        c->erase_start = arg;
+        PushR1(c, r1);
+        break;
+    case 33:
+        c->erase_end = arg;
+        PushR1(c, r1);
+        break;
+    case 38:
+        if (c->erase_start > c->erase_end || c->erase_end >= c->sectors) {
+            PushR1(c, r1 | 0x10);   /* erase sequence error */
+            break;
+        }
+        PushR1(c, r1);
+        memset(c->img + (size_t)c->erase_start * 512u, 0x00,
+               (size_t)(c->erase_end - c->erase_start + 1u) * 512u);
+        SetBusy(c, 250 + (c->erase_end - c->erase_start + 1u) / 64u);
+        break;
+    default:
+        PushR1(c, r1 | 0x04);       /* illegal command */
+        break;
+    }
+}
+
+/**
+  * @brief  Card side of one byte exchange
+  */
+static uint8_t OutByte(SdSim_Card_t *c)
+{
+    uint64_t now = SdSim_NowNs();
+    uint8_t b;
+
+    if (c->out_head != c->out_tail) {
+        b = c->out[c->out_tail];
+        c->out_tail = (c->out_tail + 1) % OUTQ_SIZE;
+        return b;
+    }
+    if (now < c->busy_until) return 0x00;
+    if (!c->pend_active && c->rd_stream) {
+        if (c->rd_lba >= c->sectors) {
+            c->rd_stream = 0;
+            return 0xFF;
+        }
+        PendBlock(c, c->img + (size_t)c->rd_lba * 512u, 512,
+                  c->st.blocks_read ? c->cfg.read_latency_us / 8 : c->cfg.read_latency_us);
+        c->rd_lba++;
+        c->st.blocks_read++;
+    }
+    if (c->pend_active) {
+        if (now < c->pend_ready_at) return 0xFF;
+        uint16_t crc = Crc16(c->pend_data, c->pend_len);
+        c->pend_active = 0;
+        if (c->pend_len == 512) Noise(c, c->pend_data);
+        OutPush(c, 0xFE);
+        for (int i = 0; i < c->pend_len; i++) OutPush(c, c->pend_data[i]);
+        OutPush(c, (uint8_t)(crc >> 8));
+        OutPush(c, (uint8_t)crc);
+        return 0xFF;
+    }
+    return 0xFF;
+}
+
+/**
+  * @brief  Flip one bit of every corrupt_every-th 512-byte block on the wire
+  */
+static void Noise(SdSim_Card_t *c, uint8_t *data)
+{
+    c->wire_blocks++;
+    if (!c->cfg.corrupt_every || (c->wire_blocks % c->cfg.corrupt_every) != 0) return;
+    data[(c->wire_blocks * 131u) % 512u] ^= (uint8_t)(1u << (c->wire_blocks % 8u));
+    c->st.corrupted++;
+}
+
+static void InByte(SdSim_Card_t *c, uint8_t b)
+{
+    if (SdSim_NowNs() < c->busy_until) return;
+
+    if (c->wr_mode != WR_NONE && !c->wr_data) {
+        if (b == 0xFF) return;
+        if ((c->wr_mode == WR_SINGLE && b == 0xFE) || (c->wr_mode == WR_MULTI && b == 0xFC)) {
+            c->wr_data = 1;
+            c->wr_len = 0;
+            return;
+        }
+        if (c->wr_mode == WR_MULTI && b == 0xFD) {
+            c->wr_mode = WR_NONE;
+            OutPush(c, 0xFF);
+            SetBusy(c, c->cfg.stop_busy_us);
+            return;
+        }
+        if ((b & 0xC0) != 0x40) return;
+        c->wr_mode = WR_NONE;       /* command instead of data, fall through */
+    }
+
+    if (c->wr_data) {
+        c->wr_buf[c->wr_len++] = b;
+        if (c->wr_len < 514) return;
+        c->wr_data = 0;
+        Noise(c, c->wr_buf);
+        if (c->crc_on && Crc16(c->wr_buf, 512) != (uint16_t)((c->wr_buf[512] << 8) | c->wr_buf[513])) {
+            c->st.crc_errors++;
+            OutPush(c, 0xEB);       /* data rejected, CRC error */
+            SetBusy(c, 5);
+            if (c->wr_mode == WR_SINGLE) c->wr_mode = WR_NONE;
+            return;
+        }
+        if (c->wr_lba >= c->sectors) {
+            OutPush(c, 0xED);       /* write error */
+            c->wr_mode = WR_NONE;
+            return;
+        }
+        memcpy(c->img + (size_t)c->wr_lba * 512u, c->wr_buf, 512);
+        SdSim_Written((int)(c - Cards), c->wr_lba, 1);
+        c->wr_lba++;
+        c->wr_blocks++;
+        OutPush(c, 0xE5);           /* data accepted */
+        SetBusy(c, c->cfg.write_busy_us +
+                   ((c->cfg.stall_every && (c->wr_blocks % c->cfg.stall_every) == 0) ? c->cfg.stall_us : 0));
+        if (c->wr_mode == WR_SINGLE) c->wr_mode = WR_NONE;
+        return;
+    }
+
+    if (c->cmd_len == 0 && (b & 0xC0) != 0x40) return;
+    c->cmd[c->cmd_len++] = b;
+    if (c->cmd_len == 6) {
+        c->cmd_len = 0;
+        Execute(c);
+    }
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+void SdSim_DefaultConfig(SdSim_Config_t *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->capacity_mb = 128;
+    cfg->ncr_bytes = 1;
+    cfg->init_polls = 20;
+    cfg->read_latency_us = 300;
+    cfg->write_busy_us = 250;
+    cfg->stop_busy_us = 500;
+    cfg->stall_every = 0;
+    cfg->corrupt_every = 0;
+    cfg->stall_us = 0;
+    cfg->tran_speed = 0x32;
+    cfg->au_size = 9;
+}
+
+int SdSim_Init(int card, const SdSim_Config_t *cfg)
+{
+    SdSim_Card_t *c;
+    if (card < 0 || card >= SDSIM_MAX_CARDS) return -1;
+    c = &Cards[card];
+    SdSim_Free(card);
+    memset(c, 0, sizeof(*c));
+    c->cfg = *cfg;
+    c->sectors = cfg->capacity_mb * 2048u;
+    c->img = calloc(c->sectors, 512);
+    if (!c->img) return -1;
+    c->spi = card;
+    c->used = 1;
+    return 0;
+}
+
+void SdSim_Free(int card)
+{
+    if (card < 0 || card >= SDSIM_MAX_CARDS) return;
+    free(Cards[card].img);
+    Cards[card].img = NULL;
+    Cards[card].used = 0;
+}
+
+int SdSim_LoadImage(int card, const char *path)
+{
+    SdSim_Card_t *c = &Cards[card];
+    FILE *f = fopen(path, "rb");
+    size_t n;
+    if (!f) return -1;
+    n = fread(c->img, 512, c->sectors, f);
+    fclose(f);
+    return n > 0 ? 0 : -1;
+}
+
+int SdSim_SaveImage(int card, const char *path)
+{
+    SdSim_Card_t *c = &Cards[card];
+    FILE *f = fopen(path, "wb");
+    size_t n;
+    if (!f) return -1;
+    n = fwrite(c->img, 512, c->sectors, f);
+    fclose(f);
+    return n == c->sectors ? 0 : -1;
+}
+
+uint8_t *SdSim_Image(int card, uint32_t *sectors)
+{
+    if (sectors) *sectors = Cards[card].sectors;
+    return Cards[card].img;
+}
+
+void SdSim_Bind(int card, int spi_index, void *cs_port, uint16_t cs_pin)
+{
+    Cards[card].spi = spi_index;
+    Cards[card].cs_port = cs_port;
+    Cards[card].cs_pin = cs_pin;
+}
+
+const SdSim_Config_t *SdSim_GetConfig(int card)
+{
+    return &Cards[card].cfg;
+}
+
+void SdSim_CardRegs(int card, uint8_t *csd, uint8_t *cid, uint8_t *sd_status)
+{
+    if (csd) BuildCsd(&Cards[card], csd);
+    if (cid) BuildCid(cid);
+    if (sd_status) BuildSdStatus(&Cards[card], sd_status);
+}
+
+SdSim_Stats_t *SdSim_Stats(int card)
+{
+    return &Cards[card].st;
+}
+
+void SdSim_ResetStats(int card)
+{
+    memset(&Cards[card].st, 0, sizeof(Cards[card].st));
+}
+
+void SdSim_Watch(int card, uint32_t lba, uint32_t count)
+{
+    Cards[card].watch_lba = lba;
+    Cards[card].watch_count = count;
+}
+
+void SdSim_Written(int card, uint32_t lba, uint32_t blocks)
+{
+    SdSim_Card_t *c = &Cards[card];
+    uint64_t lo = lba, hi = (uint64_t)lba + blocks;
+    uint64_t wlo = c->watch_lba, whi = (uint64_t)c->watch_lba + c->watch_count;
+
+    c->st.blocks_written += blocks;
+    if (lo < wlo) lo = wlo;
+    if (hi > whi) hi = whi;
+    if (hi > lo) c->st.watch_written += hi - lo;
+}
+
+int SdSim_CardForSpi(int spi_index)
+{
+    for (int i = 0; i < SDSIM_MAX_CARDS; i++) {
+        if (Cards[i].used && Cards[i].spi == spi_index) return i;
+    }
+    return -1;
+}
+
+void SdSim_ChipSelect(void *port, uint16_t pin, int level)
+{
+    for (int i = 0; i < SDSIM_MAX_CARDS; i++) {
+        SdSim_Card_t *c = &Cards[i];
+        if (!c->used || c->cs_port != port || c->cs_pin != pin) continue;
+        if (level) {
+            /* deselect drops the frame in progress, the card keeps its state */
+            c->selected = 0;
+            c->cmd_len = 0;
+            c->out_head = c->out_tail = 0;
+        } else {
+            c->selected = 1;
+        }
+    }
+}
+
+uint8_t SdSim_Xchg(int card, uint8_t mosi)
+{
+    SdSim_Card_t *c;
+    uint8_t miso;
+    if (card < 0 || card >= SDSIM_MAX_CARDS || !Cards[card].used) return 0xFF;
+    c = &Cards[card];
+    c->st.spi_bytes++;
+    if (!c->selected) return 0xFF;
+    miso = OutByte(c);
+    InByte(c, mosi);
+    return miso;
+}
@@ -0,0 +1,102 @@
+/**
+  ******************************************************************************
+  * @file           : sd_card_sim.h
+  * @brief          : Behavioral SD card (SPI mode) model for host benchmarking
+  ******************************************************************************
+  * @note           : The model answers the SPI-mode command set used by
+  *                   FATFS_SD.c, produces data tokens and busy signalling and
+  *                   charges configurable latencies against a simulated clock.
+  *                   Cards are SDHC (block addressed) backed by a RAM image.
+  ******************************************************************************
+  */
+
+#ifndef SD_CARD_SIM_H
+#define SD_CARD_SIM_H
+
+#include <stdint.h>
+
+#define SDSIM_MAX_CARDS     2
+
+/* Card behaviour */
+typedef struct {
+    uint32_t capacity_mb;       // card size
+    uint32_t ncr_bytes;         // 0xFF bytes before every R1 (1..8)
+    uint32_t init_polls;        // ACMD41 polls answered "idle" before ready
+    uint32_t read_latency_us;   // CMD17/18: command to data token
+    uint32_t write_busy_us;     // programming busy after each block
+    uint32_t stop_busy_us;      // busy after stop token / CMD12
+    uint32_t stall_every;       // every Nth written block ...
+    uint32_t stall_us;          // ... is followed by this much busy (0 = off)
+    uint32_t corrupt_every;     // every Nth data block on the wire gets a bit flipped (0 = off)
+    uint8_t  tran_speed;        // CSD TRAN_SPEED (0x32 = 25 MHz)
+    uint8_t  au_size;           // SD status AU_SIZE code (9 = 4 MB)
+} SdSim_Config_t;
+
+/* Bus and card counters */
+typedef struct {
+    uint64_t spi_bytes;         // bytes clocked on the bus
+    uint64_t cmd_count[64];     // commands received, by index
+    uint64_t acmd_count[64];    // application commands, by index
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t watch_written;     // blocks written inside the SdSim_Watch range
+    uint64_t busy_ns;           // time the card reported busy
+    uint64_t cpu_spi_ns;        // time the CPU spent clocking bytes itself
+    uint64_t dma_spi_ns;        // time spent in DMA transfers
+    uint64_t dma_bytes;         // bytes moved by DMA transfers
+    uint32_t crc_errors;        // command or data CRC mismatches seen
+    uint32_t corrupted;         // data blocks hit by corrupt_every
+} SdSim_Stats_t;
+
+/* Setup */
+void SdSim_DefaultConfig(SdSim_Config_t *cfg);
+int SdSim_Init(int card, const SdSim_Config_t *cfg);
+void SdSim_Free(int card);
+int SdSim_LoadImage(int card, const char *path);
+int SdSim_SaveImage(int card, const char *path);
+uint8_t *SdSim_Image(int card, uint32_t *sectors);
+
+/* Bind a card to a chip select line and to an SPI peripheral index (0 = SPI1) */
+void SdSim_Bind(int card, int spi_index, void *cs_port, uint16_t cs_pin);
+
+/* Card registers for the SD bus model (sdio_mock.c): CSD, CID, SD status */
+const SdSim_Config_t *SdSim_GetConfig(int card);
+void SdSim_CardRegs(int card, uint8_t *csd, uint8_t *cid, uint8_t *sd_status);
+
+/* Statistics */
+SdSim_Stats_t *SdSim_Stats(int card);
+void SdSim_ResetStats(int card);
+
+/* Count blocks written to [lba, lba + count) in watch_written, e.g. the FAT */
+void SdSim_Watch(int card, uint32_t lba, uint32_t count);
+
+/* Bus level, used by the HAL shim */
+int SdSim_CardForSpi(int spi_index);
+void SdSim_ChipSelect(void *port, uint16_t pin, int level);
+uint8_t SdSim_Xchg(int card, uint8_t mosi);
+
+/* Account blocks stored at lba, used by the SD bus model */
+void SdSim_Written(int card, uint32_t lba, uint32_t blocks);
+
+/* Simulated time; SdSim_Advance() fires SdSim_SysTick() on each 1 ms edge */
+uint64_t SdSim_NowNs(void);
+void SdSim_Advance(uint64_t ns);
+void SdSim_SysTick(void);
+
+/* CPU cost charged for every HAL SPI call (polled and DMA start) */
+extern uint32_t SdSim_HalCallNs;
+
+/* CPU cost charged for every SPI register access (SPI_RD/SPI_WR) */
+extern uint32_t SdSim_RegAccessNs;
+
+/* Interrupt taken at every Nth SPI register access, holding the CPU for
+   SdSim_IrqNs; 0 = none */
+extern uint32_t SdSim_IrqEvery;
+extern uint32_t SdSim_IrqNs;
+
+/* CPU cycles per byte of the driver's CRC16 table loop (DMA builds); hidden
+   behind a transmit DMA still on the wire, not behind a receive, whose data
+   the loop has to wait for */
+extern uint32_t SdSim_Crc16Cycles;
+
+#endif /* SD_CARD_SIM_H */
@@ -0,0 +1,549 @@
+/**
+  ******************************************************************************
+  * @file           : sdio_mock.c
+  * @brief          : SDIO peripheral + SD bus mode card model for FATFS_SDIO.c
+  ******************************************************************************
+  * @note           : The command path answers after the frame and response
+  *                   have been clocked at the CLKCR rate; the data path
+  *                   completes a whole transfer at once, charging access
+  *                   latency, wire time and (writes) programming busy. The
+  *                   card image, latencies and statistics are shared with
+  *                   the SPI model in sd_card_sim.c.
+  ******************************************************************************
+  */
+
+#include "sdio_mock.h"
+#include "sd_card_sim.h"
+#include <string.h>
+
+#define SDIOCLK_HZ      48000000u
+#define MOCK_RCA        0xB368u
+
+/* card states (R1 CURRENT_STATE) */
+enum { ST_IDLE, ST_READY, ST_IDENT, ST_STBY, ST_TRAN, ST_DATA, ST_RCV, ST_PRG };
+
+/* responses */
+enum { RSP_NONE, RSP_R1, RSP_R2, RSP_R3, RSP_R6, RSP_R7 };
+
+/* data operation armed by a command */
+enum { OP_NONE, OP_READ, OP_WRITE, OP_REG };
+
+#define R1_OUT_OF_RANGE (1UL << 31)
+#define R1_ERASE_SEQ    (1UL << 28)
+#define R1_READY        (1UL << 8)
+#define R1_APP_CMD      (1UL << 5)
+
+typedef struct {
+    int      card;
+
+    /* peripheral registers */
+    uint32_t power, clkcr, arg, dtimer, dlen, dctrl;
+    uint32_t sta;
+    uint32_t respcmd, resp[4];
+
+    /* CPSM */
+    int      cmd_active;
+    uint64_t cmd_done_at;
+    uint32_t cmd_flags;
+
+    /* card */
+    int      state;
+    uint16_t rca;
+    int      app;
+    uint32_t acmd41_polls;
+    int      width4;
+    int      hs;
+    uint64_t busy_until;
+    uint32_t erase_start, erase_end;
+    uint64_t wr_blocks;
+
+    /* armed by a data command */
+    int      op;
+    int      op_multi;
+    uint32_t op_lba;
+    uint8_t  reg[64];
+    int      reg_len;
+    int      hs_pending;
+
+    /* DPSM */
+    int      xfer_active;
+    uint64_t xfer_done_at;
+    uint32_t xfer_flags;
+    int      xfer_ok;
+    int      after_state;
+    uint64_t after_busy;
+    uint32_t fifo[16];
+    int      fifo_len, fifo_pos;
+
+    /* DMA2 Stream6 */
+    const void *dma_buf;
+    uint32_t dma_len;
+    int      dma_tx;
+    int      dma_on;
+    uint8_t  dma_state;
+} SdioMock_t;
+
+static SdioMock_t M = { .card = -1 };
+
+/* Private function prototypes */
+static uint32_t BusHz(void);
+static uint64_t ClkNs(uint64_t clocks);
+static void CardReset(void);
+static void Update(void);
+static uint32_t Status(int state);
+static int CardCommand(uint32_t idx, uint32_t arg);
+static void Command(uint32_t cmdreg);
+static void StartData(void);
+
+static uint32_t BusHz(void)
+{
+    if (M.clkcr & SDIO_CLKCR_BYPASS) return SDIOCLK_HZ;
+    return SDIOCLK_HZ / ((M.clkcr & SDIO_CLKCR_CLKDIV) + 2u);
+}
+
+static uint64_t ClkNs(uint64_t clocks)
+{
+    return clocks * 1000000000ull / BusHz();
+}
+
+static void CardReset(void)
+{
+    M.state = ST_IDLE;
+    M.rca = 0;
+    M.app = 0;
+    M.acmd41_polls = 0;
+    M.width4 = 0;
+    M.hs = 0;
+    M.op = OP_NONE;
+    M.xfer_active = 0;
+    M.fifo_len = M.fifo_pos = 0;
+}
+
+/**
+  * @brief  Latch whatever finished by now
+  */
+static void Update(void)
+{
+    uint64_t now = SdSim_NowNs();
+
+    if (M.cmd_active && now >= M.cmd_done_at) {
+        M.cmd_active = 0;
+        M.sta |= M.cmd_flags;
+    }
+    if (M.xfer_active && now >= M.xfer_done_at) {
+        M.xfer_active = 0;
+        M.sta |= M.xfer_flags;
+        if (M.dma_on && M.xfer_ok) M.dma_state = 1;
+        M.state = M.after_state;
+        if (M.after_busy > M.busy_until) M.busy_until = M.after_busy;
+        if (M.hs_pending && M.xfer_ok) M.hs = 1;
+        M.hs_pending = 0;
+    }
+    if (M.state == ST_PRG && now >= M.busy_until) M.state = ST_TRAN;
+}
+
+/* R1 card status as seen in a given state */
+static uint32_t Status(int state)
+{
+    uint32_t st = (uint32_t)state << 9;
+    if (state != ST_PRG && state != ST_RCV) st |= R1_READY;
+    return st;
+}
+
+/**
+  * @brief  Card side of one command, fills RESP and returns the response kind
+  */
+static int CardCommand(uint32_t idx, uint32_t arg)
+{
+    const SdSim_Config_t *cfg = SdSim_GetConfig(M.card);
+    SdSim_Stats_t *st = SdSim_Stats(M.card);
+    uint32_t sectors;
+    uint8_t *img = SdSim_Image(M.card, &sectors);
+    int app = M.app, prev = M.state;
+    int addressed = (arg >> 16) == M.rca;
+    uint8_t r2[16];
+
+    M.app = 0;
+    if (app) st->acmd_count[idx]++;
+    else st->cmd_count[idx]++;
+
+    M.resp[0] = Status(prev);
+    if (app) {
+        M.resp[0] |= R1_APP_CMD;
+        switch (idx) {
+        case 41:
+            if (prev != ST_IDLE) return RSP_NONE;
+            M.resp[0] = 0x00FF8000u;
+            if (++M.acmd41_polls >= cfg->init_polls) {
+                M.state = ST_READY;
+                M.resp[0] |= 0x80000000u | (arg & 0x40000000u);     /* busy done, CCS */
+            }
+            return RSP_R3;
+        case 6:
+            if (prev != ST_TRAN) return RSP_NONE;
+            M.width4 = (arg & 3u) == 2u;
+            return RSP_R1;
+        case 13:
+            if (prev != ST_TRAN) return RSP_NONE;
+            SdSim_CardRegs(M.card, NULL, NULL, M.reg);
+            M.reg_len = 64;
+            M.op = OP_REG;
+            M.state = ST_DATA;
+            return RSP_R1;
+        case 23:
+            return (prev == ST_TRAN) ? RSP_R1 : RSP_NONE;
+        case 51:
+            if (prev != ST_TRAN) return RSP_NONE;
+            memset(M.reg, 0, 8);
+            M.reg[0] = 0x02;        /* SCR 1.0, SD_SPEC 2.00 */
+            M.reg[1] = 0x35;        /* SD_SECURITY 3, bus widths 1 and 4 */
+            M.reg[2] = 0x80;        /* SD_SPEC3 */
+            M.reg_len = 8;
+            M.op = OP_REG;
+            M.state = ST_DATA;
+            return RSP_R1;
+        default:
+            break;                  /* not an ACMD, executed as the plain command */
+        }
+    }
+
+    switch (idx) {
+    case 0:
+        CardReset();
+        return RSP_NONE;
+    case 8:
+        if (prev != ST_IDLE) return RSP_NONE;
+        M.resp[0] = arg & 0xFFFu;
+        return RSP_R7;
+    case 55:
+        if (prev != ST_IDLE && !addressed) return RSP_NONE;
+        M.app = 1;
+        M.resp[0] |= R1_APP_CMD;
+        return RSP_R1;
+    case 2:
+        if (prev != ST_READY) return RSP_NONE;
+        M.state = ST_IDENT;
+        SdSim_CardRegs(M.card, NULL, r2, NULL);
+        break;
+    case 3:
+        if (prev != ST_IDENT && prev != ST_STBY) return RSP_NONE;
+        M.state = ST_STBY;
+        M.rca = MOCK_RCA;
+        M.resp[0] = ((uint32_t)M.rca << 16) | ((uint32_t)prev << 9) | R1_READY;
+        return RSP_R6;
+    case 9:
+    case 10:
+        if (prev != ST_STBY || !addressed) return RSP_NONE;
+        SdSim_CardRegs(M.card, idx == 9 ? r2 : NULL, idx == 10 ? r2 : NULL, NULL);
+        break;
+    case 7:
+        if (!addressed) {
+            if (prev == ST_TRAN) M.state = ST_STBY;
+            return RSP_NONE;
+        }
+        if (prev != ST_STBY) return RSP_NONE;
+        M.state = ST_TRAN;
+        return RSP_R1;
+    case 13:
+        if (!addressed || prev < ST_STBY) return RSP_NONE;
+        return RSP_R1;
+    case 16:
+        return (prev == ST_TRAN) ? RSP_R1 : RSP_NONE;
+    case 6:
+        if (prev != ST_TRAN) return RSP_NONE;
+        /* switch status: 0x8003 group 1 support (default + high speed) */
+        memset(M.reg, 0, 64);
+        M.reg[0] = 0x00;
+        M.reg[1] = 0x64;            /* 100 mA */
+        M.reg[12] = 0x80;
+        M.reg[13] = 0x03;
+        if ((arg & 0xFu) == 1u) M.reg[16] = 0x01;
+        else if ((arg & 0xFu) == 0xFu) M.reg[16] = (uint8_t)M.hs;
+        M.hs_pending = (arg & 0x80000000u) && (arg & 0xFu) == 1u;
+        M.reg_len = 64;
+        M.op = OP_REG;
+        M.state = ST_DATA;
+        return RSP_R1;
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+        if (prev != ST_TRAN) return RSP_NONE;
+        if (arg >= sectors) {
+            M.resp[0] |= R1_OUT_OF_RANGE;
+            return RSP_R1;
+        }
+        M.op = (idx < 24) ? OP_READ : OP_WRITE;
+        M.op_multi = (idx == 18 || idx == 25);
+        M.op_lba = arg;
+        M.state = (idx < 24) ? ST_DATA : ST_RCV;
+        return RSP_R1;
+    case 12:
+        if (prev == ST_DATA) {
+            M.state = ST_TRAN;
+        } else if (prev == ST_RCV) {
+            uint64_t until = SdSim_NowNs() + (uint64_t)cfg->stop_busy_us * 1000u;
+            if (until > M.busy_until) M.busy_until = until;
+            M.state = ST_PRG;
+        } else {
+            return RSP_NONE;
+        }
+        M.op = OP_NONE;
+        M.xfer_active = 0;
+        return RSP_R1;
+    case 32:
+    case 33:
+        if (prev != ST_TRAN) return RSP_NONE;
+        if (idx == 32) M.erase_start = arg;
+        else M.erase_end = arg;
+        return RSP_R1;
+    case 38:
+        if (prev != ST_TRAN) return RSP_NONE;
+        if (M.erase_start > M.erase_end || M.erase_end >= sectors) {
+            M.resp[0] |= R1_ERASE_SEQ;
+            return RSP_R1;
+        }
+        memset(img + (size_t)M.erase_start * 512u, 0x00,
+               (size_t)(M.erase_end - M.erase_start + 1u) * 512u);
+        {
+            uint64_t now = SdSim_NowNs();
+            uint64_t until = now + (250u + (M.erase_end - M.erase_start + 1u) / 64u) * 1000ull;
+            st->busy_ns += until - now;
+            M.busy_until = until;
+        }
+        M.state = ST_PRG;
+        return RSP_R1;
+    default:
+        return RSP_NONE;            /* illegal in SD mode: no response */
+    }
+
+    /* R2: bits [127:1] of CID/CSD in RESP1..4, CRC byte without its end bit */
+    for (int i = 0; i < 4; i++) {
+        M.resp[i] = ((uint32_t)r2[4 * i] << 24) | ((uint32_t)r2[4 * i + 1] << 16) |
+                    ((uint32_t)r2[4 * i + 2] << 8) | r2[4 * i + 3];
+    }
+    M.resp[3] &= ~1u;
+    return RSP_R2;
+}
+
+/**
+  * @brief  CPSM: run a command written to SDIO_CMD
+  */
+static void Command(uint32_t cmdreg)
+{
+    uint32_t idx = cmdreg & SDIO_CMD_CMDINDEX;
+    uint32_t wait = cmdreg & SDIO_CMD_WAITRESP;
+    uint64_t clocks = 48;
+    int rsp;
+
+    Update();
+    if (M.card < 0 || M.power != SDIO_POWER_PWRCTRL || !(M.clkcr & SDIO_CLKCR_CLKEN)) {
+        /* no card or no clock: nothing ever answers */
+        rsp = RSP_NONE;
+    } else {
+        rsp = CardCommand(idx, M.arg);
+        SdSim_Stats(M.card)->spi_bytes += 6;
+    }
+
+    M.respcmd = (rsp == RSP_R2 || rsp == RSP_R3) ? 0x3Fu : idx;
+    if (!wait) {
+        M.cmd_flags = SDIO_STA_CMDSENT;
+    } else if (rsp == RSP_NONE) {
+        clocks += 64;
+        M.cmd_flags = SDIO_STA_CTIMEOUT;
+    } else if (rsp == RSP_R2) {
+        clocks += 8 + 136;
+        M.cmd_flags = SDIO_STA_CMDREND;
+    } else {
+        clocks += 8 + 48;
+        /* R3 has no CRC, the CPSM flags it */
+        M.cmd_flags = (rsp == RSP_R3) ? SDIO_STA_CCRCFAIL : SDIO_STA_CMDREND;
+    }
+    M.cmd_active = 1;
+    M.cmd_done_at = SdSim_NowNs() + ((M.card >= 0 && (M.clkcr & SDIO_CLKCR_CLKEN)) ? ClkNs(clocks) : 0);
+    StartData();
+}
+
+/**
+  * @brief  DPSM: once the card and the DPSM are both armed, run the transfer
+  */
+static void StartData(void)
+{
+    const SdSim_Config_t *cfg;
+    SdSim_Stats_t *st;
+    uint32_t sectors, hz = BusHz(), blocks, blen;
+    uint8_t *img;
+    uint64_t t, wire, lat;
+    int rx, bad;
+
+    if (M.op == OP_NONE || M.xfer_active || !(M.dctrl & SDIO_DCTRL_DTEN) || M.card < 0) return;
+    cfg = SdSim_GetConfig(M.card);
+    st = SdSim_Stats(M.card);
+    img = SdSim_Image(M.card, &sectors);
+    rx = (M.op != OP_WRITE);
+    if (rx != !!(M.dctrl & SDIO_DCTRL_DTDIR)) return;
+
+    /* the card sees garbage outside its speed mode or bus width */
+    bad = (hz > 25000000u && !M.hs) || hz > 50000000u ||
+          (!!(M.clkcr & SDIO_CLKCR_WIDBUS_0) != M.width4);
+
+    blen = 1u << ((M.dctrl & SDIO_DCTRL_DBLOCKSIZE) >> SDIO_DCTRL_DBLOCKSIZE_Pos);
+    blocks = (M.op == OP_REG) ? 1u : M.dlen / 512u;
+    if (M.op == OP_REG) blen = (uint32_t)M.reg_len;
+    if (!M.op_multi && M.op != OP_REG) blocks = 1;
+    /* data bits + start, CRC16 and end bit on each line, CRC status on writes */
+    wire = ClkNs((uint64_t)blen * (M.width4 ? 2u : 8u) + 18u + (rx ? 0u : 10u));
+
+    t = (M.cmd_active ? M.cmd_done_at : SdSim_NowNs());
+    M.xfer_ok = !bad;
+    M.after_busy = 0;
+    if (M.op == OP_REG) {
+        lat = 50000u;
+        t += lat + wire;
+        if (!bad) {
+            memset(M.fifo, 0, sizeof(M.fifo));
+            memcpy(M.fifo, M.reg, (size_t)M.reg_len);
+            M.fifo_len = (M.reg_len + 3) / 4;
+            M.fifo_pos = 0;
+        }
+        M.after_state = ST_TRAN;
+    } else if (M.op == OP_READ) {
+        if (M.op_lba + blocks > sectors) blocks = sectors - M.op_lba;
+        for (uint32_t i = 0; i < blocks; i++) {
+            lat = (uint64_t)(i ? cfg->read_latency_us / 8u : cfg->read_latency_us) * 1000u;
+            /* DTIMER counts card clocks while waiting for the start bit */
+            if (lat * hz / 1000000000ull > M.dtimer) {
+                M.xfer_ok = 0;
+                M.xfer_flags = SDIO_STA_DTIMEOUT;
+            }
+            t += lat + wire;
+        }
+        if (M.xfer_ok && M.dma_on && !M.dma_tx) {
+            memcpy((void *)M.dma_buf, img + (size_t)M.op_lba * 512u, (size_t)blocks * 512u);
+        }
+        if (!bad) st->blocks_read += blocks;
+        M.after_state = M.op_multi ? ST_DATA : ST_TRAN;
+    } else {
+        uint64_t busy = 0;
+        if (M.op_lba + blocks > sectors) blocks = sectors - M.op_lba;
+        for (uint32_t i = 0; i < blocks; i++) {
+            /* the DPSM holds the next block while the card drives D0 busy */
+            t += busy + wire;
+            M.wr_blocks++;
+            busy = (uint64_t)(cfg->write_busy_us +
+                   ((cfg->stall_every && (M.wr_blocks % cfg->stall_every) == 0) ? cfg->stall_us : 0)) * 1000u;
+            if (!bad) st->busy_ns += busy;
+        }
+        if (!bad && M.dma_on && M.dma_tx) {
+            memcpy(img + (size_t)M.op_lba * 512u, M.dma_buf, (size_t)blocks * 512u);
+            SdSim_Written(M.card, M.op_lba, blocks);
+        }
+        M.after_busy = t + busy;
+        M.after_state = M.op_multi ? ST_RCV : ST_PRG;
+    }
+
+    if (M.xfer_ok) M.xfer_flags = SDIO_STA_DATAEND | SDIO_STA_DBCKEND;
+    else if (bad) M.xfer_flags = SDIO_STA_DCRCFAIL;
+    if (bad) st->crc_errors++;
+    st->spi_bytes += (uint64_t)blocks * blen;
+    if (M.op != OP_REG) st->dma_spi_ns += (t - SdSim_NowNs());
+
+    M.op = OP_NONE;
+    M.xfer_active = 1;
+    M.xfer_done_at = t;
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+uint32_t SdioMock_Read(uint32_t offset)
+{
+    uint32_t v = 0;
+
+    SdSim_Advance(SDIOMOCK_ACCESS_NS);
+    Update();
+    switch (offset) {
+    case offsetof(SDIO_TypeDef, POWER):   v = M.power; break;
+    case offsetof(SDIO_TypeDef, CLKCR):   v = M.clkcr; break;
+    case offsetof(SDIO_TypeDef, ARG):     v = M.arg; break;
+    case offsetof(SDIO_TypeDef, RESPCMD): v = M.respcmd; break;
+    case offsetof(SDIO_TypeDef, RESP1):   v = M.resp[0]; break;
+    case offsetof(SDIO_TypeDef, RESP2):   v = M.resp[1]; break;
+    case offsetof(SDIO_TypeDef, RESP3):   v = M.resp[2]; break;
+    case offsetof(SDIO_TypeDef, RESP4):   v = M.resp[3]; break;
+    case offsetof(SDIO_TypeDef, DTIMER):  v = M.dtimer; break;
+    case offsetof(SDIO_TypeDef, DLEN):    v = M.dlen; break;
+    case offsetof(SDIO_TypeDef, DCTRL):   v = M.dctrl; break;
+    case offsetof(SDIO_TypeDef, STA):
+        v = M.sta;
+        if (M.cmd_active) v |= SDIO_STA_CMDACT;
+        if (M.xfer_active) v |= (M.dctrl & SDIO_DCTRL_DTDIR) ? SDIO_STA_RXACT : SDIO_STA_TXACT;
+        else if (M.fifo_pos < M.fifo_len) v |= SDIO_STA_RXDAVL;
+        break;
+    case offsetof(SDIO_TypeDef, FIFO):
+        if (!M.xfer_active && M.fifo_pos < M.fifo_len) v = M.fifo[M.fifo_pos++];
+        break;
+    default:
+        break;
+    }
+    return v;
+}
+
+void SdioMock_Write(uint32_t offset, uint32_t value)
+{
+    SdSim_Advance(SDIOMOCK_ACCESS_NS);
+    Update();
+    switch (offset) {
+    case offsetof(SDIO_TypeDef, POWER):
+        M.power = value & SDIO_POWER_PWRCTRL;
+        if (!M.power) CardReset();
+        break;
+    case offsetof(SDIO_TypeDef, CLKCR):  M.clkcr = value; break;
+    case offsetof(SDIO_TypeDef, ARG):    M.arg = value; break;
+    case offsetof(SDIO_TypeDef, CMD):
+        if (value & SDIO_CMD_CPSMEN) Command(value);
+        break;
+    case offsetof(SDIO_TypeDef, DTIMER): M.dtimer = value; break;
+    case offsetof(SDIO_TypeDef, DLEN):   M.dlen = value; break;
+    case offsetof(SDIO_TypeDef, DCTRL):
+        M.dctrl = value;
+        if (!(value & SDIO_DCTRL_DTEN)) {
+            /* DPSM disabled: whatever is left in flight is dropped */
+            M.xfer_active = 0;
+            M.fifo_len = M.fifo_pos = 0;
+        }
+        StartData();
+        break;
+    case offsetof(SDIO_TypeDef, ICR):    M.sta &= ~value; break;
+    default:
+        break;
+    }
+}
+
+void SdioMock_DmaStart(const void *buff, uint32_t len, int to_card)
+{
+    M.dma_buf = buff;
+    M.dma_len = len;
+    M.dma_tx = to_card;
+    M.dma_on = 1;
+    M.dma_state = 0;
+}
+
+uint8_t SdioMock_DmaStatus(void)
+{
+    SdSim_Advance(SDIOMOCK_ACCESS_NS);
+    Update();
+    return M.dma_state;
+}
+
+void SdioMock_DmaStop(void)
+{
+    M.dma_on = 0;
+    M.dma_state = 0;
+}
+
+void SdioMock_Attach(int card)
+{
+    memset(&M, 0, sizeof(M));
+    M.card = card;
+    CardReset();
+}
@@ -0,0 +1,41 @@
+/**
+  ******************************************************************************
+  * @file           : sdio_mock.h
+  * @brief          : SDIO peripheral + SD bus mode card model for FATFS_SDIO.c
+  ******************************************************************************
+  * @note           : Built with -DSDIO_MOCK, FATFS_SDIO.h routes SDIO_RD/SDIO_WR
+  *                   and the DMA stream here. The model behaves like the
+  *                   STM32F4 CPSM/DPSM (status flags, R1/R2/R3/R6/R7,
+  *                   DATAEND, RXDAVL for FIFO reads) in front of a card in
+  *                   SD bus mode, with the card's data and latencies taken
+  *                   from sd_card_sim.c. Wire time follows CLKCR (divider,
+  *                   bypass, bus width); a clock above 25 MHz without the
+  *                   CMD6 high-speed switch or a bus width the card was not
+  *                   told about ends in DCRCFAIL, as on real hardware.
+  ******************************************************************************
+  */
+
+#ifndef SDIO_MOCK_H
+#define SDIO_MOCK_H
+
+#include "stm32f4xx_hal.h"
+#include <stdint.h>
+
+#define SDIO_RD(reg)            SdioMock_Read(offsetof(SDIO_TypeDef, reg))
+#define SDIO_WR(reg, val)       SdioMock_Write(offsetof(SDIO_TypeDef, reg), (val))
+
+/* Bus level: every access costs SDIOMOCK_ACCESS_NS of simulated time */
+#define SDIOMOCK_ACCESS_NS      30u
+
+uint32_t SdioMock_Read(uint32_t offset);
+void SdioMock_Write(uint32_t offset, uint32_t value);
+
+/* DMA2 Stream6 stand-in: status 0 in flight, 1 complete, 2 error */
+void SdioMock_DmaStart(const void *buff, uint32_t len, int to_card);
+uint8_t SdioMock_DmaStatus(void);
+void SdioMock_DmaStop(void);
+
+/* Put sd_card_sim card 'card' in the SDIO slot (-1: empty slot) */
+void SdioMock_Attach(int card);
+
+#endif /* SDIO_MOCK_H */
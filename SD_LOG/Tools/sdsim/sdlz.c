@@ -0,0 +1,329 @@
+/**
+  ******************************************************************************
+  * @file           : sdlz.c
+  * @brief          : Decompress sd_lz.c streams, and benchmark the compressor
+  ******************************************************************************
+  * @note           : -d (the default) turns a compressed log from the card or
+  *                   a capture of the USB stream back into the original bytes,
+  *                   ready for binlog2csv. A stream that ends in the middle of
+  *                   a block (log not closed, capture cut off) is decoded up
+  *                   to the last whole block. Blocks carry no marker to resync
+  *                   on, so a block that does not decode ends the output
+  *                   there; the binlog CRCs catch damage inside blocks that
+  *                   still decode.
+  *
+  *                   -b runs the firmware compressor (Core/Src/sd_lz.c) on
+  *                   recorded-style data: throttle/ADC samples as sd_binlog
+  *                   records and as the sprintf CSV lines, plus any FILE
+  *                   given, and reports ratio, compress cost per byte (mean
+  *                   and worst block), decompress speed, and checks the round
+  *                   trip.
+  ******************************************************************************
+  */
+
+#include "sd_lz.h"
+#include "sd_binlog.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    uint8_t *buf;
+    size_t len, cap;
+} Mem_t;
+
+typedef struct {
+    uint64_t blocks, stored, resets;
+    int bad, truncated;
+} DecodeStats_t;
+
+static void Usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d] FILE [OUT]        decompress FILE to OUT (default stdout)\n"
+            "       %s -c FILE [OUT]          compress FILE with the firmware compressor\n"
+            "       %s -b [-n N] [FILE...]    compressor benchmark\n"
+            "  -n N       benchmark samples (default 200000)\n", prog, prog, prog);
+}
+
+static double NowSec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void MemPut(Mem_t *m, const void *data, size_t len)
+{
+    if (m->len + len > m->cap) {
+        m->cap = (m->len + len) * 2 + 4096;
+        m->buf = realloc(m->buf, m->cap);
+        if (!m->buf) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(m->buf + m->len, data, len);
+    m->len += len;
+}
+
+static bool MemSink(void *ctx, const void *data, UINT len)
+{
+    MemPut((Mem_t *)ctx, data, len);
+    return true;
+}
+
+//-----[ Decompressor ]-----
+
+static int GetLen(const uint8_t **p, const uint8_t *end, size_t *n)
+{
+    uint8_t b;
+    do {
+        if (*p >= end) return 0;
+        b = *(*p)++;
+        *n += b;
+    } while (b == 255u);
+    return 1;
+}
+
+/* one block payload onto out; base is where history starts (last reset) */
+static int DecodeBlock(const uint8_t *p, const uint8_t *end, Mem_t *out, size_t base)
+{
+    while (p < end) {
+        uint8_t token = *p++;
+        size_t lit = token >> 4, mlen = (token & 15u) + LZ_MIN_MATCH, off;
+
+        if (lit == 15u && !GetLen(&p, end, &lit)) return 0;
+        if ((size_t)(end - p) < lit) return 0;
+        MemPut(out, p, lit);
+        p += lit;
+        if (p == end) return 1;                     /* last sequence */
+
+        if (end - p < 2) return 0;
+        off = p[0] | (size_t)p[1] << 8;
+        p += 2;
+        if ((token & 15u) == 15u && !GetLen(&p, end, &mlen)) return 0;
+        if (off == 0 || off > out->len - base || off > 2u * LZ_WINDOW) return 0;
+
+        while (out->len + mlen > out->cap) {
+            out->cap = out->cap * 2 + mlen;
+            out->buf = realloc(out->buf, out->cap);
+            if (!out->buf) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        /* byte by byte: the match may overlap what it produces */
+        for (size_t i = 0; i < mlen; i++, out->len++) out->buf[out->len] = out->buf[out->len - off];
+    }
+    return 1;
+}
+
+static int Decompress(const uint8_t *in, size_t n, Mem_t *out, DecodeStats_t *st)
+{
+    const uint8_t *p = in, *end = in + n;
+    size_t base = out->len;
+
+    memset(st, 0, sizeof(*st));
+    while (end - p >= 2) {
+        uint16_t hdr = (uint16_t)(p[0] | p[1] << 8);
+        size_t len = hdr & LZ_BLOCK_LEN_MASK, mark = out->len;
+
+        if ((size_t)(end - p - 2) < len) {
+            st->truncated = 1;
+            break;
+        }
+        if (hdr & LZ_BLOCK_RESET) {
+            base = out->len;
+            st->resets++;
+        }
+        if (len == 0u || len > LZ_WINDOW) {
+            st->bad = 1;
+            return 0;
+        }
+        if (hdr & LZ_BLOCK_STORED) {
+            MemPut(out, p + 2, len);
+            st->stored++;
+        } else if (!DecodeBlock(p + 2, p + 2 + len, out, base)) {
+            out->len = mark;
+            st->bad = 1;
+            return 0;
+        }
+        st->blocks++;
+        p += 2 + len;
+    }
+    if (p != end) st->truncated = 1;
+    return 1;
+}
+
+//-----[ Benchmark ]-----
+
+/* throttle position, four ADC channels and engine speed at 1 kHz */
+static void MakeSamples(uint32_t count, Mem_t *bin, Mem_t *csv)
+{
+    static const uint8_t types[] = { BINLOG_U16, BINLOG_U16, BINLOG_U16, BINLOG_U16, BINLOG_U16, BINLOG_UVAR };
+    static const char *const fields[] = { "throttle", "adc0", "adc1", "adc2", "adc3", "rpm" };
+    static const BINLOG_Schema_t sample = { 1, "sample", 6, types, fields };
+    static const BINLOG_Schema_t *const schemas[] = { &sample };
+    BINLOG_t b;
+    uint32_t rng = 12345u, ts = 0;
+    double thr = 0.0, target = 150.0, rpm = 900.0;
+    char line[96];
+
+    BINLOG_Init(&b, MemSink, bin, schemas, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t v[6];
+        rng = rng * 1664525u + 1013904223u;
+        ts += 1u + ((rng >> 24) == 0u);           /* 1 ms, now and then 2 */
+        if (i % 2000u == 0u) target = (double)((rng >> 8) % 1000u);
+        thr += (target - thr) * 0.01;
+        rpm += (900.0 + thr * 6.0 - rpm) * 0.002;
+        v[0] = (uint32_t)(thr + ((rng >> 4) & 3u));
+        for (int k = 0; k < 4; k++)
+            v[1 + k] = (uint32_t)(2048.0 + 1500.0 * sin(i * (0.002 + 0.003 * k)) + ((rng >> (8 + 3 * k)) & 7u));
+        v[5] = (uint32_t)rpm;
+        BINLOG_Write(&b, 1, ts, v);
+        MemPut(csv, line, (size_t)snprintf(line, sizeof(line), "%lu,%lu,%lu,%lu,%lu,%lu,%lu\r\n",
+                                           (unsigned long)ts, (unsigned long)v[0], (unsigned long)v[1],
+                                           (unsigned long)v[2], (unsigned long)v[3], (unsigned long)v[4],
+                                           (unsigned long)v[5]));
+    }
+    BINLOG_Sync(&b);
+}
+
+static int BenchOne(const char *name, const uint8_t *data, size_t n)
+{
+    static LZ_t z;
+    Mem_t c = { 0 }, d = { 0 };
+    LZ_Stats_t st;
+    DecodeStats_t ds;
+    double t0, t_c, t_d, worst = 0.0;
+    int ok;
+
+    /* room up front so the sink never reallocates inside a timed call */
+    c.cap = n + n / 64u + 4096u;
+    c.buf = malloc(c.cap);
+    memset(c.buf, 0, c.cap);
+
+    /* one block per LZ_Write call, so the slowest call is the slowest block */
+    LZ_Init(&z, MemSink, &c);
+    t0 = NowSec();
+    for (size_t i = 0; i < n; i += LZ_WINDOW) {
+        double tb = NowSec();
+        LZ_Write(&z, data + i, (UINT)((n - i < LZ_WINDOW) ? n - i : LZ_WINDOW));
+        tb = NowSec() - tb;
+        if (tb > worst) worst = tb;
+    }
+    LZ_Flush(&z, false);
+    t_c = NowSec() - t0;
+    LZ_GetStats(&z, &st, false);
+
+    t0 = NowSec();
+    ok = Decompress(c.buf, c.len, &d, &ds);
+    t_d = NowSec() - t0;
+    ok = ok && !ds.truncated && d.len == n && !memcmp(d.buf, data, n);
+
+    printf("%-12s %10zu %10zu %6.2f %6.2f %7.1f %9.2f %9.2f %7.1f %s\n", name, n, c.len,
+           (double)n / (c.len ? c.len : 1), 100.0 * st.stored / (st.blocks ? st.blocks : 1),
+           n / 1e6 / t_c, t_c * 1e9 / n, worst * 1e9 / LZ_WINDOW, n / 1e6 / t_d, ok ? "ok" : "MISMATCH");
+    free(c.buf);
+    free(d.buf);
+    return ok ? 0 : 1;
+}
+
+static int ReadFile(const char *path, Mem_t *m)
+{
+    uint8_t tmp[65536];
+    size_t n;
+    FILE *f = (!strcmp(path, "-")) ? stdin : fopen(path, "rb");
+
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) MemPut(m, tmp, n);
+    if (f != stdin) fclose(f);
+    return 1;
+}
+
+static int Bench(uint32_t count, char **files, int nfiles)
+{
+    Mem_t bin = { 0 }, csv = { 0 };
+    uint8_t *noise;
+    uint32_t rng = 1;
+    int fail = 0;
+
+    MakeSamples(count, &bin, &csv);
+    noise = malloc(1u << 20);
+    for (size_t i = 0; i < (1u << 20); i++) noise[i] = (uint8_t)((rng = rng * 1664525u + 1013904223u) >> 24);
+
+    printf("LZ_WINDOW %u, LZ_HASH_BITS %u, compressor state %zu B\n", (unsigned)LZ_WINDOW,
+           (unsigned)LZ_HASH_BITS, sizeof(LZ_t));
+    printf("%-12s %10s %10s %6s %6s %7s %9s %9s %7s\n", "data", "bytes", "packed", "ratio", "stor%",
+           "MB/s", "ns/B", "worst", "un MB/s");
+    fail |= BenchOne("binlog", bin.buf, bin.len);
+    fail |= BenchOne("csv", csv.buf, csv.len);
+    fail |= BenchOne("random", noise, 1u << 20);
+    for (int i = 0; i < nfiles; i++) {
+        Mem_t f = { 0 };
+        const char *base = strrchr(files[i], '/');
+        if (!ReadFile(files[i], &f)) return 1;
+        fail |= BenchOne(base ? base + 1 : files[i], f.buf, f.len);
+        free(f.buf);
+    }
+    free(noise);
+    free(bin.buf);
+    free(csv.buf);
+    return fail;
+}
+
+int main(int argc, char **argv)
+{
+    int mode = 'd', nfiles = 0;
+    uint32_t count = 200000;
+    char *files[16];
+    Mem_t in = { 0 }, out = { 0 };
+    int ret = 0;
+    FILE *f;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (!strcmp(a, "-b") || !strcmp(a, "-c") || !strcmp(a, "-d")) { mode = a[1]; continue; }
+        if (!strcmp(a, "-n") && i + 1 < argc) { count = (uint32_t)strtoul(argv[++i], NULL, 0); continue; }
+        if ((a[0] != '-' || !a[1]) && nfiles < 16) { files[nfiles++] = argv[i]; continue; }
+        Usage(argv[0]);
+        return 2;
+    }
+    if (mode == 'b') return Bench(count ? count : 1, files, nfiles);
+    if (nfiles < 1 || nfiles > 2 || !ReadFile(files[0], &in)) { Usage(argv[0]); return 2; }
+
+    if (mode == 'c') {
+        static LZ_t z;
+        LZ_Init(&z, MemSink, &out);
+        LZ_Write(&z, in.buf, (UINT)in.len);
+        LZ_Flush(&z, false);
+    } else {
+        DecodeStats_t st;
+        Decompress(in.buf, in.len, &out, &st);
+        fprintf(stderr, "%llu blocks (%llu stored, %llu resets), %zu -> %zu bytes%s",
+                (unsigned long long)st.blocks, (unsigned long long)st.stored, (unsigned long long)st.resets,
+                in.len, out.len, st.truncated ? ", last block incomplete" : "");
+        fprintf(stderr, "\n");
+        if (st.bad) {
+            fprintf(stderr, "bad block at output byte %zu, output ends there\n", out.len);
+            ret = 3;
+        }
+    }
+
+    f = (nfiles == 2) ? fopen(files[1], "wb") : stdout;
+    if (!f || fwrite(out.buf, 1, out.len, f) != out.len) {
+        perror(nfiles == 2 ? files[1] : "stdout");
+        return 1;
+    }
+    if (f != stdout) fclose(f);
+    free(in.buf);
+    free(out.buf);
+    return ret;
+}
@@ -22,6 +22,7 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "sd_queue.h"
 
 /* USER CODE END INCLUDE */
 
@@ -31,6 +32,7 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
+extern LOGQ_t LogQueue;  // main.c, host data is logged to the SD card
 
 /* USER CODE END PV */
 
@@ -261,6 +263,7 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
+  LOGQ_Push(&LogQueue, Buf, *Len);  // dropped and counted when the logger falls behind
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
   USBD_CDC_ReceivePacket(&hUsbDeviceFS);
   return (USBD_OK);
@@ -316,6 +319,36 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  CDC_Transmit_Wait_FS
+  *         Send a buffer and return once the USB stack is done with it, so
+  *         the caller can reuse it (log stream blocks, see sd_lz.h).
+  * @param  Buf: Buffer of data to be sent
+  * @param  Len: Number of data to be sent (in bytes)
+  * @param  Timeout: ms to wait for the endpoint, before and after sending
+  * @retval USBD_OK if sent, USBD_BUSY on timeout (a transfer that was started
+  *         may still be reading Buf), else USBD_FAIL
+  */
+uint8_t CDC_Transmit_Wait_FS(uint8_t* Buf, uint16_t Len, uint32_t Timeout)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  uint32_t start = HAL_GetTick();
+  uint8_t result;
+
+  if (hcdc == NULL) return USBD_FAIL;  // not enumerated
+  while ((result = CDC_Transmit_FS(Buf, Len)) == USBD_BUSY)
+  {
+    if (HAL_GetTick() - start > Timeout) return USBD_BUSY;
+  }
+  if (result != USBD_OK) return result;
+  start = HAL_GetTick();
+  while (hcdc->TxState != 0)
+  {
+    if (HAL_GetTick() - start > Timeout) return USBD_BUSY;
+  }
+  return USBD_OK;
+}
+
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
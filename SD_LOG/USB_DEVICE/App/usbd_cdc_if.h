@@ -108,6 +108,7 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+uint8_t CDC_Transmit_Wait_FS(uint8_t* Buf, uint16_t Len, uint32_t Timeout);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 